@@ -793,6 +793,8 @@ extern void kstat_set_string(char *, const char *);
 extern void kstat_delete_byname(const char *, int, const char *);
 extern void kstat_delete_byname_zone(const char *, int, const char *, zoneid_t);
 extern void kstat_named_init(kstat_named_t *, const char *, uchar_t);
+extern int kstat_walk(const char *, const char *,
+    int (*)(const kstat_t *, const kstat_named_t *, void *), void *);
 extern void kstat_timer_init(kstat_timer_t *, const char *);
 extern void kstat_waitq_enter(kstat_io_t *);
 extern void kstat_waitq_exit(kstat_io_t *);
@@ -0,0 +1,481 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Directory name lookup cache for libzfswrap.
+ *
+ * The cache is split in NC_SHARDS independent shards, selected by the hash
+ * of <directory, name>, so that lookups in different directories (or of
+ * different names) rarely contend.  Each shard has its own lock, hash table
+ * and LRU list, and holds at most ncsize / NC_SHARDS entries; inserting
+ * into a full shard recycles its least recently used entry.
+ *
+ * Every entry holds its directory and its target vnode.  Those holds are
+ * always dropped after the shard lock is released, since the last VN_RELE()
+ * calls VOP_INACTIVE().
+ */
+
+#include <sys/types.h>
+#include <sys/systm.h>
+#include <sys/param.h>
+#include <sys/sysmacros.h>
+#include <sys/atomic.h>
+#include <sys/kmem.h>
+#include <sys/kstat.h>
+#include <sys/list.h>
+#include <sys/debug.h>
+#include <sys/vfs.h>
+#include <sys/vnode.h>
+#include <sys/dnlc.h>
+#include <string.h>
+
+#define	NC_SHARDS	64		/* must be a power of 2 */
+#define	NC_MINSIZE	(NC_SHARDS * 64)
+#define	NC_MAXSIZE	(1 << 20)
+#define	NC_CACHELINE	64
+
+typedef struct ncache {
+	struct ncache	*hash_next;	/* hash chain */
+	struct ncache	**hash_prevp;
+	list_node_t	lru_node;	/* shard LRU list, MRU at the tail */
+	vnode_t		*dp;		/* directory (held) */
+	vnode_t		*vp;		/* target or DNLC_NO_VNODE (held) */
+	uint32_t	hash;
+	uchar_t		namlen;
+	char		name[NC_NAMLEN];
+} ncache_t;
+
+typedef struct nc_shard {
+	kmutex_t	ns_lock;
+	ncache_t	**ns_hash;
+	uint_t		ns_hashmask;
+	uint_t		ns_count;
+	uint_t		ns_max;
+	list_t		ns_lru;
+} nc_shard_t;
+
+/*
+ * Keep the shards (and thus their locks) on separate cache lines.
+ */
+typedef union nc_shard_pad {
+	nc_shard_t	s;
+	char		pad[P2ROUNDUP(sizeof (nc_shard_t), NC_CACHELINE)];
+} nc_shard_pad_t;
+
+uint_t ncsize = 0;
+vnode_t negative_cache_vnode;
+
+static nc_shard_pad_t *nc_shards;
+static kmem_cache_t *nc_cache;
+static kstat_t *nc_ksp;
+
+typedef struct ncstats {
+	kstat_named_t	hits;
+	kstat_named_t	misses;
+	kstat_named_t	enters;
+	kstat_named_t	removes;
+	kstat_named_t	purges;
+	kstat_named_t	evictions;
+	kstat_named_t	too_long;
+} ncstats_t;
+
+static ncstats_t ncstats = {
+	{ "hits",		KSTAT_DATA_UINT64 },
+	{ "misses",		KSTAT_DATA_UINT64 },
+	{ "enters",		KSTAT_DATA_UINT64 },
+	{ "removes",		KSTAT_DATA_UINT64 },
+	{ "purges",		KSTAT_DATA_UINT64 },
+	{ "evictions",		KSTAT_DATA_UINT64 },
+	{ "too_long",		KSTAT_DATA_UINT64 },
+};
+
+#define	NCSTAT(stat)	atomic_add_64(&ncstats.stat.value.ui64, 1)
+
+/*
+ * FNV-1a over the directory pointer and the name.  Returns the name length
+ * through *lenp.
+ */
+static uint32_t
+dnlc_hash(vnode_t *dp, const char *name, size_t *lenp)
+{
+	uint32_t hash = 2166136261U;
+	uintptr_t dpv = (uintptr_t)dp;
+	const char *cp;
+	int i;
+
+	for (i = 0; i < sizeof (dpv); i++, dpv >>= 8)
+		hash = (hash ^ (uchar_t)dpv) * 16777619U;
+	for (cp = name; *cp != '\0'; cp++)
+		hash = (hash ^ (uchar_t)*cp) * 16777619U;
+
+	*lenp = cp - name;
+	return (hash);
+}
+
+static nc_shard_t *
+dnlc_shard(uint32_t hash)
+{
+	return (&nc_shards[hash & (NC_SHARDS - 1)].s);
+}
+
+static ncache_t **
+dnlc_bucket(nc_shard_t *ns, uint32_t hash)
+{
+	/* The low bits select the shard, use the others here */
+	return (&ns->ns_hash[(hash / NC_SHARDS) & ns->ns_hashmask]);
+}
+
+static ncache_t *
+dnlc_search(nc_shard_t *ns, vnode_t *dp, const char *name, size_t namlen,
+    uint32_t hash)
+{
+	ncache_t *ncp;
+
+	ASSERT(MUTEX_HELD(&ns->ns_lock));
+
+	for (ncp = *dnlc_bucket(ns, hash); ncp != NULL; ncp = ncp->hash_next) {
+		if (ncp->hash == hash && ncp->dp == dp &&
+		    ncp->namlen == namlen && bcmp(ncp->name, name, namlen) == 0)
+			return (ncp);
+	}
+
+	return (NULL);
+}
+
+static void
+dnlc_unlink(nc_shard_t *ns, ncache_t *ncp)
+{
+	ASSERT(MUTEX_HELD(&ns->ns_lock));
+
+	if (ncp->hash_next != NULL)
+		ncp->hash_next->hash_prevp = ncp->hash_prevp;
+	*ncp->hash_prevp = ncp->hash_next;
+	list_remove(&ns->ns_lru, ncp);
+	ns->ns_count--;
+}
+
+/*
+ * Drop the holds of an entry which has been unlinked, and free it.
+ */
+static void
+dnlc_free(ncache_t *ncp)
+{
+	VN_RELE(ncp->vp);
+	VN_RELE(ncp->dp);
+	kmem_cache_free(nc_cache, ncp);
+}
+
+void
+dnlc_init(void)
+{
+	uint_t nshard, nhash;
+	int i;
+
+	if (ncsize == 0) {
+		/* One entry per 64KB of memory */
+		ncsize = MIN(physmem * PAGESIZE / (64 << 10), NC_MAXSIZE);
+	}
+	ncsize = MAX(ncsize, NC_MINSIZE);
+	nshard = ncsize / NC_SHARDS;
+
+	/* Aim for chains of one or two entries */
+	for (nhash = 1; nhash < nshard; nhash <<= 1)
+		continue;
+
+	mutex_init(&negative_cache_vnode.v_lock, NULL, MUTEX_DEFAULT, NULL);
+	negative_cache_vnode.v_count = 1;	/* never inactive */
+
+	nc_cache = kmem_cache_create("dnlc_cache", sizeof (ncache_t), 0,
+	    NULL, NULL, NULL, NULL, NULL, 0);
+
+	nc_shards = kmem_zalloc(NC_SHARDS * sizeof (nc_shard_pad_t), KM_SLEEP);
+	for (i = 0; i < NC_SHARDS; i++) {
+		nc_shard_t *ns = &nc_shards[i].s;
+
+		mutex_init(&ns->ns_lock, NULL, MUTEX_DEFAULT, NULL);
+		ns->ns_hash = kmem_zalloc(nhash * sizeof (ncache_t *), KM_SLEEP);
+		ns->ns_hashmask = nhash - 1;
+		ns->ns_max = nshard;
+		list_create(&ns->ns_lru, sizeof (ncache_t),
+		    offsetof(ncache_t, lru_node));
+	}
+
+	nc_ksp = kstat_create("unix", 0, "dnlcstats", "misc", KSTAT_TYPE_NAMED,
+	    sizeof (ncstats) / sizeof (kstat_named_t), KSTAT_FLAG_VIRTUAL);
+	if (nc_ksp != NULL) {
+		nc_ksp->ks_data = &ncstats;
+		kstat_install(nc_ksp);
+	}
+}
+
+void
+dnlc_fini(void)
+{
+	int i;
+
+	if (nc_ksp != NULL) {
+		kstat_delete(nc_ksp);
+		nc_ksp = NULL;
+	}
+
+	dnlc_reduce_cache((void *)(uintptr_t)100);
+
+	for (i = 0; i < NC_SHARDS; i++) {
+		nc_shard_t *ns = &nc_shards[i].s;
+
+		ASSERT(ns->ns_count == 0);
+		list_destroy(&ns->ns_lru);
+		kmem_free(ns->ns_hash, (ns->ns_hashmask + 1) *
+		    sizeof (ncache_t *));
+		mutex_destroy(&ns->ns_lock);
+	}
+	kmem_free(nc_shards, NC_SHARDS * sizeof (nc_shard_pad_t));
+	nc_shards = NULL;
+
+	kmem_cache_destroy(nc_cache);
+	mutex_destroy(&negative_cache_vnode.v_lock);
+}
+
+/*
+ * Look up <dp, name>.  Returns a held vnode, DNLC_NO_VNODE (also held) for
+ * a cached negative entry, or NULL on a miss.
+ */
+vnode_t *
+dnlc_lookup(vnode_t *dp, const char *name)
+{
+	nc_shard_t *ns;
+	ncache_t *ncp;
+	vnode_t *vp;
+	uint32_t hash;
+	size_t namlen;
+
+	hash = dnlc_hash(dp, name, &namlen);
+	if (namlen >= NC_NAMLEN)
+		return (NULL);
+
+	ns = dnlc_shard(hash);
+	mutex_enter(&ns->ns_lock);
+	ncp = dnlc_search(ns, dp, name, namlen, hash);
+	if (ncp == NULL) {
+		mutex_exit(&ns->ns_lock);
+		NCSTAT(misses);
+		return (NULL);
+	}
+
+	list_remove(&ns->ns_lru, ncp);
+	list_insert_tail(&ns->ns_lru, ncp);
+	vp = ncp->vp;
+	VN_HOLD(vp);
+	mutex_exit(&ns->ns_lock);
+
+	NCSTAT(hits);
+	return (vp);
+}
+
+/*
+ * Enter <dp, name> -> vp in the cache, replacing any existing entry.
+ */
+void
+dnlc_update(vnode_t *dp, const char *name, vnode_t *vp)
+{
+	nc_shard_t *ns;
+	ncache_t *ncp, *victim = NULL;
+	ncache_t **bucket;
+	vnode_t *oldvp = NULL;
+	uint32_t hash;
+	size_t namlen;
+
+	hash = dnlc_hash(dp, name, &namlen);
+	if (namlen >= NC_NAMLEN) {
+		NCSTAT(too_long);
+		return;
+	}
+
+	ns = dnlc_shard(hash);
+	mutex_enter(&ns->ns_lock);
+
+	ncp = dnlc_search(ns, dp, name, namlen, hash);
+	if (ncp != NULL) {
+		if (ncp->vp != vp) {
+			oldvp = ncp->vp;
+			VN_HOLD(vp);
+			ncp->vp = vp;
+		}
+		list_remove(&ns->ns_lru, ncp);
+		list_insert_tail(&ns->ns_lru, ncp);
+		mutex_exit(&ns->ns_lock);
+
+		if (oldvp != NULL)
+			VN_RELE(oldvp);
+		return;
+	}
+
+	ncp = kmem_cache_alloc(nc_cache, KM_NOSLEEP);
+	if (ncp == NULL) {
+		mutex_exit(&ns->ns_lock);
+		return;
+	}
+
+	if (ns->ns_count >= ns->ns_max) {
+		victim = list_head(&ns->ns_lru);
+		dnlc_unlink(ns, victim);
+	}
+
+	VN_HOLD(dp);
+	VN_HOLD(vp);
+	ncp->dp = dp;
+	ncp->vp = vp;
+	ncp->hash = hash;
+	ncp->namlen = namlen;
+	bcopy(name, ncp->name, namlen);
+
+	bucket = dnlc_bucket(ns, hash);
+	ncp->hash_next = *bucket;
+	if (ncp->hash_next != NULL)
+		ncp->hash_next->hash_prevp = &ncp->hash_next;
+	ncp->hash_prevp = bucket;
+	*bucket = ncp;
+	list_insert_tail(&ns->ns_lru, ncp);
+	ns->ns_count++;
+
+	mutex_exit(&ns->ns_lock);
+
+	NCSTAT(enters);
+	if (victim != NULL) {
+		NCSTAT(evictions);
+		dnlc_free(victim);
+	}
+}
+
+/*
+ * Remove <dp, name> from the cache, if present.
+ */
+void
+dnlc_remove(vnode_t *dp, const char *name)
+{
+	nc_shard_t *ns;
+	ncache_t *ncp;
+	uint32_t hash;
+	size_t namlen;
+
+	hash = dnlc_hash(dp, name, &namlen);
+	if (namlen >= NC_NAMLEN)
+		return;
+
+	ns = dnlc_shard(hash);
+	mutex_enter(&ns->ns_lock);
+	ncp = dnlc_search(ns, dp, name, namlen, hash);
+	if (ncp != NULL)
+		dnlc_unlink(ns, ncp);
+	mutex_exit(&ns->ns_lock);
+
+	if (ncp != NULL) {
+		NCSTAT(removes);
+		dnlc_free(ncp);
+	}
+}
+
+/*
+ * Purge the entries of every directory belonging to vfsp, or of every
+ * directory when vfsp is NULL, stopping after count entries if count is
+ * non-zero.  Returns the number of entries purged.
+ */
+static int
+dnlc_purge_common(struct vfs *vfsp, int count)
+{
+	nc_shard_t *ns;
+	ncache_t *ncp, *next;
+	list_t purged;
+	int n = 0;
+	int i;
+
+	list_create(&purged, sizeof (ncache_t), offsetof(ncache_t, lru_node));
+
+	for (i = 0; i < NC_SHARDS && (count == 0 || n < count); i++) {
+		ns = &nc_shards[i].s;
+		mutex_enter(&ns->ns_lock);
+		for (ncp = list_head(&ns->ns_lru); ncp != NULL; ncp = next) {
+			next = list_next(&ns->ns_lru, ncp);
+			if (vfsp != NULL && ncp->dp->v_vfsp != vfsp)
+				continue;
+			dnlc_unlink(ns, ncp);
+			list_insert_tail(&purged, ncp);
+			if (++n == count)
+				break;
+		}
+		mutex_exit(&ns->ns_lock);
+
+		while ((ncp = list_remove_head(&purged)) != NULL)
+			dnlc_free(ncp);
+	}
+
+	list_destroy(&purged);
+
+	atomic_add_64(&ncstats.purges.value.ui64, n);
+	return (n);
+}
+
+int
+dnlc_purge_vfsp(struct vfs *vfsp, int count)
+{
+	return (dnlc_purge_common(vfsp, count));
+}
+
+/*
+ * Release the least recently used reduce_percent percent of each shard,
+ * to give back the memory (and znode holds) of cached entries.
+ */
+void
+dnlc_reduce_cache(void *reduce_percent)
+{
+	uint_t percent = (uint_t)(uintptr_t)reduce_percent;
+	nc_shard_t *ns;
+	ncache_t *ncp;
+	list_t purged;
+	uint_t n;
+	int i;
+
+	if (percent == 0)
+		return;
+	if (percent >= 100) {
+		(void) dnlc_purge_common(NULL, 0);
+		return;
+	}
+
+	list_create(&purged, sizeof (ncache_t), offsetof(ncache_t, lru_node));
+
+	for (i = 0; i < NC_SHARDS; i++) {
+		ns = &nc_shards[i].s;
+		mutex_enter(&ns->ns_lock);
+		n = (ns->ns_count * percent + 99) / 100;
+		while (n-- > 0 && (ncp = list_head(&ns->ns_lru)) != NULL) {
+			dnlc_unlink(ns, ncp);
+			list_insert_tail(&purged, ncp);
+			NCSTAT(evictions);
+		}
+		mutex_exit(&ns->ns_lock);
+
+		while ((ncp = list_remove_head(&purged)) != NULL)
+			dnlc_free(ncp);
+	}
+
+	list_destroy(&purged);
+}
@@ -27,11 +27,35 @@
 #ifndef _SYS_DNLC_H
 #define _SYS_DNLC_H
 
-#define dnlc_remove(v,c) ((void) 0)
-#define dnlc_purge_vfsp(v,c) ((void) 0)
-#define dnlc_lookup(v,c) (NULL)
-#define dnlc_update(v,c,vn) ((void) 0)
+#include <sys/types.h>
+#include <sys/vnode.h>
 
-#define DNLC_NO_VNODE ((void *) 0x12345678)
+/*
+ * Directory name lookup cache.
+ *
+ * Maps <directory vnode, name> to a held vnode.  Negative entries map to
+ * DNLC_NO_VNODE, which callers release with VN_RELE() like any other vnode.
+ */
+
+/*
+ * Names this long or longer are not cached.
+ */
+#define	NC_NAMLEN	64
+
+extern vnode_t negative_cache_vnode;
+#define	DNLC_NO_VNODE	(&negative_cache_vnode)
+
+/*
+ * Maximum number of entries in the cache (0 means compute a default).
+ */
+extern uint_t ncsize;
+
+extern void dnlc_init(void);
+extern void dnlc_fini(void);
+extern vnode_t *dnlc_lookup(vnode_t *, const char *);
+extern void dnlc_update(vnode_t *, const char *, vnode_t *);
+extern void dnlc_remove(vnode_t *, const char *);
+extern int dnlc_purge_vfsp(struct vfs *, int);
+extern void dnlc_reduce_cache(void *);
 
 #endif
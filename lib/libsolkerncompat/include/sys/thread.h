@@ -32,6 +32,7 @@ typedef pthread_t kthread_t;
 typedef kthread_t *kthread_id_t;
 
 extern kthread_t *zk_thread_create(void (*func)(), void *arg);
+extern int zk_cpu_seqid(void);
 
 #define thread_create(stk, stksize, func, arg, len, pp, state, pri) zk_thread_create(func, arg)
 #define thread_exit(r) pthread_exit(NULL)
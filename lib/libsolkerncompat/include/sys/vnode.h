@@ -314,6 +314,7 @@ extern void vn_rele_async(struct vnode *vp, struct taskq *taskq);
 extern int vn_open(char *pnamep, enum uio_seg seg, int filemode, int createmode, struct vnode **vpp, enum create crwhy, mode_t umask);
 extern int vn_openat(char *pnamep, enum uio_seg seg, int filemode, int createmode, struct vnode **vpp, enum create crwhy, mode_t umask, struct vnode *startvp, int fd);
 extern int vn_rdwr(enum uio_rw rw, struct vnode *vp, caddr_t base, ssize_t len, offset_t offset, enum uio_seg seg, int ioflag, rlim64_t ulimit, cred_t *cr, ssize_t *residp);
+extern int vn_rdwrv(enum uio_rw rw, struct vnode *vp, struct iovec *iov, int iovcnt, offset_t offset, enum uio_seg seg, int ioflag, rlim64_t ulimit, cred_t *cr, ssize_t *residp);
 extern void vn_close(vnode_t *vp);
 
 /* ZFSFUSE */
@@ -64,12 +64,13 @@ extern "C" {
 #include <sys/fm/util.h>
 #include <sys/sunddi.h>
 
-// #define	CPU_SEQID (thr_self() & (max_ncpus - 1))
-/* zfs-fuse : this CPU_SEQID macro is used to enter a mutex
- * for a cpu group. Wonder if it's safe in zfs-fuse ?
- * Here it seems to assume that threads are assigned sequentially to
- * all the cpus. I prefer to return 0 for this now... */
-#define CPU_SEQID 0
+/*
+ * CPU_SEQID only selects which per-CPU slot (e.g. tx_cpu_t) a thread uses;
+ * the slot is remembered by the caller, so it's fine if the thread migrates
+ * to another CPU afterwards.  zk_cpu_seqid() uses the current CPU, or a
+ * per-thread index if that isn't available.
+ */
+#define	CPU_SEQID	zk_cpu_seqid()
 
 extern char *kmem_asprintf(const char *fmt, ...);
 #define	strfree(str) kmem_free((str), strlen(str)+1)
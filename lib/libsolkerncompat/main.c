@@ -28,6 +28,8 @@
 #include <sys/debug.h>
 #include <sys/policy.h>
 #include <sys/kmem.h>
+#include <sys/kstat.h>
+#include <sys/dnlc.h>
 #include <sys/utsname.h>
 
 #include <stdio.h>
@@ -75,6 +77,10 @@ void libsolkerncompat_init()
 
 	vfs_init();
 
+	/* taskq_create() registers kstats, so this must come first */
+	kstat_init();
+	dnlc_init();
+
 	/* Carefull here : umem_init is called on another core when using a multi core cpu
 	 * but it must have finished when calling taskq_init.
 	 * My tests with my dual core laptop is ok, but I am not sure it works everywhere */
@@ -84,6 +90,7 @@ void libsolkerncompat_init()
 
 void libsolkerncompat_exit()
 {
+	dnlc_fini();
 	kmem_cache_destroy(vnode_cache);
 
 	vfs_exit();
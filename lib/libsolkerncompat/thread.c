@@ -28,8 +28,11 @@
 #include <sys/thread.h>
 #include <sys/debug.h>
 #include <sys/types.h>
+#include <sys/atomic.h>
+#include <sys/cpuvar.h>
 
 #include <pthread.h>
+#include <sched.h>
 
 kthread_t *
 zk_thread_create(void (*func)(), void *arg)
@@ -47,3 +50,31 @@ zk_thread_create(void (*func)(), void *arg)
 
 	return ((void *)(uintptr_t)tid);
 }
+
+/*
+ * Sequential index of the thread, handed out on first use.  Used when the
+ * current CPU can't be determined.
+ */
+static uint32_t zk_thread_next_index;
+static __thread int zk_thread_index = -1;
+
+/*
+ * Return a small integer in [0, max_ncpus) identifying the CPU we're
+ * running on, for spreading per-CPU data structures (see CPU_SEQID).
+ * Threads may migrate at any time, so callers must only use this as a
+ * hint and never assume two calls return the same value.
+ */
+int
+zk_cpu_seqid(void)
+{
+	int cpu = sched_getcpu();
+
+	if (cpu < 0) {
+		if (zk_thread_index < 0)
+			zk_thread_index =
+			    atomic_add_32_nv(&zk_thread_next_index, 1);
+		cpu = zk_thread_index;
+	}
+
+	return (cpu & (max_ncpus - 1));
+}
@@ -601,20 +601,46 @@ vn_rdwr(
 	cred_t *cr,
 	ssize_t *residp)
 {
-	struct uio uio;
 	struct iovec iov;
-	int error;
-
-	if (rw == UIO_WRITE && ISROFILE(vp))
-		return (EROFS);
 
 	if (len < 0)
 		return (EIO);
 
 	iov.iov_base = base;
 	iov.iov_len = len;
-	uio.uio_iov = &iov;
-	uio.uio_iovcnt = 1;
+
+	return (vn_rdwrv(rw, vp, &iov, 1, offset, seg, ioflag, ulimit, cr,
+	    residp));
+}
+
+/*
+ * Like vn_rdwr(), with the data scattered over iovcnt buffers.
+ */
+int
+vn_rdwrv(
+	enum uio_rw rw,
+	struct vnode *vp,
+	struct iovec *iov,
+	int iovcnt,
+	offset_t offset,
+	enum uio_seg seg,
+	int ioflag,
+	rlim64_t ulimit,	/* meaningful only if rw is UIO_WRITE */
+	cred_t *cr,
+	ssize_t *residp)
+{
+	struct uio uio;
+	ssize_t len = 0;
+	int error, i;
+
+	if (rw == UIO_WRITE && ISROFILE(vp))
+		return (EROFS);
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	uio.uio_iov = iov;
+	uio.uio_iovcnt = iovcnt;
 	uio.uio_loffset = offset;
 	uio.uio_segflg = (short)seg;
 	uio.uio_resid = len;
@@ -1273,23 +1299,27 @@ root_close(vnode_t *vp, int flag, int count, offset_t offset, cred_t *cr)
 	return close(vp->v_fd);
 }
 
+/*
+ * The uio_iov vectors are handed to the kernel as they are, so a request
+ * scattered over several buffers still costs a single system call.
+ */
 static int
 root_read(vnode_t *vp, uio_t *uiop, int ioflag, cred_t *cr, caller_context_t *ct)
 {
 	ASSERT(vp->v_fd != -1);
 	ASSERT(vp->v_type != VBLK || IS_P2ALIGNED(uiop->uio_loffset, 512));
-	ASSERT(vp->v_type != VBLK || IS_P2ALIGNED(uiop->uio_iov->iov_len, 512));
+	ASSERT(vp->v_type != VBLK || IS_P2ALIGNED(uiop->uio_resid, 512));
 
 	int error = 0;
 
-	ssize_t iolen = pread64(vp->v_fd, uiop->uio_iov->iov_base, uiop->uio_iov->iov_len, uiop->uio_loffset);
+	ssize_t iolen = preadv(vp->v_fd, uiop->uio_iov, uiop->uio_iovcnt, uiop->uio_loffset);
 	if(iolen == -1) {
 		error = errno;
-		perror("pread64");
+		perror("preadv");
 	}
 
-	if(iolen != uiop->uio_iov->iov_len)
-		fprintf(stderr, "root_read(): len: %lli iolen: %lli offset: %lli file: %s\n", (longlong_t) uiop->uio_iov->iov_len, (longlong_t) iolen, (longlong_t) uiop->uio_loffset, vp->v_path);
+	if(iolen != uiop->uio_resid)
+		fprintf(stderr, "root_read(): len: %lli iolen: %lli offset: %lli file: %s\n", (longlong_t) uiop->uio_resid, (longlong_t) iolen, (longlong_t) uiop->uio_loffset, vp->v_path);
 
 	if(error)
 		return error;
@@ -1304,18 +1334,18 @@ root_write(vnode_t *vp, uio_t *uiop, int ioflag, cred_t *cr, caller_context_t *c
 {
 	ASSERT(vp->v_fd != -1);
 	ASSERT(vp->v_type != VBLK || IS_P2ALIGNED(uiop->uio_loffset, 512));
-	ASSERT(vp->v_type != VBLK || IS_P2ALIGNED(uiop->uio_iov->iov_len, 512));
+	ASSERT(vp->v_type != VBLK || IS_P2ALIGNED(uiop->uio_resid, 512));
 
 	int error = 0;
 
-	ssize_t iolen = pwrite64(vp->v_fd, uiop->uio_iov->iov_base, uiop->uio_iov->iov_len, uiop->uio_loffset);
+	ssize_t iolen = pwritev(vp->v_fd, uiop->uio_iov, uiop->uio_iovcnt, uiop->uio_loffset);
 	if(iolen == -1) {
 		error = errno;
-		perror("pwrite64");
+		perror("pwritev");
 	}
 
-	if(iolen != uiop->uio_iov->iov_len)
-		fprintf(stderr, "root_write(): len: %lli iolen: %lli offset: %lli file: %s\n", (longlong_t) uiop->uio_iov->iov_len, (longlong_t) iolen, (longlong_t) uiop->uio_loffset, vp->v_path);
+	if(iolen != uiop->uio_resid)
+		fprintf(stderr, "root_write(): len: %lli iolen: %lli offset: %lli file: %s\n", (longlong_t) uiop->uio_resid, (longlong_t) iolen, (longlong_t) uiop->uio_loffset, vp->v_path);
 
 	if(error)
 		return error;
@@ -1332,10 +1362,10 @@ fd_read(vnode_t *vp, uio_t *uiop, int ioflag, cred_t *cr, caller_context_t *ct)
 
 	int error = 0;
 
-	ssize_t iolen = read(vp->v_fd, uiop->uio_iov->iov_base, uiop->uio_iov->iov_len);
+	ssize_t iolen = readv(vp->v_fd, uiop->uio_iov, uiop->uio_iovcnt);
 	if(iolen == -1) {
 		error = errno;
-		perror("read");
+		perror("readv");
 	}
 
 	if(error)
@@ -1353,14 +1383,14 @@ fd_write(vnode_t *vp, uio_t *uiop, int ioflag, cred_t *cr, caller_context_t *ct)
 
 	int error = 0;
 
-	ssize_t iolen = write(vp->v_fd, uiop->uio_iov->iov_base, uiop->uio_iov->iov_len);
+	ssize_t iolen = writev(vp->v_fd, uiop->uio_iov, uiop->uio_iovcnt);
 	if(iolen == -1) {
 		error = errno;
-		perror("write");
+		perror("writev");
 	}
 
-	if(iolen != uiop->uio_iov->iov_len)
-		fprintf(stderr, "fd_write(): len: %lli iolen: %lli offset: %lli file: %s\n", (longlong_t) uiop->uio_iov->iov_len, (longlong_t) iolen, (longlong_t) uiop->uio_loffset, vp->v_path);
+	if(iolen != uiop->uio_resid)
+		fprintf(stderr, "fd_write(): len: %lli iolen: %lli offset: %lli file: %s\n", (longlong_t) uiop->uio_resid, (longlong_t) iolen, (longlong_t) uiop->uio_loffset, vp->v_path);
 
 	if(error)
 		return error;
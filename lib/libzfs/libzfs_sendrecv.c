@@ -178,6 +178,22 @@ cksum_and_write(const void *buf, uint64_t len, zio_cksum_t *zc, int outfd)
 	return (write(outfd, buf, len));
 }
 
+/*
+ * Like cksum_and_write() for a replay record of a substream, which ends
+ * with the checksum of the stream up to there.  The records rewritten
+ * below need theirs recomputed along with the stream's.
+ */
+static int
+cksum_and_write_record(dmu_replay_record_t *drr, zio_cksum_t *zc, int outfd)
+{
+	zio_cksum_t *drrc = &drr->drr_u.drr_checksum.drr_checksum;
+
+	fletcher_4_incremental_native(drr, (char *)drrc - (char *)drr, zc);
+	*drrc = *zc;
+	fletcher_4_incremental_native(drrc, sizeof (zio_cksum_t), zc);
+	return (write(outfd, drr, sizeof (dmu_replay_record_t)));
+}
+
 /*
  * This function is started in a separate thread when the dedup option
  * has been requested.  The main send thread determines the list of
@@ -282,16 +298,16 @@ cksummer(void *arg)
 			ZIO_SET_CHECKSUM(&drre->drr_checksum,
 			    stream_cksum.zc_word[0], stream_cksum.zc_word[1],
 			    stream_cksum.zc_word[2], stream_cksum.zc_word[3]);
-			if ((write(outfd, drr,
-			    sizeof (dmu_replay_record_t))) == -1)
+			if (cksum_and_write_record(drr, &stream_cksum,
+			    outfd) == -1)
 				goto out;
 			break;
 		}
 
 		case DRR_OBJECT:
 		{
-			if (cksum_and_write(drr, sizeof (dmu_replay_record_t),
-			    &stream_cksum, outfd) == -1)
+			if (cksum_and_write_record(drr, &stream_cksum,
+			    outfd) == -1)
 				goto out;
 			if (drro->drr_bonuslen > 0) {
 				(void) ssread(buf,
@@ -307,8 +323,8 @@ cksummer(void *arg)
 
 		case DRR_FREEOBJECTS:
 		{
-			if (cksum_and_write(drr, sizeof (dmu_replay_record_t),
-			    &stream_cksum, outfd) == -1)
+			if (cksum_and_write_record(drr, &stream_cksum,
+			    outfd) == -1)
 				goto out;
 			break;
 		}
@@ -371,15 +387,13 @@ cksummer(void *arg)
 				wbr_drrr->drr_key.ddk_prop =
 				    drrw->drr_key.ddk_prop;
 
-				if (cksum_and_write(&wbr_drr,
-				    sizeof (dmu_replay_record_t), &stream_cksum,
-				    outfd) == -1)
+				if (cksum_and_write_record(&wbr_drr,
+				    &stream_cksum, outfd) == -1)
 					goto out;
 			} else {
 				/* block not previously seen */
-				if (cksum_and_write(drr,
-				    sizeof (dmu_replay_record_t), &stream_cksum,
-				    outfd) == -1)
+				if (cksum_and_write_record(drr,
+				    &stream_cksum, outfd) == -1)
 					goto out;
 				if (cksum_and_write(buf,
 				    drrw->drr_length,
@@ -391,8 +405,8 @@ cksummer(void *arg)
 
 		case DRR_FREE:
 		{
-			if (cksum_and_write(drr, sizeof (dmu_replay_record_t),
-			    &stream_cksum, outfd) == -1)
+			if (cksum_and_write_record(drr, &stream_cksum,
+			    outfd) == -1)
 				goto out;
 			break;
 		}
@@ -2183,6 +2197,17 @@ recv_skip(libzfs_handle_t *hdl, int fd, boolean_t byteswap)
 			    drr->drr_u.drr_write.drr_length, B_FALSE, NULL);
 			break;
 
+		case DRR_WRITE_COMPRESSED:
+			if (byteswap) {
+				drr->drr_u.drr_write.drr_key.ddk_prop =
+				    BSWAP_64(drr->drr_u.drr_write.drr_key.
+				    ddk_prop);
+			}
+			(void) recv_read(hdl, fd, buf,
+			    DDK_GET_PSIZE(&drr->drr_u.drr_write.drr_key),
+			    B_FALSE, NULL);
+			break;
+
 		case DRR_WRITE_BYREF:
 		case DRR_FREEOBJECTS:
 		case DRR_FREE:
@@ -2650,6 +2675,11 @@ zfs_receive_one(libzfs_handle_t *hdl, int infd, const char *tosnap,
 			    "invalid stream (checksum mismatch)"));
 			(void) zfs_error(hdl, EZFS_BADSTREAM, errbuf);
 			break;
+		case EPIPE:
+			zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+			    "stream ended early"));
+			(void) zfs_error(hdl, EZFS_BADSTREAM, errbuf);
+			break;
 		default:
 			(void) zfs_standard_error(hdl, ioctl_errno, errbuf);
 		}
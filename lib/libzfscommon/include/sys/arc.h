@@ -67,6 +67,8 @@ typedef enum arc_buf_contents {
 #define	ARC_PREFETCH	(1 << 3)	/* I/O is a prefetch */
 #define	ARC_CACHED	(1 << 4)	/* I/O was already in cache */
 #define	ARC_L2CACHE	(1 << 5)	/* cache in L2ARC */
+#define	ARC_LOWPRI	(1 << 6)	/* cache at low priority */
+#define	ARC_NOFILTER	(1 << 7)	/* bypass the admission filter */
 
 /*
  * The following breakdows of arc_size exist for kstat only.
@@ -120,6 +122,7 @@ int arc_tempreserve_space(uint64_t reserve, uint64_t txg);
 
 void arc_init(void);
 void arc_fini(void);
+int arc_set_limits(uint64_t min, uint64_t max);
 
 /*
  * Level 2 ARC
@@ -360,6 +360,8 @@ uint64_t dmu_buf_refcount(dmu_buf_t *db);
  * with dmu_buf_rele_array.  You can NOT release the hold on each buffer
  * individually with dmu_buf_rele.
  */
+int dmu_buf_hold_array(objset_t *os, uint64_t object, uint64_t offset,
+    uint64_t length, int read, void *tag, int *numbufsp, dmu_buf_t ***dbpp);
 int dmu_buf_hold_array_by_bonus(dmu_buf_t *db, uint64_t offset,
     uint64_t length, int read, void *tag, int *numbufsp, dmu_buf_t ***dbpp);
 void dmu_buf_rele_array(dmu_buf_t **, int numbufs, void *tag);
@@ -491,6 +493,9 @@ void dmu_write(objset_t *os, uint64_t object, uint64_t offset, uint64_t size,
 	const void *buf, dmu_tx_t *tx);
 void dmu_prealloc(objset_t *os, uint64_t object, uint64_t offset, uint64_t size,
 	dmu_tx_t *tx);
+void dmu_write_compressed(struct zio *pio, objset_t *os, uint64_t object,
+	uint64_t offset, uint64_t lsize, const void *data, const void *cdata,
+	uint64_t psize, uint8_t compress, dmu_tx_t *tx);
 int dmu_read_uio(objset_t *os, uint64_t object, struct uio *uio, uint64_t size);
 int dmu_write_uio(objset_t *os, uint64_t object, struct uio *uio, uint64_t size,
     dmu_tx_t *tx);
@@ -668,8 +673,31 @@ typedef void (*dmu_traverse_cb_t)(objset_t *os, void *arg, struct blkptr *bp,
 void dmu_traverse_objset(objset_t *os, uint64_t txg_start,
     dmu_traverse_cb_t cb, void *arg);
 
+/*
+ * Send and receive streams may also be written to, or read from, a
+ * callback.  It transfers up to len bytes and returns the number done in
+ * *done (0 at the end of a receive stream), or an error.
+ */
+typedef int (dmu_stream_func_t)(void *arg, void *buf, size_t len,
+    size_t *done);
+
+/*
+ * How far an interrupted resumable receive got, from dmu_recv_resume_token().
+ * A send of the same snapshots given this token starts there.
+ */
+typedef struct dmu_resume_token {
+	uint64_t drt_toguid;
+	uint64_t drt_fromguid;
+	uint64_t drt_object;
+	uint64_t drt_offset;
+} dmu_resume_token_t;
+
 int dmu_sendbackup(objset_t *tosnap, objset_t *fromsnap, boolean_t fromorigin,
     struct vnode *vp, offset_t *off);
+int dmu_sendbackup_func(objset_t *tosnap, objset_t *fromsnap,
+    boolean_t fromorigin, boolean_t compressok,
+    const dmu_resume_token_t *resume, dmu_stream_func_t *func,
+    void *arg, offset_t *off);
 
 typedef struct dmu_recv_cookie {
 	/*
@@ -686,12 +714,17 @@ typedef struct dmu_recv_cookie {
 	char *drc_top_ds;
 	boolean_t drc_newfs;
 	boolean_t drc_force;
+	boolean_t drc_resumable;
 } dmu_recv_cookie_t;
 
 int dmu_recv_begin(char *tofs, char *tosnap, char *topds, struct drr_begin *,
-    boolean_t force, objset_t *origin, dmu_recv_cookie_t *);
+    boolean_t force, boolean_t resumable, objset_t *origin,
+    dmu_recv_cookie_t *);
 int dmu_recv_stream(dmu_recv_cookie_t *drc, struct vnode *vp, offset_t *voffp);
+int dmu_recv_stream_func(dmu_recv_cookie_t *drc, dmu_stream_func_t *func,
+    void *arg, offset_t *voffp);
 int dmu_recv_end(dmu_recv_cookie_t *drc);
+int dmu_recv_resume_token(char *tofs, char *tosnap, dmu_resume_token_t *drt);
 
 /* CRC64 table */
 #define	ZFS_CRC64_POLY	0xC96C5795D7870F42ULL	/* ECMA-182, reflected form */
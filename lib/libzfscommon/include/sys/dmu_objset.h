@@ -77,6 +77,7 @@ struct objset {
 	uint8_t os_logbias;
 	uint8_t os_primary_cache;
 	uint8_t os_secondary_cache;
+	uint8_t os_cache_filter;
 
 	/* no lock needed: */
 	struct dmu_tx *os_synctx; /* XXX sketchy */
@@ -47,9 +47,24 @@ typedef int (blkptr_cb_t)(spa_t *spa, zilog_t *zilog, const blkptr_t *bp,
 #define	TRAVERSE_PREFETCH_DATA		(1<<3)
 #define	TRAVERSE_PREFETCH (TRAVERSE_PREFETCH_METADATA | TRAVERSE_PREFETCH_DATA)
 #define	TRAVERSE_HARD			(1<<4)
+/*
+ * Visit blocks of dnodes concurrently from a taskq.  The callback must be
+ * thread safe and is not called in any particular order, unless
+ * TRAVERSE_ORDERED is also given; without this flag blocks are visited in
+ * order.  Cannot be combined with TRAVERSE_POST.
+ */
+#define	TRAVERSE_PARALLEL		(1<<5)
+/*
+ * With TRAVERSE_PARALLEL, only read the blocks of dnodes and what is below
+ * them concurrently.  The callback is called one call at a time, from any
+ * thread, in the order of a serial traversal.
+ */
+#define	TRAVERSE_ORDERED		(1<<6)
 
 int traverse_dataset(struct dsl_dataset *ds,
     uint64_t txg_start, int flags, blkptr_cb_t func, void *arg);
+int traverse_dataset_resume(struct dsl_dataset *ds, uint64_t txg_start,
+    const zbookmark_t *resume, int flags, blkptr_cb_t func, void *arg);
 int traverse_pool(spa_t *spa,
     uint64_t txg_start, int flags, blkptr_cb_t func, void *arg);
 
@@ -100,7 +100,16 @@ typedef struct dsl_dataset_phys {
 	uint64_t ds_next_clones_obj;	/* DMU_OT_DSL_CLONES */
 	uint64_t ds_props_obj;		/* DMU_OT_DSL_PROPS for snaps */
 	uint64_t ds_userrefs_obj;	/* DMU_OT_USERREFS */
-	uint64_t ds_pad[5]; /* pad out to 320 bytes for good measure */
+	/*
+	 * Set while a resumable receive is in progress, only valid with
+	 * DS_FLAG_INCONSISTENT: the stream's guids and the end of the last
+	 * block written out.
+	 */
+	uint64_t ds_resume_toguid;
+	uint64_t ds_resume_fromguid;
+	uint64_t ds_resume_object;
+	uint64_t ds_resume_offset;
+	uint64_t ds_pad[1]; /* pad out to 320 bytes for good measure */
 } dsl_dataset_phys_t;
 
 typedef struct dsl_dataset {
@@ -106,6 +106,11 @@ typedef struct dsl_pool {
 	boolean_t dp_scrub_restart;
 	kmutex_t dp_scrub_cancel_lock; /* protects dp_scrub_restart */
 	zio_t *dp_scrub_prefetch_zio_root;
+	avl_tree_t *dp_scrub_queues;	/* sorted scrub i/o, per top vdev */
+	int dp_scrub_nqueues;
+	uint64_t dp_scrub_queued;	/* bytes of i/o in dp_scrub_queues */
+	uint64_t dp_scrub_queued_mem;	/* memory used by dp_scrub_queues */
+	uint64_t dp_scrub_issue_rate;	/* bytes/sec the queues drained at */
 
 	/* Has its own locking */
 	tx_state_t dp_tx;
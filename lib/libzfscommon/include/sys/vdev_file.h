@@ -37,8 +37,15 @@ extern "C" {
 
 typedef struct vdev_file {
 	vnode_t		*vf_vnode;
+#ifdef LINUX_URING
+	struct vdev_uring *vf_uring;	/* io_uring state, if in use */
+#endif
 } vdev_file_t;
 
+#ifdef LINUX_URING
+extern void vdev_file_uring_flush(void);
+#endif
+
 #ifdef	__cplusplus
 }
 #endif
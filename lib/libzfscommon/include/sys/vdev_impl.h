@@ -303,6 +303,18 @@ extern uint64_t vdev_default_asize(vdev_t *vd, uint64_t psize);
 extern uint64_t vdev_get_min_asize(vdev_t *vd);
 extern void vdev_set_min_asize(vdev_t *vd);
 
+/*
+ * RAID-Z parity kernel selection
+ */
+extern void vdev_raidz_math_init(void);
+extern const char *vdev_raidz_math_impl(void);
+
+/*
+ * Fill buffers of vectored aggregate I/O
+ */
+extern void vdev_queue_buf_init(void);
+extern void vdev_queue_buf_fini(void);
+
 /*
  * zdb uses this tunable, so it must be declared here to make lint happy.
  */
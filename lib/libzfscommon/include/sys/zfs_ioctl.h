@@ -71,12 +71,15 @@ typedef enum drr_headertype {
 
 #define	DMU_BACKUP_FEATURE_DEDUP	(0x1)
 #define	DMU_BACKUP_FEATURE_DEDUPPROPS	(0x2)
+#define	DMU_BACKUP_FEATURE_COMPRESSED	(0x4)
+#define	DMU_BACKUP_FEATURE_RESUMING	(0x8)
 
 /*
  * Mask of all supported backup features
  */
 #define	DMU_BACKUP_FEATURE_MASK	(DMU_BACKUP_FEATURE_DEDUP | \
-		DMU_BACKUP_FEATURE_DEDUPPROPS)
+		DMU_BACKUP_FEATURE_DEDUPPROPS | \
+		DMU_BACKUP_FEATURE_COMPRESSED | DMU_BACKUP_FEATURE_RESUMING)
 
 /* Are all features in the given flag word currently supported? */
 #define	DMU_STREAM_SUPPORTED(x)	(!((x) & ~DMU_BACKUP_FEATURE_MASK))
@@ -166,6 +169,15 @@ typedef struct {
     char drr_toname[MAXNAMELEN];
   };
 
+  /*
+   * the payload of the DRR_BEGIN record of a DMU_BACKUP_FEATURE_RESUMING
+   * stream: the position in the dataset the stream starts at
+   */
+  struct drr_begin_resume {
+    uint64_t drr_object;
+    uint64_t drr_offset;
+  };
+
   struct drr_end {
     zio_cksum_t drr_checksum;
     uint64_t drr_toguid;
@@ -201,7 +213,11 @@ typedef struct {
     uint8_t drr_checksumflags;
     uint8_t drr_pad2[6];
     ddt_key_t drr_key; /* deduplication key */
-    /* content follows */
+    /*
+     * content follows: drr_length bytes, or for DRR_WRITE_COMPRESSED
+     * the on-disk block, DDK_GET_PSIZE(&drr_key) bytes compressed with
+     * DDK_GET_COMPRESS(&drr_key)
+     */
   };
 
   struct drr_free {
@@ -232,7 +248,7 @@ typedef struct dmu_replay_record {
 	enum {
 		DRR_BEGIN, DRR_OBJECT, DRR_FREEOBJECTS,
 		DRR_WRITE, DRR_FREE, DRR_END, DRR_WRITE_BYREF,
-		DRR_NUMTYPES
+		DRR_WRITE_COMPRESSED, DRR_NUMTYPES
 	} drr_type;
 	uint32_t drr_payloadlen;
 	union {
@@ -243,6 +259,15 @@ typedef struct dmu_replay_record {
 		struct drr_write drr_write;
 		struct drr_free drr_free;
 		struct drr_write_byref drr_write_byref;
+		struct drr_checksum {
+			uint64_t drr_pad[34];
+			/*
+			 * fletcher-4 checksum of the stream up to here, at
+			 * the end of every record but DRR_BEGIN; zero in
+			 * streams from older senders.
+			 */
+			zio_cksum_t drr_checksum;
+		} drr_checksum;
 	} drr_u;
 } dmu_replay_record_t;
 
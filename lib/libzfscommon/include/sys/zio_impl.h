@@ -38,10 +38,22 @@ extern "C" {
 #endif
 
 #ifdef LINUX_AIO
+/*
+ * Maximum number of iocbs handed to io_submit() in a single call.
+ */
+#define	ZIO_AIO_MAXBATCH	64
+
 typedef struct zio_aio_ctx {
-	io_context_t zac_ctx;     /* AIO context */
-	kthread_t    *zac_thread; /* AIO thread */
-	boolean_t    zac_enabled; /* is AIO enabled? */
+	io_context_t zac_ctx;       /* AIO context */
+	kthread_t    **zac_threads; /* AIO completion reaper threads */
+	int          zac_nthreads;  /* number of reaper threads created */
+	int          zac_running;   /* reaper threads still running */
+	boolean_t    zac_enabled;   /* is AIO enabled? */
+	boolean_t    zac_closing;   /* zio_aio_fini() has been called */
+	kmutex_t     zac_lock;      /* protects zac_running/zac_closing */
+	kmutex_t     zac_sq_lock;   /* protects the submission queue */
+	int          zac_sq_count;  /* iocbs waiting in zac_sq */
+	struct iocb  *zac_sq[ZIO_AIO_MAXBATCH]; /* submission queue */
 } zio_aio_ctx_t;
 #endif
 
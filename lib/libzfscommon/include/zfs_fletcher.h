@@ -45,6 +45,8 @@ void fletcher_4_incremental_native(const void *, uint64_t,
    zio_cksum_t *);
 void fletcher_4_incremental_byteswap(const void *, uint64_t,
    zio_cksum_t *);
+void fletcher_4_init(void);
+const char *fletcher_4_impl(void);
 
 #ifdef	__cplusplus
 }
@@ -102,6 +102,8 @@ zpool_prop_init(void)
 	    ZFS_TYPE_POOL, "on | off", "LISTSNAPS", boolean_table);
 	register_index(ZPOOL_PROP_AUTOEXPAND, "autoexpand", 0, PROP_DEFAULT,
 	    ZFS_TYPE_POOL, "on | off", "EXPAND", boolean_table);
+	register_index(ZPOOL_PROP_LZ4_COMPRESS, "lz4_compress", 0,
+	    PROP_DEFAULT, ZFS_TYPE_POOL, "on | off", "LZ4", boolean_table);
 
 	/* default index properties */
 	register_index(ZPOOL_PROP_FAILUREMODE, "failmode",
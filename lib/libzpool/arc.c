@@ -119,6 +119,7 @@
 
 #include <sys/spa.h>
 #include <sys/zio.h>
+#include <sys/zio_compress.h>
 #include <sys/zfs_context.h>
 #include <sys/arc.h>
 #include <sys/refcount.h>
@@ -135,6 +136,8 @@
 #include <sys/kstat.h>
 #include <zfs_fletcher.h>
 #include <syslog.h>
+#include <stdio.h>
+#include <unistd.h>
 #include "format.h"
 
 static kmutex_t		arc_reclaim_thr_lock;
@@ -185,6 +188,55 @@ int zfs_arc_grow_retry = 0;
 int zfs_arc_shrink_shift = 0;
 int zfs_arc_p_min_shift = 0;
 
+/*
+ * Memory pressure tunables.  We share the machine, and frequently a cgroup,
+ * with the application that embeds us, so the ARC backs off when any of
+ * these is exceeded:
+ *	- our cgroup v2 memory.current, less its inactive page cache, comes
+ *	  within 1/2^shift of memory.high (or memory.max when no high limit
+ *	  is set)
+ *	- MemAvailable in /proc/meminfo drops below zfs_arc_sys_free
+ *	  (default 1/64 of physical memory)
+ *	- tasks stalled on memory for zfs_arc_psi_threshold percent of the
+ *	  last ten seconds, according to PSI
+ * The sources are sampled at most every zfs_arc_pressure_interval_ms.
+ */
+uint64_t zfs_arc_sys_free = 0;
+int zfs_arc_cgroup_headroom_shift = 5;
+int zfs_arc_psi_threshold = 10;
+int zfs_arc_pressure_interval_ms = 100;
+
+/*
+ * Keep blocks that are compressed on disk compressed in the cache as well.
+ * A header then holds the payload exactly as read from disk, and the
+ * uncompressed data only exists while somebody references the block.
+ */
+int zfs_compressed_arc_enabled = 0;
+
+/*
+ * The hash table doubles in size, as many times as needed, whenever the
+ * average chain would be longer than this, or when arc_c_max is raised.
+ * Headers move to the new table one lock stripe at a time, so a lookup
+ * only waits while its own stripe is being moved.
+ */
+int zfs_arc_hash_chain_target = 2;
+
+/*
+ * Admission filter.  Once the ARC is full, a data block that is read for
+ * the first time goes in at low priority: at the tail of its list, where
+ * eviction looks first, rather than at the head.  "First time" is judged
+ * by a frequency sketch that remembers far more blocks than the ghost
+ * lists, so a block that misses again later is let in normally.  One pass
+ * over a large dataset, such as a backup, then mostly recycles its own
+ * buffers instead of evicting what everybody else is using.
+ *
+ * Prefetched blocks, until they are used, and blocks read on behalf of a
+ * scrub (ARC_LOWPRI) always go in at low priority.  Datasets with the
+ * cachefilter property turned off bypass the filter (ARC_NOFILTER).
+ */
+int zfs_arc_admit_filter = 1;
+int zfs_arc_admit_freq = 1;	/* sightings needed to go in normally */
+
 /*
  * Note that buffers can be in one of 6 states:
  *	ARC_anon	- anonymous (discussed below)
@@ -247,6 +299,7 @@ typedef struct arc_stats {
 	kstat_named_t arcstat_mru_ghost_hits;
 	kstat_named_t arcstat_mfu_hits;
 	kstat_named_t arcstat_mfu_ghost_hits;
+	kstat_named_t arcstat_admit_lowpri;
 	kstat_named_t arcstat_deleted;
 	kstat_named_t arcstat_recycle_miss;
 	kstat_named_t arcstat_mutex_miss;
@@ -267,6 +320,8 @@ typedef struct arc_stats {
 	kstat_named_t arcstat_hdr_size;
 	kstat_named_t arcstat_data_size;
 	kstat_named_t arcstat_other_size;
+	kstat_named_t arcstat_compressed_size;
+	kstat_named_t arcstat_uncompressed_size;
 	kstat_named_t arcstat_l2_hits;
 	kstat_named_t arcstat_l2_misses;
 	kstat_named_t arcstat_l2_feeds;
@@ -285,6 +340,9 @@ typedef struct arc_stats {
 	kstat_named_t arcstat_l2_io_error;
 	kstat_named_t arcstat_l2_size;
 	kstat_named_t arcstat_l2_hdr_size;
+	kstat_named_t arcstat_l2_log_blk_writes;
+	kstat_named_t arcstat_l2_rebuild_log_blks;
+	kstat_named_t arcstat_l2_rebuild_bufs;
 	kstat_named_t arcstat_memory_throttle_count;
 } arc_stats_t;
 
@@ -303,6 +361,7 @@ static arc_stats_t arc_stats = {
 	{ "mru_ghost_hits",		KSTAT_DATA_UINT64 },
 	{ "mfu_hits",			KSTAT_DATA_UINT64 },
 	{ "mfu_ghost_hits",		KSTAT_DATA_UINT64 },
+	{ "admit_lowpri",		KSTAT_DATA_UINT64 },
 	{ "deleted",			KSTAT_DATA_UINT64 },
 	{ "recycle_miss",		KSTAT_DATA_UINT64 },
 	{ "mutex_miss",			KSTAT_DATA_UINT64 },
@@ -323,6 +382,8 @@ static arc_stats_t arc_stats = {
 	{ "hdr_size",			KSTAT_DATA_UINT64 },
 	{ "data_size",			KSTAT_DATA_UINT64 },
 	{ "other_size",			KSTAT_DATA_UINT64 },
+	{ "compressed_size",		KSTAT_DATA_UINT64 },
+	{ "uncompressed_size",		KSTAT_DATA_UINT64 },
 	{ "l2_hits",			KSTAT_DATA_UINT64 },
 	{ "l2_misses",			KSTAT_DATA_UINT64 },
 	{ "l2_feeds",			KSTAT_DATA_UINT64 },
@@ -341,6 +402,9 @@ static arc_stats_t arc_stats = {
 	{ "l2_io_error",		KSTAT_DATA_UINT64 },
 	{ "l2_size",			KSTAT_DATA_UINT64 },
 	{ "l2_hdr_size",		KSTAT_DATA_UINT64 },
+	{ "l2_log_blk_writes",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_log_blks",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_bufs",		KSTAT_DATA_UINT64 },
 	{ "memory_throttle_count",	KSTAT_DATA_UINT64 }
 };
 
@@ -405,6 +469,7 @@ static arc_state_t	*arc_l2c_only;
 #define	arc_c_max	ARCSTAT(arcstat_c_max)	/* max target cache size */
 
 static int		arc_no_grow;	/* Don't try to grow cache size */
+static uint64_t		arc_need_free;	/* bytes we are over a memory limit */
 static uint64_t		arc_tempreserve;
 static uint64_t		arc_loaned_bytes;
 static uint64_t		arc_meta_used;
@@ -446,6 +511,11 @@ struct arc_buf_hdr {
 	uint32_t		b_flags;
 	uint32_t		b_datacnt;
 
+	/* on-disk payload, when kept compressed */
+	void			*b_cdata;
+	uint32_t		b_psize;
+	enum zio_compress	b_compress;
+
 	arc_callback_t		*b_acb;
 	kcondvar_t		b_cv;
 
@@ -472,7 +542,8 @@ static arc_buf_t *arc_eviction_list;
 static kmutex_t arc_eviction_mtx;
 static arc_buf_hdr_t arc_eviction_hdr;
 static void arc_get_data_buf(arc_buf_t *buf);
-static void arc_access(arc_buf_hdr_t *buf, kmutex_t *hash_lock);
+static void arc_access(arc_buf_hdr_t *buf, kmutex_t *hash_lock,
+    boolean_t demand);
 static int arc_evict_needed(arc_buf_contents_t type);
 static void arc_evict_ghost(arc_state_t *state, uint64_t spa, int64_t bytes);
 
@@ -500,6 +571,7 @@ static boolean_t l2arc_write_eligible(uint64_t spa_guid, arc_buf_hdr_t *ab);
 #define	ARC_L2_WRITING		(1 << 16)	/* L2ARC write in progress */
 #define	ARC_L2_EVICTED		(1 << 17)	/* evicted during I/O */
 #define	ARC_L2_WRITE_HEAD	(1 << 18)	/* head of write list */
+#define	ARC_COLD		(1 << 19)	/* cached at low priority */
 
 #define	HDR_IN_HASH_TABLE(hdr)	((hdr)->b_flags & ARC_IN_HASH_TABLE)
 #define	HDR_IO_IN_PROGRESS(hdr)	((hdr)->b_flags & ARC_IO_IN_PROGRESS)
@@ -514,6 +586,7 @@ static boolean_t l2arc_write_eligible(uint64_t spa_guid, arc_buf_hdr_t *ab);
 #define	HDR_L2_WRITING(hdr)	((hdr)->b_flags & ARC_L2_WRITING)
 #define	HDR_L2_EVICTED(hdr)	((hdr)->b_flags & ARC_L2_EVICTED)
 #define	HDR_L2_WRITE_HEAD(hdr)	((hdr)->b_flags & ARC_L2_WRITE_HEAD)
+#define	HDR_COLD(hdr)		((hdr)->b_flags & ARC_COLD)
 
 /*
  * Other sizes
@@ -522,34 +595,63 @@ static boolean_t l2arc_write_eligible(uint64_t spa_guid, arc_buf_hdr_t *ab);
 #define	HDR_SIZE ((int64_t)sizeof (arc_buf_hdr_t))
 #define	L2HDR_SIZE ((int64_t)sizeof (l2arc_buf_hdr_t))
 
+/*
+ * Bytes a header accounts for in its state: its uncompressed copies plus
+ * the compressed payload, if it kept one.
+ */
+#define	HDR_DATA_SIZE(hdr)	((hdr)->b_size * (hdr)->b_datacnt +	\
+	((hdr)->b_cdata != NULL ? (hdr)->b_psize : 0))
+
 /*
  * Hash table routines
  */
 
+/*
+ * The buckets are striped over a power of two number of locks, a bucket
+ * being covered by the lock of the same index modulo the number of locks.
+ * The table is always at least as large as the lock array, so a header is
+ * covered by the same lock whatever the size of the table.
+ *
+ * That is what lets the table grow without stopping everything: the
+ * reclaim thread allocates a larger table and moves the buckets over one
+ * lock at a time.  Each lock records which table its buckets are in, and
+ * lookups under it use that table.
+ */
 #define	HT_LOCK_PAD	64
+#define	BUF_LOCKS_PER_CPU 64
+#define	BUF_LOCKS_MIN	256
 
 struct ht_lock {
 	kmutex_t	ht_lock;
-#ifdef _KERNEL
-	unsigned char	pad[(HT_LOCK_PAD - sizeof (kmutex_t))];
-#endif
+	arc_buf_hdr_t	**ht_table;	/* table holding this stripe */
+	uint64_t	ht_mask;	/* and its size, minus one */
+	uint8_t		*ht_sketch;	/* sketch counting this stripe */
+	uint64_t	ht_sketch_mask;	/* and its size, minus one */
 };
 
-#define	BUF_LOCKS 256
+/* keep each lock on its own cache line */
+typedef union ht_lock_pad {
+	struct ht_lock	htp_lock;
+	unsigned char	htp_pad[P2ROUNDUP(sizeof (struct ht_lock),
+	    HT_LOCK_PAD)];
+} ht_lock_pad_t;
+
 typedef struct buf_hash_table {
-	uint64_t ht_mask;
-	arc_buf_hdr_t **ht_table;
-	struct ht_lock ht_locks[BUF_LOCKS];
+	uint64_t ht_mask;		/* newest table size, minus one */
+	arc_buf_hdr_t **ht_table;	/* newest table */
+	uint64_t ht_lock_mask;		/* number of locks, minus one */
+	ht_lock_pad_t *ht_locks;
+	void *ht_locks_alloc;		/* unaligned ht_locks */
+	boolean_t ht_grow_wanted;	/* ask the reclaim thread to grow */
 } buf_hash_table_t;
 
 static buf_hash_table_t buf_hash_table;
 
-#define	BUF_HASH_INDEX(spa, dva, birth) \
-	(buf_hash(spa, dva, birth) & buf_hash_table.ht_mask)
-#define	BUF_HASH_LOCK_NTRY(idx) (buf_hash_table.ht_locks[idx & (BUF_LOCKS-1)])
-#define	BUF_HASH_LOCK(idx)	(&(BUF_HASH_LOCK_NTRY(idx).ht_lock))
+#define	BUF_HASH_STRIPE(hv) \
+	(&buf_hash_table.ht_locks[(hv) & buf_hash_table.ht_lock_mask].htp_lock)
+#define	BUF_HASH_LOCK(hv)	(&BUF_HASH_STRIPE(hv)->ht_lock)
 #define	HDR_LOCK(buf) \
-	(BUF_HASH_LOCK(BUF_HASH_INDEX(buf->b_spa, &buf->b_dva, buf->b_birth)))
+	(BUF_HASH_LOCK(buf_hash(buf->b_spa, &buf->b_dva, buf->b_birth)))
 
 uint64_t zfs_crc64_table[256];
 
@@ -576,8 +678,66 @@ uint64_t l2arc_feed_min_ms = L2ARC_FEED_MIN_MS;	/* min interval milliseconds */
 boolean_t l2arc_noprefetch = B_TRUE;		/* don't cache prefetch bufs */
 boolean_t l2arc_feed_again = B_TRUE;		/* turbo warmup */
 boolean_t l2arc_norw = B_TRUE;			/* no reads during writes */
+boolean_t l2arc_rebuild_enabled = B_TRUE;	/* reload devices at import */
 uint64_t max_arc_size = 0;
 
+/*
+ * Persistent L2ARC
+ *
+ * So that a cache device stays warm across an export/import or a restart,
+ * every feed pass ends by writing log blocks that describe the buffers it
+ * wrote (their identity, location, size and the checksum l2arc_read_done()
+ * verifies), followed by a device header in the space just past the front
+ * vdev labels.  The header points at the newest log block, and each log
+ * block at the one written before it; pointers carry the fletcher-4
+ * checksum of the block they reference.
+ *
+ * When a device is added, l2arc_rebuild_thread() walks that chain from
+ * newest to oldest and recreates l2c_only headers for everything that has
+ * not been overwritten since.  The device is not fed while this runs.  The
+ * walk stops at the first block that fails to checksum, and at the point
+ * where the write hand has come round to overwrite older entries.
+ */
+#define	L2ARC_DEV_HDR_MAGIC	0x6c3261726364686dULL	/* "l2arcdhm" */
+#define	L2ARC_LOG_BLK_MAGIC	0x6c3261726c6f676dULL	/* "l2arclogm" */
+#define	L2ARC_LOG_BLK_SIZE	(1ULL << 16)	/* largest log block */
+#define	L2ARC_LOG_BLK_ENTRIES	818		/* fits in 64K */
+#define	L2ARC_DEV_HDR_SIZE	SPA_MINBLOCKSIZE
+
+typedef struct l2arc_log_blkptr {
+	uint64_t	lbp_daddr;		/* device address */
+	uint64_t	lbp_psize;		/* bytes written */
+	zio_cksum_t	lbp_cksum;		/* fletcher-4 of the block */
+} l2arc_log_blkptr_t;
+
+typedef struct l2arc_log_ent_phys {
+	dva_t		le_dva;			/* identity of the buffer */
+	uint64_t	le_birth;
+	uint64_t	le_cksum0;
+	zio_cksum_t	le_freeze_cksum;	/* b_freeze_cksum of the data */
+	uint64_t	le_daddr;		/* where it is on the device */
+	uint32_t	le_size;		/* logical size */
+	uint32_t	le_type;		/* arc_buf_contents_t */
+} l2arc_log_ent_phys_t;
+
+typedef struct l2arc_log_blk_phys {
+	uint64_t		lb_magic;
+	uint64_t		lb_nents;
+	l2arc_log_blkptr_t	lb_prev;	/* previous log block */
+	l2arc_log_ent_phys_t	lb_entries[L2ARC_LOG_BLK_ENTRIES];
+} l2arc_log_blk_phys_t;
+
+typedef struct l2arc_dev_hdr_phys {
+	uint64_t		dh_magic;
+	uint64_t		dh_spa_guid;
+	uint64_t		dh_vdev_guid;
+	uint64_t		dh_hand;	/* write hand after the pass */
+	uint64_t		dh_evict;	/* next pass may write up to */
+	uint64_t		dh_first;	/* still on the first sweep */
+	l2arc_log_blkptr_t	dh_log;		/* newest log block */
+	zio_cksum_t		dh_cksum;	/* of this header, zeroed */
+} l2arc_dev_hdr_phys_t;
+
 /*
  * L2ARC Internals
  */
@@ -594,6 +754,12 @@ typedef struct l2arc_dev {
 	boolean_t		l2ad_writing;	/* currently writing */
 	list_t			*l2ad_buflist;	/* buffer list */
 	list_node_t		l2ad_node;	/* device list node */
+	uint64_t		l2ad_hdr_asize;	/* dev header size on disk */
+	uint64_t		l2ad_log_asize;	/* log block size on disk */
+	l2arc_log_blk_phys_t	*l2ad_log_blk;	/* log block being filled */
+	l2arc_log_blkptr_t	l2ad_log_head;	/* newest log block written */
+	boolean_t		l2ad_rebuild;	/* rebuild in progress */
+	boolean_t		l2ad_rebuild_cancel; /* device going away */
 } l2arc_dev_t;
 
 static list_t L2ARC_dev_list;			/* device list */
@@ -605,6 +771,7 @@ static list_t L2ARC_free_on_write;		/* free after write buf list */
 static list_t *l2arc_free_on_write;		/* free after write list ptr */
 static kmutex_t l2arc_free_on_write_mtx;	/* mutex for list */
 static uint64_t l2arc_ndev;			/* number of devices */
+static kcondvar_t l2arc_rebuild_cv;		/* rebuild finished */
 
 typedef struct l2arc_read_callback {
 	arc_buf_t	*l2rcb_buf;		/* read buffer */
@@ -671,12 +838,13 @@ buf_hash(uint64_t spa, const dva_t *dva, uint64_t birth)
 static arc_buf_hdr_t *
 buf_hash_find(uint64_t spa, const dva_t *dva, uint64_t birth, kmutex_t **lockp)
 {
-	uint64_t idx = BUF_HASH_INDEX(spa, dva, birth);
-	kmutex_t *hash_lock = BUF_HASH_LOCK(idx);
+	uint64_t hv = buf_hash(spa, dva, birth);
+	struct ht_lock *htl = BUF_HASH_STRIPE(hv);
+	kmutex_t *hash_lock = &htl->ht_lock;
 	arc_buf_hdr_t *buf;
 
 	mutex_enter(hash_lock);
-	for (buf = buf_hash_table.ht_table[idx]; buf != NULL;
+	for (buf = htl->ht_table[hv & htl->ht_mask]; buf != NULL;
 	    buf = buf->b_hash_next) {
 		if (BUF_EQUAL(spa, dva, birth, buf)) {
 			*lockp = hash_lock;
@@ -697,22 +865,24 @@ buf_hash_find(uint64_t spa, const dva_t *dva, uint64_t birth, kmutex_t **lockp)
 static arc_buf_hdr_t *
 buf_hash_insert(arc_buf_hdr_t *buf, kmutex_t **lockp)
 {
-	uint64_t idx = BUF_HASH_INDEX(buf->b_spa, &buf->b_dva, buf->b_birth);
-	kmutex_t *hash_lock = BUF_HASH_LOCK(idx);
-	arc_buf_hdr_t *fbuf;
+	uint64_t hv = buf_hash(buf->b_spa, &buf->b_dva, buf->b_birth);
+	struct ht_lock *htl = BUF_HASH_STRIPE(hv);
+	kmutex_t *hash_lock = &htl->ht_lock;
+	arc_buf_hdr_t *fbuf, **bucket;
 	uint32_t i;
 
 	ASSERT(!HDR_IN_HASH_TABLE(buf));
 	*lockp = hash_lock;
 	mutex_enter(hash_lock);
-	for (fbuf = buf_hash_table.ht_table[idx], i = 0; fbuf != NULL;
+	bucket = &htl->ht_table[hv & htl->ht_mask];
+	for (fbuf = *bucket, i = 0; fbuf != NULL;
 	    fbuf = fbuf->b_hash_next, i++) {
 		if (BUF_EQUAL(buf->b_spa, &buf->b_dva, buf->b_birth, fbuf))
 			return (fbuf);
 	}
 
-	buf->b_hash_next = buf_hash_table.ht_table[idx];
-	buf_hash_table.ht_table[idx] = buf;
+	buf->b_hash_next = *bucket;
+	*bucket = buf;
 	buf->b_flags |= ARC_IN_HASH_TABLE;
 
 	/* collect some hash table performance data */
@@ -727,19 +897,27 @@ buf_hash_insert(arc_buf_hdr_t *buf, kmutex_t **lockp)
 	ARCSTAT_BUMP(arcstat_hash_elements);
 	ARCSTAT_MAXSTAT(arcstat_hash_elements);
 
+	if (!buf_hash_table.ht_grow_wanted &&
+	    ARCSTAT(arcstat_hash_elements) > (buf_hash_table.ht_mask + 1) *
+	    zfs_arc_hash_chain_target) {
+		buf_hash_table.ht_grow_wanted = B_TRUE;
+		cv_signal(&arc_reclaim_thr_cv);
+	}
+
 	return (NULL);
 }
 
 static void
 buf_hash_remove(arc_buf_hdr_t *buf)
 {
-	arc_buf_hdr_t *fbuf, **bufp;
-	uint64_t idx = BUF_HASH_INDEX(buf->b_spa, &buf->b_dva, buf->b_birth);
+	arc_buf_hdr_t *fbuf, **bucket, **bufp;
+	uint64_t hv = buf_hash(buf->b_spa, &buf->b_dva, buf->b_birth);
+	struct ht_lock *htl = BUF_HASH_STRIPE(hv);
 
-	ASSERT(MUTEX_HELD(BUF_HASH_LOCK(idx)));
+	ASSERT(MUTEX_HELD(&htl->ht_lock));
 	ASSERT(HDR_IN_HASH_TABLE(buf));
 
-	bufp = &buf_hash_table.ht_table[idx];
+	bucket = bufp = &htl->ht_table[hv & htl->ht_mask];
 	while ((fbuf = *bufp) != buf) {
 		ASSERT(fbuf != NULL);
 		bufp = &fbuf->b_hash_next;
@@ -751,11 +929,179 @@ buf_hash_remove(arc_buf_hdr_t *buf)
 	/* collect some hash table performance data */
 	ARCSTAT_BUMPDOWN(arcstat_hash_elements);
 
-	if (buf_hash_table.ht_table[idx] &&
-	    buf_hash_table.ht_table[idx]->b_hash_next == NULL)
+	if (*bucket && (*bucket)->b_hash_next == NULL)
 		ARCSTAT_BUMPDOWN(arcstat_hash_chains);
 }
 
+/*
+ * Frequency sketch for the admission filter: a count-min sketch of 4-bit
+ * saturating counters, four per block, halved every ten sightings per
+ * counter so that it follows the workload.  Updates are not atomic; the
+ * odd lost increment doesn't matter to an estimate.
+ *
+ * The sketch grows with the hash table and is switched over stripe by
+ * stripe in the same way, so a block is always counted in the sketch its
+ * hash lock points at.  arc_sketch is the newest one; the reclaim thread,
+ * which alone replaces it, also does the halving.
+ */
+#define	ARC_SKETCH_DEPTH	4
+#define	ARC_SKETCH_MAX		15
+
+static uint8_t *arc_sketch;
+static uint64_t arc_sketch_mask;
+static uint64_t arc_sketch_adds;
+static boolean_t arc_sketch_age_wanted;
+
+static void
+arc_sketch_age(void)
+{
+	arc_sketch_age_wanted = B_FALSE;
+	for (uint64_t i = 0; i <= arc_sketch_mask; i++)
+		arc_sketch[i] >>= 1;
+}
+
+/*
+ * Count a sighting of the block, and return how often it had been seen.
+ * Called with the block's hash lock held.
+ */
+static uint_t
+arc_sketch_touch(arc_buf_hdr_t *ab)
+{
+	uint64_t hv = buf_hash(ab->b_spa, &ab->b_dva, ab->b_birth);
+	uint64_t step = (hv >> 32) | 1;
+	struct ht_lock *htl = BUF_HASH_STRIPE(hv);
+	uint8_t *ctr[ARC_SKETCH_DEPTH];
+	uint_t est = ARC_SKETCH_MAX;
+	int i;
+
+	ASSERT(MUTEX_HELD(&htl->ht_lock));
+	for (i = 0; i < ARC_SKETCH_DEPTH; i++) {
+		ctr[i] = &htl->ht_sketch[(hv + i * step) & htl->ht_sketch_mask];
+		est = MIN(est, *ctr[i]);
+	}
+
+	/* only raise the counters that make up the estimate */
+	if (est < ARC_SKETCH_MAX) {
+		for (i = 0; i < ARC_SKETCH_DEPTH; i++) {
+			if (*ctr[i] == est)
+				(*ctr[i])++;
+		}
+	}
+
+	if (atomic_inc_64_nv(&arc_sketch_adds) %
+	    (10 * (arc_sketch_mask + 1)) == 0) {
+		arc_sketch_age_wanted = B_TRUE;
+		cv_signal(&arc_reclaim_thr_cv);
+	}
+
+	return (est);
+}
+
+/*
+ * Move the buckets of every stripe into a table of hsize buckets, and its
+ * counting into a sketch four times that size.  Only one stripe is locked
+ * at a time, so lookups elsewhere carry on.
+ */
+static void
+buf_hash_resize(uint64_t hsize)
+{
+	arc_buf_hdr_t **otable, **ntable, *buf, *next;
+	uint64_t omask, nmask, nlocks, hv, idx;
+	uint8_t *osketch, *nsketch;
+	uint64_t osmask, nsmask;
+	int64_t chains;
+
+	otable = buf_hash_table.ht_table;
+	omask = buf_hash_table.ht_mask;
+	nmask = hsize - 1;
+	nlocks = buf_hash_table.ht_lock_mask + 1;
+	ASSERT3U(hsize, >, omask + 1);
+
+	ntable = kmem_zalloc(hsize * sizeof (void *), KM_NOSLEEP);
+	if (ntable == NULL)
+		return;
+
+	/*
+	 * Seed each new counter from the one it was folded into, which keeps
+	 * the estimates an upper bound.  Without memory for a new sketch
+	 * the old one carries on, only more crowded.
+	 */
+	osketch = arc_sketch;
+	osmask = arc_sketch_mask;
+	nsmask = 4 * hsize - 1;
+	nsketch = kmem_alloc(nsmask + 1, KM_NOSLEEP);
+	if (nsketch != NULL) {
+		for (idx = 0; idx <= nsmask; idx++)
+			nsketch[idx] = osketch[idx & osmask];
+	} else {
+		nsketch = osketch;
+		nsmask = osmask;
+	}
+
+	for (uint64_t l = 0; l < nlocks; l++) {
+		struct ht_lock *htl = &buf_hash_table.ht_locks[l].htp_lock;
+
+		mutex_enter(&htl->ht_lock);
+		ASSERT3P(htl->ht_table, ==, otable);
+		chains = 0;
+		for (idx = l; idx <= omask; idx += nlocks) {
+			if (otable[idx] != NULL &&
+			    otable[idx]->b_hash_next != NULL)
+				chains--;
+			for (buf = otable[idx]; buf != NULL; buf = next) {
+				next = buf->b_hash_next;
+				hv = buf_hash(buf->b_spa, &buf->b_dva,
+				    buf->b_birth);
+				ASSERT3U(hv & (nlocks - 1), ==, l);
+				buf->b_hash_next = ntable[hv & nmask];
+				ntable[hv & nmask] = buf;
+			}
+			otable[idx] = NULL;
+		}
+		for (idx = l; idx <= nmask; idx += nlocks) {
+			if (ntable[idx] != NULL &&
+			    ntable[idx]->b_hash_next != NULL)
+				chains++;
+		}
+		htl->ht_table = ntable;
+		htl->ht_mask = nmask;
+		htl->ht_sketch = nsketch;
+		htl->ht_sketch_mask = nsmask;
+		mutex_exit(&htl->ht_lock);
+		ARCSTAT_INCR(arcstat_hash_chains, chains);
+	}
+
+	buf_hash_table.ht_table = ntable;
+	buf_hash_table.ht_mask = nmask;
+	kmem_free(otable, (omask + 1) * sizeof (void *));
+
+	if (nsketch != osketch) {
+		arc_sketch = nsketch;
+		arc_sketch_mask = nsmask;
+		kmem_free(osketch, osmask + 1);
+	}
+}
+
+/*
+ * Size the table for an average block size of 64K in an ARC of arc_c_max
+ * bytes, and for the headers it holds to be spread zfs_arc_hash_chain_target
+ * deep.  Called from the reclaim thread, which is the only one to resize.
+ */
+static void
+buf_hash_grow(void)
+{
+	uint64_t hsize = buf_hash_table.ht_mask + 1;
+
+	buf_hash_table.ht_grow_wanted = B_FALSE;
+	while (hsize * 65536 < arc_c_max ||
+	    hsize * MAX(zfs_arc_hash_chain_target, 1) <
+	    ARCSTAT(arcstat_hash_elements))
+		hsize <<= 1;
+
+	if (hsize > buf_hash_table.ht_mask + 1)
+		buf_hash_resize(hsize);
+}
+
 /*
  * Global data structures and functions for the buf kmem cache.
  */
@@ -769,8 +1115,12 @@ buf_fini(void)
 
 	kmem_free(buf_hash_table.ht_table,
 	    (buf_hash_table.ht_mask + 1) * sizeof (void *));
-	for (i = 0; i < BUF_LOCKS; i++)
-		mutex_destroy(&buf_hash_table.ht_locks[i].ht_lock);
+	for (i = 0; i <= buf_hash_table.ht_lock_mask; i++)
+		mutex_destroy(&buf_hash_table.ht_locks[i].htp_lock.ht_lock);
+	kmem_free(buf_hash_table.ht_locks_alloc,
+	    (buf_hash_table.ht_lock_mask + 1) * sizeof (ht_lock_pad_t) +
+	    HT_LOCK_PAD);
+	kmem_free(arc_sketch, arc_sketch_mask + 1);
 	kmem_cache_destroy(hdr_cache);
 	kmem_cache_destroy(buf_cache);
 }
@@ -855,14 +1205,22 @@ buf_init(void)
 {
 	uint64_t *ct;
 	uint64_t hsize = 1ULL << 12;
+	uint64_t nlocks = BUF_LOCKS_MIN;
 	int i, j;
 
 	/*
-	 * The hash table is big enough to fill all of physical memory
-	 * with an average 64K block size.  The table will take up
-	 * totalmem*sizeof(void*)/64K (eg. 128KB/GB with 8-byte pointers).
+	 * BUF_LOCKS_PER_CPU locks per CPU, but no fewer than BUF_LOCKS_MIN.
 	 */
-	while (hsize * 65536 < physmem * PAGESIZE)
+	while (nlocks < (uint64_t)MAX(ncpus, 1) * BUF_LOCKS_PER_CPU)
+		nlocks <<= 1;
+
+	/*
+	 * The hash table starts out big enough to fill the ARC with an
+	 * average 64K block size.  The table will take up
+	 * arc_c_max*sizeof(void*)/64K (eg. 128KB/GB with 8-byte pointers),
+	 * and buf_hash_grow() enlarges it when that turns out too small.
+	 */
+	while (hsize * 65536 < arc_c_max)
 		hsize <<= 1;
 retry:
 	buf_hash_table.ht_mask = hsize - 1;
@@ -873,6 +1231,12 @@ retry:
 		hsize >>= 1;
 		goto retry;
 	}
+	while (nlocks > hsize)
+		nlocks >>= 1;
+
+	/* the sketch remembers four times as many blocks as fit */
+	arc_sketch_mask = 4 * hsize - 1;
+	arc_sketch = kmem_zalloc(arc_sketch_mask + 1, KM_SLEEP);
 
 	hdr_cache = kmem_cache_create("arc_buf_hdr_t", sizeof (arc_buf_hdr_t),
 	    0, hdr_cons, hdr_dest, hdr_recl, NULL, NULL, 0);
@@ -883,9 +1247,19 @@ retry:
 		for (ct = zfs_crc64_table + i, *ct = i, j = 8; j > 0; j--)
 			*ct = (*ct >> 1) ^ (-(*ct & 1) & ZFS_CRC64_POLY);
 
-	for (i = 0; i < BUF_LOCKS; i++) {
-		mutex_init(&buf_hash_table.ht_locks[i].ht_lock,
-		    NULL, MUTEX_DEFAULT, NULL);
+	buf_hash_table.ht_lock_mask = nlocks - 1;
+	buf_hash_table.ht_locks_alloc = kmem_zalloc(nlocks *
+	    sizeof (ht_lock_pad_t) + HT_LOCK_PAD, KM_SLEEP);
+	buf_hash_table.ht_locks = (ht_lock_pad_t *)P2ROUNDUP(
+	    (uintptr_t)buf_hash_table.ht_locks_alloc, HT_LOCK_PAD);
+	for (i = 0; i < nlocks; i++) {
+		struct ht_lock *htl = &buf_hash_table.ht_locks[i].htp_lock;
+
+		mutex_init(&htl->ht_lock, NULL, MUTEX_DEFAULT, NULL);
+		htl->ht_table = buf_hash_table.ht_table;
+		htl->ht_mask = buf_hash_table.ht_mask;
+		htl->ht_sketch = arc_sketch;
+		htl->ht_sketch_mask = arc_sketch_mask;
 	}
 }
 
@@ -972,6 +1346,22 @@ arc_buf_freeze(arc_buf_t *buf)
 	arc_cksum_compute(buf, B_FALSE);
 }
 
+/*
+ * Put an evictable buffer on its state's list.  Eviction works from the
+ * tail, so that is where low priority buffers go.
+ */
+static void
+arc_list_insert(arc_state_t *state, arc_buf_hdr_t *ab)
+{
+	list_t *list = &state->arcs_list[ab->b_type];
+
+	ASSERT(MUTEX_HELD(&state->arcs_mtx));
+	if (HDR_COLD(ab))
+		list_insert_tail(list, ab);
+	else
+		list_insert_head(list, ab);
+}
+
 static void
 add_reference(arc_buf_hdr_t *ab, kmutex_t *hash_lock, void *tag)
 {
@@ -979,7 +1369,7 @@ add_reference(arc_buf_hdr_t *ab, kmutex_t *hash_lock, void *tag)
 
 	if ((refcount_add(&ab->b_refcnt, tag) == 1) &&
 	    (ab->b_state != arc_anon)) {
-		uint64_t delta = ab->b_size * ab->b_datacnt;
+		uint64_t delta = HDR_DATA_SIZE(ab);
 		list_t *list = &ab->b_state->arcs_list[ab->b_type];
 		uint64_t *size = &ab->b_state->arcs_lsize[ab->b_type];
 
@@ -1018,9 +1408,9 @@ remove_reference(arc_buf_hdr_t *ab, kmutex_t *hash_lock, void *tag)
 		ASSERT(!MUTEX_HELD(&state->arcs_mtx));
 		mutex_enter(&state->arcs_mtx);
 		ASSERT(!list_link_active(&ab->b_arc_node));
-		list_insert_head(&state->arcs_list[ab->b_type], ab);
-		ASSERT(ab->b_datacnt > 0);
-		atomic_add_64(size, ab->b_size * ab->b_datacnt);
+		arc_list_insert(state, ab);
+		ASSERT(ab->b_datacnt > 0 || ab->b_cdata != NULL);
+		atomic_add_64(size, HDR_DATA_SIZE(ab));
 		mutex_exit(&state->arcs_mtx);
 	}
 	return (cnt);
@@ -1041,10 +1431,11 @@ arc_change_state(arc_state_t *new_state, arc_buf_hdr_t *ab, kmutex_t *hash_lock)
 	ASSERT(new_state != old_state);
 	ASSERT(refcnt == 0 || ab->b_datacnt > 0);
 	ASSERT(ab->b_datacnt == 0 || !GHOST_STATE(new_state));
+	ASSERT(ab->b_cdata == NULL || !GHOST_STATE(new_state));
 	ASSERT(ab->b_datacnt <= 1 || new_state != arc_anon);
 	ASSERT(ab->b_datacnt <= 1 || old_state != arc_anon);
 
-	from_delta = to_delta = ab->b_datacnt * ab->b_size;
+	from_delta = to_delta = HDR_DATA_SIZE(ab);
 
 	/*
 	 * If this buffer is evictable, transfer it from the
@@ -1083,7 +1474,7 @@ arc_change_state(arc_state_t *new_state, arc_buf_hdr_t *ab, kmutex_t *hash_lock)
 			if (use_mutex)
 				mutex_enter(&new_state->arcs_mtx);
 
-			list_insert_head(&new_state->arcs_list[ab->b_type], ab);
+			arc_list_insert(new_state, ab);
 
 			/* ghost elements have a ghost size */
 			if (GHOST_STATE(new_state)) {
@@ -1275,6 +1666,33 @@ arc_buf_clone(arc_buf_t *from)
 	return (buf);
 }
 
+/*
+ * Give a header that only holds its compressed payload a buffer again.
+ */
+static arc_buf_t *
+arc_buf_decompress(arc_buf_hdr_t *hdr)
+{
+	arc_buf_t *buf;
+
+	ASSERT(hdr->b_state != arc_anon);
+	ASSERT(hdr->b_cdata != NULL);
+	ASSERT3P(hdr->b_buf, ==, NULL);
+	ASSERT3U(hdr->b_datacnt, ==, 0);
+
+	buf = kmem_cache_alloc(buf_cache, KM_PUSHPAGE);
+	buf->b_hdr = hdr;
+	buf->b_data = NULL;
+	buf->b_efunc = NULL;
+	buf->b_private = NULL;
+	buf->b_next = NULL;
+	hdr->b_buf = buf;
+	arc_get_data_buf(buf);
+	VERIFY(zio_decompress_data(hdr->b_compress, hdr->b_cdata,
+	    buf->b_data, hdr->b_psize, hdr->b_size) == 0);
+	hdr->b_datacnt = 1;
+	return (buf);
+}
+
 void
 arc_buf_add_ref(arc_buf_t *buf, void* tag)
 {
@@ -1300,7 +1718,7 @@ arc_buf_add_ref(arc_buf_t *buf, void* tag)
 	ASSERT(hdr->b_state == arc_mru || hdr->b_state == arc_mfu);
 	add_reference(hdr, hash_lock, tag);
 	DTRACE_PROBE1(arc__hit, arc_buf_hdr_t *, hdr);
-	arc_access(hdr, hash_lock);
+	arc_access(hdr, hash_lock, B_TRUE);
 	mutex_exit(hash_lock);
 	ARCSTAT_BUMP(arcstat_hits);
 	ARCSTAT_CONDSTAT(!(hdr->b_flags & ARC_PREFETCH),
@@ -1331,6 +1749,73 @@ arc_buf_data_free(arc_buf_hdr_t *hdr, void (*free_func)(void *, size_t),
 	}
 }
 
+/*
+ * Attach a buffer for the compressed payload of the block to hdr.
+ * The payload is charged to the state the hdr is in.
+ */
+static void
+arc_hdr_alloc_cdata(arc_buf_hdr_t *hdr, uint64_t psize,
+    enum zio_compress compress)
+{
+	arc_state_t *state = hdr->b_state;
+
+	ASSERT(hdr->b_cdata == NULL);
+	ASSERT(!GHOST_STATE(state));
+
+	if (hdr->b_type == ARC_BUFC_METADATA) {
+		hdr->b_cdata = zio_buf_alloc(psize);
+		arc_space_consume(psize, ARC_SPACE_DATA);
+	} else {
+		ASSERT(hdr->b_type == ARC_BUFC_DATA);
+		hdr->b_cdata = zio_data_buf_alloc(psize);
+		ARCSTAT_INCR(arcstat_data_size, psize);
+		atomic_add_64(&arc_size, psize);
+	}
+	hdr->b_psize = psize;
+	hdr->b_compress = compress;
+
+	atomic_add_64(&state->arcs_size, psize);
+	if (list_link_active(&hdr->b_arc_node)) {
+		ASSERT(refcount_is_zero(&hdr->b_refcnt));
+		atomic_add_64(&state->arcs_lsize[hdr->b_type], psize);
+	}
+	ARCSTAT_INCR(arcstat_compressed_size, psize);
+	ARCSTAT_INCR(arcstat_uncompressed_size, hdr->b_size);
+}
+
+static void
+arc_hdr_free_cdata(arc_buf_hdr_t *hdr)
+{
+	arc_state_t *state = hdr->b_state;
+	uint64_t psize = hdr->b_psize;
+
+	ASSERT(hdr->b_cdata != NULL);
+
+	if (list_link_active(&hdr->b_arc_node)) {
+		uint64_t *cnt = &state->arcs_lsize[hdr->b_type];
+
+		ASSERT(refcount_is_zero(&hdr->b_refcnt));
+		ASSERT(state != arc_anon);
+		ASSERT3U(*cnt, >=, psize);
+		atomic_add_64(cnt, -psize);
+	}
+	ASSERT3U(state->arcs_size, >=, psize);
+	atomic_add_64(&state->arcs_size, -psize);
+
+	if (hdr->b_type == ARC_BUFC_METADATA) {
+		zio_buf_free(hdr->b_cdata, psize);
+		arc_space_return(psize, ARC_SPACE_DATA);
+	} else {
+		zio_data_buf_free(hdr->b_cdata, psize);
+		ARCSTAT_INCR(arcstat_data_size, -psize);
+		atomic_add_64(&arc_size, -psize);
+	}
+	ARCSTAT_INCR(arcstat_compressed_size, -psize);
+	ARCSTAT_INCR(arcstat_uncompressed_size, -hdr->b_size);
+	hdr->b_cdata = NULL;
+	hdr->b_psize = 0;
+}
+
 static void
 arc_buf_destroy(arc_buf_t *buf, boolean_t recycle, boolean_t all)
 {
@@ -1451,6 +1936,8 @@ arc_hdr_destroy(arc_buf_hdr_t *hdr)
 			arc_buf_destroy(hdr->b_buf, FALSE, TRUE);
 		}
 	}
+	if (hdr->b_cdata != NULL)
+		arc_hdr_free_cdata(hdr);
 	if (hdr->b_freeze_cksum != NULL) {
 		kmem_free(hdr->b_freeze_cksum, sizeof (zio_cksum_t));
 		hdr->b_freeze_cksum = NULL;
@@ -1476,7 +1963,8 @@ arc_buf_free(arc_buf_t *buf, void *tag)
 
 		mutex_enter(hash_lock);
 		(void) remove_reference(hdr, hash_lock, tag);
-		if (hdr->b_datacnt > 1) {
+		if (hdr->b_datacnt > 1 || (hdr->b_cdata != NULL &&
+		    refcount_is_zero(&hdr->b_refcnt))) {
 			arc_buf_destroy(buf, FALSE, TRUE);
 		} else {
 			ASSERT(buf == hdr->b_buf);
@@ -1526,7 +2014,9 @@ arc_buf_remove_ref(arc_buf_t *buf, void* tag)
 	ASSERT(buf->b_data != NULL);
 
 	(void) remove_reference(hdr, hash_lock, tag);
-	if (hdr->b_datacnt > 1) {
+	if (hdr->b_datacnt > 1 || (hdr->b_cdata != NULL &&
+	    refcount_is_zero(&hdr->b_refcnt))) {
+		/* a compressed hdr only keeps its data while referenced */
 		if (no_callback)
 			arc_buf_destroy(buf, FALSE, TRUE);
 	} else if (no_callback) {
@@ -1569,6 +2059,7 @@ arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes, boolean_t recycle,
 	list_t *list = &state->arcs_list[type];
 	kmutex_t *hash_lock;
 	boolean_t have_lock;
+	boolean_t had_data;
 	void *stolen = NULL;
 
 	ASSERT(state == arc_mru || state == arc_mfu);
@@ -1596,7 +2087,8 @@ arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes, boolean_t recycle,
 		have_lock = MUTEX_HELD(hash_lock);
 		if (have_lock || mutex_tryenter(hash_lock)) {
 			ASSERT3U(refcount_count(&ab->b_refcnt), ==, 0);
-			ASSERT(ab->b_datacnt > 0);
+			ASSERT(ab->b_datacnt > 0 || ab->b_cdata != NULL);
+			had_data = (ab->b_datacnt > 0);
 			while (ab->b_buf) {
 				arc_buf_t *buf = ab->b_buf;
 				if (!rw_tryenter(&buf->b_lock, RW_WRITER)) {
@@ -1643,7 +2135,20 @@ arc_evict(arc_state_t *state, uint64_t spa, int64_t bytes, boolean_t recycle,
 				}
 			}
 
-			if (ab->b_datacnt == 0) {
+			if (ab->b_datacnt == 0 && ab->b_cdata != NULL &&
+			    had_data && bytes >= 0) {
+				/*
+				 * Only the uncompressed copy goes; the
+				 * compressed one starts over at the head.
+				 */
+				list_remove(list, ab);
+				list_insert_head(list, ab);
+				ab->b_flags &= ~ARC_BUF_AVAILABLE;
+			} else if (ab->b_datacnt == 0) {
+				if (ab->b_cdata != NULL) {
+					bytes_evicted += ab->b_psize;
+					arc_hdr_free_cdata(ab);
+				}
 				arc_change_state(evicted_state, ab, hash_lock);
 				ASSERT(HDR_IN_HASH_TABLE(ab));
 				ab->b_flags |= ARC_IN_HASH_TABLE;
@@ -1905,11 +2410,7 @@ arc_shrink(void)
 	if (arc_c > arc_c_min) {
 		uint64_t to_free;
 
-#if 0
-		to_free = MAX(arc_c >> arc_shrink_shift, ptob(needfree));
-#else
-		to_free = arc_c >> arc_shrink_shift;
-#endif
+		to_free = MAX(arc_c >> arc_shrink_shift, arc_need_free);
 		if (arc_c > arc_c_min + to_free)
 			atomic_add_64(&arc_c, -to_free);
 		else
@@ -1928,65 +2429,236 @@ arc_shrink(void)
 		arc_adjust();
 }
 
+#ifdef _KERNEL
+static kmutex_t		arc_pressure_lock;
+static hrtime_t		arc_pressure_last;
+static int		arc_pressure_reclaim;
+static char		arc_cgroup_dir[MAXPATHLEN];
+
+/*
+ * Reads a cgroup file holding a single number.  "max" (no limit) and
+ * missing files (cgroup v1, or no memory controller) return ENOENT.
+ */
 static int
-arc_reclaim_needed(void)
+arc_cgroup_read(const char *name, uint64_t *valp)
 {
-#if 0
-	uint64_t extra;
+	char path[MAXPATHLEN];
+	char buf[32];
+	FILE *fp;
+	int error = ENOENT;
+
+	if (snprintf(path, sizeof (path), "%s/%s", arc_cgroup_dir,
+	    name) >= sizeof (path))
+		return (ENOENT);
+	if ((fp = fopen(path, "r")) == NULL)
+		return (ENOENT);
+	if (fgets(buf, sizeof (buf), fp) != NULL &&
+	    buf[0] >= '0' && buf[0] <= '9') {
+		*valp = strtoull(buf, NULL, 10);
+		error = 0;
+	}
+	(void) fclose(fp);
+	return (error);
+}
 
-#ifdef _KERNEL
+/*
+ * Reads one counter from the cgroup's memory.stat.
+ */
+static int
+arc_cgroup_stat(const char *key, uint64_t *valp)
+{
+	char path[MAXPATHLEN];
+	char line[128];
+	size_t len = strlen(key);
+	FILE *fp;
+	int error = ENOENT;
+
+	if (snprintf(path, sizeof (path), "%s/memory.stat",
+	    arc_cgroup_dir) >= sizeof (path))
+		return (ENOENT);
+	if ((fp = fopen(path, "r")) == NULL)
+		return (ENOENT);
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		if (strncmp(line, key, len) == 0 && line[len] == ' ') {
+			*valp = strtoull(line + len + 1, NULL, 10);
+			error = 0;
+			break;
+		}
+	}
+	(void) fclose(fp);
+	return (error);
+}
 
-	if (needfree)
-		return (1);
+static int
+arc_meminfo_available(uint64_t *availp)
+{
+	char line[128];
+	u_longlong_t kb;
+	FILE *fp;
+	int error = ENOENT;
+
+	if ((fp = fopen("/proc/meminfo", "r")) == NULL)
+		return (ENOENT);
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+			*availp = kb << 10;
+			error = 0;
+			break;
+		}
+	}
+	(void) fclose(fp);
+	return (error);
+}
 
-	/*
-	 * take 'desfree' extra pages, so we reclaim sooner, rather than later
-	 */
-	extra = desfree;
+/*
+ * Returns the integer part of the "some avg10" memory stall percentage,
+ * preferring our own cgroup over the system wide figure.
+ */
+static int
+arc_psi_stall(uint_t *stallp)
+{
+	char path[MAXPATHLEN];
+	char line[128];
+	FILE *fp;
+	int error = ENOENT;
+
+	if ((snprintf(path, sizeof (path), "%s/memory.pressure",
+	    arc_cgroup_dir) >= sizeof (path) ||
+	    (fp = fopen(path, "r")) == NULL) &&
+	    (fp = fopen("/proc/pressure/memory", "r")) == NULL)
+		return (ENOENT);
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		if (sscanf(line, "some avg10=%u", stallp) == 1) {
+			error = 0;
+			break;
+		}
+	}
+	(void) fclose(fp);
+	return (error);
+}
 
-	/*
-	 * check that we're out of range of the pageout scanner.  It starts to
-	 * schedule paging if freemem is less than lotsfree and needfree.
-	 * lotsfree is the high-water mark for pageout, and needfree is the
-	 * number of needed free pages.  We add extra pages here to make sure
-	 * the scanner doesn't start up while we're freeing memory.
-	 */
-	if (freemem < lotsfree + needfree + extra)
-		return (1);
+/*
+ * Find the cgroup v2 directory we are charged to.  Inside a container with
+ * a private cgroup namespace our group is the root of /sys/fs/cgroup.
+ */
+static void
+arc_pressure_init(void)
+{
+	char line[MAXPATHLEN];
+	char path[MAXPATHLEN];
+	FILE *fp;
+
+	mutex_init(&arc_pressure_lock, NULL, MUTEX_DEFAULT, NULL);
+	arc_pressure_last = 0;
+	arc_pressure_reclaim = 0;
+	arc_need_free = 0;
+
+	(void) snprintf(arc_cgroup_dir, sizeof (arc_cgroup_dir),
+	    "/sys/fs/cgroup");
+	if ((fp = fopen("/proc/self/cgroup", "r")) == NULL)
+		return;
+	while (fgets(line, sizeof (line), fp) != NULL) {
+		if (strncmp(line, "0::", 3) != 0)
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		/*
+		 * A group whose path doesn't fit can't be opened anyway;
+		 * stay with the root rather than watch a truncated name.
+		 */
+		if (snprintf(path, sizeof (path),
+		    "/sys/fs/cgroup%s/memory.current", line + 3) <
+		    sizeof (path) && access(path, R_OK) == 0 &&
+		    snprintf(path, sizeof (path), "/sys/fs/cgroup%s",
+		    line + 3) < sizeof (arc_cgroup_dir))
+			(void) strcpy(arc_cgroup_dir, path);
+		break;
+	}
+	(void) fclose(fp);
+}
 
-	/*
-	 * check to make sure that swapfs has enough space so that anon
-	 * reservations can still succeed. anon_resvmem() checks that the
-	 * availrmem is greater than swapfs_minfree, and the number of reserved
-	 * swap pages.  We also add a bit of extra here just to prevent
-	 * circumstances from getting really dire.
-	 */
-	if (availrmem < swapfs_minfree + swapfs_reserve + extra)
-		return (1);
+static void
+arc_pressure_fini(void)
+{
+	mutex_destroy(&arc_pressure_lock);
+}
+
+/*
+ * Returns the tighter of the cgroup's high and max limits, if any.
+ */
+static int
+arc_cgroup_limit(uint64_t *limitp)
+{
+	uint64_t high, max;
+	int herr, merr;
+
+	herr = arc_cgroup_read("memory.high", &high);
+	merr = arc_cgroup_read("memory.max", &max);
+	if (herr != 0 && merr != 0)
+		return (ENOENT);
+	if (herr != 0)
+		*limitp = max;
+	else if (merr != 0)
+		*limitp = high;
+	else
+		*limitp = MIN(high, max);
+	return (0);
+}
+#endif
+
+static int
+arc_reclaim_needed(void)
+{
+#ifdef _KERNEL
+	hrtime_t now = gethrtime();
+	uint64_t current, inactive, limit, headroom, avail, sys_free;
+	uint64_t need = 0;
+	uint_t stall;
+	int reclaim;
 
-#if defined(__i386)
 	/*
-	 * If we're on an i386 platform, it's possible that we'll exhaust the
-	 * kernel heap space before we ever run out of available physical
-	 * memory.  Most checks of the size of the heap_area compare against
-	 * tune.t_minarmem, which is the minimum available real memory that we
-	 * can have in the system.  However, this is generally fixed at 25 pages
-	 * which is so low that it's useless.  In this comparison, we seek to
-	 * calculate the total heap-size, and reclaim if more than 3/4ths of the
-	 * heap is allocated.  (Or, in the calculation, if less than 1/4th is
-	 * free)
+	 * This is called for every buffer we add to the cache, so only one
+	 * caller at a time reads /proc and /sys, and only every
+	 * zfs_arc_pressure_interval_ms.  Everyone else gets the last answer.
 	 */
-	if (btop(vmem_size(heap_arena, VMEM_FREE)) <
-	    (btop(vmem_size(heap_arena, VMEM_FREE | VMEM_ALLOC)) >> 2))
-		return (1);
-#endif
+	if (now - arc_pressure_last <
+	    (hrtime_t)zfs_arc_pressure_interval_ms * (NANOSEC / MILLISEC) ||
+	    !mutex_tryenter(&arc_pressure_lock))
+		return (arc_pressure_reclaim);
+
+	if (arc_cgroup_read("memory.current", &current) == 0 &&
+	    arc_cgroup_limit(&limit) == 0) {
+		/*
+		 * memory.current includes page cache the kernel can drop
+		 * at no cost to us; don't shrink the ARC to make room for it.
+		 */
+		if (arc_cgroup_stat("inactive_file", &inactive) == 0)
+			current -= MIN(current, inactive);
+		headroom = limit >> zfs_arc_cgroup_headroom_shift;
+		if (current + headroom > limit)
+			need = current + headroom - limit;
+	}
+
+	sys_free = zfs_arc_sys_free;
+	if (sys_free == 0)
+		sys_free = ptob(physmem) >> 6;
+	if (arc_meminfo_available(&avail) == 0 && avail < sys_free)
+		need = MAX(need, sys_free - avail);
+
+	reclaim = (need != 0);
+	if (zfs_arc_psi_threshold > 0 && arc_psi_stall(&stall) == 0 &&
+	    stall >= zfs_arc_psi_threshold)
+		reclaim = 1;
+
+	arc_need_free = need;
+	arc_pressure_reclaim = reclaim;
+	membar_producer();
+	arc_pressure_last = now;
+	mutex_exit(&arc_pressure_lock);
 
+	return (reclaim);
 #else
-	if (spa_get_random(100) == 0)
-		return (1);
-#endif
-#endif
 	return (0);
+#endif
 }
 
 static void
@@ -2048,7 +2720,15 @@ arc_reclaim_thread(void)
 	while (arc_thread_exit == 0) {
 		if (arc_reclaim_needed()) {
 
-			if (arc_no_grow) {
+			/*
+			 * Past a hard memory limit, reaping the kmem caches
+			 * alone will not get us back under it.
+			 */
+			if (arc_need_free != 0) {
+				arc_no_grow = TRUE;
+				last_reclaim = ARC_RECLAIM_AGGR;
+				membar_producer();
+			} else if (arc_no_grow) {
 				if (last_reclaim == ARC_RECLAIM_CONS) {
 					last_reclaim = ARC_RECLAIM_AGGR;
 				} else {
@@ -2074,6 +2754,12 @@ arc_reclaim_thread(void)
 		    arc_mru_ghost->arcs_size + arc_mfu_ghost->arcs_size)
 			arc_adjust();
 
+		if (buf_hash_table.ht_grow_wanted)
+			buf_hash_grow();
+
+		if (arc_sketch_age_wanted)
+			arc_sketch_age();
+
 		if (arc_eviction_list != NULL)
 			arc_do_user_evicts();
 
@@ -2289,14 +2975,53 @@ out:
 }
 
 /*
- * This routine is called whenever a buffer is accessed.
+ * Decide whether a buffer that is entering the MRU state, or a prefetched
+ * one that is now being used, is cached at low priority.  freq is how
+ * often the sketch had seen the block before.
+ */
+static void
+arc_admit(arc_buf_hdr_t *buf, uint_t freq)
+{
+	boolean_t cold;
+
+	if (buf->b_flags & (ARC_PREFETCH | ARC_LOWPRI)) {
+		cold = B_TRUE;
+	} else {
+		cold = zfs_arc_admit_filter && buf->b_type == ARC_BUFC_DATA &&
+		    !(buf->b_flags & ARC_NOFILTER) && arc_size >= arc_c &&
+		    freq < zfs_arc_admit_freq;
+	}
+
+	if (cold) {
+		buf->b_flags |= ARC_COLD;
+		ARCSTAT_BUMP(arcstat_admit_lowpri);
+	} else {
+		buf->b_flags &= ~ARC_COLD;
+	}
+}
+
+/*
+ * This routine is called whenever a buffer is accessed.  demand is
+ * whether the access is a use of the data rather than a prefetch; a
+ * prefetched buffer still has ARC_PREFETCH set on its first use.
  * NOTE: the hash lock is dropped in this function.
  */
 static void
-arc_access(arc_buf_hdr_t *buf, kmutex_t *hash_lock)
+arc_access(arc_buf_hdr_t *buf, kmutex_t *hash_lock, boolean_t demand)
 {
+	uint_t freq = 0;
+
 	ASSERT(MUTEX_HELD(hash_lock));
 
+	/*
+	 * Demand reads of data feed the admission filter's sketch,
+	 * including the first use of a prefetched buffer, which
+	 * arc_admit() below then reconsiders.
+	 */
+	if (zfs_arc_admit_filter && demand && buf->b_type == ARC_BUFC_DATA &&
+	    !(buf->b_flags & (ARC_LOWPRI | ARC_NOFILTER)))
+		freq = arc_sketch_touch(buf);
+
 	if (buf->b_state == arc_anon) {
 		/*
 		 * This buffer is not in the cache, and does not
@@ -2306,6 +3031,7 @@ arc_access(arc_buf_hdr_t *buf, kmutex_t *hash_lock)
 
 		ASSERT(buf->b_arc_access == 0);
 		buf->b_arc_access = lbolt;
+		arc_admit(buf, freq);
 		DTRACE_PROBE1(new_state__mru, arc_buf_hdr_t *, buf);
 		arc_change_state(arc_mru, buf, hash_lock);
 
@@ -2323,6 +3049,7 @@ arc_access(arc_buf_hdr_t *buf, kmutex_t *hash_lock)
 				ASSERT(list_link_active(&buf->b_arc_node));
 			} else {
 				buf->b_flags &= ~ARC_PREFETCH;
+				arc_admit(buf, freq);
 				ARCSTAT_BUMP(arcstat_mru_hits);
 			}
 			buf->b_arc_access = lbolt;
@@ -2341,6 +3068,7 @@ arc_access(arc_buf_hdr_t *buf, kmutex_t *hash_lock)
 			 * most frequently used state.
 			 */
 			buf->b_arc_access = lbolt;
+			buf->b_flags &= ~ARC_COLD;
 			DTRACE_PROBE1(new_state__mfu, arc_buf_hdr_t *, buf);
 			arc_change_state(arc_mfu, buf, hash_lock);
 		}
@@ -2357,9 +3085,11 @@ arc_access(arc_buf_hdr_t *buf, kmutex_t *hash_lock)
 			new_state = arc_mru;
 			if (refcount_count(&buf->b_refcnt) > 0)
 				buf->b_flags &= ~ARC_PREFETCH;
+			arc_admit(buf, freq);
 			DTRACE_PROBE1(new_state__mru, arc_buf_hdr_t *, buf);
 		} else {
 			new_state = arc_mfu;
+			buf->b_flags &= ~ARC_COLD;
 			DTRACE_PROBE1(new_state__mfu, arc_buf_hdr_t *, buf);
 		}
 
@@ -2398,6 +3128,9 @@ arc_access(arc_buf_hdr_t *buf, kmutex_t *hash_lock)
 			 */
 			ASSERT3U(refcount_count(&buf->b_refcnt), ==, 0);
 			new_state = arc_mru;
+			arc_admit(buf, freq);
+		} else {
+			buf->b_flags &= ~ARC_COLD;
 		}
 
 		buf->b_arc_access = lbolt;
@@ -2411,6 +3144,7 @@ arc_access(arc_buf_hdr_t *buf, kmutex_t *hash_lock)
 		 */
 
 		buf->b_arc_access = lbolt;
+		buf->b_flags &= ~ARC_COLD;
 		DTRACE_PROBE1(new_state__mfu, arc_buf_hdr_t *, buf);
 		arc_change_state(arc_mfu, buf, hash_lock);
 	} else {
@@ -2472,6 +3206,12 @@ arc_read_done(zio_t *zio)
 	if (l2arc_noprefetch && (hdr->b_flags & ARC_PREFETCH))
 		hdr->b_flags &= ~ARC_L2CACHE;
 
+	/* the block was read as stored on disk; expand it for the callers */
+	if (hdr->b_cdata != NULL && zio->io_error == 0 &&
+	    zio_decompress_data(hdr->b_compress, hdr->b_cdata, buf->b_data,
+	    hdr->b_psize, hdr->b_size) != 0)
+		zio->io_error = EIO;
+
 	/* byteswap if necessary */
 	callback_list = hdr->b_acb;
 	ASSERT(callback_list != NULL);
@@ -2489,9 +3229,10 @@ arc_read_done(zio_t *zio)
 		 * Only call arc_access on anonymous buffers.  This is because
 		 * if we've issued an I/O for an evicted buffer, we've already
 		 * called arc_access (to prevent any simultaneous readers from
-		 * getting confused).
+		 * getting confused).  Only demand readers hold references.
 		 */
-		arc_access(hdr, hash_lock);
+		arc_access(hdr, hash_lock,
+		    refcount_count(&hdr->b_refcnt) > 0);
 	}
 
 	/* create copies of the data buffer for the callers */
@@ -2519,6 +3260,8 @@ arc_read_done(zio_t *zio)
 		hdr->b_flags |= ARC_IO_ERROR;
 		if (hdr->b_state != arc_anon)
 			arc_change_state(arc_anon, hdr, hash_lock);
+		if (hdr->b_cdata != NULL)
+			arc_hdr_free_cdata(hdr);
 		if (HDR_IN_HASH_TABLE(hdr))
 			buf_hash_remove(hdr);
 		freeable = refcount_is_zero(&hdr->b_refcnt);
@@ -2616,7 +3359,7 @@ arc_read_nolock(zio_t *pio, spa_t *spa, const blkptr_t *bp,
 top:
 	hdr = buf_hash_find(guid, BP_IDENTITY(bp), BP_PHYSICAL_BIRTH(bp),
 	    &hash_lock);
-	if (hdr && hdr->b_datacnt > 0) {
+	if (hdr && (hdr->b_datacnt > 0 || hdr->b_cdata != NULL)) {
 
 		*arc_flags |= ARC_CACHED;
 
@@ -2661,21 +3404,24 @@ top:
 			 * that arc_release() will always succeed.
 			 */
 			buf = hdr->b_buf;
-			ASSERT(buf);
-			ASSERT(buf->b_data);
-			if (HDR_BUF_AVAILABLE(hdr)) {
+			if (buf == NULL) {
+				buf = arc_buf_decompress(hdr);
+			} else if (HDR_BUF_AVAILABLE(hdr)) {
 				ASSERT(buf->b_efunc == NULL);
 				hdr->b_flags &= ~ARC_BUF_AVAILABLE;
 			} else {
 				buf = arc_buf_clone(buf);
 			}
+			ASSERT(buf->b_data);
 
 		} else if (*arc_flags & ARC_PREFETCH &&
 		    refcount_count(&hdr->b_refcnt) == 0) {
 			hdr->b_flags |= ARC_PREFETCH;
 		}
+		hdr->b_flags &= ~(ARC_LOWPRI | ARC_NOFILTER);
+		hdr->b_flags |= *arc_flags & (ARC_LOWPRI | ARC_NOFILTER);
 		DTRACE_PROBE1(arc__hit, arc_buf_hdr_t *, hdr);
-		arc_access(hdr, hash_lock);
+		arc_access(hdr, hash_lock, !(*arc_flags & ARC_PREFETCH));
 		if (*arc_flags & ARC_L2CACHE)
 			hdr->b_flags |= ARC_L2CACHE;
 		mutex_exit(hash_lock);
@@ -2720,6 +3466,8 @@ top:
 			}
 			if (*arc_flags & ARC_L2CACHE)
 				hdr->b_flags |= ARC_L2CACHE;
+			hdr->b_flags |=
+			    *arc_flags & (ARC_LOWPRI | ARC_NOFILTER);
 			if (BP_GET_LEVEL(bp) > 0)
 				hdr->b_flags |= ARC_INDIRECT;
 		} else {
@@ -2736,6 +3484,9 @@ top:
 				add_reference(hdr, hash_lock, private);
 			if (*arc_flags & ARC_L2CACHE)
 				hdr->b_flags |= ARC_L2CACHE;
+			hdr->b_flags &= ~(ARC_LOWPRI | ARC_NOFILTER);
+			hdr->b_flags |=
+			    *arc_flags & (ARC_LOWPRI | ARC_NOFILTER);
 			buf = kmem_cache_alloc(buf_cache, KM_PUSHPAGE);
 			buf->b_hdr = hdr;
 			buf->b_data = NULL;
@@ -2745,12 +3496,24 @@ top:
 			hdr->b_buf = buf;
 			ASSERT(hdr->b_datacnt == 0);
 			hdr->b_datacnt = 1;
-			arc_access(hdr, hash_lock);
+			arc_access(hdr, hash_lock,
+			    !(*arc_flags & ARC_PREFETCH));
 			arc_get_data_buf(buf);
 		}
 
 		ASSERT(!GHOST_STATE(hdr->b_state));
 
+		/*
+		 * Read a compressed block as it is stored, so that we can
+		 * keep that copy.  Blocks that come from the L2ARC, that
+		 * need byteswapping or that are ganged are read as usual.
+		 */
+		if (zfs_compressed_arc_enabled && hdr->b_l2hdr == NULL &&
+		    BP_GET_COMPRESS(bp) != ZIO_COMPRESS_OFF &&
+		    !BP_IS_GANG(bp) && !BP_SHOULD_BYTESWAP(bp))
+			arc_hdr_alloc_cdata(hdr, BP_GET_PSIZE(bp),
+			    BP_GET_COMPRESS(bp));
+
 		acb = kmem_zalloc(sizeof (arc_callback_t), KM_SLEEP);
 		acb->acb_done = done;
 		acb->acb_private = private;
@@ -2849,8 +3612,14 @@ top:
 			}
 		}
 
-		rzio = zio_read(pio, spa, bp, buf->b_data, size,
-		    arc_read_done, buf, priority, zio_flags, zb);
+		if (hdr->b_cdata != NULL) {
+			rzio = zio_read(pio, spa, bp, hdr->b_cdata,
+			    hdr->b_psize, arc_read_done, buf, priority,
+			    zio_flags | ZIO_FLAG_RAW, zb);
+		} else {
+			rzio = zio_read(pio, spa, bp, buf->b_data, size,
+			    arc_read_done, buf, priority, zio_flags, zb);
+		}
 
 		if (*arc_flags & ARC_WAIT)
 			return (zio_wait(rzio));
@@ -2924,7 +3693,10 @@ arc_buf_evict(arc_buf_t *buf)
 	ASSERT(buf->b_data != NULL);
 	arc_buf_destroy(buf, FALSE, FALSE);
 
-	if (hdr->b_datacnt == 0) {
+	if (hdr->b_datacnt == 0 && hdr->b_cdata != NULL) {
+		/* the compressed copy stays cached */
+		hdr->b_flags &= ~ARC_BUF_AVAILABLE;
+	} else if (hdr->b_datacnt == 0) {
 		arc_state_t *old_state = hdr->b_state;
 		arc_state_t *evicted_state;
 
@@ -3054,6 +3826,8 @@ arc_release(arc_buf_t *buf, void *tag)
 		ASSERT(refcount_count(&hdr->b_refcnt) == 1);
 		ASSERT(!list_link_active(&hdr->b_arc_node));
 		ASSERT(!HDR_IO_IN_PROGRESS(hdr));
+		if (hdr->b_cdata != NULL)
+			arc_hdr_free_cdata(hdr);
 		arc_change_state(arc_anon, hdr, hash_lock);
 		hdr->b_arc_access = 0;
 		mutex_exit(hash_lock);
@@ -3197,7 +3971,7 @@ arc_write_done(zio_t *zio)
 		hdr->b_flags &= ~ARC_IO_IN_PROGRESS;
 		/* if it's not anon, we are doing a scrub */
 		if (!exists && hdr->b_state == arc_anon)
-			arc_access(hdr, hash_lock);
+			arc_access(hdr, hash_lock, B_TRUE);
 		mutex_exit(hash_lock);
 	} else {
 		hdr->b_flags &= ~ARC_IO_IN_PROGRESS;
@@ -3447,6 +4221,21 @@ arc_init(void)
 	if (zfs_arc_min > 64<<20 && zfs_arc_min <= arc_c_max)
 		arc_c_min = zfs_arc_min;
 
+#ifdef _KERNEL
+	arc_pressure_init();
+
+	/*
+	 * Unless told otherwise, don't let the cache take more than half of
+	 * the memory our cgroup may use.
+	 */
+	if (max_arc_size == 0 && zfs_arc_max == 0) {
+		uint64_t limit;
+
+		if (arc_cgroup_limit(&limit) == 0 && limit / 2 < arc_c_max)
+			arc_c_max = MAX(limit / 2, arc_c_min);
+	}
+#endif
+
 	arc_c = arc_c_max;
 	arc_p = (arc_c >> 1);
 
@@ -3557,6 +4346,9 @@ arc_fini(void)
 		arc_ksp = NULL;
 	}
 
+#ifdef _KERNEL
+	arc_pressure_fini();
+#endif
 	mutex_destroy(&arc_eviction_mtx);
 	mutex_destroy(&arc_reclaim_thr_lock);
 	cv_destroy(&arc_reclaim_thr_cv);
@@ -3584,6 +4376,48 @@ arc_fini(void)
 	ASSERT(arc_loaned_bytes == 0);
 }
 
+/*
+ * Change the bounds of the cache target while running.  A zero leaves that
+ * bound as it is.  If the cache is now over its target it is trimmed here.
+ */
+int
+arc_set_limits(uint64_t min, uint64_t max)
+{
+	mutex_enter(&arc_reclaim_thr_lock);
+	if (min == 0)
+		min = arc_c_min;
+	if (max == 0)
+		max = arc_c_max;
+	if (min > max || max < (16 << 20) || max > ptob(physmem)) {
+		mutex_exit(&arc_reclaim_thr_lock);
+		return (EINVAL);
+	}
+
+	arc_c_min = min;
+	arc_c_max = max;
+	if (zfs_arc_meta_limit > 0 && zfs_arc_meta_limit <= max)
+		arc_meta_limit = zfs_arc_meta_limit;
+	else
+		arc_meta_limit = max / 4;
+
+	if (arc_c > max)
+		arc_c = max;
+	if (arc_c < min)
+		arc_c = min;
+	if (arc_p > arc_c)
+		arc_p = (arc_c >> 1);
+
+	/* the hash table may need to grow along */
+	buf_hash_table.ht_grow_wanted = B_TRUE;
+	cv_signal(&arc_reclaim_thr_cv);
+	mutex_exit(&arc_reclaim_thr_lock);
+
+	if (arc_size > arc_c)
+		arc_adjust();
+
+	return (0);
+}
+
 /*
  * Level 2 ARC
  *
@@ -3825,10 +4659,10 @@ l2arc_dev_get_next(void)
 		else if (next == first)
 			break;
 
-	} while (vdev_is_dead(next->l2ad_vdev));
+	} while (vdev_is_dead(next->l2ad_vdev) || next->l2ad_rebuild);
 
 	/* if we were unable to find any usable vdevs, return NULL */
-	if (vdev_is_dead(next->l2ad_vdev))
+	if (vdev_is_dead(next->l2ad_vdev) || next->l2ad_rebuild)
 		next = NULL;
 
 	l2arc_dev_last = next;
@@ -4059,6 +4893,22 @@ l2arc_list_locked(int list_num, kmutex_t **lock)
 	return (list);
 }
 
+/*
+ * Where a pass that may write up to distance bytes will evict to.
+ */
+static uint64_t
+l2arc_evict_target(l2arc_dev_t *dev, uint64_t distance)
+{
+	/*
+	 * When nearing the end of the device, evict to the end
+	 * before the device write hand jumps to the start.
+	 */
+	if (dev->l2ad_hand >= (dev->l2ad_end - (2 * distance)))
+		return (dev->l2ad_end);
+
+	return (dev->l2ad_hand + distance);
+}
+
 /*
  * Evict buffers from the device write hand to the distance specified in
  * bytes.  This distance may span populated buffers, it may span nothing.
@@ -4087,15 +4937,7 @@ l2arc_evict(l2arc_dev_t *dev, uint64_t distance, boolean_t all)
 		return;
 	}
 
-	if (dev->l2ad_hand >= (dev->l2ad_end - (2 * distance))) {
-		/*
-		 * When nearing the end of the device, evict to the end
-		 * before the device write hand jumps to the start.
-		 */
-		taddr = dev->l2ad_end;
-	} else {
-		taddr = dev->l2ad_hand + distance;
-	}
+	taddr = l2arc_evict_target(dev, distance);
 	DTRACE_PROBE4(l2arc__evict, l2arc_dev_t *, dev, list_t *, buflist,
 	    uint64_t, taddr, boolean_t, all);
 
@@ -4190,6 +5032,107 @@ top:
 	dev->l2ad_evict = taddr;
 }
 
+/*
+ * Record a buffer that is being written to the device in the log block
+ * being filled.  The caller holds the buffer's hash lock.
+ */
+static void
+l2arc_log_blk_append(l2arc_dev_t *dev, arc_buf_hdr_t *ab)
+{
+	l2arc_log_blk_phys_t *lb = dev->l2ad_log_blk;
+	l2arc_log_ent_phys_t *le;
+
+	ASSERT3U(lb->lb_nents, <, L2ARC_LOG_BLK_ENTRIES);
+	ASSERT(ab->b_freeze_cksum != NULL);
+
+	le = &lb->lb_entries[lb->lb_nents++];
+	le->le_dva = ab->b_dva;
+	le->le_birth = ab->b_birth;
+	le->le_cksum0 = ab->b_cksum0;
+	le->le_freeze_cksum = *ab->b_freeze_cksum;
+	le->le_daddr = ab->b_l2hdr->b_daddr;
+	le->le_size = (uint32_t)ab->b_size;
+	le->le_type = ab->b_type;
+}
+
+static void
+l2arc_log_blk_write_done(zio_t *zio)
+{
+	zio_buf_free(zio->io_private, zio->io_orig_size);
+}
+
+/*
+ * Write out the log block being filled at the device write hand, and make
+ * it the head of the device's log chain.  Returns the space it took.
+ */
+static uint64_t
+l2arc_log_blk_commit(l2arc_dev_t *dev, zio_t *pio)
+{
+	l2arc_log_blk_phys_t *lb = dev->l2ad_log_blk;
+	l2arc_log_blkptr_t *lbp = &dev->l2ad_log_head;
+	uint64_t size, psize, asize;
+	void *data;
+
+	ASSERT(lb->lb_nents != 0);
+
+	lb->lb_magic = L2ARC_LOG_BLK_MAGIC;
+	lb->lb_prev = *lbp;
+
+	size = offsetof(l2arc_log_blk_phys_t, lb_entries) +
+	    lb->lb_nents * sizeof (l2arc_log_ent_phys_t);
+	psize = P2ROUNDUP(size, SPA_MINBLOCKSIZE);
+	asize = vdev_psize_to_asize(dev->l2ad_vdev, psize);
+	ASSERT3U(psize, <=, L2ARC_LOG_BLK_SIZE);
+
+	data = zio_buf_alloc(psize);
+	bcopy(lb, data, size);
+	bzero((char *)data + size, psize - size);
+
+	lbp->lbp_daddr = dev->l2ad_hand;
+	lbp->lbp_psize = psize;
+	fletcher_4_native(data, psize, &lbp->lbp_cksum);
+
+	(void) zio_nowait(zio_write_phys(pio, dev->l2ad_vdev,
+	    dev->l2ad_hand, psize, data, ZIO_CHECKSUM_OFF,
+	    l2arc_log_blk_write_done, data, ZIO_PRIORITY_ASYNC_WRITE,
+	    ZIO_FLAG_CANFAIL, B_FALSE));
+
+	ARCSTAT_BUMP(arcstat_l2_log_blk_writes);
+	bzero(lb, size);
+	dev->l2ad_hand += asize;
+
+	return (asize);
+}
+
+/*
+ * Point the device header at the newest log block.  This is done once the
+ * writes of a pass have completed, so that the header never refers to a
+ * log block that is not on the device yet.
+ */
+static void
+l2arc_dev_hdr_update(l2arc_dev_t *dev)
+{
+	l2arc_dev_hdr_phys_t *dh;
+
+	dh = zio_buf_alloc(L2ARC_DEV_HDR_SIZE);
+	bzero(dh, L2ARC_DEV_HDR_SIZE);
+	dh->dh_magic = L2ARC_DEV_HDR_MAGIC;
+	dh->dh_spa_guid = spa_guid(dev->l2ad_spa);
+	dh->dh_vdev_guid = dev->l2ad_vdev->vdev_guid;
+	dh->dh_hand = dev->l2ad_hand;
+	dh->dh_evict = l2arc_evict_target(dev,
+	    dev->l2ad_write + dev->l2ad_boost);
+	dh->dh_first = dev->l2ad_first;
+	dh->dh_log = dev->l2ad_log_head;
+	fletcher_4_native(dh, sizeof (*dh), &dh->dh_cksum);
+
+	(void) zio_wait(zio_write_phys(NULL, dev->l2ad_vdev,
+	    VDEV_LABEL_START_SIZE, L2ARC_DEV_HDR_SIZE, dh, ZIO_CHECKSUM_OFF,
+	    NULL, NULL, ZIO_PRIORITY_ASYNC_WRITE, ZIO_FLAG_CANFAIL, B_FALSE));
+
+	zio_buf_free(dh, L2ARC_DEV_HDR_SIZE);
+}
+
 /*
  * Find and write ARC buffers to the L2ARC device.
  *
@@ -4202,7 +5145,7 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 	arc_buf_hdr_t *ab, *ab_prev, *head;
 	l2arc_buf_hdr_t *hdrl2;
 	list_t *list;
-	uint64_t passed_sz, write_sz, buf_sz, headroom;
+	uint64_t passed_sz, write_sz, log_sz, buf_sz, headroom;
 	void *buf_data;
 	kmutex_t *hash_lock, *list_lock;
 	boolean_t have_lock, full;
@@ -4213,7 +5156,7 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 	ASSERT(dev->l2ad_vdev != NULL);
 
 	pio = NULL;
-	write_sz = 0;
+	write_sz = log_sz = 0;
 	full = B_FALSE;
 	head = kmem_cache_alloc(hdr_cache, KM_PUSHPAGE);
 	head->b_flags |= ARC_L2_WRITE_HEAD;
@@ -4267,7 +5210,21 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 				continue;
 			}
 
-			if ((write_sz + ab->b_size) > target_sz) {
+			/*
+			 * Nothing to write while only the compressed
+			 * copy is cached.
+			 */
+			if (ab->b_buf == NULL) {
+				mutex_exit(hash_lock);
+				continue;
+			}
+
+			/*
+			 * Leave room for the log block that will
+			 * describe this buffer.
+			 */
+			if ((write_sz + ab->b_size + dev->l2ad_log_asize) >
+			    target_sz) {
 				full = B_TRUE;
 				mutex_exit(hash_lock);
 				break;
@@ -4308,6 +5265,7 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 			 */
 			arc_cksum_verify(ab->b_buf);
 			arc_cksum_compute(ab->b_buf, B_TRUE);
+			l2arc_log_blk_append(dev, ab);
 
 			mutex_exit(hash_lock);
 
@@ -4327,6 +5285,13 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 
 			write_sz += buf_sz;
 			dev->l2ad_hand += buf_sz;
+
+			if (dev->l2ad_log_blk->lb_nents ==
+			    L2ARC_LOG_BLK_ENTRIES) {
+				buf_sz = l2arc_log_blk_commit(dev, pio);
+				write_sz += buf_sz;
+				log_sz += buf_sz;
+			}
 		}
 
 		mutex_exit(list_lock);
@@ -4342,10 +5307,16 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 		return (0);
 	}
 
+	if (dev->l2ad_log_blk->lb_nents != 0) {
+		buf_sz = l2arc_log_blk_commit(dev, pio);
+		write_sz += buf_sz;
+		log_sz += buf_sz;
+	}
+
 	ASSERT3U(write_sz, <=, target_sz);
 	ARCSTAT_BUMP(arcstat_l2_writes_sent);
 	ARCSTAT_INCR(arcstat_l2_write_bytes, write_sz);
-	ARCSTAT_INCR(arcstat_l2_size, write_sz);
+	ARCSTAT_INCR(arcstat_l2_size, write_sz - log_sz);
 	vdev_space_update(dev->l2ad_vdev, write_sz, 0, 0);
 
 	/*
@@ -4361,7 +5332,8 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 	}
 
 	dev->l2ad_writing = B_TRUE;
-	(void) zio_wait(pio);
+	if (zio_wait(pio) == 0)
+		l2arc_dev_hdr_update(dev);
 	dev->l2ad_writing = B_FALSE;
 
 	return (write_sz);
@@ -4454,6 +5426,214 @@ l2arc_feed_thread(void)
 	thread_exit();
 }
 
+/*
+ * Read len bytes at offset from a cache device that is being rebuilt.
+ * Returns ECANCELED if the device is being removed.
+ */
+static int
+l2arc_rebuild_read(l2arc_dev_t *dev, uint64_t offset, uint64_t len,
+    void *data)
+{
+	spa_t *spa = dev->l2ad_spa;
+	vdev_t *vd = dev->l2ad_vdev;
+	int err;
+
+	/*
+	 * The removal of the device waits for us with the config lock
+	 * held as writer, so don't block on it.
+	 */
+	while (!spa_config_tryenter(spa, SCL_L2ARC, vd, RW_READER)) {
+		if (dev->l2ad_rebuild_cancel)
+			return (ECANCELED);
+		delay(1);
+	}
+	if (dev->l2ad_rebuild_cancel) {
+		spa_config_exit(spa, SCL_L2ARC, vd);
+		return (ECANCELED);
+	}
+
+	err = zio_wait(zio_read_phys(NULL, vd, offset, len, data,
+	    ZIO_CHECKSUM_OFF, NULL, NULL, ZIO_PRIORITY_ASYNC_READ,
+	    ZIO_FLAG_DONT_CACHE | ZIO_FLAG_CANFAIL |
+	    ZIO_FLAG_DONT_PROPAGATE | ZIO_FLAG_DONT_RETRY, B_FALSE));
+
+	spa_config_exit(spa, SCL_L2ARC, vd);
+
+	return (err);
+}
+
+/*
+ * Recreate the l2c_only header for a log entry, unless the block is
+ * already known to the ARC.
+ */
+static void
+l2arc_rebuild_buf(l2arc_dev_t *dev, const l2arc_log_ent_phys_t *le)
+{
+	arc_buf_hdr_t *hdr, *exists;
+	l2arc_buf_hdr_t *l2hdr;
+	kmutex_t *hash_lock;
+
+	hdr = kmem_cache_alloc(hdr_cache, KM_PUSHPAGE);
+	ASSERT(BUF_EMPTY(hdr));
+	hdr->b_dva = le->le_dva;
+	hdr->b_birth = le->le_birth;
+	hdr->b_cksum0 = le->le_cksum0;
+	hdr->b_size = le->le_size;
+	hdr->b_type = le->le_type;
+	hdr->b_spa = spa_guid(dev->l2ad_spa);
+	hdr->b_state = arc_anon;
+	hdr->b_arc_access = 0;
+	hdr->b_flags = ARC_L2CACHE;
+	hdr->b_freeze_cksum = kmem_alloc(sizeof (zio_cksum_t), KM_SLEEP);
+	*hdr->b_freeze_cksum = le->le_freeze_cksum;
+
+	exists = buf_hash_insert(hdr, &hash_lock);
+	if (exists) {
+		mutex_exit(hash_lock);
+		bzero(&hdr->b_dva, sizeof (dva_t));
+		hdr->b_birth = 0;
+		hdr->b_cksum0 = 0;
+		arc_hdr_destroy(hdr);
+		return;
+	}
+
+	l2hdr = kmem_zalloc(sizeof (l2arc_buf_hdr_t), KM_SLEEP);
+	l2hdr->b_dev = dev;
+	l2hdr->b_daddr = le->le_daddr;
+	hdr->b_l2hdr = l2hdr;
+	arc_change_state(arc_l2c_only, hdr, hash_lock);
+
+	/*
+	 * The log is walked from newest to oldest, so this keeps the
+	 * buflist ordered as l2arc_evict() expects.
+	 */
+	mutex_enter(&l2arc_buflist_mtx);
+	list_insert_tail(dev->l2ad_buflist, hdr);
+	mutex_exit(&l2arc_buflist_mtx);
+	mutex_exit(hash_lock);
+
+	ARCSTAT_INCR(arcstat_l2_size, hdr->b_size);
+	ARCSTAT_BUMP(arcstat_l2_rebuild_bufs);
+}
+
+/*
+ * Read the device header and walk the log chain it points to, restoring
+ * the write hand and the headers of the buffers that are still intact.
+ *
+ * Everything below the saved hand was written on the current sweep of the
+ * device.  When the device has wrapped, what lies between the eviction
+ * target of the next pass and the end of the device is left from the
+ * previous sweep.  The chain goes down through the first region and then
+ * down through the second; anything else has been or may have been
+ * overwritten.
+ */
+static void
+l2arc_rebuild(l2arc_dev_t *dev)
+{
+	vdev_t *vd = dev->l2ad_vdev;
+	l2arc_dev_hdr_phys_t *dh;
+	l2arc_log_blk_phys_t *lb;
+	l2arc_log_blkptr_t lbp;
+	zio_cksum_t cksum;
+	uint64_t hand, evict, addr, asize, last;
+	boolean_t first, prev_lap = B_FALSE;
+
+	dh = zio_buf_alloc(L2ARC_DEV_HDR_SIZE);
+	if (l2arc_rebuild_read(dev, VDEV_LABEL_START_SIZE,
+	    L2ARC_DEV_HDR_SIZE, dh) != 0) {
+		zio_buf_free(dh, L2ARC_DEV_HDR_SIZE);
+		return;
+	}
+	cksum = dh->dh_cksum;
+	bzero(&dh->dh_cksum, sizeof (zio_cksum_t));
+	fletcher_4_native(dh, sizeof (*dh), &dh->dh_cksum);
+	if (dh->dh_magic != L2ARC_DEV_HDR_MAGIC ||
+	    !ZIO_CHECKSUM_EQUAL(dh->dh_cksum, cksum) ||
+	    dh->dh_spa_guid != spa_guid(dev->l2ad_spa) ||
+	    dh->dh_vdev_guid != vd->vdev_guid ||
+	    dh->dh_hand < dev->l2ad_start || dh->dh_hand > dev->l2ad_end ||
+	    dh->dh_evict < dh->dh_hand || dh->dh_evict > dev->l2ad_end) {
+		zio_buf_free(dh, L2ARC_DEV_HDR_SIZE);
+		return;
+	}
+	hand = dh->dh_hand;
+	evict = dh->dh_evict;
+	first = (dh->dh_first != 0);
+	lbp = dh->dh_log;
+	zio_buf_free(dh, L2ARC_DEV_HDR_SIZE);
+
+	/*
+	 * Carry on from where the device was left.
+	 */
+	dev->l2ad_hand = hand;
+	dev->l2ad_evict = hand;
+	dev->l2ad_first = first;
+	dev->l2ad_log_head = lbp;
+	vdev_space_update(vd, (first ? hand : dev->l2ad_end) -
+	    dev->l2ad_start, 0, 0);
+
+	lb = zio_buf_alloc(L2ARC_LOG_BLK_SIZE);
+	last = hand;
+	while (lbp.lbp_psize != 0 && lbp.lbp_psize <= L2ARC_LOG_BLK_SIZE &&
+	    !dev->l2ad_rebuild_cancel && !arc_reclaim_needed()) {
+		addr = lbp.lbp_daddr;
+		asize = vdev_psize_to_asize(vd, lbp.lbp_psize);
+
+		if (addr >= dev->l2ad_start && addr + asize <= hand &&
+		    !prev_lap) {
+			if (addr + asize > last)
+				break;
+		} else if (!first && addr >= evict &&
+		    addr + asize <= dev->l2ad_end) {
+			if (prev_lap && addr + asize > last)
+				break;
+			prev_lap = B_TRUE;
+		} else {
+			break;
+		}
+
+		if (l2arc_rebuild_read(dev, addr, lbp.lbp_psize, lb) != 0)
+			break;
+		fletcher_4_native(lb, lbp.lbp_psize, &cksum);
+		if (!ZIO_CHECKSUM_EQUAL(cksum, lbp.lbp_cksum) ||
+		    lb->lb_magic != L2ARC_LOG_BLK_MAGIC ||
+		    lb->lb_nents > L2ARC_LOG_BLK_ENTRIES)
+			break;
+		ARCSTAT_BUMP(arcstat_l2_rebuild_log_blks);
+
+		for (int i = lb->lb_nents - 1; i >= 0; i--) {
+			l2arc_log_ent_phys_t *le = &lb->lb_entries[i];
+			uint64_t lo = prev_lap ? evict : dev->l2ad_start;
+			uint64_t hi = prev_lap ? dev->l2ad_end : hand;
+
+			if (le->le_size == 0 ||
+			    le->le_size > SPA_MAXBLOCKSIZE ||
+			    le->le_type >= ARC_BUFC_NUMTYPES ||
+			    le->le_daddr < lo || le->le_daddr +
+			    vdev_psize_to_asize(vd, le->le_size) > hi)
+				continue;
+			l2arc_rebuild_buf(dev, le);
+		}
+
+		last = addr;
+		lbp = lb->lb_prev;
+	}
+	zio_buf_free(lb, L2ARC_LOG_BLK_SIZE);
+}
+
+static void
+l2arc_rebuild_thread(l2arc_dev_t *dev)
+{
+	l2arc_rebuild(dev);
+
+	mutex_enter(&l2arc_dev_mtx);
+	dev->l2ad_rebuild = B_FALSE;
+	cv_broadcast(&l2arc_rebuild_cv);
+	mutex_exit(&l2arc_dev_mtx);
+
+	thread_exit();
+}
+
 boolean_t
 l2arc_vdev_present(vdev_t *vd)
 {
@@ -4489,12 +5669,17 @@ l2arc_add_vdev(spa_t *spa, vdev_t *vd)
 	adddev->l2ad_vdev = vd;
 	adddev->l2ad_write = l2arc_write_max;
 	adddev->l2ad_boost = l2arc_write_boost;
-	adddev->l2ad_start = VDEV_LABEL_START_SIZE;
+	adddev->l2ad_hdr_asize = vdev_psize_to_asize(vd, L2ARC_DEV_HDR_SIZE);
+	adddev->l2ad_log_asize = vdev_psize_to_asize(vd, L2ARC_LOG_BLK_SIZE);
+	adddev->l2ad_start = VDEV_LABEL_START_SIZE + adddev->l2ad_hdr_asize;
 	adddev->l2ad_end = VDEV_LABEL_START_SIZE + vdev_get_min_asize(vd);
 	adddev->l2ad_hand = adddev->l2ad_start;
 	adddev->l2ad_evict = adddev->l2ad_start;
 	adddev->l2ad_first = B_TRUE;
 	adddev->l2ad_writing = B_FALSE;
+	adddev->l2ad_log_blk = kmem_zalloc(sizeof (l2arc_log_blk_phys_t),
+	    KM_SLEEP);
+	adddev->l2ad_rebuild = l2arc_rebuild_enabled;
 	ASSERT3U(adddev->l2ad_write, >, 0);
 
 	/*
@@ -4514,6 +5699,14 @@ l2arc_add_vdev(spa_t *spa, vdev_t *vd)
 	list_insert_head(l2arc_dev_list, adddev);
 	atomic_inc_64(&l2arc_ndev);
 	mutex_exit(&l2arc_dev_mtx);
+
+	/*
+	 * Reload what the device held when it was last used.  It won't
+	 * be fed until this is done.
+	 */
+	if (adddev->l2ad_rebuild)
+		(void) thread_create(NULL, 0, l2arc_rebuild_thread, adddev,
+		    0, &p0, TS_RUN, minclsyspri);
 }
 
 /*
@@ -4543,6 +5736,13 @@ l2arc_remove_vdev(vdev_t *vd)
 	list_remove(l2arc_dev_list, remdev);
 	l2arc_dev_last = NULL;		/* may have been invalidated */
 	atomic_dec_64(&l2arc_ndev);
+
+	/*
+	 * Stop a rebuild that is still going on.
+	 */
+	remdev->l2ad_rebuild_cancel = B_TRUE;
+	while (remdev->l2ad_rebuild)
+		cv_wait(&l2arc_rebuild_cv, &l2arc_dev_mtx);
 	mutex_exit(&l2arc_dev_mtx);
 
 	/*
@@ -4551,6 +5751,7 @@ l2arc_remove_vdev(vdev_t *vd)
 	l2arc_evict(remdev, 0, B_TRUE);
 	list_destroy(remdev->l2ad_buflist);
 	kmem_free(remdev->l2ad_buflist, sizeof (list_t));
+	kmem_free(remdev->l2ad_log_blk, sizeof (l2arc_log_blk_phys_t));
 	kmem_free(remdev, sizeof (l2arc_dev_t));
 }
 
@@ -4567,6 +5768,7 @@ l2arc_init(void)
 	mutex_init(&l2arc_dev_mtx, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&l2arc_buflist_mtx, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&l2arc_free_on_write_mtx, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&l2arc_rebuild_cv, NULL, CV_DEFAULT, NULL);
 
 	l2arc_dev_list = &L2ARC_dev_list;
 	l2arc_free_on_write = &L2ARC_free_on_write;
@@ -4592,6 +5794,7 @@ l2arc_fini(void)
 	mutex_destroy(&l2arc_dev_mtx);
 	mutex_destroy(&l2arc_buflist_mtx);
 	mutex_destroy(&l2arc_free_on_write_mtx);
+	cv_destroy(&l2arc_rebuild_cv);
 
 	list_destroy(l2arc_dev_list);
 	list_destroy(l2arc_free_on_write);
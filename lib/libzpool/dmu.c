@@ -277,7 +277,7 @@ dmu_buf_hold_array_by_dnode(dnode_t *dn, uint64_t offset, uint64_t length,
 	return (0);
 }
 
-static int
+int
 dmu_buf_hold_array(objset_t *os, uint64_t object, uint64_t offset,
     uint64_t length, int read, void *tag, int *numbufsp, dmu_buf_t ***dbpp)
 {
@@ -1093,6 +1093,127 @@ dmu_sync(zio_t *pio, uint64_t txg, dmu_sync_cb_t *done, zgd_t *zgd)
 	return (0);
 }
 
+typedef struct {
+	dbuf_dirty_record_t	*dwc_dr;
+	blkptr_t		dwc_bp;
+	void			*dwc_data;
+	uint64_t		dwc_psize;
+} dmu_write_compressed_arg_t;
+
+static void
+dmu_write_compressed_ready(zio_t *zio)
+{
+	if (zio->io_error == 0) {
+		ASSERT(!BP_IS_HOLE(zio->io_bp));
+		ASSERT(BP_GET_LEVEL(zio->io_bp) == 0);
+		zio->io_bp->blk_fill = 1;
+	}
+}
+
+static void
+dmu_write_compressed_done(zio_t *zio)
+{
+	dmu_write_compressed_arg_t *dwc = zio->io_private;
+	dbuf_dirty_record_t *dr = dwc->dwc_dr;
+	dmu_buf_impl_t *db = dr->dr_dbuf;
+
+	mutex_enter(&db->db_mtx);
+	ASSERT(dr->dt.dl.dr_override_state == DR_IN_DMU_SYNC);
+	if (zio->io_error == 0) {
+		dr->dt.dl.dr_overridden_by = dwc->dwc_bp;
+		dr->dt.dl.dr_override_state = DR_OVERRIDDEN;
+		dr->dt.dl.dr_copies = zio->io_prop.zp_copies;
+	} else {
+		/* the block will be compressed and written by spa_sync() */
+		dr->dt.dl.dr_override_state = DR_NOT_OVERRIDDEN;
+	}
+	cv_broadcast(&db->db_changed);
+	mutex_exit(&db->db_mtx);
+
+	dbuf_rele(db, dwc);
+	zio_data_buf_free(dwc->dwc_data, dwc->dwc_psize);
+	kmem_free(dwc, sizeof (dmu_write_compressed_arg_t));
+}
+
+/*
+ * Write a whole block given both as data and as cdata, the same data
+ * compressed to psize bytes with compress (as received in a compressed
+ * send stream).  data goes into the dbuf so that readers see it, while
+ * cdata is written out right away as a child of pio and replaces the
+ * block spa_sync() would write, as in dmu_sync(), so that it is never
+ * compressed again.  The caller must wait for pio before freeing or
+ * otherwise rewriting the block in the same txg.  Ranges that are not
+ * exactly one block are written with dmu_write().
+ */
+void
+dmu_write_compressed(zio_t *pio, objset_t *os, uint64_t object,
+    uint64_t offset, uint64_t lsize, const void *data, const void *cdata,
+    uint64_t psize, uint8_t compress, dmu_tx_t *tx)
+{
+	uint64_t txg = dmu_tx_get_txg(tx);
+	dmu_buf_t *db_fake;
+	dmu_buf_impl_t *db;
+	dbuf_dirty_record_t *dr;
+	dmu_write_compressed_arg_t *dwc;
+	zbookmark_t zb;
+	zio_prop_t zp;
+
+	if (dmu_buf_hold(os, object, offset, FTAG, &db_fake) != 0) {
+		dmu_write(os, object, offset, lsize, data, tx);
+		return;
+	}
+	db = (dmu_buf_impl_t *)db_fake;
+
+	if (db_fake->db_offset != offset || db_fake->db_size != lsize ||
+	    psize >= lsize) {
+		dbuf_rele(db, FTAG);
+		dmu_write(os, object, offset, lsize, data, tx);
+		return;
+	}
+
+	/* a previous compressed write of this block must finish first */
+	mutex_enter(&db->db_mtx);
+	while ((dr = db->db_last_dirty) != NULL && dr->dr_txg == txg &&
+	    dr->dt.dl.dr_override_state == DR_IN_DMU_SYNC)
+		cv_wait(&db->db_changed, &db->db_mtx);
+	mutex_exit(&db->db_mtx);
+
+	dmu_buf_will_fill(db_fake, tx);
+	bcopy(data, db_fake->db_data, lsize);
+	dmu_buf_fill_done(db_fake, tx);
+
+	mutex_enter(&db->db_mtx);
+	dr = db->db_last_dirty;
+	ASSERT(dr != NULL && dr->dr_txg == txg);
+	if (dr->dt.dl.dr_override_state != DR_NOT_OVERRIDDEN) {
+		mutex_exit(&db->db_mtx);
+		dbuf_rele(db, FTAG);
+		return;
+	}
+	dr->dt.dl.dr_override_state = DR_IN_DMU_SYNC;
+	mutex_exit(&db->db_mtx);
+
+	dmu_write_policy(os, db->db_dnode, 0, WP_DMU_SYNC, &zp);
+	zp.zp_compress = compress;
+
+	dwc = kmem_zalloc(sizeof (dmu_write_compressed_arg_t), KM_SLEEP);
+	dwc->dwc_dr = dr;
+	dwc->dwc_psize = psize;
+	dwc->dwc_data = zio_data_buf_alloc(psize);
+	bcopy(cdata, dwc->dwc_data, psize);
+	dbuf_add_ref(db, dwc);
+	dbuf_rele(db, FTAG);
+
+	SET_BOOKMARK(&zb, os->os_dsl_dataset ?
+	    os->os_dsl_dataset->ds_object : DMU_META_OBJSET,
+	    object, 0, db->db_blkid);
+
+	zio_nowait(zio_write_compressed(pio, os->os_spa, txg, &dwc->dwc_bp,
+	    dwc->dwc_data, psize, lsize, &zp,
+	    dmu_write_compressed_ready, dmu_write_compressed_done, dwc,
+	    ZIO_PRIORITY_ASYNC_WRITE, ZIO_FLAG_CANFAIL, &zb));
+}
+
 int
 dmu_object_set_blocksize(objset_t *os, uint64_t object, uint64_t size, int ibs,
 	dmu_tx_t *tx)
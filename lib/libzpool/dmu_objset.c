@@ -183,6 +183,19 @@ secondary_cache_changed_cb(void *arg, uint64_t newval)
 	os->os_secondary_cache = newval;
 }
 
+static void
+cache_filter_changed_cb(void *arg, uint64_t newval)
+{
+	objset_t *os = arg;
+
+	/*
+	 * Inheritance and range checking should have been done by now.
+	 */
+	ASSERT(newval == 0 || newval == 1);
+
+	os->os_cache_filter = newval;
+}
+
 static void
 logbias_changed_cb(void *arg, uint64_t newval)
 {
@@ -287,6 +300,9 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 		if (err == 0)
 			err = dsl_prop_register(ds, "secondarycache",
 			    secondary_cache_changed_cb, os);
+		if (err == 0)
+			err = dsl_prop_register(ds, "cachefilter",
+			    cache_filter_changed_cb, os);
 		if (!dsl_dataset_is_snapshot(ds)) {
 			if (err == 0)
 				err = dsl_prop_register(ds, "checksum",
@@ -320,6 +336,7 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 		os->os_logbias = 0;
 		os->os_primary_cache = ZFS_CACHE_ALL;
 		os->os_secondary_cache = ZFS_CACHE_ALL;
+		os->os_cache_filter = 1;
 	}
 
 	os->os_zil_header = os->os_phys->os_zil_header;
@@ -498,6 +515,8 @@ dmu_objset_evict(objset_t *os)
 		    primary_cache_changed_cb, os));
 		VERIFY(0 == dsl_prop_unregister(ds, "secondarycache",
 		    secondary_cache_changed_cb, os));
+		VERIFY(0 == dsl_prop_unregister(ds, "cachefilter",
+		    cache_filter_changed_cb, os));
 	}
 
 	/*
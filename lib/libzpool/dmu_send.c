@@ -39,11 +39,385 @@
 #include <sys/zfs_ioctl.h>
 #include <sys/zap.h>
 #include <sys/zio_checksum.h>
+#include <sys/zio_compress.h>
 #include <sys/avl.h>
 #include <sys/ddt.h>
 
 static char *dmu_recv_tag = "dmu_recv_tag";
 
+/*
+ * Send and receive streams pass through a ring buffer between the thread
+ * walking or applying the dataset and a thread doing the stream I/O, so
+ * that reading blocks from disk and writing them to the stream (or
+ * reading the stream and writing the blocks) overlap.  These are the
+ * sizes of the rings.
+ */
+int zfs_send_queue_length = 16 * 1024 * 1024;
+int zfs_recv_queue_length = 16 * 1024 * 1024;
+
+/*
+ * Number of raw reads of compressed blocks a compressed send keeps in
+ * flight ahead of the stream.
+ */
+int zfs_send_raw_window = 16;
+
+/*
+ * A resumable receive records how far it got every this many bytes of
+ * stream.
+ */
+uint64_t zfs_recv_checkpoint_interval = 64 * 1024 * 1024;
+
+typedef struct dmu_stream {
+	kmutex_t st_lock;
+	kcondvar_t st_cv;
+	char *st_buf;
+	uint64_t st_size;
+	uint64_t st_head;	/* bytes put in the ring */
+	uint64_t st_tail;	/* bytes taken from the ring */
+	uint64_t st_off;	/* bytes transferred by the I/O thread */
+	int st_err;
+	boolean_t st_done;	/* no more data will be put or taken */
+	boolean_t st_byteswap;
+	uint64_t st_prefix;	/* bytes ahead of the first record */
+	dmu_stream_func_t *st_func;
+	void *st_arg;
+	taskq_t *st_tq;
+} dmu_stream_t;
+
+static void
+dmu_stream_start(dmu_stream_t *st, const char *name, uint64_t size,
+    task_func_t *task, dmu_stream_func_t *func, void *arg)
+{
+	mutex_init(&st->st_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&st->st_cv, NULL, CV_DEFAULT, NULL);
+	st->st_size = size;
+	st->st_buf = kmem_alloc(size, KM_SLEEP);
+	st->st_func = func;
+	st->st_arg = arg;
+	st->st_tq = taskq_create(name, 1, minclsyspri, 1, 1, 0);
+	VERIFY(taskq_dispatch(st->st_tq, task, st, TQ_SLEEP) != 0);
+}
+
+/*
+ * Stop the stream, passing err to the I/O thread, and wait for the I/O
+ * thread to finish.  Returns the first error either side hit.
+ */
+static int
+dmu_stream_stop(dmu_stream_t *st, int err)
+{
+	mutex_enter(&st->st_lock);
+	if (st->st_err == 0)
+		st->st_err = err;
+	st->st_done = B_TRUE;
+	cv_broadcast(&st->st_cv);
+	mutex_exit(&st->st_lock);
+
+	taskq_wait(st->st_tq);
+	taskq_destroy(st->st_tq);
+
+	err = st->st_err;
+	kmem_free(st->st_buf, st->st_size);
+	mutex_destroy(&st->st_lock);
+	cv_destroy(&st->st_cv);
+	return (err);
+}
+
+/*
+ * Copy len bytes into the ring, waiting for the other side to make room.
+ */
+static int
+dmu_stream_put(dmu_stream_t *st, const void *buf, uint64_t len)
+{
+	const char *cp = buf;
+
+	while (len != 0) {
+		uint64_t off, n;
+
+		mutex_enter(&st->st_lock);
+		while (st->st_head - st->st_tail == st->st_size &&
+		    st->st_err == 0 && !st->st_done)
+			cv_wait(&st->st_cv, &st->st_lock);
+		if (st->st_err != 0 || st->st_done) {
+			mutex_exit(&st->st_lock);
+			return (st->st_err != 0 ? st->st_err : EINTR);
+		}
+		off = st->st_head % st->st_size;
+		n = MIN(len, st->st_size - (st->st_head - st->st_tail));
+		n = MIN(n, st->st_size - off);
+		mutex_exit(&st->st_lock);
+
+		bcopy(cp, st->st_buf + off, n);
+
+		mutex_enter(&st->st_lock);
+		st->st_head += n;
+		cv_broadcast(&st->st_cv);
+		mutex_exit(&st->st_lock);
+		cp += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/*
+ * Copy len bytes out of the ring, waiting for the other side to fill it.
+ * Returns EINVAL if the stream ends first.
+ */
+static int
+dmu_stream_get(dmu_stream_t *st, void *buf, uint64_t len)
+{
+	char *cp = buf;
+
+	while (len != 0) {
+		uint64_t off, n;
+
+		mutex_enter(&st->st_lock);
+		while (st->st_head == st->st_tail &&
+		    st->st_err == 0 && !st->st_done)
+			cv_wait(&st->st_cv, &st->st_lock);
+		if (st->st_head == st->st_tail) {
+			mutex_exit(&st->st_lock);
+			return (st->st_err != 0 ? st->st_err : EINVAL);
+		}
+		off = st->st_tail % st->st_size;
+		n = MIN(len, st->st_head - st->st_tail);
+		n = MIN(n, st->st_size - off);
+		mutex_exit(&st->st_lock);
+
+		bcopy(st->st_buf + off, cp, n);
+
+		mutex_enter(&st->st_lock);
+		st->st_tail += n;
+		cv_broadcast(&st->st_cv);
+		mutex_exit(&st->st_lock);
+		cp += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/*
+ * Read exactly len bytes from the stream source.  The source ending
+ * early is EPIPE, which unlike a corrupt stream leaves a resumable
+ * receive something to resume.
+ */
+static int
+dmu_stream_read(dmu_stream_t *st, void *buf, uint64_t len)
+{
+	char *cp = buf;
+	size_t done;
+	int err;
+
+	while (len != 0) {
+		err = st->st_func(st->st_arg, cp, len, &done);
+		if (err == 0 && done == 0)
+			err = EPIPE;
+		if (err)
+			return (err);
+		st->st_off += done;
+		cp += done;
+		len -= done;
+	}
+	return (0);
+}
+
+/*
+ * The send stream writer: drains the ring into the stream sink.
+ */
+static void
+dmu_stream_writer(void *arg)
+{
+	dmu_stream_t *st = arg;
+	int err = 0;
+
+	for (;;) {
+		uint64_t off, n;
+		size_t done;
+
+		mutex_enter(&st->st_lock);
+		while (st->st_head == st->st_tail &&
+		    st->st_err == 0 && !st->st_done)
+			cv_wait(&st->st_cv, &st->st_lock);
+		if (st->st_err != 0 || st->st_head == st->st_tail) {
+			mutex_exit(&st->st_lock);
+			return;
+		}
+		off = st->st_tail % st->st_size;
+		n = MIN(st->st_head - st->st_tail, st->st_size - off);
+		mutex_exit(&st->st_lock);
+
+		err = st->st_func(st->st_arg, st->st_buf + off, n, &done);
+		if (err == 0 && done == 0)
+			err = EIO;
+
+		mutex_enter(&st->st_lock);
+		if (err != 0) {
+			if (st->st_err == 0)
+				st->st_err = err;
+		} else {
+			st->st_tail += done;
+			st->st_off += done;
+		}
+		cv_broadcast(&st->st_cv);
+		mutex_exit(&st->st_lock);
+		if (err != 0)
+			return;
+	}
+}
+
+/*
+ * Returns the length of the payload following a replay record, or -1 if
+ * the record is invalid or the last of the stream.  The lengths must
+ * match what dmu_recv_stream() reads for each record.
+ */
+static int64_t
+dmu_stream_payload(const dmu_replay_record_t *drr, boolean_t byteswap)
+{
+	uint32_t type = drr->drr_type;
+	uint64_t len;
+
+	if (byteswap)
+		type = BSWAP_32(type);
+
+	switch (type) {
+	case DRR_OBJECT:
+		len = drr->drr_u.drr_object.drr_bonuslen;
+		if (byteswap)
+			len = BSWAP_32(len);
+		if (len > DN_MAX_BONUSLEN)
+			return (-1);
+		return (P2ROUNDUP(len, 8));
+	case DRR_WRITE:
+		len = drr->drr_u.drr_write.drr_length;
+		if (byteswap)
+			len = BSWAP_64(len);
+		if (len > SPA_MAXBLOCKSIZE)
+			return (-1);
+		return (len);
+	case DRR_WRITE_COMPRESSED:
+	{
+		ddt_key_t ddk = drr->drr_u.drr_write.drr_key;
+
+		if (byteswap)
+			ddk.ddk_prop = BSWAP_64(ddk.ddk_prop);
+		len = DDK_GET_PSIZE(&ddk);
+		if (len > SPA_MAXBLOCKSIZE)
+			return (-1);
+		return (len);
+	}
+	case DRR_FREEOBJECTS:
+	case DRR_WRITE_BYREF:
+	case DRR_FREE:
+		return (0);
+	default:
+		return (-1);
+	}
+}
+
+/*
+ * The receive stream reader: fills the ring from the stream source, a
+ * record at a time so that it stops exactly at the end of the stream.
+ */
+static void
+dmu_stream_reader(void *arg)
+{
+	dmu_stream_t *st = arg;
+	dmu_replay_record_t *drr;
+	int64_t len;
+	int err;
+
+	drr = kmem_alloc(sizeof (dmu_replay_record_t), KM_SLEEP);
+
+	/* the payload of the BEGIN record, which the caller already read */
+	ASSERT3U(st->st_prefix, <=, sizeof (dmu_replay_record_t));
+	err = dmu_stream_read(st, drr, st->st_prefix);
+	if (err == 0)
+		err = dmu_stream_put(st, drr, st->st_prefix);
+
+	while (err == 0) {
+		err = dmu_stream_read(st, drr, sizeof (dmu_replay_record_t));
+		if (err == 0)
+			err = dmu_stream_put(st, drr,
+			    sizeof (dmu_replay_record_t));
+		if (err)
+			break;
+
+		len = dmu_stream_payload(drr, st->st_byteswap);
+		if (len < 0)
+			break;
+
+		while (len != 0) {
+			uint64_t off, n;
+
+			mutex_enter(&st->st_lock);
+			while (st->st_head - st->st_tail == st->st_size &&
+			    st->st_err == 0 && !st->st_done)
+				cv_wait(&st->st_cv, &st->st_lock);
+			if (st->st_err != 0 || st->st_done) {
+				mutex_exit(&st->st_lock);
+				err = EINTR;
+				break;
+			}
+			off = st->st_head % st->st_size;
+			n = MIN(len, st->st_size - (st->st_head - st->st_tail));
+			n = MIN(n, st->st_size - off);
+			mutex_exit(&st->st_lock);
+
+			err = dmu_stream_read(st, st->st_buf + off, n);
+			if (err)
+				break;
+
+			mutex_enter(&st->st_lock);
+			st->st_head += n;
+			cv_broadcast(&st->st_cv);
+			mutex_exit(&st->st_lock);
+			len -= n;
+		}
+		if (err)
+			break;
+	}
+	kmem_free(drr, sizeof (dmu_replay_record_t));
+
+	mutex_enter(&st->st_lock);
+	if (err != 0 && err != EINTR && st->st_err == 0)
+		st->st_err = err;
+	st->st_done = B_TRUE;
+	cv_broadcast(&st->st_cv);
+	mutex_exit(&st->st_lock);
+}
+
+struct vnstream {
+	vnode_t *vs_vp;
+	offset_t vs_off;
+};
+
+static int
+vnstream_write(void *arg, void *buf, size_t len, size_t *done)
+{
+	struct vnstream *vs = arg;
+	ssize_t resid; /* have to get resid to get detailed errno */
+	int err;
+
+	err = vn_rdwr(UIO_WRITE, vs->vs_vp, (caddr_t)buf, len,
+	    0, UIO_SYSSPACE, FAPPEND, RLIM64_INFINITY, CRED(), &resid);
+	*done = len - resid;
+	return (err);
+}
+
+static int
+vnstream_read(void *arg, void *buf, size_t len, size_t *done)
+{
+	struct vnstream *vs = arg;
+	ssize_t resid;
+	int err;
+
+	err = vn_rdwr(UIO_READ, vs->vs_vp, (caddr_t)buf, len,
+	    vs->vs_off, UIO_SYSSPACE, FAPPEND, RLIM64_INFINITY, CRED(),
+	    &resid);
+	*done = len - resid;
+	vs->vs_off += len - resid;
+	return (err);
+}
+
 /*
  * The list of data whose inclusion in a send stream can be pending from
  * one call to backup_cb to another.  Multiple calls to dump_free() and
@@ -56,28 +430,60 @@ typedef enum {
 	PENDING_FREEOBJECTS
 } pendop_t;
 
+/*
+ * A raw read of a compressed block, waiting to be sent.
+ */
+struct backup_raw {
+	zio_t *br_zio;
+	void *br_data;
+	blkptr_t br_bp;
+	zbookmark_t br_zb;
+};
+
 struct backuparg {
 	dmu_replay_record_t *drr;
-	vnode_t *vp;
-	offset_t *off;
+	dmu_stream_t *st;
 	objset_t *os;
 	zio_cksum_t zc;
 	uint64_t toguid;
 	int err;
+	boolean_t compressok;
+	uint64_t resumeobj;	/* earlier objects were already received */
 	pendop_t pending_op;
+	struct backup_raw *raw;	/* ring of raw reads, oldest at raw_head */
+	int raw_max;
+	int raw_head;
+	int raw_count;
 };
 
 static int
 dump_bytes(struct backuparg *ba, void *buf, int len)
 {
-	ssize_t resid; /* have to get resid to get detailed errno */
 	ASSERT3U(len % 8, ==, 0);
 
 	fletcher_4_incremental_native(buf, len, &ba->zc);
-	ba->err = vn_rdwr(UIO_WRITE, ba->vp,
-	    (caddr_t)buf, len,
-	    0, UIO_SYSSPACE, FAPPEND, RLIM64_INFINITY, CRED(), &resid);
-	*ba->off += len;
+	ba->err = dmu_stream_put(ba->st, buf, len);
+	return (ba->err);
+}
+
+/*
+ * Write the current record.  All but DRR_BEGIN end with the checksum of
+ * the stream up to there, so that a receiver can tell that everything
+ * before a record arrived intact without waiting for DRR_END.
+ */
+static int
+dump_record(struct backuparg *ba)
+{
+	dmu_replay_record_t *drr = ba->drr;
+	zio_cksum_t *zc = &drr->drr_u.drr_checksum.drr_checksum;
+
+	ASSERT3U(sizeof (drr->drr_u.drr_checksum), ==, sizeof (drr->drr_u));
+
+	fletcher_4_incremental_native(drr, (char *)zc - (char *)drr, &ba->zc);
+	if (drr->drr_type != DRR_BEGIN)
+		*zc = ba->zc;
+	fletcher_4_incremental_native(zc, sizeof (zio_cksum_t), &ba->zc);
+	ba->err = dmu_stream_put(ba->st, drr, sizeof (dmu_replay_record_t));
 	return (ba->err);
 }
 
@@ -95,7 +501,7 @@ dump_free(struct backuparg *ba, uint64_t object, uint64_t offset,
 	 * aggregated with other DRR_FREEOBJECTS records.
 	 */
 	if (ba->pending_op != PENDING_NONE && ba->pending_op != PENDING_FREE) {
-		if (dump_bytes(ba, ba->drr, sizeof (dmu_replay_record_t)) != 0)
+		if (dump_record(ba) != 0)
 			return (EINTR);
 		ba->pending_op = PENDING_NONE;
 	}
@@ -118,8 +524,7 @@ dump_free(struct backuparg *ba, uint64_t object, uint64_t offset,
 			return (0);
 		} else {
 			/* not a continuation.  Push out pending record */
-			if (dump_bytes(ba, ba->drr,
-			    sizeof (dmu_replay_record_t)) != 0)
+			if (dump_record(ba) != 0)
 				return (EINTR);
 			ba->pending_op = PENDING_NONE;
 		}
@@ -132,7 +537,7 @@ dump_free(struct backuparg *ba, uint64_t object, uint64_t offset,
 	drrf->drr_length = length;
 	drrf->drr_toguid = ba->toguid;
 	if (length == -1ULL) {
-		if (dump_bytes(ba, ba->drr, sizeof (dmu_replay_record_t)) != 0)
+		if (dump_record(ba) != 0)
 			return (EINTR);
 	} else {
 		ba->pending_op = PENDING_FREE;
@@ -141,9 +546,14 @@ dump_free(struct backuparg *ba, uint64_t object, uint64_t offset,
 	return (0);
 }
 
+/*
+ * If compressed, data is the block as stored on disk, BP_GET_PSIZE(bp)
+ * bytes compressed with BP_GET_COMPRESS(bp).
+ */
 static int
 dump_data(struct backuparg *ba, dmu_object_type_t type,
-    uint64_t object, uint64_t offset, int blksz, const blkptr_t *bp, void *data)
+    uint64_t object, uint64_t offset, int blksz, const blkptr_t *bp, void *data,
+    boolean_t compressed)
 {
 	struct drr_write *drrw = &(ba->drr->drr_u.drr_write);
 
@@ -155,13 +565,13 @@ dump_data(struct backuparg *ba, dmu_object_type_t type,
 	 * of different types.
 	 */
 	if (ba->pending_op != PENDING_NONE) {
-		if (dump_bytes(ba, ba->drr, sizeof (dmu_replay_record_t)) != 0)
+		if (dump_record(ba) != 0)
 			return (EINTR);
 		ba->pending_op = PENDING_NONE;
 	}
 	/* write a DATA record */
 	bzero(ba->drr, sizeof (dmu_replay_record_t));
-	ba->drr->drr_type = DRR_WRITE;
+	ba->drr->drr_type = compressed ? DRR_WRITE_COMPRESSED : DRR_WRITE;
 	drrw->drr_object = object;
 	drrw->drr_type = type;
 	drrw->drr_offset = offset;
@@ -175,9 +585,9 @@ dump_data(struct backuparg *ba, dmu_object_type_t type,
 	DDK_SET_COMPRESS(&drrw->drr_key, BP_GET_COMPRESS(bp));
 	drrw->drr_key.ddk_cksum = bp->blk_cksum;
 
-	if (dump_bytes(ba, ba->drr, sizeof (dmu_replay_record_t)) != 0)
+	if (dump_record(ba) != 0)
 		return (EINTR);
-	if (dump_bytes(ba, data, blksz) != 0)
+	if (dump_bytes(ba, data, compressed ? BP_GET_PSIZE(bp) : blksz) != 0)
 		return (EINTR);
 	return (0);
 }
@@ -196,7 +606,7 @@ dump_freeobjects(struct backuparg *ba, uint64_t firstobj, uint64_t numobjs)
 	 */
 	if (ba->pending_op != PENDING_NONE &&
 	    ba->pending_op != PENDING_FREEOBJECTS) {
-		if (dump_bytes(ba, ba->drr, sizeof (dmu_replay_record_t)) != 0)
+		if (dump_record(ba) != 0)
 			return (EINTR);
 		ba->pending_op = PENDING_NONE;
 	}
@@ -210,8 +620,7 @@ dump_freeobjects(struct backuparg *ba, uint64_t firstobj, uint64_t numobjs)
 			return (0);
 		} else {
 			/* can't be aggregated.  Push out pending record */
-			if (dump_bytes(ba, ba->drr,
-			    sizeof (dmu_replay_record_t)) != 0)
+			if (dump_record(ba) != 0)
 				return (EINTR);
 			ba->pending_op = PENDING_NONE;
 		}
@@ -238,7 +647,7 @@ dump_dnode(struct backuparg *ba, uint64_t object, dnode_phys_t *dnp)
 		return (dump_freeobjects(ba, object, 1));
 
 	if (ba->pending_op != PENDING_NONE) {
-		if (dump_bytes(ba, ba->drr, sizeof (dmu_replay_record_t)) != 0)
+		if (dump_record(ba) != 0)
 			return (EINTR);
 		ba->pending_op = PENDING_NONE;
 	}
@@ -255,7 +664,7 @@ dump_dnode(struct backuparg *ba, uint64_t object, dnode_phys_t *dnp)
 	drro->drr_compress = dnp->dn_compress;
 	drro->drr_toguid = ba->toguid;
 
-	if (dump_bytes(ba, ba->drr, sizeof (dmu_replay_record_t)) != 0)
+	if (dump_record(ba) != 0)
 		return (EINTR);
 
 	if (dump_bytes(ba, DN_BONUS(dnp), P2ROUNDUP(dnp->dn_bonuslen, 8)) != 0)
@@ -270,6 +679,60 @@ dump_dnode(struct backuparg *ba, uint64_t object, dnode_phys_t *dnp)
 	return (0);
 }
 
+/*
+ * Send the oldest raw reads until at most keep are left in flight.  After
+ * an error, including one passed in, they are only waited for.
+ */
+static int
+backup_raw_drain(struct backuparg *ba, int keep, int err)
+{
+	struct backup_raw *br;
+
+	while (ba->raw_count > keep) {
+		br = &ba->raw[ba->raw_head];
+		ba->raw_head = (ba->raw_head + 1) % ba->raw_max;
+		ba->raw_count--;
+
+		if (zio_wait(br->br_zio) != 0 && err == 0)
+			err = EIO;
+		if (err == 0) {
+			int blksz = BP_GET_LSIZE(&br->br_bp);
+
+			err = dump_data(ba, BP_GET_TYPE(&br->br_bp),
+			    br->br_zb.zb_object, br->br_zb.zb_blkid * blksz,
+			    blksz, &br->br_bp, br->br_data, B_TRUE);
+		}
+		zio_data_buf_free(br->br_data, BP_GET_PSIZE(&br->br_bp));
+	}
+	return (err);
+}
+
+/*
+ * Start reading a compressed block as it is on disk, making room in the
+ * ring first if it is full.
+ */
+static int
+backup_raw_issue(struct backuparg *ba, spa_t *spa, const blkptr_t *bp,
+    const zbookmark_t *zb)
+{
+	struct backup_raw *br;
+	int err;
+
+	if ((err = backup_raw_drain(ba, ba->raw_max - 1, 0)) != 0)
+		return (err);
+
+	br = &ba->raw[(ba->raw_head + ba->raw_count) % ba->raw_max];
+	ba->raw_count++;
+	br->br_bp = *bp;
+	br->br_zb = *zb;
+	br->br_data = zio_data_buf_alloc(BP_GET_PSIZE(bp));
+	br->br_zio = zio_root(spa, NULL, NULL, ZIO_FLAG_CANFAIL);
+	zio_nowait(zio_read(br->br_zio, spa, &br->br_bp, br->br_data,
+	    BP_GET_PSIZE(bp), NULL, NULL, ZIO_PRIORITY_ASYNC_READ,
+	    ZIO_FLAG_CANFAIL | ZIO_FLAG_RAW, &br->br_zb));
+	return (0);
+}
+
 #define	BP_SPAN(dnp, level) \
 	(((uint64_t)dnp->dn_datablkszsec) << (SPA_MINBLOCKSHIFT + \
 	(level) * (dnp->dn_indblkshift - SPA_BLKPTRSHIFT)))
@@ -286,6 +749,22 @@ backup_cb(spa_t *spa, zilog_t *zilog, const blkptr_t *bp,
 	if (issig(JUSTLOOKING) && issig(FORREAL))
 		return (EINTR);
 
+	if (bp != NULL && zb->zb_level == 0 && ba->compressok &&
+	    type != DMU_OT_DNODE && type != DMU_OT_OBJSET &&
+	    !DMU_OBJECT_IS_SPECIAL(zb->zb_object) &&
+	    BP_GET_COMPRESS(bp) != ZIO_COMPRESS_OFF) {
+		/* send the block as it is on disk, still compressed */
+		return (backup_raw_issue(ba, spa, bp, zb));
+	}
+
+	/*
+	 * Any other record goes after the compressed blocks before it.
+	 * Indirect blocks give no record, so they don't hold up the reads.
+	 */
+	if ((bp == NULL || (zb->zb_level == 0 && type != DMU_OT_OBJSET)) &&
+	    (err = backup_raw_drain(ba, 0, 0)) != 0)
+		return (err);
+
 	if (zb->zb_object != DMU_META_DNODE_OBJECT &&
 	    DMU_OBJECT_IS_SPECIAL(zb->zb_object)) {
 		return (0);
@@ -314,6 +793,8 @@ backup_cb(spa_t *spa, zilog_t *zilog, const blkptr_t *bp,
 		for (i = 0; i < blksz >> DNODE_SHIFT; i++) {
 			uint64_t dnobj = (zb->zb_blkid <<
 			    (DNODE_BLOCK_SHIFT - DNODE_SHIFT)) + i;
+			if (dnobj < ba->resumeobj)
+				continue;
 			err = dump_dnode(ba, dnobj, blk+i);
 			if (err)
 				break;
@@ -330,7 +811,7 @@ backup_cb(spa_t *spa, zilog_t *zilog, const blkptr_t *bp,
 			return (EIO);
 
 		err = dump_data(ba, type, zb->zb_object, zb->zb_blkid * blksz,
-		    blksz, bp, abuf->b_data);
+		    blksz, bp, abuf->b_data, B_FALSE);
 		(void) arc_buf_remove_ref(abuf, &abuf);
 	}
 
@@ -338,16 +819,29 @@ backup_cb(spa_t *spa, zilog_t *zilog, const blkptr_t *bp,
 	return (err);
 }
 
+/*
+ * Generate a send stream of tosnap into func.  The dataset is walked in
+ * order, with the blocks it needs read concurrently ahead of it, while a
+ * separate thread writes the stream out.  If compressok,
+ * compressed blocks are sent as they are on disk, in DRR_WRITE_COMPRESSED
+ * records, rather than decompressed.  If resume is given, the stream
+ * only carries what the receive that returned it is still missing.
+ */
 int
-dmu_sendbackup(objset_t *tosnap, objset_t *fromsnap, boolean_t fromorigin,
-    vnode_t *vp, offset_t *off)
+dmu_sendbackup_func(objset_t *tosnap, objset_t *fromsnap,
+    boolean_t fromorigin, boolean_t compressok,
+    const dmu_resume_token_t *resume, dmu_stream_func_t *func,
+    void *arg, offset_t *off)
 {
 	dsl_dataset_t *ds = tosnap->os_dsl_dataset;
 	dsl_dataset_t *fromds = fromsnap ? fromsnap->os_dsl_dataset : NULL;
 	dmu_replay_record_t *drr;
 	struct backuparg ba;
-	int err;
-	uint64_t fromtxg = 0;
+	dmu_stream_t st = { 0 };
+	zbookmark_t resumezb;
+	struct drr_begin_resume drrr = { 0 };
+	int err, featureflags = 0;
+	uint64_t fromtxg = 0, fromguid = 0;
 
 	/* tosnap must be a snapshot */
 	if (ds->ds_phys->ds_next_snap_obj == 0)
@@ -376,12 +870,41 @@ dmu_sendbackup(objset_t *tosnap, objset_t *fromsnap, boolean_t fromorigin,
 		}
 	}
 
+	if (fromds)
+		fromguid = fromds->ds_phys->ds_guid;
+
+	if (resume != NULL) {
+		dmu_object_info_t doi;
+
+		if (resume->drt_toguid != ds->ds_phys->ds_guid ||
+		    resume->drt_fromguid != fromguid)
+			err = EINVAL;
+		else
+			err = dmu_object_info(tosnap, resume->drt_object, &doi);
+		if (err) {
+			if (fromorigin)
+				dsl_dataset_rele(fromds, FTAG);
+			return (err == ENOENT ? EINVAL : err);
+		}
+		SET_BOOKMARK(&resumezb, ds->ds_object, resume->drt_object, 0,
+		    resume->drt_offset / doi.doi_data_block_size);
+		drrr.drr_object = resume->drt_object;
+		drrr.drr_offset = resumezb.zb_blkid * doi.doi_data_block_size;
+	}
 
 	drr = kmem_zalloc(sizeof (dmu_replay_record_t), KM_SLEEP);
 	drr->drr_type = DRR_BEGIN;
 	drr->drr_u.drr_begin.drr_magic = DMU_BACKUP_MAGIC;
 	DMU_SET_STREAM_HDRTYPE(drr->drr_u.drr_begin.drr_versioninfo,
 	    DMU_SUBSTREAM);
+	if (compressok)
+		featureflags |= DMU_BACKUP_FEATURE_COMPRESSED;
+	if (resume != NULL) {
+		featureflags |= DMU_BACKUP_FEATURE_RESUMING;
+		drr->drr_payloadlen = sizeof (struct drr_begin_resume);
+	}
+	DMU_SET_FEATUREFLAGS(drr->drr_u.drr_begin.drr_versioninfo,
+	    featureflags);
 	drr->drr_u.drr_begin.drr_creation_time =
 	    ds->ds_phys->ds_creation_time;
 	drr->drr_u.drr_begin.drr_type = tosnap->os_phys->os_type;
@@ -391,8 +914,7 @@ dmu_sendbackup(objset_t *tosnap, objset_t *fromsnap, boolean_t fromorigin,
 	if (ds->ds_phys->ds_flags & DS_FLAG_CI_DATASET)
 		drr->drr_u.drr_begin.drr_flags |= DRR_FLAG_CI_DATA;
 
-	if (fromds)
-		drr->drr_u.drr_begin.drr_fromguid = fromds->ds_phys->ds_guid;
+	drr->drr_u.drr_begin.drr_fromguid = fromguid;
 	dsl_dataset_name(ds, drr->drr_u.drr_begin.drr_toname);
 
 	if (fromds)
@@ -401,45 +923,85 @@ dmu_sendbackup(objset_t *tosnap, objset_t *fromsnap, boolean_t fromorigin,
 		dsl_dataset_rele(fromds, FTAG);
 
 	ba.drr = drr;
-	ba.vp = vp;
+	ba.st = &st;
 	ba.os = tosnap;
-	ba.off = off;
 	ba.toguid = ds->ds_phys->ds_guid;
+	ba.err = 0;
+	ba.compressok = compressok;
+	ba.resumeobj = resume ? resume->drt_object : 0;
 	ZIO_SET_CHECKSUM(&ba.zc, 0, 0, 0, 0);
 	ba.pending_op = PENDING_NONE;
+	ba.raw_max = MAX(zfs_send_raw_window, 1);
+	ba.raw_head = 0;
+	ba.raw_count = 0;
+	ba.raw = compressok ? kmem_alloc(ba.raw_max *
+	    sizeof (struct backup_raw), KM_SLEEP) : NULL;
 
-	if (dump_bytes(&ba, drr, sizeof (dmu_replay_record_t)) != 0) {
-		kmem_free(drr, sizeof (dmu_replay_record_t));
-		return (ba.err);
-	}
+	dmu_stream_start(&st, "dmu_send", zfs_send_queue_length,
+	    dmu_stream_writer, func, arg);
 
-	err = traverse_dataset(ds, fromtxg, TRAVERSE_PRE | TRAVERSE_PREFETCH,
-	    backup_cb, &ba);
+	err = dump_record(&ba);
+	if (err == 0 && resume != NULL)
+		err = dump_bytes(&ba, &drrr, sizeof (drrr));
 
-	if (ba.pending_op != PENDING_NONE)
-		if (dump_bytes(&ba, drr, sizeof (dmu_replay_record_t)) != 0)
-			err = EINTR;
+	if (err == 0) {
+		/*
+		 * Compressed blocks are read raw, bypassing the ARC, by
+		 * backup_cb() itself with zfs_send_raw_window reads in
+		 * flight, so prefetching their decompressed data would be
+		 * wasted.  The
+		 * blocks of dnodes are read concurrently, but the records
+		 * are written in order.
+		 */
+		int flags = TRAVERSE_PRE | TRAVERSE_PARALLEL |
+		    TRAVERSE_ORDERED | (compressok ?
+		    TRAVERSE_PREFETCH_METADATA : TRAVERSE_PREFETCH);
 
-	if (err) {
+		if (resume != NULL) {
+			err = traverse_dataset_resume(ds, fromtxg, &resumezb,
+			    flags, backup_cb, &ba);
+		} else {
+			err = traverse_dataset(ds, fromtxg, flags, backup_cb,
+			    &ba);
+		}
+		err = backup_raw_drain(&ba, 0, err);
+		if (ba.pending_op != PENDING_NONE)
+			if (dump_record(&ba) != 0)
+				err = EINTR;
 		if (err == EINTR && ba.err)
 			err = ba.err;
-		kmem_free(drr, sizeof (dmu_replay_record_t));
-		return (err);
 	}
 
-	bzero(drr, sizeof (dmu_replay_record_t));
-	drr->drr_type = DRR_END;
-	drr->drr_u.drr_end.drr_checksum = ba.zc;
-	drr->drr_u.drr_end.drr_toguid = ba.toguid;
+	if (err == 0) {
+		bzero(drr, sizeof (dmu_replay_record_t));
+		drr->drr_type = DRR_END;
+		drr->drr_u.drr_end.drr_checksum = ba.zc;
+		drr->drr_u.drr_end.drr_toguid = ba.toguid;
 
-	if (dump_bytes(&ba, drr, sizeof (dmu_replay_record_t)) != 0) {
-		kmem_free(drr, sizeof (dmu_replay_record_t));
-		return (ba.err);
+		err = dump_record(&ba);
 	}
 
+	/* an error from the writer takes precedence over the EINTR it caused */
+	err = dmu_stream_stop(&st, err);
+	*off += st.st_off;
+
 	kmem_free(drr, sizeof (dmu_replay_record_t));
+	if (ba.raw != NULL)
+		kmem_free(ba.raw, ba.raw_max * sizeof (struct backup_raw));
 
-	return (0);
+	return (err);
+}
+
+int
+dmu_sendbackup(objset_t *tosnap, objset_t *fromsnap, boolean_t fromorigin,
+    vnode_t *vp, offset_t *off)
+{
+	struct vnstream vs;
+
+	vs.vs_vp = vp;
+	vs.vs_off = *off;
+	return (dmu_sendbackup_func(tosnap, fromsnap, fromorigin, B_FALSE,
+	    NULL, vnstream_write, &vs, off));
 }
 
 struct recvbeginsyncarg {
@@ -447,9 +1009,11 @@ struct recvbeginsyncarg {
 	const char *tosnap;
 	dsl_dataset_t *origin;
 	uint64_t fromguid;
+	uint64_t toguid;
 	dmu_objset_type_t type;
 	void *tag;
 	boolean_t force;
+	boolean_t resumable;
 	uint64_t dsflags;
 	char clonelastname[MAXNAMELEN];
 	dsl_dataset_t *ds; /* the ds to recv into; returned from the syncfunc */
@@ -484,6 +1048,24 @@ recv_new_check(void *arg1, void *arg2, dmu_tx_t *tx)
 	return (0);
 }
 
+/*
+ * Mark the dataset a resumable receive was just started into, so that
+ * dmu_recv_resume_token() and a later dmu_recv_begin() can find it.
+ */
+static void
+recv_resume_init_sync(dsl_dataset_t *ds, struct recvbeginsyncarg *rbsa,
+    dmu_tx_t *tx)
+{
+	if (!rbsa->resumable)
+		return;
+
+	dmu_buf_will_dirty(ds->ds_dbuf, tx);
+	ds->ds_phys->ds_resume_toguid = rbsa->toguid;
+	ds->ds_phys->ds_resume_fromguid = rbsa->fromguid;
+	ds->ds_phys->ds_resume_object = 0;
+	ds->ds_phys->ds_resume_offset = 0;
+}
+
 static void
 recv_new_sync(void *arg1, void *arg2, cred_t *cr, dmu_tx_t *tx)
 {
@@ -502,6 +1084,7 @@ recv_new_sync(void *arg1, void *arg2, cred_t *cr, dmu_tx_t *tx)
 		(void) dmu_objset_create_impl(dd->dd_pool->dp_spa,
 		    rbsa->ds, &rbsa->ds->ds_phys->ds_bp, rbsa->type, tx);
 	}
+	recv_resume_init_sync(rbsa->ds, rbsa, tx);
 
 	spa_history_internal_log(LOG_DS_REPLAY_FULL_SYNC,
 	    dd->dd_pool->dp_spa, tx, cr, "dataset = %lld", dsobj);
@@ -603,18 +1186,108 @@ recv_existing_sync(void *arg1, void *arg2, cred_t *cr, dmu_tx_t *tx)
 	}
 
 	rbsa->ds = cds;
+	recv_resume_init_sync(cds, rbsa, tx);
 
 	spa_history_internal_log(LOG_DS_REPLAY_INC_SYNC,
 	    dp->dp_spa, tx, cr, "dataset = %lld", dsobj);
 }
 
+/*
+ * Find the dataset an interrupted resumable receive of tosnap into tofs
+ * was left in: tofs itself for a new file system, or its temporary clone
+ * otherwise.  Returns ENOENT if there is none.  On success the dataset is
+ * held with tag, and so is tofs if it is the temporary clone's parent.
+ */
+static int
+recv_resume_hold(char *tofs, char *tosnap, void *tag, dsl_dataset_t **dsp,
+    dsl_dataset_t **rdsp)
+{
+	char name[MAXNAMELEN];
+	dsl_dataset_t *ds, *rds;
+	int err;
+
+	err = dsl_dataset_hold(tofs, tag, &ds);
+	if (err)
+		return (err);
+
+	if (DS_IS_INCONSISTENT(ds)) {
+		rds = ds;
+	} else {
+		if (snprintf(name, sizeof (name), "%s/%%%s", tofs, tosnap) >=
+		    sizeof (name)) {
+			dsl_dataset_rele(ds, tag);
+			return (ENAMETOOLONG);
+		}
+		err = dsl_dataset_hold(name, tag, &rds);
+		if (err) {
+			dsl_dataset_rele(ds, tag);
+			return (err);
+		}
+	}
+
+	if (!DS_IS_INCONSISTENT(rds) || rds->ds_phys->ds_resume_toguid == 0) {
+		if (rds != ds)
+			dsl_dataset_rele(rds, tag);
+		dsl_dataset_rele(ds, tag);
+		return (ENOENT);
+	}
+
+	*dsp = ds;
+	*rdsp = rds;
+	return (0);
+}
+
+/*
+ * Pick up where an interrupted resumable receive of the same stream left
+ * off.  Returns ENOENT if there is nothing to resume.
+ */
+static int
+recv_resume_begin(char *tofs, char *tosnap, struct recvbeginsyncarg *rbsa,
+    dmu_recv_cookie_t *drc)
+{
+	dsl_dataset_t *ds, *rds;
+	int err;
+
+	err = recv_resume_hold(tofs, tosnap, dmu_recv_tag, &ds, &rds);
+	if (err)
+		return (err);
+
+	if (rds->ds_phys->ds_resume_toguid != rbsa->toguid ||
+	    rds->ds_phys->ds_resume_fromguid != rbsa->fromguid) {
+		err = EEXIST;
+	} else if (rds != ds && !mutex_tryenter(&ds->ds_recvlock)) {
+		err = EBUSY;
+	} else if (!dsl_dataset_tryown(rds, B_TRUE, dmu_recv_tag)) {
+		if (rds != ds)
+			mutex_exit(&ds->ds_recvlock);
+		err = EBUSY;
+	}
+	if (err) {
+		if (rds != ds)
+			dsl_dataset_rele(rds, dmu_recv_tag);
+		dsl_dataset_rele(ds, dmu_recv_tag);
+		return (err);
+	}
+
+	drc->drc_logical_ds = ds;
+	drc->drc_real_ds = rds;
+	drc->drc_newfs = (rds == ds);
+	return (0);
+}
+
 /*
  * NB: callers *MUST* call dmu_recv_stream() if dmu_recv_begin()
  * succeeds; otherwise we will leak the holds on the datasets.
+ *
+ * If resumable, what has been received is kept when the stream is
+ * interrupted, and a later resumable receive of the same stream, or of
+ * the rest of it from dmu_sendbackup_func() given dmu_recv_resume_token(),
+ * continues from there.
  */
 int
 dmu_recv_begin(char *tofs, char *tosnap, char *top_ds, struct drr_begin *drrb,
-    boolean_t force, objset_t *origin, dmu_recv_cookie_t *drc)
+    boolean_t force, boolean_t resumable, objset_t *origin,
+    dmu_recv_cookie_t *drc)
 {
 	int err = 0;
 	boolean_t byteswap;
@@ -634,6 +1307,7 @@ dmu_recv_begin(char *tofs, char *tosnap, char *top_ds, struct drr_begin *drrb,
 	rbsa.tosnap = tosnap;
 	rbsa.origin = origin ? origin->os_dsl_dataset : NULL;
 	rbsa.fromguid = drrb->drr_fromguid;
+	rbsa.toguid = drrb->drr_toguid;
 	rbsa.type = drrb->drr_type;
 	rbsa.tag = FTAG;
 	rbsa.dsflags = 0;
@@ -643,6 +1317,7 @@ dmu_recv_begin(char *tofs, char *tosnap, char *top_ds, struct drr_begin *drrb,
 	if (byteswap) {
 		rbsa.type = BSWAP_32(rbsa.type);
 		rbsa.fromguid = BSWAP_64(rbsa.fromguid);
+		rbsa.toguid = BSWAP_64(rbsa.toguid);
 		versioninfo = BSWAP_64(versioninfo);
 		flags = BSWAP_32(flags);
 	}
@@ -660,6 +1335,19 @@ dmu_recv_begin(char *tofs, char *tosnap, char *top_ds, struct drr_begin *drrb,
 	drc->drc_tosnap = tosnap;
 	drc->drc_top_ds = top_ds;
 	drc->drc_force = force;
+	drc->drc_resumable = resumable;
+	rbsa.resumable = resumable;
+
+	if (resumable) {
+		err = recv_resume_begin(tofs, tosnap, &rbsa, drc);
+		if (err != ENOENT)
+			return (err);
+		err = 0;
+	}
+
+	/* the rest of a stream needs what an earlier receive left */
+	if (DMU_GET_FEATUREFLAGS(versioninfo) & DMU_BACKUP_FEATURE_RESUMING)
+		return (EINVAL);
 
 	/*
 	 * Process the begin in syncing context.
@@ -729,12 +1417,19 @@ dmu_recv_begin(char *tofs, char *tosnap, char *top_ds, struct drr_begin *drrb,
 struct restorearg {
 	int err;
 	int byteswap;
-	vnode_t *vp;
+	dmu_stream_t *st;
 	char *buf;
 	uint64_t voff;
 	int bufsize; /* amount of memory allocated for buf */
 	zio_cksum_t cksum;
 	avl_tree_t guid_to_ds_map;
+	zio_t *zio;	/* outstanding DRR_WRITE_COMPRESSED writes */
+	dsl_dataset_t *resume_ds; /* for a resumable receive, else NULL */
+	uint64_t resume_object;
+	uint64_t resume_offset;
+	uint64_t resume_voff;	/* ra->voff when last recorded */
+	uint64_t verified_object; /* the position the stream's checksums */
+	uint64_t verified_offset; /* have vouched for so far */
 };
 
 typedef struct guid_map_entry {
@@ -815,28 +1510,16 @@ static void *
 restore_read(struct restorearg *ra, int len)
 {
 	void *rv;
-	int done = 0;
 
 	/* some things will require 8-byte alignment, so everything must */
 	ASSERT3U(len % 8, ==, 0);
+	ASSERT3U(len, <=, ra->bufsize);
 
-	while (done < len) {
-		ssize_t resid;
-
-		ra->err = vn_rdwr(UIO_READ, ra->vp,
-		    (caddr_t)ra->buf + done, len - done,
-		    ra->voff, UIO_SYSSPACE, FAPPEND,
-		    RLIM64_INFINITY, CRED(), &resid);
-
-		if (resid == len - done)
-			ra->err = EINVAL;
-		ra->voff += len - done - resid;
-		done = len - resid;
-		if (ra->err)
-			return (NULL);
-	}
+	ra->err = dmu_stream_get(ra->st, ra->buf, len);
+	if (ra->err)
+		return (NULL);
+	ra->voff += len;
 
-	ASSERT3U(done, ==, len);
 	rv = ra->buf;
 	if (ra->byteswap)
 		fletcher_4_incremental_byteswap(rv, len, &ra->cksum);
@@ -845,6 +1528,52 @@ restore_read(struct restorearg *ra, int len)
 	return (rv);
 }
 
+/*
+ * Read the next record, checking the checksum it ends with, if any,
+ * against that of the stream read so far.  Returns B_TRUE in *verified
+ * if the record vouched for everything before it.
+ */
+static dmu_replay_record_t *
+restore_read_record(struct restorearg *ra, boolean_t *verified)
+{
+	dmu_replay_record_t *drr;
+	zio_cksum_t *zc, want;
+
+	ra->err = dmu_stream_get(ra->st, ra->buf, sizeof (*drr));
+	if (ra->err)
+		return (NULL);
+	ra->voff += sizeof (*drr);
+
+	drr = (dmu_replay_record_t *)ra->buf;
+	zc = &drr->drr_u.drr_checksum.drr_checksum;
+	if (ra->byteswap) {
+		fletcher_4_incremental_byteswap(drr, (char *)zc - (char *)drr,
+		    &ra->cksum);
+	} else {
+		fletcher_4_incremental_native(drr, (char *)zc - (char *)drr,
+		    &ra->cksum);
+	}
+
+	want = *zc;
+	if (ra->byteswap) {
+		ZIO_SET_CHECKSUM(&want, BSWAP_64(zc->zc_word[0]),
+		    BSWAP_64(zc->zc_word[1]), BSWAP_64(zc->zc_word[2]),
+		    BSWAP_64(zc->zc_word[3]));
+	}
+	*verified = (want.zc_word[0] | want.zc_word[1] |
+	    want.zc_word[2] | want.zc_word[3]) != 0;
+	if (*verified && !ZIO_CHECKSUM_EQUAL(want, ra->cksum)) {
+		ra->err = ECKSUM;
+		return (NULL);
+	}
+
+	if (ra->byteswap)
+		fletcher_4_incremental_byteswap(zc, sizeof (*zc), &ra->cksum);
+	else
+		fletcher_4_incremental_native(zc, sizeof (*zc), &ra->cksum);
+	return (drr);
+}
+
 static void
 backup_byteswap(dmu_replay_record_t *drr)
 {
@@ -877,6 +1606,7 @@ backup_byteswap(dmu_replay_record_t *drr)
 		DO64(drr_freeobjects.drr_toguid);
 		break;
 	case DRR_WRITE:
+	case DRR_WRITE_COMPRESSED:
 		DO64(drr_write.drr_object);
 		DO32(drr_write.drr_type);
 		DO64(drr_write.drr_offset);
@@ -1036,6 +1766,7 @@ restore_write(struct restorearg *ra, objset_t *os,
 	int err;
 
 	if (drrw->drr_offset + drrw->drr_length < drrw->drr_offset ||
+	    drrw->drr_length > SPA_MAXBLOCKSIZE ||
 	    drrw->drr_type >= DMU_OT_NUMTYPES)
 		return (EINVAL);
 
@@ -1063,6 +1794,188 @@ restore_write(struct restorearg *ra, objset_t *os,
 	return (0);
 }
 
+/*
+ * Whether blocks compressed with compress may be written to the pool as
+ * they are.  Its version may be too old to know the algorithm, or, for
+ * lz4, its lz4_compress property may be unset.
+ */
+static boolean_t
+restore_compress_supported(spa_t *spa, enum zio_compress compress)
+{
+	uint64_t version = spa_version(spa);
+
+	if (compress >= ZIO_COMPRESS_GZIP_1 && compress <= ZIO_COMPRESS_GZIP_9)
+		return (version >= SPA_VERSION_GZIP_COMPRESSION);
+	if (compress == ZIO_COMPRESS_ZLE)
+		return (version >= SPA_VERSION_ZLE_COMPRESSION);
+	if (compress == ZIO_COMPRESS_LZ4)
+		return (spa_lz4_compress(spa));
+	return (B_TRUE);
+}
+
+/*
+ * Handle a DRR_WRITE_COMPRESSED record.  The block is decompressed for
+ * the dbuf cache, but written out as received rather than compressed
+ * again, unless it has to be byteswapped or the pool can't hold it.
+ */
+static int
+restore_write_compressed(struct restorearg *ra, objset_t *os,
+    struct drr_write *drrw)
+{
+	dmu_tx_t *tx;
+	void *data, *ldata;
+	uint64_t psize = DDK_GET_PSIZE(&drrw->drr_key);
+	uint64_t lsize = drrw->drr_length;
+	enum zio_compress compress = DDK_GET_COMPRESS(&drrw->drr_key);
+	int err;
+
+	if (drrw->drr_offset + lsize < drrw->drr_offset ||
+	    lsize > SPA_MAXBLOCKSIZE || psize == 0 || psize > lsize ||
+	    drrw->drr_type >= DMU_OT_NUMTYPES ||
+	    compress >= ZIO_COMPRESS_FUNCTIONS ||
+	    compress == ZIO_COMPRESS_INHERIT || compress == ZIO_COMPRESS_ON)
+		return (EINVAL);
+
+	data = restore_read(ra, psize);
+	if (data == NULL)
+		return (ra->err);
+
+	if (dmu_object_info(os, drrw->drr_object, NULL) != 0)
+		return (EINVAL);
+
+	ldata = zio_data_buf_alloc(lsize);
+	if (compress == ZIO_COMPRESS_OFF) {
+		if (psize != lsize) {
+			zio_data_buf_free(ldata, lsize);
+			return (EINVAL);
+		}
+		bcopy(data, ldata, lsize);
+	} else if (zio_decompress_data(compress, data, ldata,
+	    psize, lsize) != 0) {
+		zio_data_buf_free(ldata, lsize);
+		return (EINVAL);
+	}
+
+	tx = dmu_tx_create(os);
+
+	dmu_tx_hold_write(tx, drrw->drr_object, drrw->drr_offset, lsize);
+	err = dmu_tx_assign(tx, TXG_WAIT);
+	if (err) {
+		dmu_tx_abort(tx);
+		zio_data_buf_free(ldata, lsize);
+		return (err);
+	}
+	if (ra->byteswap || compress == ZIO_COMPRESS_OFF ||
+	    !restore_compress_supported(dmu_objset_spa(os), compress)) {
+		if (ra->byteswap)
+			dmu_ot[drrw->drr_type].ot_byteswap(ldata, lsize);
+		dmu_write(os, drrw->drr_object, drrw->drr_offset, lsize,
+		    ldata, tx);
+	} else {
+		if (ra->zio == NULL)
+			ra->zio = zio_root(dmu_objset_spa(os), NULL, NULL,
+			    ZIO_FLAG_CANFAIL);
+		dmu_write_compressed(ra->zio, os, drrw->drr_object,
+		    drrw->drr_offset, lsize, ldata, data, psize, compress, tx);
+	}
+	dmu_tx_commit(tx);
+	zio_data_buf_free(ldata, lsize);
+	return (0);
+}
+
+/*
+ * Wait for the outstanding DRR_WRITE_COMPRESSED writes.  A failed one is
+ * just written again by spa_sync().
+ */
+static void
+restore_write_wait(struct restorearg *ra)
+{
+	if (ra->zio != NULL) {
+		(void) zio_wait(ra->zio);
+		ra->zio = NULL;
+	}
+}
+
+struct recvckptarg {
+	uint64_t object;
+	uint64_t offset;
+};
+
+/* ARGSUSED */
+static void
+recv_checkpoint_sync(void *arg1, void *arg2, cred_t *cr, dmu_tx_t *tx)
+{
+	dsl_dataset_t *ds = arg1;
+	struct recvckptarg *rca = arg2;
+
+	dmu_buf_will_dirty(ds->ds_dbuf, tx);
+	ds->ds_phys->ds_resume_object = rca->object;
+	ds->ds_phys->ds_resume_offset = rca->offset;
+
+	kmem_free(rca, sizeof (struct recvckptarg));
+}
+
+/*
+ * Record how far a resumable receive got, as far as the stream's checksums
+ * have vouched for it.  This is done in the txg after those of the writes
+ * it covers, so it only reaches disk along with them.
+ */
+static void
+restore_checkpoint(struct restorearg *ra)
+{
+	dsl_dataset_t *ds = ra->resume_ds;
+	struct recvckptarg *rca;
+	dmu_tx_t *tx;
+
+	rca = kmem_alloc(sizeof (struct recvckptarg), KM_SLEEP);
+	rca->object = ra->verified_object;
+	rca->offset = ra->verified_offset;
+
+	tx = dmu_tx_create_dd(ds->ds_dir);
+	VERIFY(0 == dmu_tx_assign(tx, TXG_WAIT));
+	dsl_sync_task_do_nowait(ds->ds_dir->dd_pool, NULL,
+	    recv_checkpoint_sync, ds, rca, 1, tx);
+	dmu_tx_commit(tx);
+
+	ra->resume_voff = ra->voff;
+}
+
+/*
+ * Note that everything up to offset of object has been written.  Blocks
+ * arrive in (object, offset) order, which is also the order
+ * dmu_sendbackup_func() skips them in when it resumes.  Frees and objects
+ * do not move the position: they come ahead of the blocks they precede.
+ */
+static void
+restore_advance(struct restorearg *ra, uint64_t object, uint64_t offset)
+{
+	if (ra->resume_ds == NULL || ra->err != 0)
+		return;
+
+	if (object > ra->resume_object ||
+	    (object == ra->resume_object && offset > ra->resume_offset)) {
+		ra->resume_object = object;
+		ra->resume_offset = offset;
+	}
+}
+
+/*
+ * Note that a record has vouched for everything received before it, and
+ * record the position every zfs_recv_checkpoint_interval bytes of stream.
+ */
+static void
+restore_verified(struct restorearg *ra)
+{
+	if (ra->resume_ds == NULL)
+		return;
+
+	ra->verified_object = ra->resume_object;
+	ra->verified_offset = ra->resume_offset;
+
+	if (ra->voff - ra->resume_voff >= zfs_recv_checkpoint_interval)
+		restore_checkpoint(ra);
+}
+
 /*
  * Handle a DRR_WRITE_BYREF record.  This record is used in dedup'ed
  * streams to refer to a copy of the data that is already on the
@@ -1141,27 +2054,43 @@ restore_free(struct restorearg *ra, objset_t *os,
 }
 
 /*
+ * Apply the records following the BEGIN record read from func.  The
+ * stream is read and split into records by a separate thread, while the
+ * calling thread applies them.
+ *
  * NB: callers *must* call dmu_recv_end() if this succeeds.
  */
 int
-dmu_recv_stream(dmu_recv_cookie_t *drc, vnode_t *vp, offset_t *voffp)
+dmu_recv_stream_func(dmu_recv_cookie_t *drc, dmu_stream_func_t *func,
+    void *arg, offset_t *voffp)
 {
 	struct restorearg ra = { 0 };
+	dmu_stream_t st = { 0 };
 	dmu_replay_record_t *drr;
 	objset_t *os;
 	zio_cksum_t pcksum;
 	guid_map_entry_t *gmep;
 	int featureflags;
+	boolean_t verified, untouched = B_TRUE;
 
 	if (drc->drc_drrb->drr_magic == BSWAP_64(DMU_BACKUP_MAGIC))
 		ra.byteswap = TRUE;
 
+	featureflags = DMU_GET_FEATUREFLAGS(ra.byteswap ?
+	    BSWAP_64(drc->drc_drrb->drr_versioninfo) :
+	    drc->drc_drrb->drr_versioninfo);
+
 	{
 		/* compute checksum of drr_begin record */
 		dmu_replay_record_t *drr;
 		drr = kmem_zalloc(sizeof (dmu_replay_record_t), KM_SLEEP);
 
 		drr->drr_type = DRR_BEGIN;
+		if (featureflags & DMU_BACKUP_FEATURE_RESUMING) {
+			drr->drr_payloadlen = ra.byteswap ?
+			    BSWAP_32(sizeof (struct drr_begin_resume)) :
+			    sizeof (struct drr_begin_resume);
+		}
 		drr->drr_u.drr_begin = *drc->drc_drrb;
 		if (ra.byteswap) {
 			fletcher_4_incremental_byteswap(drr,
@@ -1183,11 +2112,25 @@ dmu_recv_stream(dmu_recv_cookie_t *drc, vnode_t *vp, offset_t *voffp)
 		drrb->drr_fromguid = BSWAP_64(drrb->drr_fromguid);
 	}
 
-	ra.vp = vp;
+	ra.st = &st;
 	ra.voff = *voffp;
+	if (drc->drc_resumable) {
+		ra.resume_ds = drc->drc_real_ds;
+		ra.resume_object = ra.resume_ds->ds_phys->ds_resume_object;
+		ra.resume_offset = ra.resume_ds->ds_phys->ds_resume_offset;
+		ra.resume_voff = ra.voff;
+		ra.verified_object = ra.resume_object;
+		ra.verified_offset = ra.resume_offset;
+	}
 	ra.bufsize = 1<<20;
 	ra.buf = kmem_alloc(ra.bufsize, KM_SLEEP);
 
+	st.st_byteswap = ra.byteswap;
+	if (featureflags & DMU_BACKUP_FEATURE_RESUMING)
+		st.st_prefix = sizeof (struct drr_begin_resume);
+	dmu_stream_start(&st, "dmu_recv", zfs_recv_queue_length,
+	    dmu_stream_reader, func, arg);
+
 	/* these were verified in dmu_recv_begin */
 	ASSERT(DMU_GET_STREAM_HDRTYPE(drc->drc_drrb->drr_versioninfo) ==
 	    DMU_SUBSTREAM);
@@ -1200,8 +2143,6 @@ dmu_recv_stream(dmu_recv_cookie_t *drc, vnode_t *vp, offset_t *voffp)
 
 	ASSERT(drc->drc_real_ds->ds_phys->ds_flags & DS_FLAG_INCONSISTENT);
 
-	featureflags = DMU_GET_FEATUREFLAGS(drc->drc_drrb->drr_versioninfo);
-
 	/* if this stream is dedup'ed, set up the avl tree for guid mapping */
 	if (featureflags & DMU_BACKUP_FEATURE_DEDUP) {
 		avl_create(&ra.guid_to_ds_map, guid_compare,
@@ -1212,20 +2153,51 @@ dmu_recv_stream(dmu_recv_cookie_t *drc, vnode_t *vp, offset_t *voffp)
 		    DS_FIND_CHILDREN);
 	}
 
+	/*
+	 * The rest of a stream must not start past where the receive it
+	 * resumes got to, or what is in between would be missing.
+	 */
+	if (featureflags & DMU_BACKUP_FEATURE_RESUMING) {
+		struct drr_begin_resume *drrr;
+
+		drrr = restore_read(&ra, sizeof (struct drr_begin_resume));
+		if (drrr == NULL)
+			goto out;
+		if (ra.byteswap) {
+			drrr->drr_object = BSWAP_64(drrr->drr_object);
+			drrr->drr_offset = BSWAP_64(drrr->drr_offset);
+		}
+		ASSERT(ra.resume_ds != NULL);
+		if (drrr->drr_object > ra.resume_object ||
+		    (drrr->drr_object == ra.resume_object &&
+		    drrr->drr_offset > ra.resume_offset)) {
+			ra.err = EINVAL;
+			goto out;
+		}
+	}
+	untouched = B_FALSE;
+
 	/*
 	 * Read records and process them.
 	 */
 	pcksum = ra.cksum;
 	while (ra.err == 0 &&
-	    NULL != (drr = restore_read(&ra, sizeof (*drr)))) {
+	    NULL != (drr = restore_read_record(&ra, &verified))) {
 		if (issig(JUSTLOOKING) && issig(FORREAL)) {
 			ra.err = EINTR;
 			goto out;
 		}
 
+		if (verified)
+			restore_verified(&ra);
+
 		if (ra.byteswap)
 			backup_byteswap(drr);
 
+		/* other records may free or rewrite the blocks in flight */
+		if (drr->drr_type != DRR_WRITE_COMPRESSED)
+			restore_write_wait(&ra);
+
 		switch (drr->drr_type) {
 		case DRR_OBJECT:
 		{
@@ -1249,6 +2221,16 @@ dmu_recv_stream(dmu_recv_cookie_t *drc, vnode_t *vp, offset_t *voffp)
 		{
 			struct drr_write drrw = drr->drr_u.drr_write;
 			ra.err = restore_write(&ra, os, &drrw);
+			restore_advance(&ra, drrw.drr_object,
+			    drrw.drr_offset + drrw.drr_length);
+			break;
+		}
+		case DRR_WRITE_COMPRESSED:
+		{
+			struct drr_write drrw = drr->drr_u.drr_write;
+			ra.err = restore_write_compressed(&ra, os, &drrw);
+			restore_advance(&ra, drrw.drr_object,
+			    drrw.drr_offset + drrw.drr_length);
 			break;
 		}
 		case DRR_WRITE_BYREF:
@@ -1256,6 +2238,8 @@ dmu_recv_stream(dmu_recv_cookie_t *drc, vnode_t *vp, offset_t *voffp)
 			struct drr_write_byref drrwbr =
 			    drr->drr_u.drr_write_byref;
 			ra.err = restore_write_byref(&ra, os, &drrwbr);
+			restore_advance(&ra, drrwbr.drr_object,
+			    drrwbr.drr_offset + drrwbr.drr_length);
 			break;
 		}
 		case DRR_FREE:
@@ -1285,7 +2269,29 @@ dmu_recv_stream(dmu_recv_cookie_t *drc, vnode_t *vp, offset_t *voffp)
 	ASSERT(ra.err != 0);
 
 out:
-	if (ra.err != 0) {
+	restore_write_wait(&ra);
+	(void) dmu_stream_stop(&st, ra.err);
+
+	if (ra.err != 0 && ra.resume_ds != NULL &&
+	    (untouched || (ra.err != ECKSUM && ra.err != EINVAL))) {
+		/*
+		 * keep what we received, in the inconsistent restoring
+		 * state, for a later receive to resume, including when
+		 * the stream just ended early (EPIPE): the checkpoint only
+		 * covers records the stream's checksums verified.  A
+		 * corrupt or invalid stream may have written anything, so
+		 * that is destroyed below instead, unless it was rejected
+		 * before it wrote anything.
+		 */
+		restore_checkpoint(&ra);
+		txg_wait_synced(drc->drc_real_ds->ds_dir->dd_pool, 0);
+
+		dsl_dataset_disown(drc->drc_real_ds, dmu_recv_tag);
+		if (drc->drc_real_ds != drc->drc_logical_ds) {
+			mutex_exit(&drc->drc_logical_ds->ds_recvlock);
+			dsl_dataset_rele(drc->drc_logical_ds, dmu_recv_tag);
+		}
+	} else if (ra.err != 0) {
 		/*
 		 * destroy what we created, so we don't leave it in the
 		 * inconsistent restoring state.
@@ -1315,6 +2321,19 @@ out:
 	return (ra.err);
 }
 
+/*
+ * NB: callers *must* call dmu_recv_end() if this succeeds.
+ */
+int
+dmu_recv_stream(dmu_recv_cookie_t *drc, vnode_t *vp, offset_t *voffp)
+{
+	struct vnstream vs;
+
+	vs.vs_vp = vp;
+	vs.vs_off = *voffp;
+	return (dmu_recv_stream_func(drc, vnstream_read, &vs, voffp));
+}
+
 struct recvendsyncarg {
 	char *tosnap;
 	uint64_t creation_time;
@@ -1336,6 +2355,12 @@ recv_end_sync(void *arg1, void *arg2, cred_t *cr, dmu_tx_t *tx)
 	dsl_dataset_t *ds = arg1;
 	struct recvendsyncarg *resa = arg2;
 
+	dmu_buf_will_dirty(ds->ds_dbuf, tx);
+	ds->ds_phys->ds_resume_toguid = 0;
+	ds->ds_phys->ds_resume_fromguid = 0;
+	ds->ds_phys->ds_resume_object = 0;
+	ds->ds_phys->ds_resume_offset = 0;
+
 	dsl_dataset_snapshot_sync(ds, resa->tosnap, cr, tx);
 
 	/* set snapshot's creation time and guid */
@@ -1431,3 +2456,28 @@ dmu_recv_end(dmu_recv_cookie_t *drc)
 	else
 		return (dmu_recv_new_end(drc));
 }
+
+/*
+ * Return how far an interrupted resumable receive of tosnap into tofs got,
+ * or ENOENT if there is none.
+ */
+int
+dmu_recv_resume_token(char *tofs, char *tosnap, dmu_resume_token_t *drt)
+{
+	dsl_dataset_t *ds, *rds;
+	int err;
+
+	err = recv_resume_hold(tofs, tosnap, FTAG, &ds, &rds);
+	if (err)
+		return (err);
+
+	drt->drt_toguid = rds->ds_phys->ds_resume_toguid;
+	drt->drt_fromguid = rds->ds_phys->ds_resume_fromguid;
+	drt->drt_object = rds->ds_phys->ds_resume_object;
+	drt->drt_offset = rds->ds_phys->ds_resume_offset;
+
+	if (rds != ds)
+		dsl_dataset_rele(rds, FTAG);
+	dsl_dataset_rele(ds, FTAG);
+	return (0);
+}
@@ -35,6 +35,15 @@
 #include <sys/dmu_impl.h>
 #include <sys/callb.h>
 
+/*
+ * Maximum number of blocks the prefetch thread may read ahead of the
+ * traversal, and the number of threads and outstanding dnode block tasks
+ * used by TRAVERSE_PARALLEL.
+ */
+int zfs_traverse_prefetch_max = 100;
+int zfs_traverse_threads = 16;
+int zfs_traverse_tasks_max = 64;
+
 struct prefetch_data {
 	kmutex_t pd_mtx;
 	kcondvar_t pd_cv;
@@ -50,14 +59,45 @@ struct traverse_data {
 	uint64_t td_objset;
 	blkptr_t *td_rootbp;
 	uint64_t td_min_txg;
+	const zbookmark_t *td_resume;
 	int td_flags;
 	struct prefetch_data *td_pfd;
 	blkptr_cb_t *td_func;
 	void *td_arg;
+	taskq_t *td_tq;
+	struct traverse_par *td_par;
+};
+
+/*
+ * State shared by the tasks of a TRAVERSE_PARALLEL traversal.  Tasks are
+ * numbered in the order they are handed out; tp_done counts the ones that
+ * are finished, which with TRAVERSE_ORDERED are the first tp_done ones.
+ */
+struct traverse_par {
+	kmutex_t tp_mtx;
+	kcondvar_t tp_cv;
+	int tp_tasks;
+	int tp_err;
+	uint64_t tp_seq;
+	uint64_t tp_done;
+	int tp_flags;
+	blkptr_cb_t *tp_func;
+	void *tp_arg;
+};
+
+struct traverse_task {
+	struct traverse_data tt_td;
+	blkptr_t tt_bp;
+	zbookmark_t tt_zb;
+	uint64_t tt_seq;
 };
 
 static int traverse_dnode(struct traverse_data *td, const dnode_phys_t *dnp,
     arc_buf_t *buf, uint64_t objset, uint64_t object);
+static int traverse_dnode_block(struct traverse_data *td, arc_buf_t *pbuf,
+    const blkptr_t *bp, const zbookmark_t *zb);
+static int traverse_dispatch(struct traverse_data *td, const blkptr_t *bp,
+    const zbookmark_t *zb);
 
 /* ARGSUSED */
 static int
@@ -127,6 +167,39 @@ traverse_zil(struct traverse_data *td, zil_header_t *zh)
 	zil_free(zilog);
 }
 
+/*
+ * Returns B_TRUE if everything below the block at zb is visited before
+ * the level 0 block named by the resume bookmark, so it can be skipped.
+ * Blocks of the meta-dnode are only skipped if all of their dnodes come
+ * before the resume object.
+ */
+static boolean_t
+traverse_before_resume(struct traverse_data *td, const dnode_phys_t *dnp,
+    const zbookmark_t *zb)
+{
+	const zbookmark_t *rzb = td->td_resume;
+	uint64_t shift, end, epb;
+
+	if (rzb == NULL || dnp == NULL || zb->zb_level < 0)
+		return (B_FALSE);
+
+	if (zb->zb_object != DMU_META_DNODE_OBJECT &&
+	    zb->zb_object != rzb->zb_object)
+		return (zb->zb_object < rzb->zb_object);
+
+	shift = zb->zb_level * (dnp->dn_indblkshift - SPA_BLKPTRSHIFT);
+	if (shift >= 64 || zb->zb_blkid + 1 > (UINT64_MAX >> shift))
+		return (B_FALSE);
+	end = (zb->zb_blkid + 1) << shift;
+
+	if (zb->zb_object != DMU_META_DNODE_OBJECT)
+		return (end <= rzb->zb_blkid);
+
+	epb = ((uint64_t)dnp->dn_datablkszsec << SPA_MINBLOCKSHIFT) >>
+	    DNODE_SHIFT;
+	return (end <= rzb->zb_object / epb);
+}
+
 static int
 traverse_visitbp(struct traverse_data *td, const dnode_phys_t *dnp,
     arc_buf_t *pbuf, blkptr_t *bp, const zbookmark_t *zb)
@@ -137,6 +210,9 @@ traverse_visitbp(struct traverse_data *td, const dnode_phys_t *dnp,
 	struct prefetch_data *pd = td->td_pfd;
 	boolean_t hard = td->td_flags & TRAVERSE_HARD;
 
+	if (traverse_before_resume(td, dnp, zb))
+		return (0);
+
 	if (bp->blk_birth == 0) {
 		err = td->td_func(td->td_spa, NULL, NULL, zb, dnp, td->td_arg);
 		return (err);
@@ -189,27 +265,10 @@ traverse_visitbp(struct traverse_data *td, const dnode_phys_t *dnp,
 			}
 		}
 	} else if (BP_GET_TYPE(bp) == DMU_OT_DNODE) {
-		uint32_t flags = ARC_WAIT;
-		int i;
-		int epb = BP_GET_LSIZE(bp) >> DNODE_SHIFT;
-
-		err = arc_read(NULL, td->td_spa, bp, pbuf,
-		    arc_getbuf_func, &buf,
-		    ZIO_PRIORITY_ASYNC_READ, ZIO_FLAG_CANFAIL, &flags, zb);
-		if (err)
-			return (err);
-
-		/* recursively visitbp() blocks below this */
-		dnp = buf->b_data;
-		for (i = 0; i < epb; i++, dnp++) {
-			err = traverse_dnode(td, dnp, buf, zb->zb_objset,
-			    zb->zb_blkid * epb + i);
-			if (err) {
-				if (!hard)
-					break;
-				lasterr = err;
-			}
-		}
+		if (td->td_tq != NULL)
+			err = traverse_dispatch(td, bp, zb);
+		else
+			err = traverse_dnode_block(td, pbuf, bp, zb);
 	} else if (BP_GET_TYPE(bp) == DMU_OT_OBJSET) {
 		uint32_t flags = ARC_WAIT;
 		objset_phys_t *osp;
@@ -277,6 +336,181 @@ traverse_dnode(struct traverse_data *td, const dnode_phys_t *dnp,
 	return (err != 0 ? err : lasterr);
 }
 
+/*
+ * Read a block of dnodes and visit each of them.  pbuf is the buffer
+ * holding bp, or NULL if bp is a private copy.
+ */
+static int
+traverse_dnode_block(struct traverse_data *td, arc_buf_t *pbuf,
+    const blkptr_t *bp, const zbookmark_t *zb)
+{
+	uint32_t flags = ARC_WAIT;
+	int i, err, lasterr = 0;
+	int epb = BP_GET_LSIZE(bp) >> DNODE_SHIFT;
+	arc_buf_t *buf = NULL;
+	dnode_phys_t *dnp;
+	boolean_t hard = (td->td_flags & TRAVERSE_HARD);
+
+	if (pbuf != NULL) {
+		err = arc_read(NULL, td->td_spa, bp, pbuf,
+		    arc_getbuf_func, &buf,
+		    ZIO_PRIORITY_ASYNC_READ, ZIO_FLAG_CANFAIL, &flags, zb);
+	} else {
+		err = arc_read_nolock(NULL, td->td_spa, bp,
+		    arc_getbuf_func, &buf,
+		    ZIO_PRIORITY_ASYNC_READ, ZIO_FLAG_CANFAIL, &flags, zb);
+	}
+	if (err)
+		return (err);
+
+	/* recursively visitbp() blocks below this */
+	dnp = buf->b_data;
+	for (i = 0; i < epb; i++, dnp++) {
+		err = traverse_dnode(td, dnp, buf, zb->zb_objset,
+		    zb->zb_blkid * epb + i);
+		if (err) {
+			if (!hard)
+				break;
+			lasterr = err;
+		}
+	}
+
+	(void) arc_buf_remove_ref(buf, &buf);
+
+	return (err != 0 ? err : lasterr);
+}
+
+/* ARGSUSED */
+static int
+traverse_warm_cb(spa_t *spa, zilog_t *zilog, const blkptr_t *bp,
+    const zbookmark_t *zb, const dnode_phys_t *dnp, void *arg)
+{
+	return (0);
+}
+
+/*
+ * Walk a block of dnodes without calling back, only to bring it and the
+ * indirect blocks below it into the ARC.  Errors are left for the real
+ * walk to report.
+ */
+static void
+traverse_warm(const struct traverse_data *td, const blkptr_t *bp,
+    const zbookmark_t *zb)
+{
+	struct traverse_data wtd = *td;
+
+	wtd.td_func = traverse_warm_cb;
+	wtd.td_arg = NULL;
+	wtd.td_pfd = NULL;
+	wtd.td_flags = TRAVERSE_HARD;
+	(void) traverse_dnode_block(&wtd, NULL, bp, zb);
+}
+
+/*
+ * The callback for the blocks a TRAVERSE_ORDERED traversal visits itself
+ * rather than from a task: the blocks of dnodes handed out before them
+ * must be done first.
+ */
+static int
+traverse_ordered_cb(spa_t *spa, zilog_t *zilog, const blkptr_t *bp,
+    const zbookmark_t *zb, const dnode_phys_t *dnp, void *arg)
+{
+	struct traverse_par *tp = arg;
+	int err = 0;
+
+	mutex_enter(&tp->tp_mtx);
+	while (tp->tp_done != tp->tp_seq)
+		cv_wait(&tp->tp_cv, &tp->tp_mtx);
+	if (!(tp->tp_flags & TRAVERSE_HARD))
+		err = tp->tp_err;
+	mutex_exit(&tp->tp_mtx);
+	if (err)
+		return (err);
+
+	return (tp->tp_func(spa, zilog, bp, zb, dnp, tp->tp_arg));
+}
+
+static void
+traverse_task(void *arg)
+{
+	struct traverse_task *tt = arg;
+	struct traverse_data *td = &tt->tt_td;
+	struct traverse_par *tp = td->td_par;
+	boolean_t hard = (td->td_flags & TRAVERSE_HARD);
+	boolean_t ordered = (td->td_flags & TRAVERSE_ORDERED);
+	int err = 0;
+
+	/*
+	 * In order, do the reading while the blocks handed out before are
+	 * being visited, then wait for them to be done.
+	 */
+	if (ordered)
+		traverse_warm(td, &tt->tt_bp, &tt->tt_zb);
+
+	mutex_enter(&tp->tp_mtx);
+	while (ordered && tp->tp_done != tt->tt_seq)
+		cv_wait(&tp->tp_cv, &tp->tp_mtx);
+	if (tp->tp_err != 0 && !hard)
+		err = tp->tp_err;
+	mutex_exit(&tp->tp_mtx);
+
+	if (err == 0)
+		err = traverse_dnode_block(td, NULL, &tt->tt_bp, &tt->tt_zb);
+
+	mutex_enter(&tp->tp_mtx);
+	if (err != 0 && tp->tp_err == 0)
+		tp->tp_err = err;
+	tp->tp_tasks--;
+	tp->tp_done++;
+	cv_broadcast(&tp->tp_cv);
+	mutex_exit(&tp->tp_mtx);
+
+	kmem_free(tt, sizeof (struct traverse_task));
+}
+
+/*
+ * Hand a block of dnodes to the traversal taskq, waiting while
+ * zfs_traverse_tasks_max blocks are already outstanding.  The block
+ * pointer is copied since its parent buffer may be released before the
+ * task runs.  If the taskq cannot take it, the block is visited inline.
+ */
+static int
+traverse_dispatch(struct traverse_data *td, const blkptr_t *bp,
+    const zbookmark_t *zb)
+{
+	struct traverse_par *tp = td->td_par;
+	struct traverse_task *tt;
+	uint64_t seq;
+	int err;
+
+	mutex_enter(&tp->tp_mtx);
+	while (tp->tp_tasks >= zfs_traverse_tasks_max &&
+	    (tp->tp_err == 0 || (td->td_flags & TRAVERSE_HARD)))
+		cv_wait(&tp->tp_cv, &tp->tp_mtx);
+	err = (td->td_flags & TRAVERSE_HARD) ? 0 : tp->tp_err;
+	if (err == 0) {
+		tp->tp_tasks++;
+		seq = tp->tp_seq++;
+	}
+	mutex_exit(&tp->tp_mtx);
+	if (err)
+		return (err);
+
+	tt = kmem_alloc(sizeof (struct traverse_task), KM_SLEEP);
+	tt->tt_td = *td;
+	tt->tt_td.td_tq = NULL;
+	tt->tt_td.td_func = tp->tp_func;
+	tt->tt_td.td_arg = tp->tp_arg;
+	tt->tt_bp = *bp;
+	tt->tt_zb = *zb;
+	tt->tt_seq = seq;
+
+	if (taskq_dispatch(td->td_tq, traverse_task, tt, TQ_SLEEP) == 0)
+		traverse_task(tt);
+
+	return (0);
+}
+
 /* ARGSUSED */
 static int
 traverse_prefetcher(spa_t *spa, zilog_t *zilog, const blkptr_t *bp,
@@ -319,6 +553,7 @@ traverse_prefetch_thread(void *arg)
 	td.td_func = traverse_prefetcher;
 	td.td_arg = td_main->td_pfd;
 	td.td_pfd = NULL;
+	td.td_tq = NULL;
 
 	SET_BOOKMARK(&czb, td.td_objset,
 	    ZB_ROOT_OBJECT, ZB_ROOT_LEVEL, ZB_ROOT_BLKID);
@@ -330,33 +565,66 @@ traverse_prefetch_thread(void *arg)
 	mutex_exit(&td_main->td_pfd->pd_mtx);
 }
 
+static taskq_t *
+traverse_taskq_create(void)
+{
+	return (taskq_create("traverse_taskq", zfs_traverse_threads,
+	    minclsyspri, zfs_traverse_threads, INT_MAX, TASKQ_PREPOPULATE));
+}
+
 /*
  * NB: dataset must not be changing on-disk (eg, is a snapshot or we are
- * in syncing context).
+ * in syncing context).  A TRAVERSE_PARALLEL traversal uses tq, or a taskq
+ * of its own if it is NULL.
  */
 static int
 traverse_impl(spa_t *spa, uint64_t objset, blkptr_t *rootbp,
-    uint64_t txg_start, int flags, blkptr_cb_t func, void *arg)
+    uint64_t txg_start, const zbookmark_t *resume, int flags, taskq_t *tq,
+    blkptr_cb_t func, void *arg)
 {
 	struct traverse_data td;
 	struct prefetch_data pd = { 0 };
+	struct traverse_par tp = { 0 };
+	taskq_t *owntq = NULL;
 	zbookmark_t czb;
 	int err;
 
+	/* a block's children may still be in flight when it is visited */
+	ASSERT(!(flags & TRAVERSE_PARALLEL) || !(flags & TRAVERSE_POST));
+	ASSERT(!(flags & TRAVERSE_ORDERED) || (flags & TRAVERSE_PARALLEL));
+
 	td.td_spa = spa;
 	td.td_objset = objset;
 	td.td_rootbp = rootbp;
 	td.td_min_txg = txg_start;
+	td.td_resume = resume;
 	td.td_func = func;
 	td.td_arg = arg;
 	td.td_pfd = &pd;
 	td.td_flags = flags;
+	td.td_tq = NULL;
+	td.td_par = &tp;
 
-	pd.pd_blks_max = 100;
+	pd.pd_blks_max = zfs_traverse_prefetch_max;
 	pd.pd_flags = flags;
 	mutex_init(&pd.pd_mtx, NULL, MUTEX_DEFAULT, NULL);
 	cv_init(&pd.pd_cv, NULL, CV_DEFAULT, NULL);
 
+	if (flags & TRAVERSE_PARALLEL) {
+		mutex_init(&tp.tp_mtx, NULL, MUTEX_DEFAULT, NULL);
+		cv_init(&tp.tp_cv, NULL, CV_DEFAULT, NULL);
+		tp.tp_flags = flags;
+		tp.tp_func = func;
+		tp.tp_arg = arg;
+		if (tq == NULL)
+			tq = owntq = traverse_taskq_create();
+		td.td_tq = tq;
+		if (flags & TRAVERSE_ORDERED) {
+			td.td_func = traverse_ordered_cb;
+			td.td_arg = &tp;
+		}
+	}
+
 	if (!(flags & TRAVERSE_PREFETCH) ||
 	    0 == taskq_dispatch(system_taskq, traverse_prefetch_thread,
 	    &td, TQ_NOQUEUE))
@@ -366,6 +634,19 @@ traverse_impl(spa_t *spa, uint64_t objset, blkptr_t *rootbp,
 	    ZB_ROOT_OBJECT, ZB_ROOT_LEVEL, ZB_ROOT_BLKID);
 	err = traverse_visitbp(&td, NULL, NULL, rootbp, &czb);
 
+	if (td.td_tq != NULL) {
+		mutex_enter(&tp.tp_mtx);
+		while (tp.tp_tasks != 0)
+			cv_wait(&tp.tp_cv, &tp.tp_mtx);
+		mutex_exit(&tp.tp_mtx);
+		if (owntq != NULL)
+			taskq_destroy(owntq);
+		if (err == 0)
+			err = tp.tp_err;
+		mutex_destroy(&tp.tp_mtx);
+		cv_destroy(&tp.tp_cv);
+	}
+
 	mutex_enter(&pd.pd_mtx);
 	pd.pd_cancel = B_TRUE;
 	cv_broadcast(&pd.pd_cv);
@@ -388,14 +669,26 @@ traverse_dataset(dsl_dataset_t *ds, uint64_t txg_start, int flags,
     blkptr_cb_t func, void *arg)
 {
 	return (traverse_impl(ds->ds_dir->dd_pool->dp_spa, ds->ds_object,
-	    &ds->ds_phys->ds_bp, txg_start, flags, func, arg));
+	    &ds->ds_phys->ds_bp, txg_start, NULL, flags, NULL, func, arg));
 }
 
 /*
- * NB: pool must not be changing on-disk (eg, from zdb or sync context).
+ * Like traverse_dataset(), but skip the blocks that come before the level
+ * 0 block named by resume, as if an earlier traversal had been stopped
+ * there.
  */
 int
-traverse_pool(spa_t *spa, uint64_t txg_start, int flags,
+traverse_dataset_resume(dsl_dataset_t *ds, uint64_t txg_start,
+    const zbookmark_t *resume, int flags, blkptr_cb_t func, void *arg)
+{
+	ASSERT3U(resume->zb_level, ==, 0);
+
+	return (traverse_impl(ds->ds_dir->dd_pool->dp_spa, ds->ds_object,
+	    &ds->ds_phys->ds_bp, txg_start, resume, flags, NULL, func, arg));
+}
+
+static int
+traverse_pool_impl(spa_t *spa, uint64_t txg_start, int flags, taskq_t *tq,
     blkptr_cb_t func, void *arg)
 {
 	int err, lasterr = 0;
@@ -406,7 +699,7 @@ traverse_pool(spa_t *spa, uint64_t txg_start, int flags,
 
 	/* visit the MOS */
 	err = traverse_impl(spa, 0, spa_get_rootblkptr(spa),
-	    txg_start, flags, func, arg);
+	    txg_start, NULL, flags, tq, func, arg);
 	if (err)
 		return (err);
 
@@ -438,7 +731,9 @@ traverse_pool(spa_t *spa, uint64_t txg_start, int flags,
 			}
 			if (ds->ds_phys->ds_prev_snap_txg > txg)
 				txg = ds->ds_phys->ds_prev_snap_txg;
-			err = traverse_dataset(ds, txg, flags, func, arg);
+			err = traverse_impl(spa, ds->ds_object,
+			    &ds->ds_phys->ds_bp, txg, NULL, flags, tq,
+			    func, arg);
 			dsl_dataset_rele(ds, FTAG);
 			if (err) {
 				if (!hard)
@@ -451,3 +746,22 @@ traverse_pool(spa_t *spa, uint64_t txg_start, int flags,
 		err = 0;
 	return (err != 0 ? err : lasterr);
 }
+
+/*
+ * NB: pool must not be changing on-disk (eg, from zdb or sync context).
+ */
+int
+traverse_pool(spa_t *spa, uint64_t txg_start, int flags,
+    blkptr_cb_t func, void *arg)
+{
+	taskq_t *tq = NULL;
+	int err;
+
+	/* the MOS and all the datasets share one taskq */
+	if (flags & TRAVERSE_PARALLEL)
+		tq = traverse_taskq_create();
+	err = traverse_pool_impl(spa, txg_start, flags, tq, func, arg);
+	if (tq != NULL)
+		taskq_destroy(tq);
+	return (err);
+}
@@ -49,6 +49,8 @@ static scrub_cb_t dsl_pool_scrub_clean_cb;
 static dsl_syncfunc_t dsl_pool_scrub_cancel_sync;
 static void scrub_visitdnode(dsl_pool_t *dp, dnode_phys_t *dnp, arc_buf_t *buf,
     uint64_t objset, uint64_t object);
+static void dsl_pool_scrub_clean_issue(dsl_pool_t *dp, const blkptr_t *bp,
+    const zbookmark_t *zb);
 
 int zfs_scrub_min_time_ms = 1000; /* min millisecs to scrub per txg */
 int zfs_resilver_min_time_ms = 3000; /* min millisecs to resilver per txg */
@@ -56,6 +58,31 @@ boolean_t zfs_no_scrub_io = B_FALSE; /* set to disable scrub i/o */
 boolean_t zfs_no_scrub_prefetch = B_FALSE; /* set to disable srub prefetching */
 enum ddt_class zfs_scrub_ddt_class_max = DDT_CLASS_DUPLICATE;
 
+/*
+ * Sorted scrub.  Reading blocks in the order the traversal finds them
+ * makes the scrub i/o random.  Instead, the traversal only queues the
+ * blocks, per top-level vdev and sorted by offset, and the queues are
+ * issued in order once zfs_scrub_queue_max bytes of i/o or
+ * zfs_scrub_queue_mem_max bytes of queue entries have piled up, after
+ * which the traversal carries on.  Whatever is left is issued when the
+ * traversal pauses.  That takes time too, so the time slice is considered
+ * over once the time spent plus the time the queues should take to drain,
+ * at the rate they last drained, is over.  Nothing stays queued across
+ * txgs, so the bookmark saved when pausing still covers everything that
+ * has been issued.
+ */
+boolean_t zfs_scrub_sorted = B_TRUE;
+uint64_t zfs_scrub_queue_max = 256ULL << 20;
+uint64_t zfs_scrub_queue_mem_max = 64ULL << 20;
+uint64_t zfs_scrub_issue_chunk = 1ULL << 20;	/* per vdev turn */
+
+typedef struct scrub_qentry {
+	avl_node_t	sqe_node;
+	uint64_t	sqe_offset;	/* of the first DVA */
+	blkptr_t	sqe_bp;
+	zbookmark_t	sqe_zb;
+} scrub_qentry_t;
+
 extern int zfs_txg_timeout;
 
 static scrub_cb_t *scrub_funcs[SCRUB_FUNC_NUMFUNCS] = {
@@ -320,6 +347,8 @@ bookmark_is_before(dnode_phys_t *dnp, const zbookmark_t *zb1,
 	return (zb1nextL0 <= zb2->zb_blkid);
 }
 
+static void scrub_queues_issue(dsl_pool_t *dp);
+
 static boolean_t
 scrub_pause(dsl_pool_t *dp, const zbookmark_t *zb, const ddt_bookmark_t *ddb)
 {
@@ -336,9 +365,17 @@ scrub_pause(dsl_pool_t *dp, const zbookmark_t *zb, const ddt_bookmark_t *ddb)
 	if (zb != NULL && zb->zb_level != 0)
 		return (B_FALSE);
 
+	if (dp->dp_scrub_queued >= zfs_scrub_queue_max ||
+	    dp->dp_scrub_queued_mem >= zfs_scrub_queue_mem_max)
+		scrub_queues_issue(dp);
+
 	mintime = dp->dp_scrub_isresilver ? zfs_resilver_min_time_ms :
 	    zfs_scrub_min_time_ms;
 	elapsed_nanosecs = gethrtime() - dp->dp_scrub_start_time;
+	if (dp->dp_scrub_issue_rate != 0) {
+		elapsed_nanosecs += dp->dp_scrub_queued * NANOSEC /
+		    dp->dp_scrub_issue_rate;
+	}
 	if (elapsed_nanosecs / NANOSEC > zfs_txg_timeout ||
 	    (elapsed_nanosecs / MICROSEC > mintime && txg_sync_waiting(dp))) {
 		if (zb) {
@@ -455,7 +492,7 @@ scrub_prefetch(dsl_pool_t *dp, arc_buf_t *buf, blkptr_t *bp, uint64_t objset,
     uint64_t object, uint64_t blkid)
 {
 	zbookmark_t czb;
-	uint32_t flags = ARC_NOWAIT | ARC_PREFETCH;
+	uint32_t flags = ARC_NOWAIT | ARC_PREFETCH | ARC_LOWPRI;
 
 	if (zfs_no_scrub_prefetch)
 		return;
@@ -517,7 +554,7 @@ scrub_visitbp(dsl_pool_t *dp, dnode_phys_t *dnp,
 		(void) scrub_funcs[dp->dp_scrub_func](dp, bp, zb);
 
 	if (BP_GET_LEVEL(bp) > 0) {
-		uint32_t flags = ARC_WAIT;
+		uint32_t flags = ARC_WAIT | ARC_LOWPRI;
 		int i;
 		blkptr_t *cbp;
 		int epb = BP_GET_LSIZE(bp) >> SPA_BLKPTRSHIFT;
@@ -544,7 +581,7 @@ scrub_visitbp(dsl_pool_t *dp, dnode_phys_t *dnp,
 			scrub_visitbp(dp, dnp, buf, cbp, &czb);
 		}
 	} else if (BP_GET_TYPE(bp) == DMU_OT_DNODE) {
-		uint32_t flags = ARC_WAIT;
+		uint32_t flags = ARC_WAIT | ARC_LOWPRI;
 		dnode_phys_t *cdnp;
 		int i, j;
 		int epb = BP_GET_LSIZE(bp) >> DNODE_SHIFT;
@@ -570,7 +607,7 @@ scrub_visitbp(dsl_pool_t *dp, dnode_phys_t *dnp,
 			    zb->zb_blkid * epb + i);
 		}
 	} else if (BP_GET_TYPE(bp) == DMU_OT_OBJSET) {
-		uint32_t flags = ARC_WAIT;
+		uint32_t flags = ARC_WAIT | ARC_LOWPRI;
 		objset_phys_t *osp;
 
 		err = arc_read_nolock(NULL, dp->dp_spa, bp,
@@ -909,6 +946,128 @@ dsl_pool_scrub_ddt_entry(dsl_pool_t *dp, enum zio_checksum checksum,
 	}
 }
 
+static int
+scrub_qentry_compare(const void *x1, const void *x2)
+{
+	const scrub_qentry_t *sqe1 = x1;
+	const scrub_qentry_t *sqe2 = x2;
+
+	if (sqe1->sqe_offset < sqe2->sqe_offset)
+		return (-1);
+	if (sqe1->sqe_offset > sqe2->sqe_offset)
+		return (1);
+
+	/* The same block can be reached twice, e.g. through the DDT */
+	if (sqe1 < sqe2)
+		return (-1);
+	if (sqe1 > sqe2)
+		return (1);
+
+	return (0);
+}
+
+static void
+scrub_queues_init(dsl_pool_t *dp)
+{
+	int q;
+
+	ASSERT(dp->dp_scrub_queues == NULL);
+
+	if (!zfs_scrub_sorted || zfs_no_scrub_io)
+		return;
+
+	dp->dp_scrub_nqueues = dp->dp_spa->spa_root_vdev->vdev_children;
+	dp->dp_scrub_queues = kmem_alloc(dp->dp_scrub_nqueues *
+	    sizeof (avl_tree_t), KM_SLEEP);
+	for (q = 0; q < dp->dp_scrub_nqueues; q++) {
+		avl_create(&dp->dp_scrub_queues[q], scrub_qentry_compare,
+		    sizeof (scrub_qentry_t),
+		    offsetof(scrub_qentry_t, sqe_node));
+	}
+	dp->dp_scrub_queued = 0;
+	dp->dp_scrub_queued_mem = 0;
+}
+
+static void
+scrub_enqueue(dsl_pool_t *dp, const blkptr_t *bp, const zbookmark_t *zb)
+{
+	scrub_qentry_t *sqe;
+
+	sqe = kmem_alloc(sizeof (scrub_qentry_t), KM_SLEEP);
+	sqe->sqe_offset = DVA_GET_OFFSET(&bp->blk_dva[0]);
+	sqe->sqe_bp = *bp;
+	sqe->sqe_zb = *zb;
+	avl_add(&dp->dp_scrub_queues[DVA_GET_VDEV(&bp->blk_dva[0])], sqe);
+
+	dp->dp_scrub_queued += BP_GET_PSIZE(bp);
+	dp->dp_scrub_queued_mem += sizeof (scrub_qentry_t);
+}
+
+/*
+ * Issue everything the traversal queued.  Each vdev's queue is read in
+ * offset order; the vdevs take turns, issuing zfs_scrub_issue_chunk bytes
+ * each time, so that they all stay busy.  Adjacent blocks are merged into
+ * large reads by the vdev queue.  Issuing waits for the scrub i/o in
+ * flight to get under its limit, so the time it takes tells how fast the
+ * disks get through the queues.
+ */
+static void
+scrub_queues_issue(dsl_pool_t *dp)
+{
+	scrub_qentry_t *sqe;
+	avl_tree_t *avl;
+	uint64_t issued;
+	hrtime_t start, t;
+	boolean_t more;
+	int q;
+
+	if (dp->dp_scrub_queues == NULL || dp->dp_scrub_queued == 0)
+		return;
+
+	start = gethrtime();
+	do {
+		more = B_FALSE;
+		for (q = 0; q < dp->dp_scrub_nqueues; q++) {
+			avl = &dp->dp_scrub_queues[q];
+			for (issued = 0; issued < zfs_scrub_issue_chunk &&
+			    (sqe = avl_first(avl)) != NULL; ) {
+				avl_remove(avl, sqe);
+				issued += BP_GET_PSIZE(&sqe->sqe_bp);
+				dsl_pool_scrub_clean_issue(dp, &sqe->sqe_bp,
+				    &sqe->sqe_zb);
+				kmem_free(sqe, sizeof (scrub_qentry_t));
+			}
+			if (avl_numnodes(avl) != 0)
+				more = B_TRUE;
+		}
+	} while (more);
+
+	if ((t = gethrtime() - start) > 0)
+		dp->dp_scrub_issue_rate = dp->dp_scrub_queued * NANOSEC / t;
+	dp->dp_scrub_queued = 0;
+	dp->dp_scrub_queued_mem = 0;
+}
+
+/*
+ * Issue what is left in the queues, and tear them down.
+ */
+static void
+scrub_queues_fini(dsl_pool_t *dp)
+{
+	int q;
+
+	if (dp->dp_scrub_queues == NULL)
+		return;
+
+	scrub_queues_issue(dp);
+	for (q = 0; q < dp->dp_scrub_nqueues; q++)
+		avl_destroy(&dp->dp_scrub_queues[q]);
+	kmem_free(dp->dp_scrub_queues,
+	    dp->dp_scrub_nqueues * sizeof (avl_tree_t));
+	dp->dp_scrub_queues = NULL;
+	dp->dp_scrub_nqueues = 0;
+}
+
 void
 dsl_pool_scrub_sync(dsl_pool_t *dp, dmu_tx_t *tx)
 {
@@ -947,6 +1106,7 @@ dsl_pool_scrub_sync(dsl_pool_t *dp, dmu_tx_t *tx)
 	dp->dp_scrub_start_time = gethrtime();
 	dp->dp_scrub_isresilver = (dp->dp_scrub_min_txg != 0);
 	spa->spa_scrub_active = B_TRUE;
+	scrub_queues_init(dp);
 
 	if (dp->dp_scrub_ddt_bookmark.ddb_class <= dp->dp_scrub_ddt_class_max) {
 		dsl_pool_scrub_ddt(dp);
@@ -1001,9 +1161,11 @@ dsl_pool_scrub_sync(dsl_pool_t *dp, dmu_tx_t *tx)
 
 	/* done. */
 
+	scrub_queues_fini(dp);
 	dsl_pool_scrub_cancel_sync(dp, &complete, kcred, tx);
 	return;
 out:
+	scrub_queues_fini(dp);
 	VERIFY(0 == zap_update(dp->dp_meta_objset, DMU_POOL_DIRECTORY_OBJECT,
 	    DMU_POOL_SCRUB_BOOKMARK, sizeof (uint64_t),
 	    sizeof (dp->dp_scrub_bookmark) / sizeof (uint64_t),
@@ -1095,39 +1257,58 @@ dsl_pool_scrub_clean_done(zio_t *zio)
 	mutex_exit(&spa->spa_scrub_lock);
 }
 
-static int
-dsl_pool_scrub_clean_cb(dsl_pool_t *dp,
+static void
+dsl_pool_scrub_clean_issue(dsl_pool_t *dp,
     const blkptr_t *bp, const zbookmark_t *zb)
 {
 	size_t size = BP_GET_PSIZE(bp);
 	spa_t *spa = dp->dp_spa;
-	uint64_t phys_birth = BP_PHYSICAL_BIRTH(bp);
-	boolean_t needs_io;
 	int zio_flags = ZIO_FLAG_SCRUB_THREAD | ZIO_FLAG_RAW | ZIO_FLAG_CANFAIL;
 	int zio_priority;
-
-	if (phys_birth <= dp->dp_scrub_min_txg ||
-	    phys_birth >= dp->dp_scrub_max_txg)
-		return (0);
-
-	count_block(dp->dp_blkstats, bp);
+	void *data;
 
 	if (dp->dp_scrub_isresilver == 0) {
-		/* It's a scrub */
 		zio_flags |= ZIO_FLAG_SCRUB;
 		zio_priority = ZIO_PRIORITY_SCRUB;
-		needs_io = B_TRUE;
 	} else {
-		/* It's a resilver */
 		zio_flags |= ZIO_FLAG_RESILVER;
 		zio_priority = ZIO_PRIORITY_RESILVER;
-		needs_io = B_FALSE;
 	}
 
 	/* If it's an intent log block, failure is expected. */
 	if (zb->zb_level == ZB_ZIL_LEVEL)
 		zio_flags |= ZIO_FLAG_SPECULATIVE;
 
+	data = zio_data_buf_alloc(size);
+
+	mutex_enter(&spa->spa_scrub_lock);
+	while (spa->spa_scrub_inflight >= spa->spa_scrub_maxinflight)
+		cv_wait(&spa->spa_scrub_io_cv, &spa->spa_scrub_lock);
+	spa->spa_scrub_inflight++;
+	mutex_exit(&spa->spa_scrub_lock);
+
+	zio_nowait(zio_read(NULL, spa, bp, data, size,
+	    dsl_pool_scrub_clean_done, NULL, zio_priority,
+	    zio_flags, zb));
+}
+
+static int
+dsl_pool_scrub_clean_cb(dsl_pool_t *dp,
+    const blkptr_t *bp, const zbookmark_t *zb)
+{
+	spa_t *spa = dp->dp_spa;
+	uint64_t phys_birth = BP_PHYSICAL_BIRTH(bp);
+	boolean_t needs_io;
+
+	if (phys_birth <= dp->dp_scrub_min_txg ||
+	    phys_birth >= dp->dp_scrub_max_txg)
+		return (0);
+
+	count_block(dp->dp_blkstats, bp);
+
+	/* A scrub reads everything, a resilver only what is missing */
+	needs_io = (dp->dp_scrub_isresilver == 0);
+
 	for (int d = 0; d < BP_GET_NDVAS(bp); d++) {
 		vdev_t *vd = vdev_lookup_top(spa,
 		    DVA_GET_VDEV(&bp->blk_dva[d]));
@@ -1161,17 +1342,11 @@ dsl_pool_scrub_clean_cb(dsl_pool_t *dp,
 	}
 
 	if (needs_io && !zfs_no_scrub_io) {
-		void *data = zio_data_buf_alloc(size);
-
-		mutex_enter(&spa->spa_scrub_lock);
-		while (spa->spa_scrub_inflight >= spa->spa_scrub_maxinflight)
-			cv_wait(&spa->spa_scrub_io_cv, &spa->spa_scrub_lock);
-		spa->spa_scrub_inflight++;
-		mutex_exit(&spa->spa_scrub_lock);
-
-		zio_nowait(zio_read(NULL, spa, bp, data, size,
-		    dsl_pool_scrub_clean_done, NULL, zio_priority,
-		    zio_flags, zb));
+		if (dp->dp_scrub_queues != NULL &&
+		    DVA_GET_VDEV(&bp->blk_dva[0]) < dp->dp_scrub_nqueues)
+			scrub_enqueue(dp, bp, zb);
+		else
+			dsl_pool_scrub_clean_issue(dp, bp, zb);
 	}
 
 	/* do not relocate this block */
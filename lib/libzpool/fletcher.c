@@ -125,10 +125,16 @@
  * than sha-256, and slower than 'off', which doesn't touch the data at all.
  */
 
-#include <sys/types.h>
+#include <sys/zfs_context.h>
 #include <sys/sysmacros.h>
 #include <sys/byteorder.h>
 #include <sys/spa.h>
+#include <zfs_fletcher.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define	FLETCHER_4_HAVE_X86
+#endif
 
 void
 fletcher_2_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
@@ -164,8 +170,8 @@ fletcher_2_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
 	ZIO_SET_CHECKSUM(zcp, a0, a1, b0, b1);
 }
 
-void
-fletcher_4_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
+static void
+fletcher_4_scalar_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
 {
 	const uint32_t *ip = buf;
 	const uint32_t *ipend = ip + (size / sizeof (uint32_t));
@@ -181,8 +187,8 @@ fletcher_4_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
 	ZIO_SET_CHECKSUM(zcp, a, b, c, d);
 }
 
-void
-fletcher_4_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
+static void
+fletcher_4_scalar_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
 {
 	const uint32_t *ip = buf;
 	const uint32_t *ipend = ip + (size / sizeof (uint32_t));
@@ -198,8 +204,8 @@ fletcher_4_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
 	ZIO_SET_CHECKSUM(zcp, a, b, c, d);
 }
 
-void
-fletcher_4_incremental_native(const void *buf, uint64_t size,
+static void
+fletcher_4_scalar_incremental_native(const void *buf, uint64_t size,
     zio_cksum_t *zcp)
 {
 	const uint32_t *ip = buf;
@@ -221,8 +227,8 @@ fletcher_4_incremental_native(const void *buf, uint64_t size,
 	ZIO_SET_CHECKSUM(zcp, a, b, c, d);
 }
 
-void
-fletcher_4_incremental_byteswap(const void *buf, uint64_t size,
+static void
+fletcher_4_scalar_incremental_byteswap(const void *buf, uint64_t size,
     zio_cksum_t *zcp)
 {
 	const uint32_t *ip = buf;
@@ -243,3 +249,480 @@ fletcher_4_incremental_byteswap(const void *buf, uint64_t size,
 
 	ZIO_SET_CHECKSUM(zcp, a, b, c, d);
 }
+
+/*
+ * Vectorized fletcher-4
+ * ---------------------
+ *
+ * The SIMD implementations below split the input into N interleaved lanes:
+ * lane j accumulates words j, j + N, j + 2N, ... with the same recurrence
+ * as above, in its own 64-bit [abcd] accumulators.  Working the series
+ * through, the checksum of the whole buffer is the following combination
+ * of the lane accumulators, which only involves integer coefficients and
+ * is therefore exact mod 2^64 as well:
+ *
+ *	a = sum(a_j)
+ *	b = sum(N * b_j - j * a_j)
+ *	c = sum(N^2 * c_j - (N(N-1)/2 + jN) * b_j + j(j-1)/2 * a_j)
+ *	d = sum(N^3 * d_j - (N^2(N-1) + jN^2) * c_j +
+ *	    (N(N-1)(N-2)/6 + jN(N-1)/2 + Nj(j-1)/2) * b_j - j(j-1)(j-2)/6 * a_j)
+ *
+ * The vector code only handles multiples of FLETCHER_4_BLKSZ bytes starting
+ * from a zero state; fletcher_4_native() finishes the tail with the scalar
+ * loop, and the incremental variants fold a chunk checksum into the running
+ * one with fletcher_4_incremental_combine().
+ *
+ * fletcher_4_init() checks every implementation the CPU supports against
+ * the scalar one, then keeps the fastest on a maximum sized block.  Setting
+ * zio_fletcher_4_impl to an implementation name before it runs forces it.
+ */
+#define	FLETCHER_4_BLKSZ	64
+
+typedef void fletcher_4_func_t(const void *, uint64_t, zio_cksum_t *);
+
+typedef struct fletcher_4_ops {
+	const char	*f4_name;
+	fletcher_4_func_t *f4_native;
+	fletcher_4_func_t *f4_byteswap;
+	boolean_t	(*f4_supported)(void);
+} fletcher_4_ops_t;
+
+char *zio_fletcher_4_impl = NULL;
+
+static boolean_t
+fletcher_4_scalar_supported(void)
+{
+	return (B_TRUE);
+}
+
+static void
+fletcher_4_lanes_fini(const uint64_t *a, const uint64_t *b,
+    const uint64_t *c, const uint64_t *d, uint64_t n, zio_cksum_t *zcp)
+{
+	uint64_t A = 0, B = 0, C = 0, D = 0;
+	uint64_t n2 = n * n, n3 = n2 * n;
+	uint64_t j;
+
+	for (j = 0; j < n; j++) {
+		A += a[j];
+		B += n * b[j] - j * a[j];
+		C += n2 * c[j] - (n * (n - 1) / 2 + j * n) * b[j] +
+		    j * (j - 1) / 2 * a[j];
+		D += n3 * d[j] - (n2 * (n - 1) + j * n2) * c[j] +
+		    (n * (n - 1) * (n - 2) / 6 + j * n * (n - 1) / 2 +
+		    n * j * (j - 1) / 2) * b[j] -
+		    j * (j - 1) * (j - 2) / 6 * a[j];
+	}
+
+	ZIO_SET_CHECKSUM(zcp, A, B, C, D);
+}
+
+#ifdef FLETCHER_4_HAVE_X86
+static boolean_t
+fletcher_4_sse2_supported(void)
+{
+	return (__builtin_cpu_supports("sse2") ? B_TRUE : B_FALSE);
+}
+
+static boolean_t
+fletcher_4_ssse3_supported(void)
+{
+	return (__builtin_cpu_supports("ssse3") ? B_TRUE : B_FALSE);
+}
+
+static boolean_t
+fletcher_4_avx2_supported(void)
+{
+	return (__builtin_cpu_supports("avx2") ? B_TRUE : B_FALSE);
+}
+
+static boolean_t
+fletcher_4_avx512f_supported(void)
+{
+	return ((__builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx2")) ? B_TRUE : B_FALSE);
+}
+
+/*
+ * Two lanes: each 16-byte load is widened into words {0, 1} and {2, 3}.
+ * Without pshufb, the byteswap is done as a 16-bit half swap followed by
+ * a byte swap inside each half.
+ */
+__attribute__((target("sse2"), always_inline))
+static inline void
+fletcher_4_sse2_impl(const void *buf, uint64_t size, zio_cksum_t *zcp,
+    boolean_t bswap)
+{
+	const __m128i *ip = buf;
+	const __m128i *ipend = (const __m128i *)((const char *)buf + size);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = zero, b = zero, c = zero, d = zero;
+	__m128i w, lo, hi;
+	uint64_t la[2], lb[2], lc[2], ld[2];
+
+	for (; ip < ipend; ip++) {
+		w = _mm_loadu_si128(ip);
+		if (bswap) {
+			w = _mm_shufflehi_epi16(_mm_shufflelo_epi16(w, 0xB1),
+			    0xB1);
+			w = _mm_or_si128(_mm_slli_epi16(w, 8),
+			    _mm_srli_epi16(w, 8));
+		}
+		lo = _mm_unpacklo_epi32(w, zero);
+		hi = _mm_unpackhi_epi32(w, zero);
+
+		a = _mm_add_epi64(a, lo);
+		b = _mm_add_epi64(b, a);
+		c = _mm_add_epi64(c, b);
+		d = _mm_add_epi64(d, c);
+		a = _mm_add_epi64(a, hi);
+		b = _mm_add_epi64(b, a);
+		c = _mm_add_epi64(c, b);
+		d = _mm_add_epi64(d, c);
+	}
+
+	_mm_storeu_si128((__m128i *)la, a);
+	_mm_storeu_si128((__m128i *)lb, b);
+	_mm_storeu_si128((__m128i *)lc, c);
+	_mm_storeu_si128((__m128i *)ld, d);
+	fletcher_4_lanes_fini(la, lb, lc, ld, 2, zcp);
+}
+
+__attribute__((target("sse2")))
+static void
+fletcher_4_sse2_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	fletcher_4_sse2_impl(buf, size, zcp, B_FALSE);
+}
+
+__attribute__((target("sse2")))
+static void
+fletcher_4_sse2_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	fletcher_4_sse2_impl(buf, size, zcp, B_TRUE);
+}
+
+/*
+ * Same as SSE2 with a single pshufb for the byteswap.
+ */
+__attribute__((target("ssse3")))
+static void
+fletcher_4_ssse3_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	const __m128i *ip = buf;
+	const __m128i *ipend = (const __m128i *)((const char *)buf + size);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+	    0x0405060700010203ULL);
+	__m128i a = zero, b = zero, c = zero, d = zero;
+	__m128i w, lo, hi;
+	uint64_t la[2], lb[2], lc[2], ld[2];
+
+	for (; ip < ipend; ip++) {
+		w = _mm_shuffle_epi8(_mm_loadu_si128(ip), mask);
+		lo = _mm_unpacklo_epi32(w, zero);
+		hi = _mm_unpackhi_epi32(w, zero);
+
+		a = _mm_add_epi64(a, lo);
+		b = _mm_add_epi64(b, a);
+		c = _mm_add_epi64(c, b);
+		d = _mm_add_epi64(d, c);
+		a = _mm_add_epi64(a, hi);
+		b = _mm_add_epi64(b, a);
+		c = _mm_add_epi64(c, b);
+		d = _mm_add_epi64(d, c);
+	}
+
+	_mm_storeu_si128((__m128i *)la, a);
+	_mm_storeu_si128((__m128i *)lb, b);
+	_mm_storeu_si128((__m128i *)lc, c);
+	_mm_storeu_si128((__m128i *)ld, d);
+	fletcher_4_lanes_fini(la, lb, lc, ld, 2, zcp);
+}
+
+/*
+ * Four lanes: each 16-byte load is zero extended into one 256-bit vector.
+ */
+__attribute__((target("avx2"), always_inline))
+static inline void
+fletcher_4_avx2_impl(const void *buf, uint64_t size, zio_cksum_t *zcp,
+    boolean_t bswap)
+{
+	const __m128i *ip = buf;
+	const __m128i *ipend = (const __m128i *)((const char *)buf + size);
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+	    0x0405060700010203ULL);
+	__m256i a, b, c, d, w;
+	__m128i v;
+	uint64_t la[4], lb[4], lc[4], ld[4];
+
+	a = b = c = d = _mm256_setzero_si256();
+	for (; ip < ipend; ip++) {
+		v = _mm_loadu_si128(ip);
+		if (bswap)
+			v = _mm_shuffle_epi8(v, mask);
+		w = _mm256_cvtepu32_epi64(v);
+
+		a = _mm256_add_epi64(a, w);
+		b = _mm256_add_epi64(b, a);
+		c = _mm256_add_epi64(c, b);
+		d = _mm256_add_epi64(d, c);
+	}
+
+	_mm256_storeu_si256((__m256i *)la, a);
+	_mm256_storeu_si256((__m256i *)lb, b);
+	_mm256_storeu_si256((__m256i *)lc, c);
+	_mm256_storeu_si256((__m256i *)ld, d);
+	_mm256_zeroupper();
+	fletcher_4_lanes_fini(la, lb, lc, ld, 4, zcp);
+}
+
+__attribute__((target("avx2")))
+static void
+fletcher_4_avx2_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	fletcher_4_avx2_impl(buf, size, zcp, B_FALSE);
+}
+
+__attribute__((target("avx2")))
+static void
+fletcher_4_avx2_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	fletcher_4_avx2_impl(buf, size, zcp, B_TRUE);
+}
+
+/*
+ * Eight lanes: each 32-byte load is zero extended into one 512-bit vector.
+ * The byteswap is done on the 256-bit load with AVX2, which every AVX-512
+ * capable CPU has, so AVX-512BW is not needed.
+ */
+__attribute__((target("avx512f,avx2"), always_inline))
+static inline void
+fletcher_4_avx512f_impl(const void *buf, uint64_t size, zio_cksum_t *zcp,
+    boolean_t bswap)
+{
+	const __m256i *ip = buf;
+	const __m256i *ipend = (const __m256i *)((const char *)buf + size);
+	const __m256i mask = _mm256_set_epi64x(0x0c0d0e0f08090a0bULL,
+	    0x0405060700010203ULL, 0x0c0d0e0f08090a0bULL,
+	    0x0405060700010203ULL);
+	__m512i a, b, c, d, w;
+	__m256i v;
+	uint64_t la[8], lb[8], lc[8], ld[8];
+
+	a = b = c = d = _mm512_setzero_si512();
+	for (; ip < ipend; ip++) {
+		v = _mm256_loadu_si256(ip);
+		if (bswap)
+			v = _mm256_shuffle_epi8(v, mask);
+		w = _mm512_cvtepu32_epi64(v);
+
+		a = _mm512_add_epi64(a, w);
+		b = _mm512_add_epi64(b, a);
+		c = _mm512_add_epi64(c, b);
+		d = _mm512_add_epi64(d, c);
+	}
+
+	_mm512_storeu_si512(la, a);
+	_mm512_storeu_si512(lb, b);
+	_mm512_storeu_si512(lc, c);
+	_mm512_storeu_si512(ld, d);
+	_mm256_zeroupper();
+	fletcher_4_lanes_fini(la, lb, lc, ld, 8, zcp);
+}
+
+__attribute__((target("avx512f,avx2")))
+static void
+fletcher_4_avx512f_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	fletcher_4_avx512f_impl(buf, size, zcp, B_FALSE);
+}
+
+__attribute__((target("avx512f,avx2")))
+static void
+fletcher_4_avx512f_byteswap(const void *buf, uint64_t size,
+    zio_cksum_t *zcp)
+{
+	fletcher_4_avx512f_impl(buf, size, zcp, B_TRUE);
+}
+#endif	/* FLETCHER_4_HAVE_X86 */
+
+static const fletcher_4_ops_t fletcher_4_impls[] = {
+	{ "scalar", fletcher_4_scalar_native, fletcher_4_scalar_byteswap,
+	    fletcher_4_scalar_supported },
+#ifdef FLETCHER_4_HAVE_X86
+	{ "sse2", fletcher_4_sse2_native, fletcher_4_sse2_byteswap,
+	    fletcher_4_sse2_supported },
+	{ "ssse3", fletcher_4_sse2_native, fletcher_4_ssse3_byteswap,
+	    fletcher_4_ssse3_supported },
+	{ "avx2", fletcher_4_avx2_native, fletcher_4_avx2_byteswap,
+	    fletcher_4_avx2_supported },
+	{ "avx512f", fletcher_4_avx512f_native, fletcher_4_avx512f_byteswap,
+	    fletcher_4_avx512f_supported },
+#endif
+};
+
+#define	FLETCHER_4_NIMPLS \
+	(sizeof (fletcher_4_impls) / sizeof (fletcher_4_impls[0]))
+
+static const fletcher_4_ops_t *fletcher_4_ops = &fletcher_4_impls[0];
+
+static void
+fletcher_4_compute(fletcher_4_func_t *func, fletcher_4_func_t *tail,
+    const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	uint64_t bulk = P2ALIGN(size, FLETCHER_4_BLKSZ);
+
+	if (bulk != 0)
+		func(buf, bulk, zcp);
+	else
+		ZIO_SET_CHECKSUM(zcp, 0, 0, 0, 0);
+
+	if (size != bulk)
+		tail((const char *)buf + bulk, size - bulk, zcp);
+}
+
+void
+fletcher_4_native(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	fletcher_4_compute(fletcher_4_ops->f4_native,
+	    fletcher_4_scalar_incremental_native, buf, size, zcp);
+}
+
+void
+fletcher_4_byteswap(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	fletcher_4_compute(fletcher_4_ops->f4_byteswap,
+	    fletcher_4_scalar_incremental_byteswap, buf, size, zcp);
+}
+
+/*
+ * Fold the checksum of a chunk of n words, computed from a zero state,
+ * into the running checksum: this is the recurrence above started from
+ * (a, b, c, d) instead of zeroes.
+ */
+static void
+fletcher_4_incremental_combine(zio_cksum_t *zcp, const zio_cksum_t *chunk,
+    uint64_t n)
+{
+	uint64_t a = zcp->zc_word[0];
+	uint64_t b = zcp->zc_word[1];
+	uint64_t c = zcp->zc_word[2];
+	uint64_t d = zcp->zc_word[3];
+	uint64_t x = n, y = n + 1, z = n + 2;
+	uint64_t t2, t3;
+
+	/*
+	 * n(n+1)/2 and n(n+1)(n+2)/6, dividing before multiplying so that
+	 * the results stay exact mod 2^64 for any n.
+	 */
+	if (x % 2 == 0)
+		x /= 2;
+	else
+		y /= 2;
+	t2 = x * y;
+	if (x % 3 == 0)
+		x /= 3;
+	else if (y % 3 == 0)
+		y /= 3;
+	else
+		z /= 3;
+	t3 = x * y * z;
+
+	ZIO_SET_CHECKSUM(zcp,
+	    a + chunk->zc_word[0],
+	    b + n * a + chunk->zc_word[1],
+	    c + n * b + t2 * a + chunk->zc_word[2],
+	    d + n * c + t2 * b + t3 * a + chunk->zc_word[3]);
+}
+
+void
+fletcher_4_incremental_native(const void *buf, uint64_t size,
+    zio_cksum_t *zcp)
+{
+	zio_cksum_t chunk;
+
+	if (size < FLETCHER_4_BLKSZ) {
+		fletcher_4_scalar_incremental_native(buf, size, zcp);
+		return;
+	}
+	fletcher_4_native(buf, size, &chunk);
+	fletcher_4_incremental_combine(zcp, &chunk, size / sizeof (uint32_t));
+}
+
+void
+fletcher_4_incremental_byteswap(const void *buf, uint64_t size,
+    zio_cksum_t *zcp)
+{
+	zio_cksum_t chunk;
+
+	if (size < FLETCHER_4_BLKSZ) {
+		fletcher_4_scalar_incremental_byteswap(buf, size, zcp);
+		return;
+	}
+	fletcher_4_byteswap(buf, size, &chunk);
+	fletcher_4_incremental_combine(zcp, &chunk, size / sizeof (uint32_t));
+}
+
+/*
+ * Select the fletcher-4 implementation.  Called once from zio_init().
+ */
+void
+fletcher_4_init(void)
+{
+	const fletcher_4_ops_t *ops, *best = NULL;
+	zio_cksum_t ref_n, ref_b, zc_n, zc_b;
+	hrtime_t t, best_time = 0;
+	uint32_t *buf;
+	int i, j;
+
+	buf = kmem_alloc(SPA_MAXBLOCKSIZE, KM_SLEEP);
+	for (i = 0; i < SPA_MAXBLOCKSIZE / sizeof (uint32_t); i++)
+		buf[i] = (uint32_t)i * 2654435761U;
+	fletcher_4_scalar_native(buf, SPA_MAXBLOCKSIZE, &ref_n);
+	fletcher_4_scalar_byteswap(buf, SPA_MAXBLOCKSIZE, &ref_b);
+
+	for (i = 0; i < FLETCHER_4_NIMPLS; i++) {
+		ops = &fletcher_4_impls[i];
+		if (!ops->f4_supported())
+			continue;
+
+		ops->f4_native(buf, SPA_MAXBLOCKSIZE, &zc_n);
+		ops->f4_byteswap(buf, SPA_MAXBLOCKSIZE, &zc_b);
+		if (!ZIO_CHECKSUM_EQUAL(zc_n, ref_n) ||
+		    !ZIO_CHECKSUM_EQUAL(zc_b, ref_b)) {
+			cmn_err(CE_WARN, "fletcher_4: '%s' implementation "
+			    "gives wrong results, not using it", ops->f4_name);
+			continue;
+		}
+
+		if (zio_fletcher_4_impl != NULL) {
+			if (strcmp(zio_fletcher_4_impl, ops->f4_name) == 0)
+				best = ops;
+			continue;
+		}
+
+		t = gethrtime();
+		for (j = 0; j < 16; j++)
+			ops->f4_native(buf, SPA_MAXBLOCKSIZE, &zc_n);
+		t = gethrtime() - t;
+		if (best == NULL || t < best_time) {
+			best = ops;
+			best_time = t;
+		}
+	}
+	kmem_free(buf, SPA_MAXBLOCKSIZE);
+
+	if (best == NULL) {
+		cmn_err(CE_WARN, "fletcher_4: unknown implementation '%s'",
+		    zio_fletcher_4_impl);
+		best = &fletcher_4_impls[0];
+	}
+	fletcher_4_ops = best;
+}
+
+const char *
+fletcher_4_impl(void)
+{
+	return (fletcher_4_ops->f4_name);
+}
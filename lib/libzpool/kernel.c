@@ -481,6 +481,31 @@ vn_rdwr(int uio, vnode_t *vp, void *addr, ssize_t len, offset_t offset,
 	return (0);
 }
 
+/*ARGSUSED*/
+int
+vn_rdwrv(int uio, vnode_t *vp, struct iovec *iov, int iovcnt, offset_t offset,
+	int x1, int x2, rlim64_t x3, void *x4, ssize_t *residp)
+{
+	ssize_t iolen, len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (uio == UIO_READ)
+		iolen = preadv64(vp->v_fd, iov, iovcnt, offset);
+	else
+		iolen = pwritev64(vp->v_fd, iov, iovcnt, offset);
+
+	if (iolen < 0)
+		return (errno);
+	if (residp)
+		*residp = len - iolen;
+	else if (iolen != len)
+		return (EIO);
+	return (0);
+}
+
 void
 vn_close(vnode_t *vp)
 {
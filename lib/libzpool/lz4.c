@@ -0,0 +1,327 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * LZ4 block compression.  The compressed data is a sequence of LZ4 block
+ * format sequences: a token byte holding the literal length and the match
+ * length in its two nibbles (15 meaning that more length bytes follow), the
+ * literals, then a 16-bit little endian match offset.  The last sequence has
+ * literals only.  As on other ZFS implementations, the block is preceded by
+ * its compressed length as a 32-bit big endian integer, so that trailing
+ * sector padding is not mistaken for data.
+ *
+ * The compressor is a single pass greedy matcher with a 4096 entry hash
+ * table of 4-byte sequences.  When no match has been found for a while it
+ * probes the input with an increasing stride, which is what makes it fast on
+ * incompressible data.
+ */
+#include <sys/zfs_context.h>
+
+#define	LZ4_HASHLOG		12
+#define	LZ4_HASHSIZE		(1 << LZ4_HASHLOG)
+#define	LZ4_MINMATCH		4
+#define	LZ4_LASTLITERALS	5
+#define	LZ4_MFLIMIT		12
+#define	LZ4_MAXDIST		65535
+#define	LZ4_SKIPTRIGGER		6
+#define	LZ4_RUNMASK		15
+#define	LZ4_HDRSIZE		sizeof (uint32_t)
+
+static uint32_t
+lz4_read32(const uchar_t *p)
+{
+	uint32_t v;
+
+	bcopy(p, &v, sizeof (v));
+	return (v);
+}
+
+static uint64_t
+lz4_read64(const uchar_t *p)
+{
+	uint64_t v;
+
+	bcopy(p, &v, sizeof (v));
+	return (v);
+}
+
+static uint32_t
+lz4_hash(uint32_t v)
+{
+	return ((v * 2654435761U) >> (32 - LZ4_HASHLOG));
+}
+
+static uchar_t *
+lz4_put_length(uchar_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (uchar_t)len;
+	return (op);
+}
+
+/*
+ * Returns the compressed size, or 0 if it would not fit in d_len bytes.
+ */
+static size_t
+lz4_compress_block(const uchar_t *src, uchar_t *dst, size_t s_len,
+    size_t d_len)
+{
+	const uchar_t *ip = src;
+	const uchar_t *anchor = src;
+	const uchar_t *iend = src + s_len;
+	const uchar_t *mflimit = iend - LZ4_MFLIMIT;
+	const uchar_t *matchlimit = iend - LZ4_LASTLITERALS;
+	const uchar_t *ref, *fwd;
+	uchar_t *op = dst;
+	uchar_t *oend = dst + d_len;
+	uchar_t *token;
+	uint32_t table[LZ4_HASHSIZE];
+	uint32_t h, attempts, step;
+	size_t len;
+
+	if (s_len < LZ4_MFLIMIT + 1)
+		goto last_literals;
+
+	bzero(table, sizeof (table));
+	ip++;
+
+	for (;;) {
+		/*
+		 * Look for a match, stepping further ahead every
+		 * 1 << LZ4_SKIPTRIGGER failed attempts.
+		 */
+		attempts = 1 << LZ4_SKIPTRIGGER;
+		fwd = ip;
+		do {
+			ip = fwd;
+			step = attempts++ >> LZ4_SKIPTRIGGER;
+			fwd = ip + step;
+			if (fwd > mflimit)
+				goto last_literals;
+			h = lz4_hash(lz4_read32(ip));
+			ref = src + table[h];
+			table[h] = (uint32_t)(ip - src);
+		} while (ref + LZ4_MAXDIST < ip ||
+		    lz4_read32(ref) != lz4_read32(ip));
+
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		len = ip - anchor;
+		token = op++;
+		if (op + len + len / 255 + 2 + 1 + LZ4_LASTLITERALS > oend)
+			return (0);
+		if (len >= LZ4_RUNMASK) {
+			*token = LZ4_RUNMASK << 4;
+			op = lz4_put_length(op, len - LZ4_RUNMASK);
+		} else {
+			*token = (uchar_t)(len << 4);
+		}
+		bcopy(anchor, op, len);
+		op += len;
+
+		for (;;) {
+			*op++ = (uchar_t)(ip - ref);
+			*op++ = (uchar_t)((ip - ref) >> 8);
+
+			ip += LZ4_MINMATCH;
+			ref += LZ4_MINMATCH;
+			anchor = ip;
+			while (ip + sizeof (uint64_t) <= matchlimit &&
+			    lz4_read64(ip) == lz4_read64(ref)) {
+				ip += sizeof (uint64_t);
+				ref += sizeof (uint64_t);
+			}
+			while (ip < matchlimit && *ip == *ref) {
+				ip++;
+				ref++;
+			}
+
+			len = ip - anchor;
+			if (op + len / 255 + 1 + LZ4_LASTLITERALS > oend)
+				return (0);
+			if (len >= LZ4_RUNMASK) {
+				*token += LZ4_RUNMASK;
+				op = lz4_put_length(op, len - LZ4_RUNMASK);
+			} else {
+				*token += (uchar_t)len;
+			}
+
+			anchor = ip;
+			if (ip > mflimit)
+				goto last_literals;
+
+			table[lz4_hash(lz4_read32(ip - 2))] =
+			    (uint32_t)(ip - 2 - src);
+
+			/*
+			 * A match right away is encoded with no literals.
+			 */
+			h = lz4_hash(lz4_read32(ip));
+			ref = src + table[h];
+			table[h] = (uint32_t)(ip - src);
+			if (ref + LZ4_MAXDIST < ip ||
+			    lz4_read32(ref) != lz4_read32(ip))
+				break;
+
+			token = op++;
+			*token = 0;
+		}
+
+		ip++;
+	}
+
+last_literals:
+	len = iend - anchor;
+	if (op + len + 1 + (len + 255 - LZ4_RUNMASK) / 255 > oend)
+		return (0);
+	if (len >= LZ4_RUNMASK) {
+		*op++ = LZ4_RUNMASK << 4;
+		op = lz4_put_length(op, len - LZ4_RUNMASK);
+	} else {
+		*op++ = (uchar_t)(len << 4);
+	}
+	bcopy(anchor, op, len);
+	op += len;
+
+	return (op - dst);
+}
+
+/*
+ * Reads a length continued in extra bytes; returns -1 past the input.
+ */
+static int
+lz4_get_length(const uchar_t **ipp, const uchar_t *iend, size_t *lenp)
+{
+	const uchar_t *ip = *ipp;
+	uchar_t s;
+
+	do {
+		if (ip >= iend)
+			return (-1);
+		s = *ip++;
+		*lenp += s;
+	} while (s == 255);
+
+	*ipp = ip;
+	return (0);
+}
+
+static int
+lz4_decompress_block(const uchar_t *src, uchar_t *dst, size_t s_len,
+    size_t d_len)
+{
+	const uchar_t *ip = src;
+	const uchar_t *iend = src + s_len;
+	const uchar_t *ref;
+	uchar_t *op = dst;
+	uchar_t *oend = dst + d_len;
+	size_t len, off;
+	uchar_t token;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		len = token >> 4;
+		if (len == LZ4_RUNMASK && lz4_get_length(&ip, iend, &len) != 0)
+			return (-1);
+		if (len > (size_t)(iend - ip) ||
+		    len > (size_t)(oend - op))
+			return (-1);
+		bcopy(ip, op, len);
+		ip += len;
+		op += len;
+
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return (-1);
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - dst))
+			return (-1);
+
+		len = token & LZ4_RUNMASK;
+		if (len == LZ4_RUNMASK && lz4_get_length(&ip, iend, &len) != 0)
+			return (-1);
+		len += LZ4_MINMATCH;
+		if (len > (size_t)(oend - op))
+			return (-1);
+
+		ref = op - off;
+		if (off >= sizeof (uint64_t)) {
+			for (; len >= sizeof (uint64_t);
+			    len -= sizeof (uint64_t)) {
+				bcopy(ref, op, sizeof (uint64_t));
+				ref += sizeof (uint64_t);
+				op += sizeof (uint64_t);
+			}
+		}
+		while (len-- != 0)
+			*op++ = *ref++;
+	}
+
+	return (0);
+}
+
+/*ARGSUSED*/
+size_t
+lz4_compress(void *s_start, void *d_start, size_t s_len, size_t d_len, int n)
+{
+	size_t c_len;
+	uint32_t hdr;
+
+	if (d_len <= LZ4_HDRSIZE)
+		return (s_len);
+
+	c_len = lz4_compress_block(s_start, (uchar_t *)d_start + LZ4_HDRSIZE,
+	    s_len, d_len - LZ4_HDRSIZE);
+	if (c_len == 0)
+		return (s_len);
+
+	hdr = BE_32((uint32_t)c_len);
+	bcopy(&hdr, d_start, LZ4_HDRSIZE);
+
+	return (c_len + LZ4_HDRSIZE);
+}
+
+/*ARGSUSED*/
+int
+lz4_decompress(void *s_start, void *d_start, size_t s_len, size_t d_len, int n)
+{
+	uint32_t hdr;
+	size_t c_len;
+
+	if (s_len < LZ4_HDRSIZE)
+		return (-1);
+
+	bcopy(s_start, &hdr, LZ4_HDRSIZE);
+	c_len = BE_32(hdr);
+	if (c_len > s_len - LZ4_HDRSIZE)
+		return (-1);
+
+	return (lz4_decompress_block((uchar_t *)s_start + LZ4_HDRSIZE,
+	    d_start, c_len, d_len));
+}
@@ -264,3 +264,71 @@ rrw_held(rrwlock_t *rrl, krw_t rw)
 
 	return (held);
 }
+
+/*
+ * Readers always use the same lock of the array, chosen from their thread
+ * id, so that re-entrant reads and rrm_exit() find the lock they took.
+ * pthread_t values are aligned addresses, hence the shift.
+ */
+#define	RRM_TD_LOCK()	(((uint32_t)(uintptr_t)(curthread)) >> 4)
+
+static rrwlock_t *
+rrm_reader_lock(rrmlock_t *rrl)
+{
+	return (&rrl->locks[RRM_TD_LOCK() % RRM_NUM_LOCKS].rs_lock);
+}
+
+void
+rrm_init(rrmlock_t *rrl)
+{
+	int i;
+
+	for (i = 0; i < RRM_NUM_LOCKS; i++)
+		rrw_init(&rrl->locks[i].rs_lock);
+}
+
+void
+rrm_destroy(rrmlock_t *rrl)
+{
+	int i;
+
+	for (i = 0; i < RRM_NUM_LOCKS; i++)
+		rrw_destroy(&rrl->locks[i].rs_lock);
+}
+
+void
+rrm_enter(rrmlock_t *rrl, krw_t rw, void *tag)
+{
+	int i;
+
+	if (rw == RW_READER) {
+		rrw_enter_read(rrm_reader_lock(rrl), tag);
+		return;
+	}
+
+	for (i = 0; i < RRM_NUM_LOCKS; i++)
+		rrw_enter_write(&rrl->locks[i].rs_lock);
+}
+
+void
+rrm_exit(rrmlock_t *rrl, void *tag)
+{
+	int i;
+
+	if (rrl->locks[0].rs_lock.rr_writer == curthread) {
+		for (i = 0; i < RRM_NUM_LOCKS; i++)
+			rrw_exit(&rrl->locks[i].rs_lock, tag);
+		return;
+	}
+
+	rrw_exit(rrm_reader_lock(rrl), tag);
+}
+
+boolean_t
+rrm_held(rrmlock_t *rrl, krw_t rw)
+{
+	if (rw == RW_WRITER)
+		return (rrw_held(&rrl->locks[0].rs_lock, rw));
+
+	return (rrw_held(rrm_reader_lock(rrl), rw));
+}
@@ -24,27 +24,369 @@
  */
 #include <sys/zfs_context.h>
 #include <sys/zio.h>
+#include <sys/zio_checksum.h>
+#include <openssl/opensslv.h>
+#include <openssl/evp.h>
+
+/*
+ * SHA256_Transform() is deprecated as of OpenSSL 3.0, which no longer
+ * exposes a block function at all.
+ */
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
 #include <openssl/sha.h>
+#define	SHA256_HAVE_OPENSSL
+#endif
 
-void
-zio_checksum_SHA256(const void *buf, uint64_t size, zio_cksum_t *zcp)
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define	SHA256_HAVE_SHANI
+#endif
+
+/*
+ * SHA-256 is computed by one of several block compression functions, all of
+ * which operate on the same eight word state and therefore produce the same
+ * digest.  The padding and the final byte ordering are shared below, so the
+ * on-disk checksum does not depend on which implementation is selected.
+ * OpenSSL's EVP interface, which has no block function, digests the whole
+ * buffer instead.
+ *
+ * zio_checksum_SHA256_init() picks the fastest implementation supported by
+ * the running CPU by timing each of them on a maximum sized block, after
+ * checking it against the generic one.  Setting zio_sha256_impl to the name
+ * of an implementation before the pool code is initialized forces it.
+ */
+typedef void sha256_compress_f(uint32_t *, const uint8_t *, size_t);
+
+typedef struct sha256_impl {
+	const char		*si_name;
+	sha256_compress_f	*si_compress;
+	zio_checksum_t		*si_digest;	/* instead of si_compress */
+	boolean_t		(*si_supported)(void);
+} sha256_impl_t;
+
+char *zio_sha256_impl = NULL;
+
+static const uint32_t sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define	ROTR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define	Ch(x, y, z)	(((x) & (y)) ^ (~(x) & (z)))
+#define	Maj(x, y, z)	(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define	SIGMA0(x)	(ROTR((x), 2) ^ ROTR((x), 13) ^ ROTR((x), 22))
+#define	SIGMA1(x)	(ROTR((x), 6) ^ ROTR((x), 11) ^ ROTR((x), 25))
+#define	sigma0(x)	(ROTR((x), 7) ^ ROTR((x), 18) ^ ((x) >> 3))
+#define	sigma1(x)	(ROTR((x), 17) ^ ROTR((x), 19) ^ ((x) >> 10))
+
+static boolean_t
+sha256_always_supported(void)
+{
+	return (B_TRUE);
+}
+
+/*
+ * Straight FIPS 180-2 implementation; also the reference the other
+ * implementations are checked against.
+ */
+static void
+sha256_compress_generic(uint32_t *H, const uint8_t *data, size_t nblocks)
+{
+	uint32_t W[64];
+	uint32_t a, b, c, d, e, f, g, h, T1, T2;
+	int t;
+
+	for (; nblocks != 0; nblocks--, data += 64) {
+		for (t = 0; t < 16; t++) {
+			W[t] = ((uint32_t)data[4 * t] << 24) |
+			    ((uint32_t)data[4 * t + 1] << 16) |
+			    ((uint32_t)data[4 * t + 2] << 8) |
+			    (uint32_t)data[4 * t + 3];
+		}
+		for (t = 16; t < 64; t++) {
+			W[t] = sigma1(W[t - 2]) + W[t - 7] +
+			    sigma0(W[t - 15]) + W[t - 16];
+		}
+
+		a = H[0]; b = H[1]; c = H[2]; d = H[3];
+		e = H[4]; f = H[5]; g = H[6]; h = H[7];
+
+		for (t = 0; t < 64; t++) {
+			T1 = h + SIGMA1(e) + Ch(e, f, g) + sha256_K[t] + W[t];
+			T2 = SIGMA0(a) + Maj(a, b, c);
+			h = g; g = f; f = e; e = d + T1;
+			d = c; c = b; b = a; a = T1 + T2;
+		}
+
+		H[0] += a; H[1] += b; H[2] += c; H[3] += d;
+		H[4] += e; H[5] += f; H[6] += g; H[7] += h;
+	}
+}
+
+#ifdef SHA256_HAVE_OPENSSL
+/*
+ * OpenSSL's block function, which carries its own assembly for most
+ * platforms.  This is what the checksum used to be computed with.
+ */
+static void
+sha256_compress_openssl(uint32_t *H, const uint8_t *data, size_t nblocks)
 {
 	SHA256_CTX ctx;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		ctx.h[i] = H[i];
+	for (; nblocks != 0; nblocks--, data += 64)
+		SHA256_Transform(&ctx, data);
+	for (i = 0; i < 8; i++)
+		H[i] = ctx.h[i];
+}
+#endif	/* SHA256_HAVE_OPENSSL */
+
+/*
+ * OpenSSL's one-shot digest, for which it carries its own assembly on most
+ * platforms.  Unlike SHA256_Transform() it is not deprecated as of OpenSSL
+ * 3.0.
+ */
+static void
+sha256_digest_evp(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
 	zio_cksum_t tmp;
 
-	SHA256_Init(&ctx);
-	SHA256_Update(&ctx, buf, size);
-	SHA256_Final((unsigned char*)&tmp, &ctx);
+	VERIFY(EVP_Digest(buf, size, (unsigned char *)&tmp, NULL,
+	    EVP_sha256(), NULL) == 1);
+
+	/* the digest is big endian; see sha256_digest() */
+	zcp->zc_word[0] = BE_64(tmp.zc_word[0]);
+	zcp->zc_word[1] = BE_64(tmp.zc_word[1]);
+	zcp->zc_word[2] = BE_64(tmp.zc_word[2]);
+	zcp->zc_word[3] = BE_64(tmp.zc_word[3]);
+}
+
+#ifdef SHA256_HAVE_SHANI
+static boolean_t
+sha256_shani_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+	    !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+		return (B_FALSE);
+	if (__get_cpuid_max(0, NULL) < 7)
+		return (B_FALSE);
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+	return ((ebx & (1 << 29)) ? B_TRUE : B_FALSE);
+}
+
+/*
+ * Intel SHA extensions.  The state is kept as the ABEF/CDGH register pair
+ * sha256rnds2 expects; each iteration runs four rounds and, from the fifth
+ * one on, derives the next four message words from the previous sixteen.
+ */
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_compress_shani(uint32_t *H, const uint8_t *data, size_t nblocks)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+	    0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, msg, tmp;
+	__m128i M[4];
+	int g;
+
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&H[0]), 0xB1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&H[4]),
+	    0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	for (; nblocks != 0; nblocks--, data += 64) {
+		abef = state0;
+		cdgh = state1;
+
+		for (g = 0; g < 16; g++) {
+			if (g < 4) {
+				M[g] = _mm_shuffle_epi8(_mm_loadu_si128(
+				    (const __m128i *)(data + 16 * g)), bswap);
+			} else {
+				tmp = _mm_add_epi32(
+				    _mm_sha256msg1_epu32(M[g & 3],
+				    M[(g + 1) & 3]),
+				    _mm_alignr_epi8(M[(g + 3) & 3],
+				    M[(g + 2) & 3], 4));
+				M[g & 3] = _mm_sha256msg2_epu32(tmp,
+				    M[(g + 3) & 3]);
+			}
+			msg = _mm_add_epi32(M[g & 3],
+			    _mm_loadu_si128((const __m128i *)&sha256_K[4 * g]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+	_mm_storeu_si128((__m128i *)&H[0], state0);
+	_mm_storeu_si128((__m128i *)&H[4], state1);
+}
+#endif	/* SHA256_HAVE_SHANI */
+
+static const sha256_impl_t sha256_impls[] = {
+	{ "generic", sha256_compress_generic, NULL, sha256_always_supported },
+	{ "evp", NULL, sha256_digest_evp, sha256_always_supported },
+#ifdef SHA256_HAVE_OPENSSL
+	{ "openssl", sha256_compress_openssl, NULL, sha256_always_supported },
+#endif
+#ifdef SHA256_HAVE_SHANI
+	{ "shani", sha256_compress_shani, NULL, sha256_shani_supported },
+#endif
+};
+
+#define	SHA256_NIMPLS	(sizeof (sha256_impls) / sizeof (sha256_impls[0]))
+
+/* until zio_checksum_SHA256_init(), what the checksum used to be */
+static const sha256_impl_t *sha256_impl = &sha256_impls[1];
+
+static void
+sha256_digest(sha256_compress_f *compress, const void *buf, uint64_t size,
+    zio_cksum_t *zcp)
+{
+	const uint8_t *data = buf;
+	uint64_t nblocks = size >> 6;
+	uint64_t resid = size & 63;
+	uint64_t bits = size << 3;
+	uint8_t pad[128];
+	uint32_t H[8];
+	int i, padlen;
+
+	bcopy(sha256_iv, H, sizeof (H));
+	if (nblocks != 0)
+		compress(H, data, nblocks);
+
+	/*
+	 * Append the 0x80 terminator and the big endian bit count, which
+	 * spills into a second block when fewer than nine bytes are left.
+	 */
+	bcopy(data + (nblocks << 6), pad, resid);
+	padlen = (resid < 56) ? 64 : 128;
+	pad[resid] = 0x80;
+	bzero(pad + resid + 1, padlen - resid - 9);
+	for (i = 0; i < 8; i++)
+		pad[padlen - 1 - i] = (uint8_t)(bits >> (8 * i));
+	compress(H, pad, padlen >> 6);
 
 	/*
 	 * A prior implementation of this function had a
 	 * private SHA256 implementation always wrote things out in
 	 * Big Endian and there wasn't a byteswap variant of it.
 	 * To preseve on disk compatibility we need to force that
-	 * behaviour.
+	 * behaviour.  Reading the big endian digest back as native
+	 * 64-bit words is the same as pairing up the state words.
 	 */
-	zcp->zc_word[0] = BE_64(tmp.zc_word[0]);
-	zcp->zc_word[1] = BE_64(tmp.zc_word[1]);
-	zcp->zc_word[2] = BE_64(tmp.zc_word[2]);
-	zcp->zc_word[3] = BE_64(tmp.zc_word[3]);
+	for (i = 0; i < 4; i++)
+		zcp->zc_word[i] = ((uint64_t)H[2 * i] << 32) | H[2 * i + 1];
+}
+
+static void
+sha256_impl_digest(const sha256_impl_t *si, const void *buf, uint64_t size,
+    zio_cksum_t *zcp)
+{
+	if (si->si_digest != NULL)
+		si->si_digest(buf, size, zcp);
+	else
+		sha256_digest(si->si_compress, buf, size, zcp);
+}
+
+void
+zio_checksum_SHA256(const void *buf, uint64_t size, zio_cksum_t *zcp)
+{
+	sha256_impl_digest(sha256_impl, buf, size, zcp);
+}
+
+/*
+ * Select the SHA-256 implementation.  Called once from zio_init().
+ */
+void
+zio_checksum_SHA256_init(void)
+{
+	const sha256_impl_t *si, *best = NULL;
+	hrtime_t t, best_time = 0;
+	zio_cksum_t ref, zc;
+	uint8_t *buf;
+	int i, j;
+
+	buf = kmem_alloc(SPA_MAXBLOCKSIZE, KM_SLEEP);
+	for (i = 0; i < SPA_MAXBLOCKSIZE; i++)
+		buf[i] = (uint8_t)(i * 2654435761U >> 24);
+	/* odd length, to exercise the two block padding as well */
+	sha256_digest(sha256_compress_generic, buf, SPA_MAXBLOCKSIZE - 5,
+	    &ref);
+
+	for (i = 0; i < SHA256_NIMPLS; i++) {
+		si = &sha256_impls[i];
+		if (!si->si_supported())
+			continue;
+
+		sha256_impl_digest(si, buf, SPA_MAXBLOCKSIZE - 5, &zc);
+		if (!ZIO_CHECKSUM_EQUAL(zc, ref)) {
+			cmn_err(CE_WARN, "sha256: '%s' implementation gives "
+			    "wrong results, not using it", si->si_name);
+			continue;
+		}
+
+		if (zio_sha256_impl != NULL) {
+			if (strcmp(zio_sha256_impl, si->si_name) == 0)
+				best = si;
+			continue;
+		}
+
+		t = gethrtime();
+		for (j = 0; j < 4; j++)
+			sha256_impl_digest(si, buf, SPA_MAXBLOCKSIZE, &zc);
+		t = gethrtime() - t;
+		if (best == NULL || t < best_time) {
+			best = si;
+			best_time = t;
+		}
+	}
+	kmem_free(buf, SPA_MAXBLOCKSIZE);
+
+	if (best == NULL) {
+		cmn_err(CE_WARN, "sha256: unknown implementation '%s'",
+		    zio_sha256_impl);
+		best = &sha256_impls[0];
+	}
+	sha256_impl = best;
+}
+
+const char *
+zio_checksum_SHA256_impl(void)
+{
+	return (sha256_impl->si_name);
 }
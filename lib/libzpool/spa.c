@@ -349,6 +349,18 @@ spa_prop_validate(spa_t *spa, nvlist_t *props)
 				error = EINVAL;
 			break;
 
+		case ZPOOL_PROP_LZ4_COMPRESS:
+			/*
+			 * No pool version covers lz4, so a pool holds lz4
+			 * blocks only once this is set, and it cannot be
+			 * unset since they may remain.
+			 */
+			error = nvpair_value_uint64(elem, &intval);
+			if (!error && (intval > 1 ||
+			    (intval == 0 && spa->spa_lz4_compress)))
+				error = EINVAL;
+			break;
+
 		case ZPOOL_PROP_BOOTFS:
 			/*
 			 * If the pool version is less than SPA_VERSION_BOOTFS,
@@ -1319,7 +1331,8 @@ spa_load_verify(spa_t *spa)
 	    ZIO_FLAG_CANFAIL | ZIO_FLAG_SPECULATIVE);
 
 	error = traverse_pool(spa, spa->spa_verify_min_txg,
-	    TRAVERSE_PRE | TRAVERSE_PREFETCH, spa_load_verify_cb, rio);
+	    TRAVERSE_PRE | TRAVERSE_PREFETCH | TRAVERSE_PARALLEL,
+	    spa_load_verify_cb, rio);
 
 	(void) zio_wait(rio);
 
@@ -1790,6 +1803,8 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 		spa_prop_find(spa, ZPOOL_PROP_AUTOEXPAND, &spa->spa_autoexpand);
 		spa_prop_find(spa, ZPOOL_PROP_DEDUPDITTO,
 		    &spa->spa_dedup_ditto);
+		spa_prop_find(spa, ZPOOL_PROP_LZ4_COMPRESS,
+		    &spa->spa_lz4_compress);
 
 		spa->spa_autoreplace = (autoreplace != 0);
 	}
@@ -2717,6 +2732,8 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 	spa->spa_delegation = zpool_prop_default_numeric(ZPOOL_PROP_DELEGATION);
 	spa->spa_failmode = zpool_prop_default_numeric(ZPOOL_PROP_FAILUREMODE);
 	spa->spa_autoexpand = zpool_prop_default_numeric(ZPOOL_PROP_AUTOEXPAND);
+	spa->spa_lz4_compress =
+	    zpool_prop_default_numeric(ZPOOL_PROP_LZ4_COMPRESS);
 
 	if (props != NULL) {
 		spa_configfile_set(spa, props, B_FALSE);
@@ -5028,6 +5045,9 @@ spa_sync_props(void *arg1, void *arg2, cred_t *cr, dmu_tx_t *tx)
 			case ZPOOL_PROP_DEDUPDITTO:
 				spa->spa_dedup_ditto = intval;
 				break;
+			case ZPOOL_PROP_LZ4_COMPRESS:
+				spa->spa_lz4_compress = intval;
+				break;
 			default:
 				break;
 			}
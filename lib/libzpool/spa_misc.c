@@ -1551,6 +1551,12 @@ spa_delegation(spa_t *spa)
 	return (spa->spa_delegation);
 }
 
+boolean_t
+spa_lz4_compress(spa_t *spa)
+{
+	return (spa->spa_lz4_compress != 0);
+}
+
 objset_t *
 spa_meta_objset(spa_t *spa)
 {
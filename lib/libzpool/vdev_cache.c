@@ -315,6 +315,26 @@ vdev_cache_read(zio_t *zio)
 	return (0);
 }
 
+/*
+ * Copy len bytes at offset off of a scatter-gather write into buf.
+ */
+static void
+vdev_cache_copy_iov(zio_t *zio, uint64_t off, char *buf, uint64_t len)
+{
+	struct iovec *iov = zio->io_iov;
+	uint64_t n;
+
+	for (; off >= iov->iov_len; iov++)
+		off -= iov->iov_len;
+
+	for (; len != 0; iov++, off = 0) {
+		n = MIN(len, iov->iov_len - off);
+		bcopy((char *)iov->iov_base + off, buf, n);
+		buf += n;
+		len -= n;
+	}
+}
+
 /*
  * Update cache contents upon write completion.
  */
@@ -345,6 +365,9 @@ vdev_cache_write(zio_t *zio)
 
 		if (ve->ve_fill_io != NULL) {
 			ve->ve_missed_update = 1;
+		} else if (zio->io_iov != NULL) {
+			vdev_cache_copy_iov(zio, start - io_start,
+			    ve->ve_data + start - ve->ve_offset, end - start);
 		} else {
 			bcopy((char *)zio->io_data + start - io_start,
 			    ve->ve_data + start - ve->ve_offset, end - start);
@@ -36,10 +36,336 @@
 #include "flushwc.h"
 #include "format.h"
 
+#ifdef LINUX_URING
+#include <liburing.h>
+
+/*
+ * io_uring tunables.  zfs_vdev_uring selects io_uring for leaf vdevs when
+ * the ring can be set up (otherwise we fall back to libaio or vn_rdwr()),
+ * zfs_vdev_uring_sqpoll asks the kernel for a submission polling thread
+ * and zfs_vdev_uring_entries is the depth of each vdev's ring.
+ */
+boolean_t zfs_vdev_uring = B_TRUE;
+boolean_t zfs_vdev_uring_sqpoll = B_FALSE;
+int zfs_vdev_uring_sqpoll_idle = 100;	/* milliseconds */
+int zfs_vdev_uring_entries = 256;
+
+/*
+ * Per leaf vdev io_uring state.  The vdev's file descriptor is registered
+ * with the ring as fixed file 0.  Submissions are serialized by vu_lock;
+ * completions are reaped by a single thread per vdev.  Every zio queued on
+ * the ring stays on vu_inflight until its completion has been reaped, so
+ * that it can be failed if the ring breaks.
+ */
+typedef struct vdev_uring {
+	struct io_uring	vu_ring;
+	kmutex_t	vu_lock;	/* protects everything below */
+	kcondvar_t	vu_cv;		/* signalled when vu_thread exits */
+	kthread_t	*vu_thread;	/* completion thread */
+	boolean_t	vu_exiting;	/* tell vu_thread to exit */
+	boolean_t	vu_failed;	/* ring is unusable, don't queue */
+	list_t		vu_inflight;	/* zios queued on the ring */
+	vdev_t		*vu_vd;
+} vdev_uring_t;
+
+/*
+ * Ring holding SQEs that the current thread queued while plugged (see
+ * zio_aio_plug()) and has not submitted yet.
+ */
+static __thread vdev_uring_t *vdev_uring_unsubmitted = NULL;
+#endif
+
+static void vdev_file_flushwc(zio_t *zio);
+
 /*
  * Virtual device vector for files.
  */
 
+#ifdef LINUX_URING
+/*
+ * The ring can no longer be used.  Stop queueing I/O on it, which sends
+ * later I/O to the libaio or vn_rdwr() paths, and fail with EIO every zio
+ * whose completion will now never be reaped.  Only called by the completion
+ * thread, right before it exits.
+ */
+static void
+vdev_uring_fail(vdev_uring_t *vu)
+{
+	list_t failed;
+	zio_t *zio;
+
+	list_create(&failed, sizeof (zio_t), offsetof(zio_t, io_uring_node));
+
+	mutex_enter(&vu->vu_lock);
+	vu->vu_failed = B_TRUE;
+	list_move_tail(&failed, &vu->vu_inflight);
+	mutex_exit(&vu->vu_lock);
+
+	while ((zio = list_head(&failed)) != NULL) {
+		list_remove(&failed, zio);
+		zio->io_error = EIO;
+		zio_interrupt(zio);
+	}
+
+	list_destroy(&failed);
+}
+
+/*
+ * Completion thread for a vdev's ring.
+ */
+static void
+vdev_uring_thread(vdev_uring_t *vu)
+{
+	struct io_uring_cqe *cqe;
+	zio_t *zio;
+	int rc;
+
+	while (!vu->vu_exiting) {
+		rc = io_uring_wait_cqe(&vu->vu_ring, &cqe);
+		if (rc == -EINTR || rc == -EAGAIN)
+			continue;
+
+		if (rc < 0) {
+			cmn_err(CE_WARN, "error '%i' in function "
+			    "io_uring_wait_cqe(), stopping io_uring "
+			    "completions for '%s'.", rc, vu->vu_vd->vdev_path);
+			vdev_uring_fail(vu);
+			break;
+		}
+
+		zio = io_uring_cqe_get_data(cqe);
+		rc = cqe->res;
+		io_uring_cqe_seen(&vu->vu_ring, cqe);
+
+		/* NOPs carry no zio; they are only used to wake us up. */
+		if (zio == NULL)
+			continue;
+
+		mutex_enter(&vu->vu_lock);
+		list_remove(&vu->vu_inflight, zio);
+		mutex_exit(&vu->vu_lock);
+
+		if (zio->io_type == ZIO_TYPE_IOCTL) {
+			zio->io_error = (rc < 0) ? -rc : 0;
+			vdev_file_flushwc(zio);
+		} else if (rc < 0) {
+			zio->io_error = -rc;
+		} else {
+			zio->io_error = (rc == zio->io_size) ? 0 : EIO;
+		}
+
+		zio_interrupt(zio);
+	}
+
+	mutex_enter(&vu->vu_lock);
+	vu->vu_thread = NULL;
+	cv_broadcast(&vu->vu_cv);
+	mutex_exit(&vu->vu_lock);
+
+	thread_exit();
+}
+
+/*
+ * Set up an io_uring for a leaf vdev.  Returns NULL if the ring could not
+ * be created, in which case the caller uses the other I/O paths.
+ */
+static vdev_uring_t *
+vdev_uring_init(vdev_t *vd, int fd)
+{
+	struct io_uring_params params;
+	vdev_uring_t *vu;
+	int error;
+
+	vu = kmem_zalloc(sizeof (vdev_uring_t), KM_SLEEP);
+
+	bzero(&params, sizeof (params));
+	if (zfs_vdev_uring_sqpoll) {
+		params.flags |= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = zfs_vdev_uring_sqpoll_idle;
+	}
+
+	error = io_uring_queue_init_params(zfs_vdev_uring_entries,
+	    &vu->vu_ring, &params);
+	if (error != 0) {
+		dprintf("io_uring_queue_init_params() returned error %i\n",
+		    error);
+		kmem_free(vu, sizeof (vdev_uring_t));
+		return (NULL);
+	}
+
+	/*
+	 * Registering the file saves an fget()/fput() per I/O, and is
+	 * required for SQ polling on older kernels.
+	 */
+	error = io_uring_register_files(&vu->vu_ring, &fd, 1);
+	if (error != 0) {
+		dprintf("io_uring_register_files() returned error %i\n", error);
+		io_uring_queue_exit(&vu->vu_ring);
+		kmem_free(vu, sizeof (vdev_uring_t));
+		return (NULL);
+	}
+
+	mutex_init(&vu->vu_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&vu->vu_cv, NULL, CV_DEFAULT, NULL);
+	list_create(&vu->vu_inflight, sizeof (zio_t),
+	    offsetof(zio_t, io_uring_node));
+	vu->vu_vd = vd;
+	vu->vu_thread = thread_create(NULL, 0, vdev_uring_thread, vu, 0, &p0,
+	    TS_RUN, maxclsyspri);
+
+	return (vu);
+}
+
+/*
+ * Hand every queued SQE to the kernel.  Called with vu_lock held.  SQEs the
+ * kernel did not take stay queued and go out with the next submission; if
+ * the ring is broken for good the completion thread fails their zios.
+ */
+static void
+vdev_uring_submit(vdev_uring_t *vu)
+{
+	int error;
+
+	ASSERT(MUTEX_HELD(&vu->vu_lock));
+
+	do {
+		error = io_uring_submit(&vu->vu_ring);
+	} while (error == -EINTR);
+
+	if (error < 0)
+		dprintf("io_uring_submit() returned error %i\n", error);
+}
+
+/*
+ * Get a submission queue entry, kicking the ring if it is full.
+ * Called with vu_lock held.
+ */
+static struct io_uring_sqe *
+vdev_uring_get_sqe(vdev_uring_t *vu)
+{
+	struct io_uring_sqe *sqe;
+
+	ASSERT(MUTEX_HELD(&vu->vu_lock));
+
+	while ((sqe = io_uring_get_sqe(&vu->vu_ring)) == NULL)
+		vdev_uring_submit(vu);
+
+	return (sqe);
+}
+
+/*
+ * Submit the SQEs the current thread queued while it was plugged.  Called
+ * by zio_aio_unplug().
+ */
+void
+vdev_file_uring_flush(void)
+{
+	vdev_uring_t *vu = vdev_uring_unsubmitted;
+
+	if (vu == NULL)
+		return;
+
+	vdev_uring_unsubmitted = NULL;
+
+	mutex_enter(&vu->vu_lock);
+	if (!vu->vu_failed)
+		vdev_uring_submit(vu);
+	mutex_exit(&vu->vu_lock);
+}
+
+static void
+vdev_uring_fini(vdev_uring_t *vu)
+{
+	struct io_uring_sqe *sqe;
+
+	/*
+	 * Wake the completion thread with a NOP and wait for it to go.
+	 */
+	mutex_enter(&vu->vu_lock);
+	vu->vu_exiting = B_TRUE;
+	if (vu->vu_thread != NULL) {
+		sqe = vdev_uring_get_sqe(vu);
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, NULL);
+		vdev_uring_submit(vu);
+	}
+	while (vu->vu_thread != NULL)
+		cv_wait(&vu->vu_cv, &vu->vu_lock);
+	mutex_exit(&vu->vu_lock);
+
+	io_uring_queue_exit(&vu->vu_ring);
+	list_destroy(&vu->vu_inflight);
+	mutex_destroy(&vu->vu_lock);
+	cv_destroy(&vu->vu_cv);
+	kmem_free(vu, sizeof (vdev_uring_t));
+}
+
+/*
+ * Queue a read, write or cache flush on the vdev's ring.  Flushes are
+ * marked IOSQE_IO_DRAIN so that they are only started once every write
+ * submitted before them has completed.  While the calling thread is
+ * plugged the SQE is only queued, and vdev_file_uring_flush() submits the
+ * whole run at once.  Returns ENXIO without queueing anything if the ring
+ * has failed or its completion thread has gone away.
+ */
+static int
+vdev_uring_io_start(vdev_uring_t *vu, zio_t *zio)
+{
+	struct io_uring_sqe *sqe;
+	boolean_t plugged = zio_aio_is_plugged();
+
+	/* Don't leave another ring's SQEs waiting behind this one. */
+	if (vdev_uring_unsubmitted != vu)
+		vdev_file_uring_flush();
+
+	mutex_enter(&vu->vu_lock);
+
+	if (vu->vu_failed || vu->vu_thread == NULL) {
+		mutex_exit(&vu->vu_lock);
+		return (ENXIO);
+	}
+
+	sqe = vdev_uring_get_sqe(vu);
+
+	switch (zio->io_type) {
+	case ZIO_TYPE_READ:
+		if (zio->io_iov != NULL)
+			io_uring_prep_readv(sqe, 0, zio->io_iov,
+			    zio->io_iovcnt, zio->io_offset);
+		else
+			io_uring_prep_read(sqe, 0, zio->io_data, zio->io_size,
+			    zio->io_offset);
+		break;
+	case ZIO_TYPE_WRITE:
+		if (zio->io_iov != NULL)
+			io_uring_prep_writev(sqe, 0, zio->io_iov,
+			    zio->io_iovcnt, zio->io_offset);
+		else
+			io_uring_prep_write(sqe, 0, zio->io_data,
+			    zio->io_size, zio->io_offset);
+		break;
+	default:
+		ASSERT(zio->io_type == ZIO_TYPE_IOCTL);
+		io_uring_prep_fsync(sqe, 0, IORING_FSYNC_DATASYNC);
+		sqe->flags |= IOSQE_IO_DRAIN;
+		break;
+	}
+
+	sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data(sqe, zio);
+	list_insert_tail(&vu->vu_inflight, zio);
+
+	if (plugged)
+		vdev_uring_unsubmitted = vu;
+	else
+		vdev_uring_submit(vu);
+
+	mutex_exit(&vu->vu_lock);
+
+	return (0);
+}
+#endif
+
 static int
 vdev_file_open(vdev_t *vd, uint64_t *psize, uint64_t *ashift)
 {
@@ -94,6 +420,11 @@ vdev_file_open(vdev_t *vd, uint64_t *psize, uint64_t *ashift)
 
 	vf->vf_vnode = vp;
 
+#ifdef LINUX_URING
+	if (zfs_vdev_uring)
+		vf->vf_uring = vdev_uring_init(vd, vp->v_fd);
+#endif
+
 #if 0
 	/*
 	 * Make sure it's a regular file.
@@ -130,6 +461,11 @@ vdev_file_close(vdev_t *vd)
 	if (vd->vdev_reopening || vf == NULL)
 		return;
 
+#ifdef LINUX_URING
+	if (vf->vf_uring != NULL)
+		vdev_uring_fini(vf->vf_uring);
+#endif
+
 	if (vf->vf_vnode != NULL) {
 		(void) VOP_PUTPAGE(vf->vf_vnode, 0, 0, B_INVAL, kcred, NULL);
 		(void) VOP_CLOSE(vf->vf_vnode, spa_mode(vd->vdev_spa), 1, 0,
@@ -141,15 +477,47 @@ vdev_file_close(vdev_t *vd)
 	vd->vdev_tsd = NULL;
 }
 
-static int
-vdev_file_io_start(zio_t *zio)
+/*
+ * Flush the device's write cache after a successful fsync.
+ */
+static void
+vdev_file_flushwc(zio_t *zio)
 {
 	vdev_t *vd = zio->io_vd;
 	vdev_file_t *vf = vd->vdev_tsd;
-#ifdef LINUX_AIO
-	struct iocb *iocbp = &zio->io_aio;
+	int error;
+
+	if (vd->vdev_nowritecache) {
+		zio->io_error = ENOTSUP;
+		return;
+	}
+
+	/* Flush the write cache */
+	error = flushwc(vf->vf_vnode);
+	dprintf("flushwc(%s) = %d\n", vd->vdev_path ? vd->vdev_path :
+	    vd->vdev_parent ? vd->vdev_ops->vdev_op_type : spa_name(vd->vdev_spa),
+	    error);
+
+	if (error) {
+#ifdef _KERNEL
+		cmn_err(CE_WARN, "Failed to flush write cache "
+		    "on device '%s'. Data on pool '%s' may be lost "
+		    "if power fails. No further warnings will "
+		    "be given.", vd->vdev_path ? vd->vdev_path :
+		    vd->vdev_parent ? vd->vdev_ops->vdev_op_type :
+		    spa_name(vd->vdev_spa), spa_name(vd->vdev_spa));
 #endif
 
+		vd->vdev_nowritecache = B_TRUE;
+		zio->io_error = error;
+	}
+}
+
+static int
+vdev_file_io_start(zio_t *zio)
+{
+	vdev_t *vd = zio->io_vd;
+	vdev_file_t *vf = vd->vdev_tsd;
 	ssize_t resid;
         int error;
 
@@ -165,34 +533,16 @@ vdev_file_io_start(zio_t *zio)
  			if (zfs_nocacheflush)
  				break;
 
+#ifdef LINUX_URING
+			if (vf->vf_uring != NULL &&
+			    vdev_uring_io_start(vf->vf_uring, zio) == 0)
+				return (ZIO_PIPELINE_STOP);
+#endif
+
 			/* This doesn't actually do much with O_DIRECT... */
 			zio->io_error = VOP_FSYNC(vf->vf_vnode, FSYNC | FDSYNC,
 			    kcred, NULL);
-			if (vd->vdev_nowritecache) {
-				zio->io_error = ENOTSUP;
-				break;
-			}
-
-			/* Flush the write cache */
-			error = flushwc(vf->vf_vnode);
-			dprintf("flushwc(%s) = %d\n", vd->vdev_path ? vd->vdev_path :
-                                               	    vd->vdev_parent ? vd->vdev_ops->vdev_op_type : spa_name(vd->vdev_spa), 
-			    error);
-
-			if (error) {
-#ifdef _KERNEL
-				cmn_err(CE_WARN, "Failed to flush write cache "
-				    "on device '%s'. Data on pool '%s' may be lost "
-				    "if power fails. No further warnings will "
-				    "be given.", vd->vdev_path ? vd->vdev_path :
-                                              	    vd->vdev_parent ? vd->vdev_ops->vdev_op_type : spa_name(vd->vdev_spa), 
-				    spa_name(vd->vdev_spa));
-#endif
-
-				vd->vdev_nowritecache = B_TRUE;
-				zio->io_error = error;
-			}
-
+			vdev_file_flushwc(zio);
 			break;
 		default:
 			zio->io_error = ENOTSUP;
@@ -201,35 +551,45 @@ vdev_file_io_start(zio_t *zio)
 		return (ZIO_PIPELINE_CONTINUE);
 	}
 
+#ifdef LINUX_URING
+	if (vf->vf_uring != NULL && vdev_uring_io_start(vf->vf_uring, zio) == 0)
+		return (ZIO_PIPELINE_STOP);
+#endif
+
 #ifdef LINUX_AIO
 	if (zio->io_aio_ctx && zio->io_aio_ctx->zac_enabled) {
-		if (zio->io_type == ZIO_TYPE_READ)
-			io_prep_pread(&zio->io_aio, vf->vf_vnode->v_fd,
-			    zio->io_data, zio->io_size, zio->io_offset);
+		int fd = vf->vf_vnode->v_fd;
+
+		if (zio->io_iov != NULL && zio->io_type == ZIO_TYPE_READ)
+			io_prep_preadv(&zio->io_aio, fd, zio->io_iov,
+			    zio->io_iovcnt, zio->io_offset);
+		else if (zio->io_iov != NULL)
+			io_prep_pwritev(&zio->io_aio, fd, zio->io_iov,
+			    zio->io_iovcnt, zio->io_offset);
+		else if (zio->io_type == ZIO_TYPE_READ)
+			io_prep_pread(&zio->io_aio, fd, zio->io_data,
+			    zio->io_size, zio->io_offset);
 		else
-			io_prep_pwrite(&zio->io_aio, vf->vf_vnode->v_fd,
-			    zio->io_data, zio->io_size, zio->io_offset);
-
-		zio->io_aio.data = zio;
-
-		do {
-			error = io_submit(zio->io_aio_ctx->zac_ctx, 1, &iocbp);
-		} while (error == -EINTR);
+			io_prep_pwrite(&zio->io_aio, fd, zio->io_data,
+			    zio->io_size, zio->io_offset);
 
-		if (error < 0) {
-			zio->io_error = -error;
-			zio_interrupt(zio);
-		} else
-			VERIFY(error == 1);
+		/* May be batched with other I/Os; see zio_aio_plug() */
+		zio_aio_submit(zio);
 
 		return (ZIO_PIPELINE_STOP);
 	}
 #endif
 
-	zio->io_error = vn_rdwr(zio->io_type == ZIO_TYPE_READ ?
-	    UIO_READ : UIO_WRITE, vf->vf_vnode, zio->io_data,
-	    zio->io_size, zio->io_offset, UIO_SYSSPACE,
-	    0, RLIM64_INFINITY, kcred, &resid);
+	if (zio->io_iov != NULL)
+		zio->io_error = vn_rdwrv(zio->io_type == ZIO_TYPE_READ ?
+		    UIO_READ : UIO_WRITE, vf->vf_vnode, zio->io_iov,
+		    zio->io_iovcnt, zio->io_offset, UIO_SYSSPACE,
+		    0, RLIM64_INFINITY, kcred, &resid);
+	else
+		zio->io_error = vn_rdwr(zio->io_type == ZIO_TYPE_READ ?
+		    UIO_READ : UIO_WRITE, vf->vf_vnode, zio->io_data,
+		    zio->io_size, zio->io_offset, UIO_SYSSPACE,
+		    0, RLIM64_INFINITY, kcred, &resid);
 
 	if (resid != 0 && zio->io_error == 0)
 		zio->io_error = ENOSPC;
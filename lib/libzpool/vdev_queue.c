@@ -56,6 +56,37 @@ int zfs_vdev_aggregation_limit = SPA_MAXBLOCKSIZE;
 int zfs_vdev_read_gap_limit = 32 << 10;
 int zfs_vdev_write_gap_limit = 4 << 10;
 
+/*
+ * When zfs_vdev_aggregate_vectored is set, an aggregate I/O is issued as a
+ * scatter-gather list over the buffers of the I/Os it combines rather than
+ * through a bounce buffer.  Read gaps land in vdev_queue_skip_buf and are
+ * thrown away; optional writes, which carry no data, are written from
+ * vdev_queue_zero_buf.  Both come from the zio buffer caches, which are
+ * page aligned like the bounce buffers, as O_DIRECT requires.
+ */
+int zfs_vdev_aggregate_vectored = 1;
+
+#define	VDEV_QUEUE_AGG_MAXIOV	1024	/* IOV_MAX */
+
+static char *vdev_queue_skip_buf;
+static char *vdev_queue_zero_buf;
+
+void
+vdev_queue_buf_init(void)
+{
+	vdev_queue_skip_buf = zio_buf_alloc(SPA_MAXBLOCKSIZE);
+	vdev_queue_zero_buf = zio_buf_alloc(SPA_MAXBLOCKSIZE);
+	bzero(vdev_queue_zero_buf, SPA_MAXBLOCKSIZE);
+}
+
+void
+vdev_queue_buf_fini(void)
+{
+	zio_buf_free(vdev_queue_skip_buf, SPA_MAXBLOCKSIZE);
+	zio_buf_free(vdev_queue_zero_buf, SPA_MAXBLOCKSIZE);
+	vdev_queue_skip_buf = vdev_queue_zero_buf = NULL;
+}
+
 /*
  * Virtual device vector for disk I/O scheduling.
  */
@@ -154,6 +185,12 @@ vdev_queue_agg_io_done(zio_t *aio)
 {
 	zio_t *pio;
 
+	if (aio->io_iov != NULL) {
+		kmem_free(aio->io_iov,
+		    aio->io_iovcnt * sizeof (struct iovec));
+		return;
+	}
+
 	while ((pio = zio_walk_parents(aio)) != NULL)
 		if (aio->io_type == ZIO_TYPE_READ)
 			bcopy((char *)aio->io_data + (pio->io_offset -
@@ -171,6 +208,76 @@ vdev_queue_agg_io_done(zio_t *aio)
 #define	IO_SPAN(fio, lio) ((lio)->io_offset + (lio)->io_size - (fio)->io_offset)
 #define	IO_GAP(fio, lio) (-IO_SPAN(lio, fio))
 
+/*
+ * Append size bytes of one of the shared fill buffers to iov, in pieces no
+ * larger than the buffer.  Passing a NULL iov only counts the pieces.
+ */
+static int
+vdev_queue_agg_fill(struct iovec *iov, int iovcnt, char *fill,
+    uint64_t size)
+{
+	uint64_t len;
+
+	for (; size != 0; size -= len) {
+		len = MIN(size, SPA_MAXBLOCKSIZE);
+		if (iov != NULL) {
+			iov[iovcnt].iov_base = fill;
+			iov[iovcnt].iov_len = len;
+		}
+		iovcnt++;
+	}
+
+	return (iovcnt);
+}
+
+/*
+ * Build the scatter-gather list for an aggregate of fio through lio.
+ * Returns NULL if it would need more than VDEV_QUEUE_AGG_MAXIOV segments,
+ * in which case the caller uses a bounce buffer.
+ */
+static struct iovec *
+vdev_queue_agg_iov(avl_tree_t *t, zio_t *fio, zio_t *lio, int *iovcntp)
+{
+	struct iovec *iov = NULL;
+	zio_t *dio, *pio;
+	int iovcnt, pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		iovcnt = 0;
+		pio = NULL;
+		dio = fio;
+		for (;;) {
+			if (pio != NULL && IO_GAP(pio, dio) != 0)
+				iovcnt = vdev_queue_agg_fill(iov, iovcnt,
+				    vdev_queue_skip_buf, IO_GAP(pio, dio));
+			if (dio->io_flags & ZIO_FLAG_NODATA) {
+				iovcnt = vdev_queue_agg_fill(iov, iovcnt,
+				    vdev_queue_zero_buf, dio->io_size);
+			} else {
+				if (iov != NULL) {
+					iov[iovcnt].iov_base = dio->io_data;
+					iov[iovcnt].iov_len = dio->io_size;
+				}
+				iovcnt++;
+			}
+			if (dio == lio)
+				break;
+			pio = dio;
+			dio = AVL_NEXT(t, dio);
+		}
+
+		if (iov == NULL) {
+			if (iovcnt > VDEV_QUEUE_AGG_MAXIOV)
+				return (NULL);
+			iov = kmem_alloc(iovcnt * sizeof (struct iovec),
+			    KM_SLEEP);
+		}
+	}
+
+	*iovcntp = iovcnt;
+	return (iov);
+}
+
 static zio_t *
 vdev_queue_io_to_issue(vdev_queue_t *vq, uint64_t pending_limit)
 {
@@ -282,12 +389,20 @@ again:
 
 	if (fio != lio) {
 		uint64_t size = IO_SPAN(fio, lio);
+		struct iovec *iov = NULL;
+		int iovcnt = 0;
 		ASSERT(size <= zfs_vdev_aggregation_limit);
 
+		if (zfs_vdev_aggregate_vectored)
+			iov = vdev_queue_agg_iov(t, fio, lio, &iovcnt);
+
 		aio = zio_vdev_delegated_io(fio->io_vd, fio->io_offset,
-		    zio_buf_alloc(size), size, fio->io_type, ZIO_PRIORITY_AGG,
+		    iov != NULL ? NULL : zio_buf_alloc(size), size,
+		    fio->io_type, ZIO_PRIORITY_AGG,
 		    flags | ZIO_FLAG_DONT_CACHE | ZIO_FLAG_DONT_QUEUE,
 		    vdev_queue_agg_io_done, NULL);
+		aio->io_iov = iov;
+		aio->io_iovcnt = iovcnt;
 
 		nio = fio;
 		do {
@@ -296,7 +411,11 @@ again:
 			ASSERT(dio->io_type == aio->io_type);
 			ASSERT(dio->io_vdev_tree == t);
 
-			if (dio->io_flags & ZIO_FLAG_NODATA) {
+			if (iov != NULL) {
+				/* The data is used in place */
+				ASSERT(!(dio->io_flags & ZIO_FLAG_NODATA) ||
+				    dio->io_type == ZIO_TYPE_WRITE);
+			} else if (dio->io_flags & ZIO_FLAG_NODATA) {
 				ASSERT(dio->io_type == ZIO_TYPE_WRITE);
 				bzero((char *)aio->io_data + (dio->io_offset -
 				    aio->io_offset), dio->io_size);
@@ -387,6 +506,13 @@ vdev_queue_io_done(zio_t *zio)
 
 	avl_remove(&vq->vq_pending_tree, zio);
 
+#ifdef LINUX_AIO
+	/*
+	 * Submit the I/Os we are about to issue to the kernel in one go.
+	 */
+	zio_aio_plug();
+#endif
+
 	for (int i = 0; i < zfs_vdev_ramp_rate; i++) {
 		zio_t *nio = vdev_queue_io_to_issue(vq, zfs_vdev_max_pending);
 		if (nio == NULL)
@@ -402,4 +528,8 @@ vdev_queue_io_done(zio_t *zio)
 	}
 
 	mutex_exit(&vq->vq_lock);
+
+#ifdef LINUX_AIO
+	zio_aio_unplug(zio->io_spa);
+#endif
 }
@@ -32,6 +32,11 @@
 #include <sys/fs/zfs.h>
 #include <sys/fm/fs/zfs.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define	VDEV_RAIDZ_HAVE_X86
+#endif
+
 /*
  * Virtual device vector for RAID-Z.
  *
@@ -252,6 +257,622 @@ vdev_raidz_exp2(uint_t a, int exp)
 	return (vdev_raidz_pow2[exp]);
 }
 
+/*
+ * Vectorized parity generation and reconstruction
+ * ------------------------------------------------
+ *
+ * Besides the 64-bit routines below, parity can be generated and the
+ * data columns rebuilt with SIMD kernels.  Multiplication by 2 is done on
+ * whole vectors as in VDEV_RAIDZ_64MUL_2(); multiplication by an arbitrary
+ * constant c, which is what reconstruction needs, splits every byte in two
+ * nibbles and looks them up with pshufb in the 16-entry tables of c * n and
+ * c * (n << 4).  The kernels are:
+ *
+ *	vrm_gen		fold one data column into the P, Q and R columns
+ *	vrm_mul_add	dst = (first ? 0 : dst) + c * src
+ *
+ * vdev_raidz_math_init() checks every kernel set the CPU supports against
+ * the byte at a time reference and selects the fastest one; the "scalar"
+ * set means the original routines.  vdev_raidz_impl forces one by name.
+ */
+typedef struct vdev_raidz_math {
+	const char	*vrm_name;
+	boolean_t	(*vrm_supported)(void);
+	void		(*vrm_gen)(int, uint8_t **, const uint8_t *, size_t,
+	    size_t);
+	void		(*vrm_mul_add)(uint8_t *, const uint8_t *, size_t,
+	    const uint8_t *, boolean_t);
+} vdev_raidz_math_t;
+
+char *vdev_raidz_impl = NULL;
+
+/*
+ * Build the two nibble product tables for multiplication by c.
+ */
+static void
+vdev_raidz_mul_tbl(uint8_t c, uint8_t *tbl)
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		tbl[i] = (c == 0) ? 0 : vdev_raidz_exp2(i, vdev_raidz_log2[c]);
+		tbl[16 + i] = (c == 0) ? 0 :
+		    vdev_raidz_exp2(i << 4, vdev_raidz_log2[c]);
+	}
+}
+
+/*
+ * Byte at a time versions of the kernels, used for whatever does not fill
+ * a whole vector and as the reference the kernels are checked against.
+ */
+static void
+vdev_raidz_gen_tail(int nparity, uint8_t **pqr, const uint8_t *src,
+    size_t off, size_t csize, size_t psize)
+{
+	uint8_t *p = pqr[VDEV_RAIDZ_P];
+	uint8_t *q = pqr[VDEV_RAIDZ_Q];
+	uint8_t *r = pqr[VDEV_RAIDZ_R];
+	uint8_t s;
+	size_t i;
+
+	if (nparity == 1)
+		psize = MIN(psize, csize);
+
+	for (i = off; i < psize; i++) {
+		s = (i < csize) ? src[i] : 0;
+		p[i] ^= s;
+		if (nparity > 1)
+			q[i] = VDEV_RAIDZ_MUL_2(q[i]) ^ s;
+		if (nparity > 2)
+			r[i] = VDEV_RAIDZ_MUL_4(r[i]) ^ s;
+	}
+}
+
+static void
+vdev_raidz_mul_add_tail(uint8_t *dst, const uint8_t *src, size_t off,
+    size_t size, const uint8_t *tbl, boolean_t first)
+{
+	uint8_t v;
+	size_t i;
+
+	for (i = off; i < size; i++) {
+		v = tbl[src[i] & 0x0f] ^ tbl[16 + (src[i] >> 4)];
+		dst[i] = first ? v : dst[i] ^ v;
+	}
+}
+
+#ifdef VDEV_RAIDZ_HAVE_X86
+static boolean_t
+vdev_raidz_ssse3_supported(void)
+{
+	return (__builtin_cpu_supports("ssse3") ? B_TRUE : B_FALSE);
+}
+
+static boolean_t
+vdev_raidz_avx2_supported(void)
+{
+	return (__builtin_cpu_supports("avx2") ? B_TRUE : B_FALSE);
+}
+
+static boolean_t
+vdev_raidz_avx512bw_supported(void)
+{
+	return ((__builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512bw")) ? B_TRUE : B_FALSE);
+}
+
+#define	VLOAD(p)	_mm_loadu_si128((const __m128i *)(p))
+#define	VSTORE(p, v)	_mm_storeu_si128((__m128i *)(p), (v))
+#define	VXOR(a, b)	_mm_xor_si128((a), (b))
+#define	VTBL(t)		_mm_loadu_si128((const __m128i *)(t))
+
+/*
+ * x * 2: shift every byte left and fold 0x1d back into the bytes whose
+ * top bit was set.  x * c: look the low and high nibbles up in the two
+ * 16-byte product tables of c.
+ */
+#define	VMUL2(x)	vdev_raidz_mul2_ssse3(x)
+#define	VMUL(x, lo, hi)	vdev_raidz_mul_ssse3(x, lo, hi)
+
+__attribute__((target("ssse3"), always_inline))
+static inline __m128i
+vdev_raidz_mul2_ssse3(__m128i x)
+{
+	__m128i m = _mm_cmpgt_epi8(_mm_setzero_si128(), x);
+
+	return (_mm_xor_si128(_mm_add_epi8(x, x),
+	    _mm_and_si128(m, _mm_set1_epi8(0x1d))));
+}
+
+__attribute__((target("ssse3"), always_inline))
+static inline __m128i
+vdev_raidz_mul_ssse3(__m128i x, __m128i tlo, __m128i thi)
+{
+	__m128i nib = _mm_set1_epi8(0x0f);
+
+	return (_mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(x, nib)),
+	    _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(x, 4), nib))));
+}
+
+__attribute__((target("ssse3"), always_inline))
+static inline void
+vdev_raidz_gen_ssse3_impl(int nparity, uint8_t **pqr, const uint8_t *src,
+    size_t csize, size_t psize)
+{
+	uint8_t *p = pqr[VDEV_RAIDZ_P];
+	uint8_t *q = pqr[VDEV_RAIDZ_Q];
+	uint8_t *r = pqr[VDEV_RAIDZ_R];
+	__m128i s;
+	size_t i;
+
+	for (i = 0; i + 16 <= csize; i += 16) {
+		s = VLOAD(src + i);
+		VSTORE(p + i, VXOR(VLOAD(p + i), s));
+		if (nparity > 1)
+			VSTORE(q + i, VXOR(VMUL2(VLOAD(q + i)), s));
+		if (nparity > 2)
+			VSTORE(r + i, VXOR(VMUL2(VMUL2(VLOAD(r + i))), s));
+	}
+	vdev_raidz_gen_tail(nparity, pqr, src, i, csize, csize);
+
+	for (i = csize; nparity > 1 && i + 16 <= psize; i += 16) {
+		VSTORE(q + i, VMUL2(VLOAD(q + i)));
+		if (nparity > 2)
+			VSTORE(r + i, VMUL2(VMUL2(VLOAD(r + i))));
+	}
+	vdev_raidz_gen_tail(nparity, pqr, src, i, csize, psize);
+}
+
+__attribute__((target("ssse3")))
+static void
+vdev_raidz_gen_ssse3(int nparity, uint8_t **pqr, const uint8_t *src,
+    size_t csize, size_t psize)
+{
+	switch (nparity) {
+	case 1:
+		vdev_raidz_gen_ssse3_impl(1, pqr, src, csize, psize);
+		break;
+	case 2:
+		vdev_raidz_gen_ssse3_impl(2, pqr, src, csize, psize);
+		break;
+	default:
+		vdev_raidz_gen_ssse3_impl(3, pqr, src, csize, psize);
+		break;
+	}
+}
+
+__attribute__((target("ssse3")))
+static void
+vdev_raidz_mul_add_ssse3(uint8_t *dst, const uint8_t *src, size_t size,
+    const uint8_t *tbl, boolean_t first)
+{
+	__m128i tlo = VTBL(tbl);
+	__m128i thi = VTBL(tbl + 16);
+	__m128i x;
+	size_t i;
+
+	for (i = 0; i + 16 <= size; i += 16) {
+		x = VMUL(VLOAD(src + i), tlo, thi);
+		if (!first)
+			x = VXOR(x, VLOAD(dst + i));
+		VSTORE(dst + i, x);
+	}
+	vdev_raidz_mul_add_tail(dst, src, i, size, tbl, first);
+}
+
+#undef	VLOAD
+#undef	VSTORE
+#undef	VXOR
+#undef	VTBL
+#undef	VMUL2
+#undef	VMUL
+
+#define	VLOAD(p)	_mm256_loadu_si256((const __m256i *)(p))
+#define	VSTORE(p, v)	_mm256_storeu_si256((__m256i *)(p), (v))
+#define	VXOR(a, b)	_mm256_xor_si256((a), (b))
+#define	VTBL(t)		_mm256_broadcastsi128_si256(\
+	_mm_loadu_si128((const __m128i *)(t)))
+
+#define	VMUL2(x)	vdev_raidz_mul2_avx2(x)
+#define	VMUL(x, lo, hi)	vdev_raidz_mul_avx2(x, lo, hi)
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i
+vdev_raidz_mul2_avx2(__m256i x)
+{
+	__m256i m = _mm256_cmpgt_epi8(_mm256_setzero_si256(), x);
+
+	return (_mm256_xor_si256(_mm256_add_epi8(x, x),
+	    _mm256_and_si256(m, _mm256_set1_epi8(0x1d))));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i
+vdev_raidz_mul_avx2(__m256i x, __m256i tlo, __m256i thi)
+{
+	__m256i nib = _mm256_set1_epi8(0x0f);
+
+	return (_mm256_xor_si256(
+	    _mm256_shuffle_epi8(tlo, _mm256_and_si256(x, nib)),
+	    _mm256_shuffle_epi8(thi,
+	    _mm256_and_si256(_mm256_srli_epi64(x, 4), nib))));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void
+vdev_raidz_gen_avx2_impl(int nparity, uint8_t **pqr, const uint8_t *src,
+    size_t csize, size_t psize)
+{
+	uint8_t *p = pqr[VDEV_RAIDZ_P];
+	uint8_t *q = pqr[VDEV_RAIDZ_Q];
+	uint8_t *r = pqr[VDEV_RAIDZ_R];
+	__m256i s;
+	size_t i;
+
+	for (i = 0; i + 32 <= csize; i += 32) {
+		s = VLOAD(src + i);
+		VSTORE(p + i, VXOR(VLOAD(p + i), s));
+		if (nparity > 1)
+			VSTORE(q + i, VXOR(VMUL2(VLOAD(q + i)), s));
+		if (nparity > 2)
+			VSTORE(r + i, VXOR(VMUL2(VMUL2(VLOAD(r + i))), s));
+	}
+	vdev_raidz_gen_tail(nparity, pqr, src, i, csize, csize);
+
+	for (i = csize; nparity > 1 && i + 32 <= psize; i += 32) {
+		VSTORE(q + i, VMUL2(VLOAD(q + i)));
+		if (nparity > 2)
+			VSTORE(r + i, VMUL2(VMUL2(VLOAD(r + i))));
+	}
+	_mm256_zeroupper();
+	vdev_raidz_gen_tail(nparity, pqr, src, i, csize, psize);
+}
+
+__attribute__((target("avx2")))
+static void
+vdev_raidz_gen_avx2(int nparity, uint8_t **pqr, const uint8_t *src,
+    size_t csize, size_t psize)
+{
+	switch (nparity) {
+	case 1:
+		vdev_raidz_gen_avx2_impl(1, pqr, src, csize, psize);
+		break;
+	case 2:
+		vdev_raidz_gen_avx2_impl(2, pqr, src, csize, psize);
+		break;
+	default:
+		vdev_raidz_gen_avx2_impl(3, pqr, src, csize, psize);
+		break;
+	}
+}
+
+__attribute__((target("avx2")))
+static void
+vdev_raidz_mul_add_avx2(uint8_t *dst, const uint8_t *src, size_t size,
+    const uint8_t *tbl, boolean_t first)
+{
+	__m256i tlo = VTBL(tbl);
+	__m256i thi = VTBL(tbl + 16);
+	__m256i x;
+	size_t i;
+
+	for (i = 0; i + 32 <= size; i += 32) {
+		x = VMUL(VLOAD(src + i), tlo, thi);
+		if (!first)
+			x = VXOR(x, VLOAD(dst + i));
+		VSTORE(dst + i, x);
+	}
+	_mm256_zeroupper();
+	vdev_raidz_mul_add_tail(dst, src, i, size, tbl, first);
+}
+
+#undef	VLOAD
+#undef	VSTORE
+#undef	VXOR
+#undef	VTBL
+#undef	VMUL2
+#undef	VMUL
+
+#define	VLOAD(p)	_mm512_loadu_si512((p))
+#define	VSTORE(p, v)	_mm512_storeu_si512((p), (v))
+#define	VXOR(a, b)	_mm512_xor_si512((a), (b))
+#define	VTBL(t)		_mm512_broadcast_i32x4(\
+	_mm_loadu_si128((const __m128i *)(t)))
+
+/*
+ * pshufb works within 128-bit lanes, so the product tables are broadcast
+ * to every lane; the byte compare is replaced by the sign bit mask.
+ */
+#define	VMUL2(x)	vdev_raidz_mul2_avx512bw(x)
+#define	VMUL(x, lo, hi)	vdev_raidz_mul_avx512bw(x, lo, hi)
+
+__attribute__((target("avx512f,avx512bw"), always_inline))
+static inline __m512i
+vdev_raidz_mul2_avx512bw(__m512i x)
+{
+	__mmask64 m = _mm512_movepi8_mask(x);
+
+	return (_mm512_xor_si512(_mm512_add_epi8(x, x),
+	    _mm512_maskz_mov_epi8(m, _mm512_set1_epi8(0x1d))));
+}
+
+__attribute__((target("avx512f,avx512bw"), always_inline))
+static inline __m512i
+vdev_raidz_mul_avx512bw(__m512i x, __m512i tlo, __m512i thi)
+{
+	__m512i nib = _mm512_set1_epi8(0x0f);
+
+	return (_mm512_xor_si512(
+	    _mm512_shuffle_epi8(tlo, _mm512_and_si512(x, nib)),
+	    _mm512_shuffle_epi8(thi,
+	    _mm512_and_si512(_mm512_srli_epi64(x, 4), nib))));
+}
+
+__attribute__((target("avx512f,avx512bw"), always_inline))
+static inline void
+vdev_raidz_gen_avx512bw_impl(int nparity, uint8_t **pqr, const uint8_t *src,
+    size_t csize, size_t psize)
+{
+	uint8_t *p = pqr[VDEV_RAIDZ_P];
+	uint8_t *q = pqr[VDEV_RAIDZ_Q];
+	uint8_t *r = pqr[VDEV_RAIDZ_R];
+	__m512i s;
+	size_t i;
+
+	for (i = 0; i + 64 <= csize; i += 64) {
+		s = VLOAD(src + i);
+		VSTORE(p + i, VXOR(VLOAD(p + i), s));
+		if (nparity > 1)
+			VSTORE(q + i, VXOR(VMUL2(VLOAD(q + i)), s));
+		if (nparity > 2)
+			VSTORE(r + i, VXOR(VMUL2(VMUL2(VLOAD(r + i))), s));
+	}
+	vdev_raidz_gen_tail(nparity, pqr, src, i, csize, csize);
+
+	for (i = csize; nparity > 1 && i + 64 <= psize; i += 64) {
+		VSTORE(q + i, VMUL2(VLOAD(q + i)));
+		if (nparity > 2)
+			VSTORE(r + i, VMUL2(VMUL2(VLOAD(r + i))));
+	}
+	_mm256_zeroupper();
+	vdev_raidz_gen_tail(nparity, pqr, src, i, csize, psize);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void
+vdev_raidz_gen_avx512bw(int nparity, uint8_t **pqr, const uint8_t *src,
+    size_t csize, size_t psize)
+{
+	switch (nparity) {
+	case 1:
+		vdev_raidz_gen_avx512bw_impl(1, pqr, src, csize, psize);
+		break;
+	case 2:
+		vdev_raidz_gen_avx512bw_impl(2, pqr, src, csize, psize);
+		break;
+	default:
+		vdev_raidz_gen_avx512bw_impl(3, pqr, src, csize, psize);
+		break;
+	}
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void
+vdev_raidz_mul_add_avx512bw(uint8_t *dst, const uint8_t *src, size_t size,
+    const uint8_t *tbl, boolean_t first)
+{
+	__m512i tlo = VTBL(tbl);
+	__m512i thi = VTBL(tbl + 16);
+	__m512i x;
+	size_t i;
+
+	for (i = 0; i + 64 <= size; i += 64) {
+		x = VMUL(VLOAD(src + i), tlo, thi);
+		if (!first)
+			x = VXOR(x, VLOAD(dst + i));
+		VSTORE(dst + i, x);
+	}
+	_mm256_zeroupper();
+	vdev_raidz_mul_add_tail(dst, src, i, size, tbl, first);
+}
+
+#undef	VLOAD
+#undef	VSTORE
+#undef	VXOR
+#undef	VTBL
+#undef	VMUL2
+#undef	VMUL
+
+#endif	/* VDEV_RAIDZ_HAVE_X86 */
+
+static boolean_t
+vdev_raidz_scalar_supported(void)
+{
+	return (B_TRUE);
+}
+
+static const vdev_raidz_math_t vdev_raidz_maths[] = {
+	{ "scalar", vdev_raidz_scalar_supported, NULL, NULL },
+#ifdef VDEV_RAIDZ_HAVE_X86
+	{ "ssse3", vdev_raidz_ssse3_supported, vdev_raidz_gen_ssse3,
+	    vdev_raidz_mul_add_ssse3 },
+	{ "avx2", vdev_raidz_avx2_supported, vdev_raidz_gen_avx2,
+	    vdev_raidz_mul_add_avx2 },
+	{ "avx512bw", vdev_raidz_avx512bw_supported, vdev_raidz_gen_avx512bw,
+	    vdev_raidz_mul_add_avx512bw },
+#endif
+};
+
+#define	VDEV_RAIDZ_NMATHS \
+	(sizeof (vdev_raidz_maths) / sizeof (vdev_raidz_maths[0]))
+
+static const vdev_raidz_math_t *vdev_raidz_math = &vdev_raidz_maths[0];
+
+static void
+vdev_raidz_mul_add(uint8_t *dst, const uint8_t *src, size_t size, uint8_t c,
+    boolean_t first)
+{
+	uint8_t tbl[32];
+
+	vdev_raidz_mul_tbl(c, tbl);
+	vdev_raidz_math->vrm_mul_add(dst, src, size, tbl, first);
+}
+
+/*
+ * Check a kernel set against the reference on sizes that leave a partial
+ * vector at the end of both the data and the zero-filled part of a column.
+ */
+#define	VDEV_RAIDZ_TEST_SIZE	(4096 + 40)
+
+static boolean_t
+vdev_raidz_math_verify(const vdev_raidz_math_t *vrm, uint8_t *buf)
+{
+	static const uint8_t coefs[] = { 0, 1, 2, 0x1d, 0x8e, 0xff };
+	size_t psize = VDEV_RAIDZ_TEST_SIZE;
+	size_t csize = psize - 104;
+	uint8_t *src = buf;
+	uint8_t *ref[VDEV_RAIDZ_MAXPARITY], *pqr[VDEV_RAIDZ_MAXPARITY];
+	uint8_t tbl[32];
+	int i, first;
+
+	for (i = 0; i < VDEV_RAIDZ_MAXPARITY; i++) {
+		ref[i] = buf + (1 + i) * psize;
+		pqr[i] = buf + (1 + VDEV_RAIDZ_MAXPARITY + i) * psize;
+		bcopy(ref[i], pqr[i], psize);
+	}
+
+	vdev_raidz_gen_tail(3, ref, src, 0, csize, psize);
+	vrm->vrm_gen(3, pqr, src, csize, psize);
+	for (i = 0; i < VDEV_RAIDZ_MAXPARITY; i++) {
+		if (bcmp(ref[i], pqr[i], psize) != 0)
+			return (B_FALSE);
+	}
+
+	for (i = 0; i < sizeof (coefs); i++) {
+		for (first = 0; first < 2; first++) {
+			vdev_raidz_mul_tbl(coefs[i], tbl);
+			vdev_raidz_mul_add_tail(ref[0], src, 0, csize, tbl,
+			    first);
+			vrm->vrm_mul_add(pqr[0], src, csize, tbl, first);
+			if (bcmp(ref[0], pqr[0], psize) != 0)
+				return (B_FALSE);
+		}
+	}
+
+	return (B_TRUE);
+}
+
+/*
+ * Select the parity kernels.  Called once from zio_init().
+ */
+void
+vdev_raidz_math_init(void)
+{
+	const vdev_raidz_math_t *vrm, *best = NULL;
+	uint8_t *buf, *pqr[VDEV_RAIDZ_MAXPARITY];
+	size_t size, csize = SPA_MAXBLOCKSIZE / 4;
+	hrtime_t t, best_time = 0;
+	int i, j;
+
+	size = MAX(csize * 3, VDEV_RAIDZ_TEST_SIZE *
+	    (1 + 2 * VDEV_RAIDZ_MAXPARITY));
+	buf = kmem_alloc(size, KM_SLEEP);
+	for (i = 0; i < size; i++)
+		buf[i] = (uint8_t)(i * 2654435761U >> 24);
+
+	for (i = 0; i < VDEV_RAIDZ_NMATHS; i++) {
+		vrm = &vdev_raidz_maths[i];
+		if (!vrm->vrm_supported())
+			continue;
+
+		if (vrm->vrm_gen != NULL && !vdev_raidz_math_verify(vrm, buf)) {
+			cmn_err(CE_WARN, "raidz: '%s' implementation gives "
+			    "wrong results, not using it", vrm->vrm_name);
+			continue;
+		}
+
+		if (vdev_raidz_impl != NULL) {
+			if (strcmp(vdev_raidz_impl, vrm->vrm_name) == 0)
+				best = vrm;
+			continue;
+		}
+
+		/*
+		 * Any of the kernels beats the byte at a time log table
+		 * lookups of the original reconstruction code, so only time
+		 * the kernels against each other, on double parity.
+		 */
+		if (vrm->vrm_gen == NULL) {
+			if (best == NULL)
+				best = vrm;
+			continue;
+		}
+
+		pqr[VDEV_RAIDZ_P] = buf + csize;
+		pqr[VDEV_RAIDZ_Q] = buf + 2 * csize;
+		pqr[VDEV_RAIDZ_R] = NULL;
+		t = gethrtime();
+		for (j = 0; j < 32; j++)
+			vrm->vrm_gen(2, pqr, buf, csize, csize);
+		t = gethrtime() - t;
+		if (best == NULL || best->vrm_gen == NULL || t < best_time) {
+			best = vrm;
+			best_time = t;
+		}
+	}
+	kmem_free(buf, size);
+
+	if (best == NULL) {
+		cmn_err(CE_WARN, "raidz: unknown implementation '%s'",
+		    vdev_raidz_impl);
+		best = &vdev_raidz_maths[0];
+	}
+	vdev_raidz_math = best;
+}
+
+const char *
+vdev_raidz_math_impl(void)
+{
+	return (vdev_raidz_math->vrm_name);
+}
+
+/*
+ * Generate parity with the selected kernels: the first data column is
+ * copied into every parity column, the others are folded in.
+ */
+static void
+vdev_raidz_generate_parity_vec(raidz_map_t *rm, int nparity)
+{
+	uint8_t *pqr[VDEV_RAIDZ_MAXPARITY] = { NULL, NULL, NULL };
+	uint64_t psize = rm->rm_col[VDEV_RAIDZ_P].rc_size;
+	uint64_t csize;
+	uint8_t *src;
+	int c, i;
+
+	for (i = 0; i < nparity; i++) {
+		ASSERT(rm->rm_col[i].rc_size == psize);
+		pqr[i] = rm->rm_col[i].rc_data;
+	}
+
+	for (c = rm->rm_firstdatacol; c < rm->rm_cols; c++) {
+		src = rm->rm_col[c].rc_data;
+		csize = rm->rm_col[c].rc_size;
+		ASSERT(csize <= psize);
+
+		if (c != rm->rm_firstdatacol) {
+			vdev_raidz_math->vrm_gen(nparity, pqr, src, csize,
+			    psize);
+			continue;
+		}
+
+		ASSERT(csize == psize || csize == 0);
+		for (i = 0; i < nparity; i++) {
+			bcopy(src, pqr[i], csize);
+			bzero(pqr[i] + csize, psize - csize);
+		}
+	}
+}
+
 static void
 vdev_raidz_map_free(raidz_map_t *rm)
 {
@@ -559,6 +1180,11 @@ vdev_raidz_generate_parity_p(raidz_map_t *rm)
 	uint64_t *p, *src, pcount, ccount, i;
 	int c;
 
+	if (vdev_raidz_math->vrm_gen != NULL) {
+		vdev_raidz_generate_parity_vec(rm, 1);
+		return;
+	}
+
 	pcount = rm->rm_col[VDEV_RAIDZ_P].rc_size / sizeof (src[0]);
 
 	for (c = rm->rm_firstdatacol; c < rm->rm_cols; c++) {
@@ -586,6 +1212,11 @@ vdev_raidz_generate_parity_pq(raidz_map_t *rm)
 	uint64_t *p, *q, *src, pcnt, ccnt, mask, i;
 	int c;
 
+	if (vdev_raidz_math->vrm_gen != NULL) {
+		vdev_raidz_generate_parity_vec(rm, 2);
+		return;
+	}
+
 	pcnt = rm->rm_col[VDEV_RAIDZ_P].rc_size / sizeof (src[0]);
 	ASSERT(rm->rm_col[VDEV_RAIDZ_P].rc_size ==
 	    rm->rm_col[VDEV_RAIDZ_Q].rc_size);
@@ -638,6 +1269,11 @@ vdev_raidz_generate_parity_pqr(raidz_map_t *rm)
 	uint64_t *p, *q, *r, *src, pcnt, ccnt, mask, i;
 	int c;
 
+	if (vdev_raidz_math->vrm_gen != NULL) {
+		vdev_raidz_generate_parity_vec(rm, 3);
+		return;
+	}
+
 	pcnt = rm->rm_col[VDEV_RAIDZ_P].rc_size / sizeof (src[0]);
 	ASSERT(rm->rm_col[VDEV_RAIDZ_P].rc_size ==
 	    rm->rm_col[VDEV_RAIDZ_Q].rc_size);
@@ -802,6 +1438,15 @@ vdev_raidz_reconstruct_q(raidz_map_t *rm, int *tgts, int ntgts)
 	dst = rm->rm_col[x].rc_data;
 	exp = 255 - (rm->rm_cols - 1 - x);
 
+	if (vdev_raidz_math->vrm_mul_add != NULL) {
+		b = (uint8_t *)dst;
+		vdev_raidz_mul_add(b, (uint8_t *)src, xcount * sizeof (src[0]),
+		    1, B_FALSE);
+		vdev_raidz_mul_add(b, b, xcount * sizeof (src[0]),
+		    vdev_raidz_exp2(1, exp), B_TRUE);
+		return (1 << VDEV_RAIDZ_Q);
+	}
+
 	for (i = 0; i < xcount; i++, dst++, src++) {
 		*dst ^= *src;
 		for (j = 0, b = (uint8_t *)dst; j < 8; j++, b++) {
@@ -881,12 +1526,28 @@ vdev_raidz_reconstruct_pq(raidz_map_t *rm, int *tgts, int ntgts)
 	aexp = vdev_raidz_log2[vdev_raidz_exp2(a, tmp)];
 	bexp = vdev_raidz_log2[vdev_raidz_exp2(b, tmp)];
 
-	for (i = 0; i < xsize; i++, p++, q++, pxy++, qxy++, xd++, yd++) {
-		*xd = vdev_raidz_exp2(*p ^ *pxy, aexp) ^
-		    vdev_raidz_exp2(*q ^ *qxy, bexp);
+	if (vdev_raidz_math->vrm_mul_add != NULL) {
+		/*
+		 * Same computation, one pass per term; Pxy and Qxy are
+		 * scratch buffers and can hold P + Pxy and Q + Qxy.
+		 */
+		vdev_raidz_mul_add(pxy, p, xsize, 1, B_FALSE);
+		vdev_raidz_mul_add(qxy, q, xsize, 1, B_FALSE);
+		vdev_raidz_mul_add(xd, pxy, xsize, vdev_raidz_pow2[aexp],
+		    B_TRUE);
+		vdev_raidz_mul_add(xd, qxy, xsize, vdev_raidz_pow2[bexp],
+		    B_FALSE);
+		vdev_raidz_mul_add(yd, pxy, ysize, 1, B_TRUE);
+		vdev_raidz_mul_add(yd, xd, ysize, 1, B_FALSE);
+	} else {
+		for (i = 0; i < xsize;
+		    i++, p++, q++, pxy++, qxy++, xd++, yd++) {
+			*xd = vdev_raidz_exp2(*p ^ *pxy, aexp) ^
+			    vdev_raidz_exp2(*q ^ *qxy, bexp);
 
-		if (i < ysize)
-			*yd = *p ^ *pxy ^ *xd;
+			if (i < ysize)
+				*yd = *p ^ *pxy ^ *xd;
+		}
 	}
 
 	zio_buf_free(rm->rm_col[VDEV_RAIDZ_P].rc_data,
@@ -1229,6 +1890,15 @@ vdev_raidz_matrix_reconstruct(raidz_map_t *rm, int n, int nmissing,
 
 		ASSERT(ccount >= rm->rm_col[missing[0]].rc_size || i > 0);
 
+		if (vdev_raidz_math->vrm_mul_add != NULL) {
+			for (cc = 0; cc < nmissing; cc++) {
+				vdev_raidz_mul_add(dst[cc], src,
+				    MIN(ccount, dcount[cc]), invrows[cc][i],
+				    i == 0);
+			}
+			continue;
+		}
+
 		for (x = 0; x < ccount; x++, src++) {
 			if (*src != 0)
 				log = vdev_raidz_log2[*src];
@@ -35,12 +35,15 @@
 #include <sys/dmu_objset.h>
 #include <sys/arc.h>
 #include <sys/ddt.h>
+#include <sys/vdev_file.h>
+#include <zfs_fletcher.h>
 
 #ifdef LINUX_AIO
 #include <libaio.h>
 
 #define AIO_MAXIO 2000
 #define AIO_MAXEVENTS 256
+#define AIO_MAXREAPERS 8
 #endif
 
 /*
@@ -159,6 +162,10 @@ zio_init(void)
 			zio_data_buf_cache[c - 1] = zio_data_buf_cache[c];
 	}
 
+	zio_checksum_SHA256_init();
+	fletcher_4_init();
+	vdev_raidz_math_init();
+	vdev_queue_buf_init();
 	zio_inject_init();
 }
 
@@ -169,6 +176,8 @@ zio_fini(void)
 	kmem_cache_t *last_cache = NULL;
 	kmem_cache_t *last_data_cache = NULL;
 
+	vdev_queue_buf_fini();
+
 	for (c = 0; c < SPA_MAXBLOCKSIZE >> SPA_MINBLOCKSHIFT; c++) {
 		if (zio_buf_cache[c] != last_cache) {
 			last_cache = zio_buf_cache[c];
@@ -633,6 +642,28 @@ zio_write(zio_t *pio, spa_t *spa, uint64_t txg, blkptr_t *bp,
 	return (zio);
 }
 
+/*
+ * Write psize bytes of data already compressed with zp->zp_compress, such
+ * as a block from a compressed send stream; lsize is its logical size.
+ */
+zio_t *
+zio_write_compressed(zio_t *pio, spa_t *spa, uint64_t txg, blkptr_t *bp,
+    void *data, uint64_t psize, uint64_t lsize, const zio_prop_t *zp,
+    zio_done_func_t *ready, zio_done_func_t *done, void *private,
+    int priority, enum zio_flag flags, const zbookmark_t *zb)
+{
+	zio_t *zio;
+
+	ASSERT(!zp->zp_dedup);
+	ASSERT(psize <= lsize);
+
+	zio = zio_write(pio, spa, txg, bp, data, lsize, zp, ready, done,
+	    private, priority, flags | ZIO_FLAG_RAW, zb);
+	zio_push_transform(zio, data, psize, 0, NULL);
+
+	return (zio);
+}
+
 zio_t *
 zio_rewrite(zio_t *pio, spa_t *spa, uint64_t txg, blkptr_t *bp, void *data,
     uint64_t size, zio_done_func_t *done, void *private, int priority,
@@ -978,7 +1009,12 @@ zio_write_bp_init(zio_t *zio)
 		    spa_max_replication(spa)) == BP_GET_NDVAS(bp));
 	}
 
-	if (compress != ZIO_COMPRESS_OFF) {
+	if (zio->io_flags & ZIO_FLAG_RAW) {
+		/* already compressed, see zio_write_compressed() */
+		lsize = zio->io_orig_size;
+		psize = zio->io_size;
+		ASSERT(compress != ZIO_COMPRESS_OFF || psize == lsize);
+	} else if (compress != ZIO_COMPRESS_OFF) {
 		void *cbuf = zio_buf_alloc(lsize);
 		psize = zio_compress_data(compress, zio->io_data, cbuf, lsize);
 		if (psize == 0 || psize == lsize) {
@@ -2925,9 +2961,158 @@ static zio_pipe_stage_t *zio_pipeline[] = {
 
 #ifdef LINUX_AIO
 
+/*
+ * Number of threads reaping AIO completions for each pool.  A value of 0
+ * means one reaper per CPU, up to AIO_MAXREAPERS.
+ */
+int zio_aio_reapers = 0;
+
+/*
+ * Non-zero while the current thread is issuing a run of I/Os (see
+ * zio_aio_plug()).  Submissions made while plugged are queued and handed
+ * to the kernel together when the thread unplugs.
+ */
+static __thread int zio_aio_plugged = 0;
+
+/*
+ * Hand a batch of prepared iocbs to the kernel, failing the zios whose
+ * iocbs could not be submitted.
+ */
+static void
+zio_aio_submit_batch(zio_aio_ctx_t *ctx, struct iocb **iocbs, int count)
+{
+	zio_t *zio;
+	int error;
+
+	while (count > 0) {
+		do {
+			error = io_submit(ctx->zac_ctx, count, iocbs);
+		} while (error == -EINTR);
+
+		if (error < 0) {
+			/*
+			 * The first iocb was rejected; fail its zio and
+			 * carry on with the rest of the batch.
+			 */
+			zio = (zio_t *) iocbs[0]->data;
+			zio->io_error = -error;
+			zio_interrupt(zio);
+			error = 1;
+		}
+
+		ASSERT(error <= count);
+		iocbs += error;
+		count -= error;
+	}
+}
+
+/*
+ * Submit everything waiting in the submission queue.
+ */
+static void
+zio_aio_flush(zio_aio_ctx_t *ctx)
+{
+	struct iocb *iocbs[ZIO_AIO_MAXBATCH];
+	int count;
+
+	mutex_enter(&ctx->zac_sq_lock);
+	count = ctx->zac_sq_count;
+	bcopy(ctx->zac_sq, iocbs, count * sizeof (struct iocb *));
+	ctx->zac_sq_count = 0;
+	mutex_exit(&ctx->zac_sq_lock);
+
+	if (count > 0)
+		zio_aio_submit_batch(ctx, iocbs, count);
+}
+
+/*
+ * Submit the (already prepared) iocb of a zio.  When the calling thread
+ * is plugged the iocb is queued so that it can be submitted together with
+ * its neighbours; otherwise it goes out immediately along with anything
+ * already queued.
+ */
+void
+zio_aio_submit(zio_t *zio)
+{
+	zio_aio_ctx_t *ctx = zio->io_aio_ctx;
+	struct iocb *iocbs[ZIO_AIO_MAXBATCH];
+	int count = 0;
+
+	zio->io_aio.data = zio;
+
+	mutex_enter(&ctx->zac_sq_lock);
+	ctx->zac_sq[ctx->zac_sq_count++] = &zio->io_aio;
+	if (ctx->zac_sq_count == ZIO_AIO_MAXBATCH || !zio_aio_plugged) {
+		count = ctx->zac_sq_count;
+		bcopy(ctx->zac_sq, iocbs, count * sizeof (struct iocb *));
+		ctx->zac_sq_count = 0;
+	}
+	mutex_exit(&ctx->zac_sq_lock);
+
+	if (count > 0)
+		zio_aio_submit_batch(ctx, iocbs, count);
+}
+
+/*
+ * Start batching AIO submissions made by the current thread.  Every call
+ * must be paired with a call to zio_aio_unplug().
+ */
+void
+zio_aio_plug(void)
+{
+	zio_aio_plugged++;
+}
+
+/*
+ * Stop batching and submit whatever the current thread queued, both on
+ * the pool's AIO context and on the io_uring of the vdev it was issuing to.
+ */
+void
+zio_aio_unplug(spa_t *spa)
+{
+	ASSERT(zio_aio_plugged > 0);
+
+	if (--zio_aio_plugged != 0)
+		return;
+
+	if (spa->spa_aio_ctx != NULL)
+		zio_aio_flush(spa->spa_aio_ctx);
+#ifdef LINUX_URING
+	vdev_file_uring_flush();
+#endif
+}
+
+/*
+ * Is the current thread batching its submissions?
+ */
+boolean_t
+zio_aio_is_plugged(void)
+{
+	return (zio_aio_plugged > 0);
+}
+
+/*
+ * Free an AIO context once both zio_aio_fini() has been called and every
+ * reaper thread has exited.
+ */
+static void
+zio_aio_ctx_free(zio_aio_ctx_t *ctx)
+{
+	int rc;
+
+	rc = io_destroy(ctx->zac_ctx);
+	if (rc != 0)
+		cmn_err(CE_WARN, "error '%i' in function io_destroy()", rc);
+
+	mutex_destroy(&ctx->zac_lock);
+	mutex_destroy(&ctx->zac_sq_lock);
+	kmem_free(ctx->zac_threads, ctx->zac_nthreads * sizeof (kthread_t *));
+	kmem_free(ctx, sizeof (zio_aio_ctx_t));
+}
+
 /*
  * AIO thread. Waits for finished AIOs and dispatches them to the
- * ZIO interrupt threads.
+ * ZIO interrupt threads.  Several of these may share one AIO context.
  */
 static void zio_aio_thread(zio_aio_ctx_t *ctx)
 {
@@ -2935,6 +3120,7 @@ static void zio_aio_thread(zio_aio_ctx_t *ctx)
 	struct io_event events[AIO_MAXEVENTS];
 	struct iocb *iocb;
 	zio_t *zio;
+	boolean_t last;
 	int rc, i;
 
 	while (ctx->zac_enabled) {
@@ -2950,13 +3136,11 @@ static void zio_aio_thread(zio_aio_ctx_t *ctx)
 			cmn_err(CE_WARN, "error '%i' in function "
 			    "io_getevents(), disabling async I/O.", rc);
 			/*
-			 * We have no choice but to exit...
-			 *
-			 * zio_fini_aio() will free zio_aio_ctx_t since it
-			 * may still be in use by other threads.
+			 * We have no choice but to exit, and so will the
+			 * other reapers once they notice.
 			 */
 			ctx->zac_enabled = B_FALSE;
-			return;
+			break;
 		}
 
 		for (i = 0; i < rc; i++) {
@@ -2972,11 +3156,16 @@ static void zio_aio_thread(zio_aio_ctx_t *ctx)
 		}
 	}
 
-	rc = io_destroy(ctx->zac_ctx);
-	if (rc != 0)
-		cmn_err(CE_WARN, "error '%i' in function io_destroy()", rc);
+	/*
+	 * The last thread out frees the context, unless zio_aio_fini()
+	 * hasn't been called yet, in which case it will do it.
+	 */
+	mutex_enter(&ctx->zac_lock);
+	last = (--ctx->zac_running == 0 && ctx->zac_closing);
+	mutex_exit(&ctx->zac_lock);
 
-	kmem_free(ctx, sizeof (zio_aio_ctx_t));
+	if (last)
+		zio_aio_ctx_free(ctx);
 }
 
 /*
@@ -2985,19 +3174,29 @@ static void zio_aio_thread(zio_aio_ctx_t *ctx)
 int zio_aio_init(spa_t *spa)
 {
 	zio_aio_ctx_t *ctx;
-	int error;
+	int nthreads = zio_aio_reapers;
+	int error, t;
 
-	spa->spa_aio_ctx = kmem_alloc(sizeof (zio_aio_ctx_t), KM_SLEEP);
-	ctx = spa->spa_aio_ctx;
+	if (nthreads <= 0)
+		nthreads = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1),
+		    AIO_MAXREAPERS);
 
-	memset(&ctx->zac_ctx, 0, sizeof (io_context_t));
+	spa->spa_aio_ctx = kmem_zalloc(sizeof (zio_aio_ctx_t), KM_SLEEP);
+	ctx = spa->spa_aio_ctx;
 
 	error = io_queue_init(AIO_MAXIO, &ctx->zac_ctx);
 
 	if (!error) {
+		mutex_init(&ctx->zac_lock, NULL, MUTEX_DEFAULT, NULL);
+		mutex_init(&ctx->zac_sq_lock, NULL, MUTEX_DEFAULT, NULL);
 		ctx->zac_enabled = B_TRUE;
-		ctx->zac_thread = thread_create(NULL, 0, zio_aio_thread,
-		    ctx, 0, &p0, TS_RUN, maxclsyspri);
+		ctx->zac_nthreads = nthreads;
+		ctx->zac_running = nthreads;
+		ctx->zac_threads = kmem_alloc(nthreads * sizeof (kthread_t *),
+		    KM_SLEEP);
+		for (t = 0; t < nthreads; t++)
+			ctx->zac_threads[t] = thread_create(NULL, 0,
+			    zio_aio_thread, ctx, 0, &p0, TS_RUN, maxclsyspri);
 	} else {
 		kmem_free(ctx, sizeof (zio_aio_ctx_t));
 		spa->spa_aio_ctx = NULL;
@@ -3011,26 +3210,29 @@ int zio_aio_init(spa_t *spa)
  */
 void zio_aio_fini(spa_t *spa)
 {
-	int rc;
+	zio_aio_ctx_t *ctx = spa->spa_aio_ctx;
+	boolean_t last;
 
-	if (spa->spa_aio_ctx == NULL)
+	if (ctx == NULL)
 		return; /* AIO never started in the first place */
 
-	if (spa->spa_aio_ctx->zac_enabled) {
-		/* AIO thread will free zio_aio_ctx_t */
-		spa->spa_aio_ctx->zac_enabled = B_FALSE;
-	} else {
-		/*
-		 * An error occured in the AIO thread, so we'll free
-		 * zio_aio_ctx_t ourselves.
-		 */
-		rc = io_destroy(spa->spa_aio_ctx->zac_ctx);
-		if (rc != 0)
-			cmn_err(CE_WARN, "error '%i' in function io_destroy()", rc);
+	ASSERT(ctx->zac_sq_count == 0);
 
-		kmem_free(spa->spa_aio_ctx, sizeof (zio_aio_ctx_t));
-		spa->spa_aio_ctx = NULL;
-	}
+	/*
+	 * Ask the reapers to exit; the last one to leave frees the
+	 * context.  If they have all already exited (because of an error)
+	 * we free it ourselves.
+	 */
+	mutex_enter(&ctx->zac_lock);
+	ctx->zac_enabled = B_FALSE;
+	ctx->zac_closing = B_TRUE;
+	last = (ctx->zac_running == 0);
+	mutex_exit(&ctx->zac_lock);
+
+	if (last)
+		zio_aio_ctx_free(ctx);
+
+	spa->spa_aio_ctx = NULL;
 
 	/* XXX: there should exist a thread_join().. */
 }
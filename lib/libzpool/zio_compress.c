@@ -50,8 +50,41 @@ zio_compress_info_t zio_compress_table[ZIO_COMPRESS_FUNCTIONS] = {
 	{gzip_compress,		gzip_decompress,	8,	"gzip-8"},
 	{gzip_compress,		gzip_decompress,	9,	"gzip-9"},
 	{zle_compress,		zle_decompress,		64,	"zle"},
+	{lz4_compress,		lz4_decompress,		0,	"lz4"},
 };
 
+/*
+ * Early abort.  Before running one of the slower compressors over a large
+ * block, LZ4 a few samples taken across it; if none of them shrinks by the
+ * 12.5% that compression has to achieve anyway, the block is most likely
+ * already compressed (media, archives, encrypted data) and is written as is
+ * without a full pass.  LZ4 itself and ZLE are cheap enough on such data,
+ * so they are not sampled.
+ */
+int zio_compress_early_abort = 1;
+size_t zio_compress_early_abort_min = 32 << 10;
+
+#define	ZIO_COMPRESS_SAMPLES		4
+#define	ZIO_COMPRESS_SAMPLE_SIZE	4096
+
+static boolean_t
+zio_compress_incompressible(void *src, size_t s_len)
+{
+	char dst[ZIO_COMPRESS_SAMPLE_SIZE];
+	size_t d_len = ZIO_COMPRESS_SAMPLE_SIZE -
+	    (ZIO_COMPRESS_SAMPLE_SIZE >> 3);
+	size_t stride = s_len / ZIO_COMPRESS_SAMPLES;
+	int i;
+
+	for (i = 0; i < ZIO_COMPRESS_SAMPLES; i++) {
+		if (lz4_compress((char *)src + i * stride, dst,
+		    ZIO_COMPRESS_SAMPLE_SIZE, d_len, 0) <= d_len)
+			return (B_FALSE);
+	}
+
+	return (B_TRUE);
+}
+
 enum zio_compress
 zio_compress_select(enum zio_compress child, enum zio_compress parent)
 {
@@ -98,6 +131,13 @@ zio_compress_data(enum zio_compress c, void *src, void *dst, size_t s_len)
 	if (d_len == 0)
 		return (s_len);
 
+	if (zio_compress_early_abort &&
+	    s_len >= MAX(zio_compress_early_abort_min,
+	    ZIO_COMPRESS_SAMPLES * ZIO_COMPRESS_SAMPLE_SIZE) &&
+	    c != ZIO_COMPRESS_LZ4 && c != ZIO_COMPRESS_ZLE &&
+	    zio_compress_incompressible(src, s_len))
+		return (s_len);
+
 	c_len = ci->ci_compress(src, dst, s_len, d_len, ci->ci_level);
 
 	if (c_len > d_len)
@@ -11,7 +11,10 @@
 #include <libzfs_impl.h>
 #include <sys/dmu_objset.h>
 #include <sys/dsl_dataset.h>
+#include <sys/arc.h>
 #include <sys/zfs_znode.h>
+#include <sys/zfs_rlock.h>
+#include <sys/kstat.h>
 #include <sys/mode.h>
 #include <sys/fcntl.h>
 
@@ -29,6 +32,13 @@ extern int zfs_vfsinit(int fstype, char *name);
 static int getattr_helper(vfs_t *p_vfs, creden_t *p_cred,
 			  inogen_t object, struct stat *p_stat,
 			  uint64_t *p_gen, int *p_type);
+static int bonus_getattr_helper(vfs_t *p_vfs, creden_t *p_cred,
+				uint64_t object, struct stat *p_stat,
+				uint64_t *p_gen, int *p_type);
+
+/** Number of threads running lzfw_aio_read() and lzfw_aio_write() */
+int lzfw_aio_threads = 32;
+static taskq_t *lzfw_aio_taskq;
 
 /**
  * Initialize the libzfswrap library
@@ -46,7 +56,13 @@ lzfw_handle_t *lzfw_init()
   libzfs_handle_t *p_zhd = libzfs_init();
 
   if (!p_zhd)
+  {
     libsolkerncompat_exit();
+    return NULL;
+  }
+
+  lzfw_aio_taskq = taskq_create("lzfw_aio", lzfw_aio_threads, minclsyspri,
+                                lzfw_aio_threads, INT_MAX, TASKQ_PREPOPULATE);
 
   return (lzfw_handle_t*)p_zhd;
 }
@@ -57,10 +73,27 @@ lzfw_handle_t *lzfw_init()
  */
 void lzfw_exit(lzfw_handle_t *p_zhd)
 {
+  // Let the queued I/Os finish
+  taskq_wait(lzfw_aio_taskq);
+  taskq_destroy(lzfw_aio_taskq);
+  lzfw_aio_taskq = NULL;
+
   libzfs_fini((libzfs_handle_t*)p_zhd);
   libsolkerncompat_exit();
 }
 
+/**
+ * Resize the ARC while the library is running
+ * @param p_zhd: the libzfswrap handle
+ * @param i_min: the minimum cache size in bytes (0 to keep the current one)
+ * @param i_max: the maximum cache size in bytes (0 to keep the current one)
+ * @return 0 on success, the error code otherwise
+ */
+int lzfw_arc_set_limits(lzfw_handle_t *p_zhd, uint64_t i_min, uint64_t i_max)
+{
+  return arc_set_limits(i_min, i_max);
+}
+
 /**
  * Create a zpool
  * @param p_zhd: the libzfswrap handle
@@ -851,6 +884,225 @@ int lzfw_zfs_snapshot_destroy(lzfw_handle_t *p_zhd,
   return i_error;
 }
 
+/**
+ * Generate a send stream of a snapshot.
+ * The stream is handed to pf_sink from a separate thread, in order.
+ * @param p_zhd: the libzfswrap handle
+ * @param psz_zfs: name of the file system
+ * @param psz_snapshot: name of the snapshot to send
+ * @param psz_from_snapshot: name of an earlier snapshot for an incremental stream, NULL for a full stream
+ * @param psz_resume_token: the token of an interrupted resumable receive of the stream, to send only the rest of it; NULL to send it all
+ * @param i_flags: LZFW_SEND_* flags
+ * @param pf_sink: the callback the stream is written to
+ * @param p_arg: the argument given to pf_sink
+ * @param ppsz_error: the error message if any
+ * @return 0 in case of success, the error code otherwise
+ */
+int lzfw_zfs_send(lzfw_handle_t *p_zhd, const char *psz_zfs,
+                  const char *psz_snapshot, const char *psz_from_snapshot,
+                  const char *psz_resume_token, int i_flags,
+                  lzfw_stream_f pf_sink, void *p_arg,
+                  const char **ppsz_error)
+{
+  char psz_name[ZFS_MAXNAMELEN];
+  objset_t *p_tosnap, *p_fromsnap = NULL;
+  dmu_resume_token_t drt;
+  unsigned long long toguid, fromguid, object, offset;
+  offset_t off = 0;
+  int i_len = 0;
+  int i_error;
+
+  if(psz_resume_token)
+  {
+    if(sscanf(psz_resume_token, "%llx-%llx-%llx-%llx%n", &toguid, &fromguid,
+              &object, &offset, &i_len) != 4 || psz_resume_token[i_len])
+    {
+      *ppsz_error = "Invalid resume token";
+      return EINVAL;
+    }
+    drt.drt_toguid = toguid;
+    drt.drt_fromguid = fromguid;
+    drt.drt_object = object;
+    drt.drt_offset = offset;
+  }
+
+  if(snprintf(psz_name, sizeof(psz_name), "%s@%s", psz_zfs,
+              psz_snapshot) >= sizeof(psz_name))
+  {
+    *ppsz_error = "The snapshot name is too long";
+    return ENAMETOOLONG;
+  }
+  if((i_error = dmu_objset_hold(psz_name, FTAG, &p_tosnap)))
+  {
+    *ppsz_error = "Unable to open the snapshot";
+    return i_error;
+  }
+
+  if(psz_from_snapshot)
+  {
+    if(snprintf(psz_name, sizeof(psz_name), "%s@%s", psz_zfs,
+                psz_from_snapshot) >= sizeof(psz_name))
+    {
+      dmu_objset_rele(p_tosnap, FTAG);
+      *ppsz_error = "The snapshot name is too long";
+      return ENAMETOOLONG;
+    }
+    if((i_error = dmu_objset_hold(psz_name, FTAG, &p_fromsnap)))
+    {
+      dmu_objset_rele(p_tosnap, FTAG);
+      *ppsz_error = "Unable to open the incremental source snapshot";
+      return i_error;
+    }
+  }
+
+  if((i_error = dmu_sendbackup_func(p_tosnap, p_fromsnap, B_FALSE,
+                                    (i_flags & LZFW_SEND_COMPRESSED) != 0,
+                                    psz_resume_token ? &drt : NULL,
+                                    pf_sink, p_arg, &off)))
+    *ppsz_error = "Unable to send the snapshot";
+
+  if(p_fromsnap)
+    dmu_objset_rele(p_fromsnap, FTAG);
+  dmu_objset_rele(p_tosnap, FTAG);
+  return i_error;
+}
+
+/**
+ * Receive a send stream into a new snapshot.
+ * The stream is read from pf_source by a separate thread, which stops
+ * right after the last record of the stream.
+ * @param p_zhd: the libzfswrap handle
+ * @param psz_zfs: name of the file system to receive into
+ * @param psz_snapshot: name of the snapshot to create
+ * @param b_force: roll back changes made since the most recent snapshot
+ * @param b_resumable: keep what was received if the stream is interrupted, and continue an earlier interrupted receive of the same stream
+ * @param pf_source: the callback the stream is read from
+ * @param p_arg: the argument given to pf_source
+ * @param ppsz_error: the error message if any
+ * @return 0 in case of success, EPIPE if the stream ended early (a resumable receive can then be resumed), the error code otherwise
+ */
+int lzfw_zfs_recv(lzfw_handle_t *p_zhd, const char *psz_zfs,
+                  const char *psz_snapshot, int b_force, int b_resumable,
+                  lzfw_stream_f pf_source, void *p_arg,
+                  const char **ppsz_error)
+{
+  char psz_tofs[ZFS_MAXNAMELEN], psz_tosnap[ZFS_MAXNAMELEN];
+  dmu_replay_record_t drr;
+  dmu_recv_cookie_t drc;
+  zfsvfs_t *p_zfsvfs;
+  offset_t off = 0;
+  size_t i_done;
+  int i_error;
+
+  if(strlcpy(psz_tofs, psz_zfs, sizeof(psz_tofs)) >= sizeof(psz_tofs) ||
+     strlcpy(psz_tosnap, psz_snapshot, sizeof(psz_tosnap)) >= sizeof(psz_tosnap))
+  {
+    *ppsz_error = "The file system or snapshot name is too long";
+    return ENAMETOOLONG;
+  }
+
+  /** Read the BEGIN record */
+  while(off < sizeof(drr))
+  {
+    if((i_error = pf_source(p_arg, (char*)&drr + off, sizeof(drr) - off,
+                            &i_done)) == 0 && i_done == 0)
+      i_error = EINVAL;
+    if(i_error)
+    {
+      *ppsz_error = "Unable to read the beginning of the stream";
+      return i_error;
+    }
+    off += i_done;
+  }
+  if(drr.drr_type != DRR_BEGIN && drr.drr_type != BSWAP_32(DRR_BEGIN))
+  {
+    *ppsz_error = "Invalid stream";
+    return EINVAL;
+  }
+
+  if((i_error = dmu_recv_begin(psz_tofs, psz_tosnap, psz_tofs,
+                               &drr.drr_u.drr_begin, b_force ? B_TRUE : B_FALSE,
+                               b_resumable ? B_TRUE : B_FALSE, NULL, &drc)))
+  {
+    *ppsz_error = "Unable to start receiving the stream";
+    return i_error;
+  }
+
+  if((i_error = dmu_recv_stream_func(&drc, pf_source, p_arg, &off)))
+  {
+    *ppsz_error = "Unable to receive the stream";
+    return i_error;
+  }
+
+  /* A mounted file system must not be used while it changes under it */
+  if(getzfsvfs(psz_tofs, &p_zfsvfs) == 0)
+  {
+    int i_end_error;
+
+    i_error = zfs_suspend_fs(p_zfsvfs);
+    /* If the suspend fails, dmu_recv_end() likely fails and cleans up */
+    i_end_error = dmu_recv_end(&drc);
+    if(i_error == 0)
+      i_error = zfs_resume_fs(p_zfsvfs, psz_tofs);
+    if(i_error == 0)
+      i_error = i_end_error;
+    VFS_RELE(p_zfsvfs->z_vfs);
+  }
+  else
+    i_error = dmu_recv_end(&drc);
+
+  if(i_error)
+    *ppsz_error = "Unable to create the received snapshot";
+
+  return i_error;
+}
+
+/**
+ * Get the token of an interrupted resumable receive.
+ * Given to lzfw_zfs_send(), it sends the rest of the stream, which
+ * lzfw_zfs_recv() with b_resumable set then adds to what was received.
+ * @param p_zhd: the libzfswrap handle
+ * @param psz_zfs: name of the file system being received into
+ * @param psz_snapshot: name of the snapshot being received
+ * @param psz_token: return the token
+ * @param i_size: size of psz_token, at least LZFW_RESUME_TOKEN_LEN
+ * @param ppsz_error: the error message if any
+ * @return 0 in case of success, ENOENT if there is nothing to resume, the error code otherwise
+ */
+int lzfw_zfs_recv_resume_token(lzfw_handle_t *p_zhd, const char *psz_zfs,
+                               const char *psz_snapshot, char *psz_token,
+                               size_t i_size, const char **ppsz_error)
+{
+  char psz_tofs[ZFS_MAXNAMELEN], psz_tosnap[ZFS_MAXNAMELEN];
+  dmu_resume_token_t drt;
+  int i_error;
+
+  if(strlcpy(psz_tofs, psz_zfs, sizeof(psz_tofs)) >= sizeof(psz_tofs) ||
+     strlcpy(psz_tosnap, psz_snapshot, sizeof(psz_tosnap)) >= sizeof(psz_tosnap))
+  {
+    *ppsz_error = "The file system or snapshot name is too long";
+    return ENAMETOOLONG;
+  }
+
+  if((i_error = dmu_recv_resume_token(psz_tofs, psz_tosnap, &drt)))
+  {
+    *ppsz_error = "No interrupted receive to resume";
+    return i_error;
+  }
+
+  if(snprintf(psz_token, i_size, "%llx-%llx-%llx-%llx",
+              (unsigned long long)drt.drt_toguid,
+              (unsigned long long)drt.drt_fromguid,
+              (unsigned long long)drt.drt_object,
+              (unsigned long long)drt.drt_offset) >= i_size)
+  {
+    *ppsz_error = "The token buffer is too small";
+    return ENAMETOOLONG;
+  }
+
+  return 0;
+}
+
 /**
  * Dataset support
  */
@@ -1014,6 +1266,124 @@ int lzfw_zfs_get_list_snapshots(lzfw_handle_t *p_zhd,
   return cb.i_num;
 }
 
+typedef struct
+{
+  lzfw_kstat_t *p_stats;
+  size_t size;
+  size_t count;
+} kstat_snapshot_t;
+
+static int lzfw_kstat_snapshot_callback(const kstat_t *p_ksp,
+					const kstat_named_t *p_knp,
+					void *data)
+{
+  kstat_snapshot_t *p_snap = (kstat_snapshot_t*)data;
+  lzfw_kstat_t *p_stat;
+  uint64_t value;
+
+  switch(p_knp->data_type)
+  {
+  case KSTAT_DATA_INT32:
+    value = (uint64_t)(int64_t)p_knp->value.i32;
+    break;
+  case KSTAT_DATA_UINT32:
+    value = p_knp->value.ui32;
+    break;
+  case KSTAT_DATA_INT64:
+    value = (uint64_t)p_knp->value.i64;
+    break;
+  case KSTAT_DATA_UINT64:
+    value = p_knp->value.ui64;
+    break;
+  default:
+    // Strings and floating point values are not exported
+    return 0;
+  }
+
+  if(p_snap->count < p_snap->size)
+  {
+    p_stat = &p_snap->p_stats[p_snap->count];
+    strlcpy(p_stat->psz_module, p_ksp->ks_module, sizeof(p_stat->psz_module));
+    strlcpy(p_stat->psz_name, p_ksp->ks_name, sizeof(p_stat->psz_name));
+    strlcpy(p_stat->psz_stat, p_knp->name, sizeof(p_stat->psz_stat));
+    p_stat->value = value;
+  }
+  p_snap->count++;
+
+  return 0;
+}
+
+/**
+ * Take a snapshot of the statistics maintained by the library
+ * @param p_zhd: the libzfswrap handle
+ * @param psz_module: only return the counters of this module (NULL for all)
+ * @param psz_name: only return the counters of this set (NULL for all)
+ * @param p_stats: the array of counters to fill
+ * @param size: the array size
+ * @param p_count: return the number of counters available, which may be
+ *                 larger than size if the array was too small
+ * @return 0 in case of success, the error code otherwise
+ */
+int lzfw_kstat_snapshot(lzfw_handle_t *p_zhd, const char *psz_module,
+			const char *psz_name, lzfw_kstat_t *p_stats,
+			size_t size, size_t *p_count)
+{
+  kstat_snapshot_t snap = { .p_stats = p_stats, .size = size, .count = 0 };
+  int i_error;
+
+  if((i_error = kstat_walk(psz_module, psz_name,
+			   lzfw_kstat_snapshot_callback, &snap)))
+    return i_error;
+
+  *p_count = snap.count;
+  return 0;
+}
+
+/**
+ * Callback-based iteration over the statistics maintained by the library
+ * @param p_zhd: the libzfswrap handle
+ * @param psz_module: only iterate on the counters of this module (NULL for all)
+ * @param psz_name: only iterate on the counters of this set (NULL for all)
+ * @param func: function to call for each counter, non-zero stops the iteration
+ * @param arg: opaque argument which will be passed to func
+ * @return 0 in case of success, the error code or the value returned by func otherwise
+ */
+int lzfw_kstat_iter(lzfw_handle_t *p_zhd, const char *psz_module,
+		    const char *psz_name, lzfw_kstat_iter_f func, void *arg)
+{
+  lzfw_kstat_t *p_stats = NULL;
+  size_t size = 0, count, i;
+  int i_error;
+
+  /*
+   * Snapshot first so that func is called without the kstat chain lock.
+   * Retry with a bigger array if kstats were added in the meantime.
+   */
+  for(;;)
+  {
+    if((i_error = lzfw_kstat_snapshot(p_zhd, psz_module, psz_name,
+				      p_stats, size, &count)))
+      goto out;
+    if(count <= size)
+      break;
+
+    free(p_stats);
+    size = count + 16;
+    if(!(p_stats = malloc(size * sizeof(lzfw_kstat_t))))
+      return ENOMEM;
+  }
+
+  for(i = 0; i < count; i++)
+  {
+    if((i_error = func(&p_stats[i], arg)))
+      break;
+  }
+
+out:
+  free(p_stats);
+  return i_error;
+}
+
 extern vfsops_t *zfs_vfsops;
 /**
  * Mount the given file system
@@ -1566,6 +1936,9 @@ int lzfw_opendir(vfs_t *p_vfs, creden_t *p_cred,
   return 0;
 }
 
+/** Size of the buffer lzfw_readdir() reads the directory entries into */
+#define LZFW_READDIR_BUFSIZE (64 * 1024)
+
 /**
  * Read the given directory
  * @param p_vfs: the virtual filesystem
@@ -1593,44 +1966,61 @@ int lzfw_readdir(vfs_t *p_vfs, creden_t *p_cred,
   uio.uio_segflg = UIO_SYSSPACE;
   uio.uio_fmode = 0;
   uio.uio_llimit = RLIM64_INFINITY;
- 
+
   off_t next_entry = *cookie;
   int eofp = 0;
-  union {
-    char buf[DIRENT64_RECLEN(MAXNAMELEN)];
-    struct dirent64 dirent;
-  } entry;
+  char *p_buf = kmem_alloc(LZFW_READDIR_BUFSIZE, KM_SLEEP);
+  struct dirent64 *p_dirent;
+  size_t index = 0, first, i;
 
   ZFS_ENTER(zfsvfs);
-  size_t index = 0;
-  while (index < size) {
-    iovec.iov_base = entry.buf;
-    iovec.iov_len = sizeof(entry.buf);
+  while (index < size && !eofp) {
+    iovec.iov_base = p_buf;
+    iovec.iov_len = MIN(LZFW_READDIR_BUFSIZE,
+                        (size - index) * DIRENT64_RECLEN(MAXNAMELEN));
     uio.uio_resid = iovec.iov_len;
     uio.uio_loffset = next_entry;
 
-    /* TODO: do only one call for more than one entry ? */
+    // Read as many entries as the buffer holds in one ZAP cursor pass
     if (VOP_READDIR(vnode, &uio, (cred_t*)p_cred, &eofp, NULL, 0))
       break;
 
     // End of directory ?
-    if (iovec.iov_base == entry.buf)
+    if (iovec.iov_base == p_buf)
       break;
 
-    // Copy the entry name
-    strcpy(p_entries[index].psz_filename, entry.dirent.d_name);
-    p_entries[index].object.inode = entry.dirent.d_ino;
-    getattr_helper(p_vfs, p_cred, p_entries[index].object,
-		   &(p_entries[index].stats),
-		   &(p_entries[index].object.generation),
-		   &(p_entries[index].type));
+    // Copy the entry names
+    first = index;
+    for (p_dirent = (struct dirent64 *)p_buf;
+         (char *)p_dirent < (char *)iovec.iov_base && index < size;
+         p_dirent = (struct dirent64 *)((char *)p_dirent +
+                                        p_dirent->d_reclen)) {
+      strcpy(p_entries[index].psz_filename, p_dirent->d_name);
+      p_entries[index].object.inode = p_dirent->d_ino;
+      next_entry = p_dirent->d_off;
+      index++;
+    }
 
-    // Go to the next entry
-    next_entry = entry.dirent.d_off;
-    index++;
+    // Start reading every dnode before waiting on the first one
+    for (i = first; i < index; i++)
+      dmu_prefetch(zfsvfs->z_os, p_entries[i].object.inode, 0, 0);
+
+    // Take the attributes from the bonus buffers, without any znode
+    for (i = first; i < index; i++) {
+      if (bonus_getattr_helper(p_vfs, p_cred, p_entries[i].object.inode,
+                               &(p_entries[i].stats),
+                               &(p_entries[i].object.generation),
+                               &(p_entries[i].type)) == 0)
+        continue;
+      getattr_helper(p_vfs, p_cred, p_entries[i].object,
+                     &(p_entries[i].stats),
+                     &(p_entries[i].object.generation),
+                     &(p_entries[i].type));
+    }
   }
 
   ZFS_EXIT(zfsvfs);
+  kmem_free(p_buf, LZFW_READDIR_BUFSIZE);
 
   // Set the last element to NULL if we end before size elements
   if (index < size) {
@@ -1889,6 +2279,86 @@ static int getattr_helper(vfs_t *p_vfs, creden_t *p_cred,
   return 0;
 }
 
+/**
+ * Get the attributes of an object straight from its bonus buffer, as
+ * zfs_getattr() would report them, without instantiating a znode
+ * @param p_vfs: the virtual filesystem
+ * @param p_cred: the credentials of the user
+ * @param object: the object number
+ * @param p_stat: the attributes to fill
+ * @param p_gen: return the generation of the object
+ * @param p_type: return the type of the object
+ * @return 0 on success, the error code otherwise.  EAGAIN means that the
+ *         object needs the full getattr_helper() treatment.
+ */
+static int bonus_getattr_helper(vfs_t *p_vfs, creden_t *p_cred,
+				uint64_t object, struct stat *p_stat,
+				uint64_t *p_gen, int *p_type)
+{
+  zfsvfs_t *zfsvfs = p_vfs->vfs_data;
+  dmu_object_info_t doi;
+  dmu_buf_t *p_db;
+  znode_phys_t *p_zp;
+  timestruc_t time;
+  uint32_t blksize;
+  u_longlong_t nblocks;
+  int i_error;
+
+  // The root counts the .zfs link.  The .zfs entry itself has no znode
+  // and is caught by the bonus type check below.
+  if (object == zfsvfs->z_root)
+    return EAGAIN;
+
+  if ((i_error = dmu_bonus_hold(zfsvfs->z_os, object, FTAG, &p_db)))
+    return i_error;
+
+  dmu_object_info_from_db(p_db, &doi);
+  p_zp = p_db->db_data;
+  if (doi.doi_bonus_type != DMU_OT_ZNODE ||
+      doi.doi_bonus_size < sizeof(znode_phys_t) ||
+      FUID_INDEX(p_zp->zp_uid) != 0 || FUID_INDEX(p_zp->zp_gid) != 0) {
+    dmu_buf_rele(p_db, FTAG);
+    return EAGAIN;
+  }
+
+  // Like zfs_getattr(), anyone but the owner of an object with a non
+  // trivial ACL needs ACE_READ_ATTRIBUTES, which takes the znode
+  if (!(p_zp->zp_flags & ZFS_ACL_TRIVIAL) &&
+      p_zp->zp_uid != crgetuid((cred_t*)p_cred)) {
+    dmu_buf_rele(p_db, FTAG);
+    return EAGAIN;
+  }
+
+  memset(p_stat, 0, sizeof(*p_stat));
+  p_stat->st_dev = zfsvfs->z_vfs->vfs_dev;
+  p_stat->st_ino = object;
+  p_stat->st_mode = p_zp->zp_mode & (S_IFMT | MODEMASK);
+  p_stat->st_nlink = MIN(p_zp->zp_links, UINT32_MAX);
+  p_stat->st_uid = p_zp->zp_uid;
+  p_stat->st_gid = p_zp->zp_gid;
+  if (S_ISCHR(p_zp->zp_mode) || S_ISBLK(p_zp->zp_mode))
+    p_stat->st_rdev = zfs_cmpldev(p_zp->zp_rdev);
+  p_stat->st_size = p_zp->zp_size;
+  ZFS_TIME_DECODE(&time, p_zp->zp_atime);
+  TIMESTRUC_TO_TIME(time, &p_stat->st_atime);
+  ZFS_TIME_DECODE(&time, p_zp->zp_mtime);
+  TIMESTRUC_TO_TIME(time, &p_stat->st_mtime);
+  ZFS_TIME_DECODE(&time, p_zp->zp_ctime);
+  TIMESTRUC_TO_TIME(time, &p_stat->st_ctime);
+
+  dmu_object_size_from_db(p_db, &blksize, &nblocks);
+  p_stat->st_blksize = blksize ? blksize : zfsvfs->z_max_blksz;
+  p_stat->st_blocks = nblocks;
+
+  if (p_gen)
+    *p_gen = p_zp->zp_gen;
+  if (p_type)
+    *p_type = p_zp->zp_mode & S_IFMT;
+
+  dmu_buf_rele(p_db, FTAG);
+  return 0;
+}
+
 /**
  * Get the attributes of an object
  * @param p_vfs: the virtual filesystem
@@ -2628,6 +3098,131 @@ ssize_t lzfw_preadv(vfs_t *p_vfs, creden_t *cred,
   return error;
 }
 
+/** A loan of cached file data */
+struct lzfw_loan
+{
+  /** The file */
+  vnode_t *p_vnode;
+  /** Keeps writers off the range */
+  rl_t *p_rl;
+  /** The held buffers */
+  dmu_buf_t **pp_dbp;
+  int i_numbufs;
+  /** What the caller was given */
+  struct iovec *p_iov;
+};
+
+/**
+ * Read from a file without copying: lend the caller the cached data
+ * @param p_vfs: the virtual file system
+ * @param p_cred: the credentials of the user
+ * @param p_vnode: the vnode
+ * @param size: the number of bytes to read
+ * @param offset: the offset to read
+ * @param pp_iov: return the data, as an array of buffers
+ * @param pi_iovcnt: return the length of the array
+ * @param pp_loan: return the loan, to give back with lzfw_read_return()
+ * @return 0 on success, the error code otherwise
+ */
+int lzfw_read_loan(vfs_t *p_vfs, creden_t *p_cred, vnode_t *p_vnode,
+		   size_t size, off_t offset,
+		   struct iovec **pp_iov, int *pi_iovcnt,
+		   lzfw_loan_t **pp_loan)
+{
+  zfsvfs_t *p_zfsvfs = p_vfs->vfs_data;
+  znode_t *p_znode = VTOZ(p_vnode);
+  lzfw_loan_t *p_loan;
+  uint64_t i_len, i_off;
+  int i, i_error;
+
+  *pp_iov = NULL;
+  *pi_iovcnt = 0;
+  *pp_loan = NULL;
+
+  ZFS_ENTER(p_zfsvfs);
+  ZFS_VERIFY_ZP(p_znode);
+
+  if(p_znode->z_phys->zp_flags & ZFS_AV_QUARANTINED)
+  {
+    ZFS_EXIT(p_zfsvfs);
+    return EACCES;
+  }
+  if(offset < 0)
+  {
+    ZFS_EXIT(p_zfsvfs);
+    return EINVAL;
+  }
+
+  p_loan = kmem_zalloc(sizeof(lzfw_loan_t), KM_SLEEP);
+  p_loan->p_vnode = p_vnode;
+  p_loan->p_rl = zfs_range_lock(p_znode, offset, size, RL_READER);
+
+  if(size == 0 || offset >= p_znode->z_phys->zp_size)
+  {
+    zfs_range_unlock(p_loan->p_rl);
+    kmem_free(p_loan, sizeof(lzfw_loan_t));
+    ZFS_ACCESSTIME_STAMP(p_zfsvfs, p_znode);
+    ZFS_EXIT(p_zfsvfs);
+    return 0;
+  }
+
+  /* dmu_buf_hold_array() refuses more than DMU_MAX_ACCESS: lend less */
+  i_len = MIN(size, p_znode->z_phys->zp_size - offset);
+  i_len = MIN(i_len, DMU_MAX_ACCESS);
+  i_error = dmu_buf_hold_array(p_zfsvfs->z_os, p_znode->z_id, offset, i_len,
+                               TRUE, p_loan, &p_loan->i_numbufs,
+                               &p_loan->pp_dbp);
+  if(i_error)
+  {
+    zfs_range_unlock(p_loan->p_rl);
+    kmem_free(p_loan, sizeof(lzfw_loan_t));
+    ZFS_EXIT(p_zfsvfs);
+    /* convert checksum errors into IO errors */
+    return i_error == ECKSUM ? EIO : i_error;
+  }
+
+  /* Point the caller at the part of each buffer that was asked for */
+  p_loan->p_iov = kmem_alloc(p_loan->i_numbufs * sizeof(struct iovec),
+                             KM_SLEEP);
+  i_off = offset;
+  for(i = 0; i < p_loan->i_numbufs; i++)
+  {
+    dmu_buf_t *p_db = p_loan->pp_dbp[i];
+    uint64_t i_bufoff = i_off - p_db->db_offset;
+    uint64_t i_tocpy = MIN(p_db->db_size - i_bufoff, i_len);
+
+    p_loan->p_iov[i].iov_base = (char *)p_db->db_data + i_bufoff;
+    p_loan->p_iov[i].iov_len = i_tocpy;
+    i_off += i_tocpy;
+    i_len -= i_tocpy;
+  }
+
+  VN_HOLD(p_vnode);
+  ZFS_ACCESSTIME_STAMP(p_zfsvfs, p_znode);
+  ZFS_EXIT(p_zfsvfs);
+
+  *pp_iov = p_loan->p_iov;
+  *pi_iovcnt = p_loan->i_numbufs;
+  *pp_loan = p_loan;
+  return 0;
+}
+
+/**
+ * Give back data lent by lzfw_read_loan()
+ * @param p_loan: the loan
+ */
+void lzfw_read_return(lzfw_loan_t *p_loan)
+{
+  if(p_loan == NULL)
+    return;
+
+  dmu_buf_rele_array(p_loan->pp_dbp, p_loan->i_numbufs, p_loan);
+  zfs_range_unlock(p_loan->p_rl);
+  VN_RELE(p_loan->p_vnode);
+  kmem_free(p_loan->p_iov, p_loan->i_numbufs * sizeof(struct iovec));
+  kmem_free(p_loan, sizeof(lzfw_loan_t));
+}
+
 /**
  * Write some data to the given file
  * @param p_vfs: the virtual file system
@@ -2711,6 +3306,232 @@ ssize_t lzfw_pwritev(vfs_t *p_vfs, creden_t *cred,
   return error;
 }
 
+/** A block buffer lent out for writing */
+struct lzfw_wbuf
+{
+  /** The file */
+  vnode_t *p_vnode;
+  /** The offset of the block */
+  off_t offset;
+  /** The loaned buffer */
+  arc_buf_t *p_abuf;
+};
+
+/**
+ * Get a buffer to fill with the data of one block of the file
+ * @param p_vfs: the virtual file system
+ * @param p_vnode: the vnode
+ * @param offset: the offset of the block, a multiple of the block size
+ * @param pp_data: return the buffer
+ * @param pi_size: return the size of the buffer (the block size)
+ * @param pp_wbuf: return the handle to give to lzfw_write_buf_commit()
+ * @return 0 on success, the error code otherwise
+ */
+int lzfw_write_buf_alloc(vfs_t *p_vfs, vnode_t *p_vnode, off_t offset,
+			 void **pp_data, size_t *pi_size,
+			 lzfw_wbuf_t **pp_wbuf)
+{
+  zfsvfs_t *p_zfsvfs = p_vfs->vfs_data;
+  znode_t *p_znode = VTOZ(p_vnode);
+  lzfw_wbuf_t *p_wbuf;
+  int i_blksz;
+
+  ZFS_ENTER(p_zfsvfs);
+  ZFS_VERIFY_ZP(p_znode);
+
+  i_blksz = p_zfsvfs->z_max_blksz;
+  if(offset < 0 || P2PHASE(offset, i_blksz) != 0)
+  {
+    ZFS_EXIT(p_zfsvfs);
+    return EINVAL;
+  }
+
+  p_wbuf = kmem_alloc(sizeof(lzfw_wbuf_t), KM_SLEEP);
+  p_wbuf->p_vnode = p_vnode;
+  p_wbuf->offset = offset;
+  p_wbuf->p_abuf = dmu_request_arcbuf(p_znode->z_dbuf, i_blksz);
+  VN_HOLD(p_vnode);
+
+  ZFS_EXIT(p_zfsvfs);
+
+  *pp_data = p_wbuf->p_abuf->b_data;
+  *pi_size = i_blksz;
+  *pp_wbuf = p_wbuf;
+  return 0;
+}
+
+/**
+ * Write a buffer obtained from lzfw_write_buf_alloc() to the file
+ * @param p_vfs: the virtual file system
+ * @param p_cred: the credentials of the user
+ * @param p_wbuf: the buffer
+ * @param size: the number of bytes of the buffer to write
+ * @return the number of bytes written on success, which can be less than
+ *         size, minus the error code otherwise
+ */
+ssize_t lzfw_write_buf_commit(vfs_t *p_vfs, creden_t *p_cred,
+			      lzfw_wbuf_t *p_wbuf, size_t size)
+{
+  zfsvfs_t *p_zfsvfs = p_vfs->vfs_data;
+  ssize_t resid, error;
+
+  if(size > arc_buf_size(p_wbuf->p_abuf))
+  {
+    lzfw_write_buf_abort(p_wbuf);
+    return -EINVAL;
+  }
+
+  ZFS_ENTER(p_zfsvfs);
+  error = zfs_write_arcbuf(p_wbuf->p_vnode, p_wbuf->p_abuf, p_wbuf->offset,
+                           size, 0, (cred_t*)p_cred, &resid);
+  ZFS_EXIT(p_zfsvfs);
+
+  /* return count of bytes actually written, or the negated error */
+  if(error)
+    error = -error;
+  else
+    error = size - resid;
+
+  VN_RELE(p_wbuf->p_vnode);
+  kmem_free(p_wbuf, sizeof(lzfw_wbuf_t));
+  return error;
+}
+
+/**
+ * Drop a buffer obtained from lzfw_write_buf_alloc() without writing it
+ * @param p_wbuf: the buffer
+ */
+void lzfw_write_buf_abort(lzfw_wbuf_t *p_wbuf)
+{
+  if(p_wbuf == NULL)
+    return;
+
+  dmu_return_arcbuf(p_wbuf->p_abuf);
+  VN_RELE(p_wbuf->p_vnode);
+  kmem_free(p_wbuf, sizeof(lzfw_wbuf_t));
+}
+
+/** A queued read or write */
+typedef struct
+{
+  creden_t *p_cred;
+  vnode_t *p_vnode;
+  uio_t uio;
+  /** UIO_READ or UIO_WRITE */
+  enum uio_rw rw;
+  lzfw_aio_done_t pf_done;
+  void *p_arg;
+} lzfw_aio_t;
+
+/**
+ * Run a queued read or write, on one of the lzfw_aio taskq threads
+ * @param p_arg: the request
+ */
+static void lzfw_aio_task(void *p_arg)
+{
+  lzfw_aio_t *p_aio = p_arg;
+  ssize_t resid = p_aio->uio.uio_resid;
+  int i_error;
+
+  // zfs_read() and zfs_write() fail with EIO once the fs is unmounted
+  if(p_aio->rw == UIO_READ)
+    i_error = VOP_READ(p_aio->p_vnode, &p_aio->uio, 0,
+                       (cred_t*)p_aio->p_cred, NULL);
+  else
+    i_error = VOP_WRITE(p_aio->p_vnode, &p_aio->uio, 0,
+                        (cred_t*)p_aio->p_cred, NULL);
+
+  VN_RELE(p_aio->p_vnode);
+  p_aio->pf_done(p_aio->p_arg, i_error, resid - p_aio->uio.uio_resid);
+  kmem_free(p_aio, sizeof(lzfw_aio_t));
+}
+
+/**
+ * Queue a read or a write
+ * @return 0 if the request was queued, the error code otherwise
+ */
+static int lzfw_aio_submit(vfs_t *p_vfs, creden_t *p_cred, vnode_t *p_vnode,
+                           enum uio_rw rw, struct iovec *iov, int iovcnt,
+                           off_t offset, lzfw_aio_done_t pf_done,
+                           void *p_arg)
+{
+  lzfw_aio_t *p_aio;
+  ssize_t resid = 0;
+  int ix;
+
+  if(offset < 0 || pf_done == NULL)
+    return EINVAL;
+
+  for(ix = 0; ix < iovcnt; ++ix)
+    resid += iov[ix].iov_len;
+
+  p_aio = kmem_alloc(sizeof(lzfw_aio_t), KM_SLEEP);
+  p_aio->p_cred = p_cred;
+  p_aio->p_vnode = p_vnode;
+  p_aio->rw = rw;
+  p_aio->pf_done = pf_done;
+  p_aio->p_arg = p_arg;
+  p_aio->uio.uio_iov = iov;
+  p_aio->uio.uio_iovcnt = iovcnt;
+  p_aio->uio.uio_segflg = UIO_SYSSPACE;
+  p_aio->uio.uio_fmode = 0;
+  p_aio->uio.uio_llimit = RLIM64_INFINITY;
+  p_aio->uio.uio_loffset = offset;
+  p_aio->uio.uio_resid = resid;
+
+  // The vnode must outlive the request even if the caller closes it
+  VN_HOLD(p_vnode);
+
+  if(taskq_dispatch(lzfw_aio_taskq, lzfw_aio_task, p_aio, TQ_SLEEP) == 0)
+  {
+    VN_RELE(p_vnode);
+    kmem_free(p_aio, sizeof(lzfw_aio_t));
+    return EAGAIN;
+  }
+
+  return 0;
+}
+
+/**
+ * Queue a read from the given file
+ * @param p_vfs: the virtual file system
+ * @param p_cred: the credentials of the user
+ * @param p_vnode: the vnode
+ * @param iov: array of iovec buffers to read into
+ * @param iovcnt: the length of the iov array
+ * @param offset: the logical file offset
+ * @param pf_done: the function to call once the read is over
+ * @param p_arg: the argument to give to pf_done
+ * @return 0 if the read was queued, the error code otherwise
+ */
+int lzfw_aio_read(vfs_t *p_vfs, creden_t *p_cred, vnode_t *p_vnode,
+		  struct iovec *iov, int iovcnt, off_t offset,
+		  lzfw_aio_done_t pf_done, void *p_arg)
+{
+  return lzfw_aio_submit(p_vfs, p_cred, p_vnode, UIO_READ, iov, iovcnt,
+                         offset, pf_done, p_arg);
+}
+
+/**
+ * Queue a write to the given file
+ * @param p_vfs: the virtual file system
+ * @param p_cred: the credentials of the user
+ * @param p_vnode: the vnode
+ * @param iov: array of iovec buffers to write
+ * @param iovcnt: the length of the iov array
+ * @param offset: the logical file offset
+ * @param pf_done: the function to call once the write is over
+ * @param p_arg: the argument to give to pf_done
+ * @return 0 if the write was queued, the error code otherwise
+ */
+int lzfw_aio_write(vfs_t *p_vfs, creden_t *p_cred, vnode_t *p_vnode,
+		   struct iovec *iov, int iovcnt, off_t offset,
+		   lzfw_aio_done_t pf_done, void *p_arg)
+{
+  return lzfw_aio_submit(p_vfs, p_cred, p_vnode, UIO_WRITE, iov, iovcnt,
+                         offset, pf_done, p_arg);
+}
+
 /**
  * Close the given vnode
  * @param p_vfs: the virtual file system
@@ -51,6 +51,36 @@ typedef struct
 /** libzfswrap library handle */
 typedef struct libzfs_handle lzfw_handle_t;
 
+/** File data lent out by lzfw_read_loan() */
+typedef struct lzfw_loan lzfw_loan_t;
+
+/** A block buffer handed out by lzfw_write_buf_alloc() */
+typedef struct lzfw_wbuf lzfw_wbuf_t;
+
+/**
+ * Completion callback of lzfw_aio_read() and lzfw_aio_write()
+ * @param p_arg: the argument given at submission
+ * @param i_error: 0 on success, the error code otherwise
+ * @param i_len: the number of bytes transferred
+ */
+typedef void (*lzfw_aio_done_t)(void *p_arg, int i_error, ssize_t i_len);
+
+/**
+ * Stream callback of lzfw_zfs_send() and lzfw_zfs_recv()
+ * @param p_arg: the argument given to lzfw_zfs_send() or lzfw_zfs_recv()
+ * @param p_buf: the data to write (send) or the buffer to fill (receive)
+ * @param size: the number of bytes to write or the size of the buffer
+ * @param pi_done: return the number of bytes transferred, 0 at the end of the input
+ * @return 0 in case of success, the error code otherwise
+ */
+typedef int (*lzfw_stream_f)(void *p_arg, void *p_buf, size_t size, size_t *pi_done);
+
+/** Send compressed blocks as they are on disk rather than decompressed */
+#define LZFW_SEND_COMPRESSED    (1 << 0)
+
+/** Size of a resume token from lzfw_zfs_recv_resume_token() */
+#define LZFW_RESUME_TOKEN_LEN   (4 * 16 + 3 + 1)
+
 /** Object mode */
 #define LZFSW_ATTR_MODE         (1 << 0)
 /** Owner user identifier */
@@ -79,6 +109,15 @@ lzfw_handle_t *lzfw_init();
  */
 void lzfw_exit(lzfw_handle_t *p_zhd);
 
+/**
+ * Resize the ARC while the library is running
+ * @param p_zhd: the libzfswrap handle
+ * @param i_min: the minimum cache size in bytes (0 to keep the current one)
+ * @param i_max: the maximum cache size in bytes (0 to keep the current one)
+ * @return 0 on success, the error code otherwise
+ */
+int lzfw_arc_set_limits(lzfw_handle_t *p_zhd, uint64_t i_min, uint64_t i_max);
+
 /**
  * Create a zpool
  * @param p_zhd: the libzfswrap handle
@@ -229,6 +268,52 @@ int lzfw_zfs_snapshot(lzfw_handle_t *p_zhd, const char *psz_zfs, const char *psz
  */
 int lzfw_zfs_snapshot_destroy(lzfw_handle_t *p_zhd, const char *psz_zfs, const char *psz_snapshot, const char **ppsz_error);
 
+/**
+ * Generate a send stream of a snapshot.
+ * The stream is handed to pf_sink from a separate thread, in order.
+ * @param p_zhd: the libzfswrap handle
+ * @param psz_zfs: name of the file system
+ * @param psz_snapshot: name of the snapshot to send
+ * @param psz_from_snapshot: name of an earlier snapshot for an incremental stream, NULL for a full stream
+ * @param psz_resume_token: the token of an interrupted resumable receive of the stream, to send only the rest of it; NULL to send it all
+ * @param i_flags: LZFW_SEND_* flags
+ * @param pf_sink: the callback the stream is written to
+ * @param p_arg: the argument given to pf_sink
+ * @param ppsz_error: the error message if any
+ * @return 0 in case of success, the error code otherwise
+ */
+int lzfw_zfs_send(lzfw_handle_t *p_zhd, const char *psz_zfs, const char *psz_snapshot, const char *psz_from_snapshot, const char *psz_resume_token, int i_flags, lzfw_stream_f pf_sink, void *p_arg, const char **ppsz_error);
+
+/**
+ * Receive a send stream into a new snapshot.
+ * The stream is read from pf_source by a separate thread, which stops
+ * right after the last record of the stream.
+ * @param p_zhd: the libzfswrap handle
+ * @param psz_zfs: name of the file system to receive into
+ * @param psz_snapshot: name of the snapshot to create
+ * @param b_force: roll back changes made since the most recent snapshot
+ * @param b_resumable: keep what was received if the stream is interrupted, and continue an earlier interrupted receive of the same stream
+ * @param pf_source: the callback the stream is read from
+ * @param p_arg: the argument given to pf_source
+ * @param ppsz_error: the error message if any
+ * @return 0 in case of success, EPIPE if the stream ended early (a resumable receive can then be resumed), the error code otherwise
+ */
+int lzfw_zfs_recv(lzfw_handle_t *p_zhd, const char *psz_zfs, const char *psz_snapshot, int b_force, int b_resumable, lzfw_stream_f pf_source, void *p_arg, const char **ppsz_error);
+
+/**
+ * Get the token of an interrupted resumable receive.
+ * Given to lzfw_zfs_send(), it sends the rest of the stream, which
+ * lzfw_zfs_recv() with b_resumable set then adds to what was received.
+ * @param p_zhd: the libzfswrap handle
+ * @param psz_zfs: name of the file system being received into
+ * @param psz_snapshot: name of the snapshot being received
+ * @param psz_token: return the token
+ * @param i_size: size of psz_token, at least LZFW_RESUME_TOKEN_LEN
+ * @param ppsz_error: the error message if any
+ * @return 0 in case of success, ENOENT if there is nothing to resume, the error code otherwise
+ */
+int lzfw_zfs_recv_resume_token(lzfw_handle_t *p_zhd, const char *psz_zfs, const char *psz_snapshot, char *psz_token, size_t i_size, const char **ppsz_error);
+
 /**
  * Create a new dataset (filesystem).
  * @param p_zhd: the libzfswrap handle
@@ -248,6 +333,47 @@ int lzfw_dataset_create(lzfw_handle_t *p_zhd, const char *psz_zfs, int type, con
  */
 int lzfw_dataset_destroy(lzfw_handle_t *p_zhd, const char *psz_zfs, const char **ppsz_error);
 
+/** Representation of a named statistic counter */
+typedef struct
+{
+  /** Module providing the statistic (e.g. "zfs", "unix") */
+  char psz_module[32];
+  /** Name of the statistic set (e.g. "arcstats", "zfetchstats") */
+  char psz_name[32];
+  /** Name of the counter (e.g. "hits") */
+  char psz_stat[32];
+  /** Value of the counter (signed counters are sign-extended) */
+  uint64_t value;
+} lzfw_kstat_t;
+
+/**
+ * Take a snapshot of the statistics maintained by the library
+ * @param p_zhd: the libzfswrap handle
+ * @param psz_module: only return the counters of this module (NULL for all)
+ * @param psz_name: only return the counters of this set (NULL for all)
+ * @param p_stats: the array of counters to fill
+ * @param size: the array size
+ * @param p_count: return the number of counters available, which may be
+ *                 larger than size if the array was too small
+ * @return 0 in case of success, the error code otherwise
+ */
+int lzfw_kstat_snapshot(lzfw_handle_t *p_zhd, const char *psz_module, const char *psz_name, lzfw_kstat_t *p_stats, size_t size, size_t *p_count);
+
+/**
+ * Callback-based iteration over the statistics maintained by the library.
+ * The counters are snapshotted before the first call to func, which may
+ * therefore call back into the library.
+ * @param p_zhd: the libzfswrap handle
+ * @param psz_module: only iterate on the counters of this module (NULL for all)
+ * @param psz_name: only iterate on the counters of this set (NULL for all)
+ * @param func: function to call for each counter, non-zero stops the iteration
+ * @param arg: opaque argument which will be passed to func
+ * @return 0 in case of success, the error code or the value returned by func otherwise
+ */
+typedef int (*lzfw_kstat_iter_f)(const lzfw_kstat_t *, void *);
+
+int lzfw_kstat_iter(lzfw_handle_t *p_zhd, const char *psz_module, const char *psz_name, lzfw_kstat_iter_f func, void *arg);
+
 /**
  * Mount the given file system
  * @param psz_zpool: the pool to mount
@@ -409,6 +535,35 @@ ssize_t lzfw_preadv(vfs_t *p_vfs, creden_t *cred,
 		    struct iovec *iov, int iovcnt,
 		    off_t offset);
 
+/**
+ * Read from a file without copying: lend the caller the cached data
+ * @param p_vfs: the virtual file system
+ * @param p_cred: the credentials of the user
+ * @param p_vnode: the vnode
+ * @param size: the number of bytes to read
+ * @param offset: the offset to read
+ * @param pp_iov: return the data, as an array of buffers
+ * @param pi_iovcnt: return the length of the array
+ * @param pp_loan: return the loan, to give back with lzfw_read_return()
+ * @return 0 on success, the error code otherwise
+ *
+ * The buffers are read-only and stay valid until the loan is returned.
+ * Writes to the range wait until then, so return loans promptly, and
+ * before closing the vnode.  Reading at or past the end of the file
+ * gives no buffers.  A loan may cover less than was asked for, at most
+ * DMU_MAX_ACCESS (10MB) bytes: add up the iov_len to know how much.
+ */
+int lzfw_read_loan(vfs_t *p_vfs, creden_t *p_cred, vnode_t *p_vnode,
+		   size_t size, off_t offset,
+		   struct iovec **pp_iov, int *pi_iovcnt,
+		   lzfw_loan_t **pp_loan);
+
+/**
+ * Give back data lent by lzfw_read_loan()
+ * @param p_loan: the loan
+ */
+void lzfw_read_return(lzfw_loan_t *p_loan);
+
 /**
  * Write some data to the given file
  * @param p_vfs: the virtual file system
@@ -437,6 +592,85 @@ ssize_t lzfw_pwritev(vfs_t *p_vfs, creden_t *cred,
 		     struct iovec *iov, int iovcnt,
 		     off_t offset);
 
+/**
+ * Get a buffer to fill with the data of one block of the file
+ * @param p_vfs: the virtual file system
+ * @param p_vnode: the vnode
+ * @param offset: the offset of the block, a multiple of the block size
+ * @param pp_data: return the buffer
+ * @param pi_size: return the size of the buffer (the block size)
+ * @param pp_wbuf: return the handle to give to lzfw_write_buf_commit()
+ * @return 0 on success, the error code otherwise
+ *
+ * Once filled, the buffer is written with lzfw_write_buf_commit() or
+ * dropped with lzfw_write_buf_abort().
+ */
+int lzfw_write_buf_alloc(vfs_t *p_vfs, vnode_t *p_vnode, off_t offset,
+			 void **pp_data, size_t *pi_size,
+			 lzfw_wbuf_t **pp_wbuf);
+
+/**
+ * Write a buffer obtained from lzfw_write_buf_alloc() to the file
+ * @param p_vfs: the virtual file system
+ * @param p_cred: the credentials of the user
+ * @param p_wbuf: the buffer
+ * @param size: the number of bytes of the buffer to write
+ * @return the number of bytes written on success, which can be less than
+ *         size, minus the error code otherwise
+ *
+ * A full buffer becomes the data of the block without being copied.
+ * The buffer belongs to the library again after this call, whatever
+ * the result.
+ */
+ssize_t lzfw_write_buf_commit(vfs_t *p_vfs, creden_t *p_cred,
+			      lzfw_wbuf_t *p_wbuf, size_t size);
+
+/**
+ * Drop a buffer obtained from lzfw_write_buf_alloc() without writing it
+ * @param p_wbuf: the buffer
+ */
+void lzfw_write_buf_abort(lzfw_wbuf_t *p_wbuf);
+
+/**
+ * Queue a read from the given file
+ * @param p_vfs: the virtual file system
+ * @param p_cred: the credentials of the user
+ * @param p_vnode: the vnode
+ * @param iov: array of iovec buffers to read into
+ * @param iovcnt: the length of the iov array
+ * @param offset: the logical file offset
+ * @param pf_done: the function to call once the read is over
+ * @param p_arg: the argument to give to pf_done
+ * @return 0 if the read was queued, the error code otherwise
+ *
+ * The read runs on one of the library's I/O threads, and pf_done is called
+ * from that thread.  The credentials, the iov array and the buffers must
+ * stay valid until then.  Reads are not ordered with respect to each other.
+ */
+int lzfw_aio_read(vfs_t *p_vfs, creden_t *p_cred, vnode_t *p_vnode,
+		  struct iovec *iov, int iovcnt, off_t offset,
+		  lzfw_aio_done_t pf_done, void *p_arg);
+
+/**
+ * Queue a write to the given file
+ * @param p_vfs: the virtual file system
+ * @param p_cred: the credentials of the user
+ * @param p_vnode: the vnode
+ * @param iov: array of iovec buffers to write
+ * @param iovcnt: the length of the iov array
+ * @param offset: the logical file offset
+ * @param pf_done: the function to call once the write is over
+ * @param p_arg: the argument to give to pf_done
+ * @return 0 if the write was queued, the error code otherwise
+ *
+ * As for lzfw_aio_read(), writes are not ordered with respect to each
+ * other: wait for the completion of a write before queueing an
+ * overlapping one.
+ */
+int lzfw_aio_write(vfs_t *p_vfs, creden_t *p_cred, vnode_t *p_vnode,
+		   struct iovec *iov, int iovcnt, off_t offset,
+		   lzfw_aio_done_t pf_done, void *p_arg);
+
 /**
  * Get the stat about a file
  * @param p_vfs: the virtual file system
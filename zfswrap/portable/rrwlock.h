@@ -76,6 +76,41 @@ boolean_t rrw_held(rrwlock_t *rrl, krw_t rw);
 #define	RRW_READ_HELD(x)	rrw_held(x, RW_READER)
 #define	RRW_WRITE_HELD(x)	rrw_held(x, RW_WRITER)
 
+/*
+ * A reader-mostly lock implementation, tuning above reader-writer locks
+ * for highly parallel read acquisitions, while pessimizing writes.
+ *
+ * The idea is to split single busy lock into array of locks, so that
+ * each reader can lock only one of them for read, depending on result
+ * of simple hash function.  That proportionally reduces lock congestion.
+ * Writer same time has to sequentially acquire write on all the locks.
+ * That makes write acquisition proportionally slower, but in places where
+ * it is used (filesystem unmount) performance is not critical.
+ *
+ * All the functions below are direct wrappers around functions above.
+ */
+#define	RRM_NUM_LOCKS		17
+#define	RRM_CACHELINE		64
+
+typedef union rrmlock_slot {
+	rrwlock_t	rs_lock;
+	char		rs_pad[(sizeof (rrwlock_t) + RRM_CACHELINE - 1) &
+			    ~(RRM_CACHELINE - 1)];
+} rrmlock_slot_t;
+
+typedef struct rrmlock {
+	rrmlock_slot_t	locks[RRM_NUM_LOCKS];
+} rrmlock_t;
+
+void rrm_init(rrmlock_t *rrl);
+void rrm_destroy(rrmlock_t *rrl);
+void rrm_enter(rrmlock_t *rrl, krw_t rw, void *tag);
+void rrm_exit(rrmlock_t *rrl, void *tag);
+boolean_t rrm_held(rrmlock_t *rrl, krw_t rw);
+
+#define	RRM_READ_HELD(x)	rrm_held(x, RW_READER)
+#define	RRM_WRITE_HELD(x)	rrm_held(x, RW_WRITER)
+
 #ifdef	__cplusplus
 }
 #endif
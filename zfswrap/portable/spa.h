@@ -584,6 +584,7 @@ extern uint8_t spa_get_failmode(spa_t *spa);
 extern boolean_t spa_suspended(spa_t *spa);
 extern uint64_t spa_bootfs(spa_t *spa);
 extern uint64_t spa_delegation(spa_t *spa);
+extern boolean_t spa_lz4_compress(spa_t *spa);
 extern objset_t *spa_meta_objset(spa_t *spa);
 
 #include <zio_checksum.h>
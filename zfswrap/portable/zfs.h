@@ -122,6 +122,7 @@ typedef enum {
 	ZFS_PROP_OBJSETID,		/* not exposed to the user */
 	ZFS_PROP_DEDUP,
 	ZFS_PROP_MLSLABEL,
+	ZFS_PROP_CACHEFILTER,
 	ZFS_NUM_PROPS
 } zfs_prop_t;
 
@@ -160,6 +161,7 @@ typedef enum {
 	ZPOOL_PROP_DEDUPRATIO,
 	ZPOOL_PROP_FREE,
 	ZPOOL_PROP_ALLOCATED,
+	ZPOOL_PROP_LZ4_COMPRESS,
 	ZPOOL_NUM_PROPS
 } zpool_prop_t;
 
@@ -32,6 +32,7 @@
 #include <zio_checksum.h>
 
 #include <zfs_context.h>
+#include <uio.h>
 #include <spa.h>
 #include <txg.h>
 #include <avl.h>
@@ -95,6 +96,7 @@ enum zio_compress {
 	ZIO_COMPRESS_GZIP_8,
 	ZIO_COMPRESS_GZIP_9,
 	ZIO_COMPRESS_ZLE,
+	ZIO_COMPRESS_LZ4,
 	ZIO_COMPRESS_FUNCTIONS
 };
 
@@ -372,6 +374,8 @@ struct zio {
 	void		*io_orig_data;
 	uint64_t	io_size;
 	uint64_t	io_orig_size;
+	struct iovec	*io_iov;	/* io_data as a vector, or NULL */
+	int		io_iovcnt;
 
 	/* Stuff for the vdev stack */
 	vdev_t		*io_vd;
@@ -413,6 +417,9 @@ struct zio {
 	struct iocb     io_aio;
 	zio_aio_ctx_t   *io_aio_ctx;
 #endif
+#ifdef LINUX_URING
+	list_node_t	io_uring_node;	/* on the vdev ring's in-flight list */
+#endif
 };
 
 extern zio_t *zio_null(zio_t *pio, spa_t *spa, vdev_t *vd,
@@ -430,6 +437,11 @@ extern zio_t *zio_write(zio_t *pio, spa_t *spa, uint64_t txg, blkptr_t *bp,
     zio_done_func_t *ready, zio_done_func_t *done, void *priv,
     int priority, enum zio_flag flags, const zbookmark_t *zb);
 
+extern zio_t *zio_write_compressed(zio_t *pio, spa_t *spa, uint64_t txg,
+    blkptr_t *bp, void *data, uint64_t psize, uint64_t lsize,
+    const zio_prop_t *zp, zio_done_func_t *ready, zio_done_func_t *done,
+    void *priv, int priority, enum zio_flag flags, const zbookmark_t *zb);
+
 extern zio_t *zio_rewrite(zio_t *pio, spa_t *spa, uint64_t txg, blkptr_t *bp,
     void *data, uint64_t size, zio_done_func_t *done, void *priv,
     int priority, enum zio_flag flags, zbookmark_t *zb);
@@ -535,6 +547,10 @@ extern void zio_handle_ignored_writes(zio_t *zio);
 #ifdef LINUX_AIO
 extern int zio_aio_init(spa_t *spa);
 extern void zio_aio_fini(spa_t *spa);
+extern void zio_aio_submit(zio_t *zio);
+extern void zio_aio_plug(void);
+extern void zio_aio_unplug(spa_t *spa);
+extern boolean_t zio_aio_is_plugged(void);
 #endif
 
 /*
@@ -211,6 +211,26 @@ zfs_earlier_version(const char *name, int version)
 	return (0);
 }
 
+/*
+ * zfs_lz4_enabled
+ *
+ *	Return TRUE if the pool of the named dataset may hold lz4 blocks.
+ *	No pool version covers lz4; the lz4_compress pool property must
+ *	be set.
+ */
+static boolean_t
+zfs_lz4_enabled(const char *name)
+{
+	spa_t *spa;
+	boolean_t rc = B_FALSE;
+
+	if (spa_open(name, &spa, FTAG) == 0) {
+		rc = spa_lz4_compress(spa);
+		spa_close(spa, FTAG);
+	}
+	return (rc);
+}
+
 /*
  * zpl_earlier_version
  *
@@ -987,7 +1007,7 @@ put_nvlist(zfs_cmd_t *zc, nvlist_t *nvl)
 	return (error);
 }
 
-static int
+int
 getzfsvfs(const char *dsname, zfsvfs_t **zvp)
 {
 	objset_t *os;
@@ -1025,14 +1045,14 @@ zfsvfs_hold(const char *name, void *tag, zfsvfs_t **zvp)
 	if (getzfsvfs(name, zvp) != 0)
 		error = zfsvfs_create(name, zvp);
 	if (error == 0) {
-		rrw_enter(&(*zvp)->z_teardown_lock, RW_READER, tag);
+		rrm_enter(&(*zvp)->z_teardown_lock, RW_READER, tag);
 		if ((*zvp)->z_unmounted) {
 			/*
 			 * XXX we could probably try again, since the unmounting
 			 * thread should be just about to disassociate the
 			 * objset from the zfsvfs.
 			 */
-			rrw_exit(&(*zvp)->z_teardown_lock, tag);
+			rrm_exit(&(*zvp)->z_teardown_lock, tag);
 			return (EBUSY);
 		}
 	}
@@ -1042,7 +1062,7 @@ zfsvfs_hold(const char *name, void *tag, zfsvfs_t **zvp)
 static void
 zfsvfs_rele(zfsvfs_t *zfsvfs, void *tag)
 {
-	rrw_exit(&zfsvfs->z_teardown_lock, tag);
+	rrm_exit(&zfsvfs->z_teardown_lock, tag);
 
 	if (zfsvfs->z_vfs) {
 		VFS_RELE(zfsvfs->z_vfs);
@@ -3176,6 +3196,10 @@ zfs_check_settable(const char *dsname, nvpair_t *pair, cred_t *cr)
 			    SPA_VERSION_ZLE_COMPRESSION))
 				return (ENOTSUP);
 
+			if (intval == ZIO_COMPRESS_LZ4 &&
+			    !zfs_lz4_enabled(dsname))
+				return (ENOTSUP);
+
 			/*
 			 * If this is a bootable dataset then
 			 * verify that the compression algorithm
@@ -3447,7 +3471,7 @@ zfs_ioc_recv(zfs_cmd_t *zc)
 	}
 
 	error = dmu_recv_begin(tofs, tosnap, zc->zc_top_ds,
-	    &zc->zc_begin_record, force, origin, &drc);
+	    &zc->zc_begin_record, force, B_FALSE, origin, &drc);
 	if (origin)
 		dmu_objset_rele(origin, FTAG);
 	if (error)
@@ -34,4 +34,7 @@ extern int zfsdev_ioctl(dev_t dev, int cmd, intptr_t arg, int flag, cred_t *cr,
 extern int zfs_ioctl_init();
 extern int zfs_ioctl_fini();
 
+struct zfsvfs;
+extern int getzfsvfs(const char *dsname, struct zfsvfs **zvp);
+
 #endif
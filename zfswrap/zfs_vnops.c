@@ -566,6 +566,7 @@ out:
  *	IN:	vp	- vnode of file to be written to.
  *		uio	- structure supplying write location, range info,
  *			  and data buffer.
+ *		lbuf	- loaned arc buffer holding the data of uio, or NULL.
  *		ioflag	- FAPPEND flag set if in append mode.
  *		cr	- credentials of caller.
  *		ct	- caller context (NFS/CIFS fem monitor only)
@@ -577,10 +578,15 @@ out:
  *
  * Timestamps:
  *	vp - ctime|mtime updated if byte count > 0
+ *
+ * When lbuf is given and the write lands on exactly one block of its size,
+ * the buffer is assigned to the dbuf instead of being copied.  lbuf is
+ * consumed in every case.
  */
 /* ARGSUSED */
 static int
-zfs_write(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
+zfs_write_impl(vnode_t *vp, uio_t *uio, arc_buf_t *lbuf, int ioflag,
+    cred_t *cr, caller_context_t *ct)
 {
 	znode_t		*zp = VTOZ(vp);
 	rlim64_t	limit = uio->uio_llimit;
@@ -602,8 +608,11 @@ zfs_write(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 	 * Fasttrack empty write
 	 */
 	n = start_resid;
-	if (n == 0)
+	if (n == 0) {
+		if (lbuf != NULL)
+			dmu_return_arcbuf(lbuf);
 		return (0);
+	}
 
 	if (limit == RLIM64_INFINITY || limit > MAXOFFSET_T)
 		limit = MAXOFFSET_T;
@@ -618,8 +627,8 @@ zfs_write(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 	if ((pflags & (ZFS_IMMUTABLE | ZFS_READONLY)) ||
 	    ((pflags & ZFS_APPENDONLY) && !(ioflag & FAPPEND) &&
 	    (uio->uio_loffset < zp->z_phys->zp_size))) {
-		ZFS_EXIT(zfsvfs);
-		return (EPERM);
+		error = EPERM;
+		goto out_early;
 	}
 
 	zilog = zfsvfs->z_log;
@@ -629,8 +638,8 @@ zfs_write(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 	 */
 	woff = ioflag & FAPPEND ? zp->z_phys->zp_size : uio->uio_loffset;
 	if (woff < 0) {
-		ZFS_EXIT(zfsvfs);
-		return (EINVAL);
+		error = EINVAL;
+		goto out_early;
 	}
 
 	/*
@@ -638,10 +647,8 @@ zfs_write(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 	 * in order to prevent a deadlock with locks set via fcntl().
 	 */
 	if (MANDMODE((mode_t)zp->z_phys->zp_mode) &&
-	    (error = chklock(vp, FWRITE, woff, n, uio->uio_fmode, ct)) != 0) {
-		ZFS_EXIT(zfsvfs);
-		return (error);
-	}
+	    (error = chklock(vp, FWRITE, woff, n, uio->uio_fmode, ct)) != 0)
+		goto out_early;
 
 	/*
 	 * Pre-fault the pages to ensure slow (eg NFS) pages
@@ -680,8 +687,8 @@ zfs_write(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 
 	if (woff >= limit) {
 		zfs_range_unlock(rl);
-		ZFS_EXIT(zfsvfs);
-		return (EFBIG);
+		error = EFBIG;
+		goto out_early;
 	}
 
 	if ((woff + n) > limit || woff > (limit - n))
@@ -698,6 +705,17 @@ zfs_write(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 		abuf = NULL;
 		woff = uio->uio_loffset;
 
+		/*
+		 * Only a loaned buffer that covers exactly this chunk can
+		 * be assigned; anything else is copied from it by
+		 * dmu_write_uio() and the buffer is given back below.
+		 */
+		if (lbuf != NULL && n == arc_buf_size(lbuf) &&
+		    n <= max_blksz && P2PHASE(woff, max_blksz) == 0) {
+			abuf = lbuf;
+			lbuf = NULL;
+		}
+
 again:
 		if (zfs_usergroup_overquota(zfsvfs,
 		    B_FALSE, zp->z_phys->zp_uid) ||
@@ -790,7 +808,7 @@ All I can hope is that we can simply disable this code without risk */
 			tx_bytes -= uio->uio_resid;
 		} else {
 			tx_bytes = nbytes;
-			ASSERT(tx_bytes == max_blksz);
+			ASSERT(tx_bytes == arc_buf_size(abuf));
 			dmu_assign_arcbuf(zp->z_dbuf, woff, abuf, tx);
 			ASSERT(tx_bytes <= uio->uio_resid);
 			uioskip(uio, tx_bytes);
@@ -855,6 +873,8 @@ All I can hope is that we can simply disable this code without risk */
 	}
 
 	zfs_range_unlock(rl);
+	if (lbuf != NULL)
+		dmu_return_arcbuf(lbuf);
 
 	/*
 	 * If we're in replay mode, or we made no progress, return error.
@@ -870,6 +890,55 @@ All I can hope is that we can simply disable this code without risk */
 
 	ZFS_EXIT(zfsvfs);
 	return (0);
+
+out_early:
+	if (lbuf != NULL)
+		dmu_return_arcbuf(lbuf);
+	ZFS_EXIT(zfsvfs);
+	return (error);
+}
+
+static int
+zfs_write(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
+{
+	return (zfs_write_impl(vp, uio, NULL, ioflag, cr, ct));
+}
+
+/*
+ * Write len bytes of a buffer loaned by dmu_request_arcbuf() at offset off.
+ * If the buffer lines up with a file block it becomes that block's data
+ * without a copy.  The buffer is consumed whatever the outcome.  On return
+ * *resid holds the number of bytes that were not written.
+ */
+int
+zfs_write_arcbuf(vnode_t *vp, arc_buf_t *abuf, offset_t off, ssize_t len,
+    int ioflag, cred_t *cr, ssize_t *resid)
+{
+	iovec_t iov;
+	uio_t uio;
+	int error;
+
+	ASSERT(len <= arc_buf_size(abuf));
+
+	iov.iov_base = abuf->b_data;
+	iov.iov_len = len;
+	uio.uio_iov = &iov;
+	uio.uio_iovcnt = 1;
+	uio.uio_segflg = UIO_SYSSPACE;
+	uio.uio_fmode = 0;
+	uio.uio_llimit = RLIM64_INFINITY;
+	uio.uio_loffset = off;
+	uio.uio_resid = len;
+
+	/* A partial buffer can only be copied */
+	if (len != arc_buf_size(abuf)) {
+		error = zfs_write_impl(vp, &uio, NULL, ioflag, cr, NULL);
+		dmu_return_arcbuf(abuf);
+	} else {
+		error = zfs_write_impl(vp, &uio, abuf, ioflag, cr, NULL);
+	}
+	*resid = uio.uio_resid;
+	return (error);
 }
 
 void